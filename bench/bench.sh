@@ -0,0 +1,55 @@
+#!/bin/sh
+# Simulator benchmark. Runs every kernel in this directory on each engine
+# several times and prints one CSV line per kernel and engine: the instruction
+# count, and the mean and standard deviation of host ns per simulated
+# instruction and of MIPS. Only the simulator's own run timer is used, so
+# process start-up, program loading and the final-state print are not counted.
+#
+# Usage: bench/bench.sh [SIMULATOR]       (default ./riscv_cpu)
+#   BENCH_RUNS=N          runs per kernel and engine (default 5)
+#   BENCH_ENGINES="..."   any of interp, jit, staged (default "interp jit")
+#   BENCH_KERNELS="..."   kernel names (default: every *.txt next to this script)
+
+SIM=${1:-./riscv_cpu}
+DIR=$(dirname "$0")
+RUNS=${BENCH_RUNS:-5}
+ENGINES=${BENCH_ENGINES:-interp jit}
+KERNELS=${BENCH_KERNELS:-$(cd "$DIR" && ls *.txt | sed 's/\.txt$//')}
+
+if [ ! -x "$SIM" ]; then
+    echo "bench.sh: $SIM is not executable (run make first)" >&2
+    exit 1
+fi
+
+echo "kernel,engine,instructions,runs,ns_per_instr_mean,ns_per_instr_stddev,mips_mean,mips_stddev"
+status=0
+for kernel in $KERNELS; do
+    for engine in $ENGINES; do
+        case $engine in
+            interp) flag= ;;
+            jit)    flag=--jit ;;
+            staged) flag=--staged ;;
+            *) echo "bench.sh: unknown engine $engine" >&2; exit 1 ;;
+        esac
+        # "Simulated N cycles in T s (...)" gives the instruction count and run time
+        i=0
+        while [ $i -lt "$RUNS" ]; do
+            $SIM $flag --max-cycles=0 --trace=final "$DIR/$kernel.txt" 2>/dev/null | grep '^Simulated' || echo "failed"
+            i=$((i + 1))
+        done | awk -v kernel="$kernel" -v engine="$engine" '
+            $1 != "Simulated" { bad = 1; next }
+            {
+                if (n > 0 && $2 != instr) bad = 1      # Every run must execute the same instructions
+                instr = $2; t = $5; n++
+                ns = t * 1e9 / instr; mips = instr / t / 1e6
+                s_ns += ns; ss_ns += ns * ns; s_m += mips; ss_m += mips * mips
+            }
+            function sd(s, ss) { v = n > 1 ? (ss - s * s / n) / (n - 1) : 0; return v > 0 ? sqrt(v) : 0 }
+            END {
+                if (bad || n == 0) { printf "%s,%s,error,,,,,\n", kernel, engine; exit 1 }
+                printf "%s,%s,%d,%d,%.3f,%.3f,%.1f,%.1f\n", kernel, engine, instr, n,
+                       s_ns / n, sd(s_ns, ss_ns), s_m / n, sd(s_m, ss_m)
+            }' || status=1
+    done
+done
+exit $status
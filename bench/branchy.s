@@ -0,0 +1,41 @@
+# branchy: data-dependent branches on the low bits of a Fibonacci sequence
+# (mod 2^32), so the outcomes are hard to predict
+  addi s0, zero, 2000
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0          # 2000 * 512 = 1024000 iterations
+  addi a0, zero, 1
+  addi a1, zero, 1
+loop:
+  add t0, a0, a1          # next term
+  add a0, a1, zero
+  add a1, t0, zero
+  andi t1, t0, 8
+  beq t1, zero, skip1
+  addi s1, s1, 1
+skip1:
+  andi t1, t0, 64
+  beq t1, zero, skip2
+  addi s2, s2, 1
+  andi t2, t0, 1024
+  beq t2, zero, skip2
+  addi s3, s3, 1
+skip2:
+  andi t1, t0, 3
+  addi t2, zero, 2
+  beq t1, t2, hit
+  addi s4, s4, 1
+  jal zero, tail
+hit:
+  addi s5, s5, 1
+tail:
+  addi s0, s0, -1
+  beq s0, zero, done
+  jal zero, loop
+done:
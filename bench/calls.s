@@ -0,0 +1,38 @@
+# calls: naive recursive fib(27) using jal/jalr and a stack frame in memory
+  addi sp, zero, 2047
+  addi sp, sp, 1
+  add sp, sp, sp
+  add sp, sp, sp
+  add sp, sp, sp
+  add sp, sp, sp
+  add sp, sp, sp
+  add sp, sp, sp          # sp = 0x40000
+  addi a0, zero, 27
+  jal ra, fib
+  jal zero, done
+fib:                      # a0 = fib(a0)
+  addi t0, zero, 2
+  and t1, a0, t0
+  or t1, t1, a0
+  addi t2, a0, -2
+  addi t3, zero, -1
+  and t2, t2, t3
+  beq a0, zero, leaf      # fib(0) = 0
+  addi t0, zero, 1
+  beq a0, t0, leaf        # fib(1) = 1
+  addi sp, sp, -12
+  sw ra, 0(sp)
+  sw a0, 4(sp)
+  addi a0, a0, -1
+  jal ra, fib
+  sw a0, 8(sp)
+  lw a0, 4(sp)
+  addi a0, a0, -2
+  jal ra, fib
+  lw t0, 8(sp)
+  add a0, a0, t0
+  lw ra, 0(sp)
+  addi sp, sp, 12
+leaf:
+  jalr zero, ra, 0
+done:
@@ -0,0 +1,20 @@
+# loop: nested counting loops over ALU work (no memory traffic)
+#   for (outer = 4000; outer != 0; outer--)
+#       for (inner = 1000; inner != 0; inner--) { a few add/sub/and/or }
+  addi s0, zero, 2000
+  add s0, s0, s0          # outer = 4000
+outer:
+  addi s1, zero, 1000     # inner
+inner:
+  add t0, t0, s1
+  sub t1, t0, s0
+  and t2, t1, t0
+  or t3, t2, s1
+  addi s1, s1, -1
+  beq s1, zero, next
+  jal zero, inner
+next:
+  addi s0, s0, -1
+  beq s0, zero, done
+  jal zero, outer
+done:
@@ -0,0 +1,58 @@
+# matmul: 32x32 integer matrix product C = A * B, 100 times
+# A holds signed bytes (lb), B and C words; each product is a mul
+  lui s1, 0x10            # A = 0x10000 (1024 bytes)
+  lui s2, 0x20            # B = 0x20000 (1024 words)
+  lui s3, 0x30            # C = 0x30000 (1024 words)
+  addi s4, zero, 32       # n
+  addi t0, zero, 0        # element index
+  addi t6, zero, 1024
+fill:
+  addi t1, zero, 7
+  mul t1, t0, t1          # A[k] = 7k, wrapped to a signed byte
+  add t2, s1, t0
+  sb t1, 0(t2)
+  addi t1, zero, 3
+  mul t1, t0, t1
+  addi t1, t1, -500       # B[k] = 3k - 500
+  slli t2, t0, 2
+  add t2, s2, t2
+  sw t1, 0(t2)
+  addi t0, t0, 1
+  blt t0, t6, fill
+  addi s0, zero, 100      # passes
+  addi s5, zero, 0        # checksum (sum of every C element)
+pass:
+  addi a0, zero, 0        # i
+row:
+  addi a1, zero, 0        # j
+col:
+  addi a2, zero, 0        # k
+  addi a3, zero, 0        # C[i][j]
+  slli t0, a0, 5
+  add t0, s1, t0          # &A[i][0]
+  slli t1, a1, 2
+  add t1, s2, t1          # &B[0][j]
+dot:
+  lb t2, 0(t0)
+  lw t3, 0(t1)
+  mul t4, t2, t3
+  add a3, a3, t4
+  addi t0, t0, 1
+  addi t1, t1, 128        # next row of B
+  addi a2, a2, 1
+  bne a2, s4, dot
+  slli t5, a0, 5
+  add t5, t5, a1
+  slli t5, t5, 2
+  add t5, s3, t5
+  sw a3, 0(t5)            # C[i][j]
+  add s5, s5, a3
+  addi a1, a1, 1
+  bne a1, s4, col
+  addi a0, a0, 1
+  bne a0, s4, row
+  addi s0, s0, -1
+  bne s0, zero, pass
+  addi t0, zero, 1000
+  remu s6, s5, t0         # checksum mod 1000
+done:
@@ -0,0 +1,45 @@
+# memcpy: copy a 16 KiB buffer (4096 words) from 0x10000 to 0x20000, 2000 times
+  addi a0, zero, 2047
+  addi a0, a0, 1          # a0 = 0x800
+  add a0, a0, a0          # 0x1000
+  add a0, a0, a0          # 0x2000
+  add a0, a0, a0          # 0x4000
+  add a0, a0, a0          # 0x8000
+  add a0, a0, a0          # src = 0x10000
+  add a1, a0, a0          # dst = 0x20000
+  addi t2, zero, 2047
+  addi t2, t2, 1
+  add t2, t2, t2          # 4096 words
+  add t2, t2, t2
+  add t2, t2, t2          # 16384 bytes
+  add a2, a0, t2          # src end
+  # fill the source with its own addresses
+  add t0, a0, zero
+fill:
+  sw t0, 0(t0)
+  addi t0, t0, 4
+  beq t0, a2, copy_all
+  jal zero, fill
+copy_all:
+  addi s0, zero, 2000     # passes
+pass:
+  add t0, a0, zero        # src
+  add t1, a1, zero        # dst
+copy:
+  lw t3, 0(t0)
+  lw t4, 4(t0)
+  lw t5, 8(t0)
+  lw t6, 12(t0)
+  sw t3, 0(t1)
+  sw t4, 4(t1)
+  sw t5, 8(t1)
+  sw t6, 12(t1)
+  addi t0, t0, 16
+  addi t1, t1, 16
+  beq t0, a2, copied
+  jal zero, copy
+copied:
+  addi s0, s0, -1
+  beq s0, zero, done
+  jal zero, pass
+done:
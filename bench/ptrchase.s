@@ -0,0 +1,58 @@
+# ptrchase: follow a linked list of 4096 16-byte nodes at 0x10000, linked in a
+# scattered order (node i points to node (i + 1597) mod 4096), for 16M loads
+  addi a0, zero, 2047
+  addi a0, a0, 1
+  add a0, a0, a0
+  add a0, a0, a0
+  add a0, a0, a0
+  add a0, a0, a0
+  add a0, a0, a0          # base = 0x10000
+  addi s2, zero, 2047
+  addi s2, s2, 1
+  add s2, s2, s2          # 4096 nodes
+  addi s3, s2, -1         # index mask 4095
+  addi s4, zero, 1597     # odd step, so the list is one cycle through every node
+  # build: node[i].next = &node[(i + step) & mask]
+  addi t0, zero, 0        # i
+build:
+  add t1, t0, s4
+  and t1, t1, s3          # j
+  add t2, t0, t0
+  add t2, t2, t2
+  add t2, t2, t2
+  add t2, t2, t2          # i * 16
+  add t2, t2, a0
+  add t3, t1, t1
+  add t3, t3, t3
+  add t3, t3, t3
+  add t3, t3, t3          # j * 16
+  add t3, t3, a0
+  sw t3, 0(t2)
+  sw t0, 4(t2)            # payload
+  addi t0, t0, 1
+  beq t0, s2, chase_all
+  jal zero, build
+chase_all:
+  add s0, s2, s2          # 4096 laps of 4096 loads
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0
+  add s0, s0, s0          # 16M hops
+  add t0, a0, zero
+chase:
+  lw t0, 0(t0)
+  lw t0, 0(t0)
+  lw t0, 0(t0)
+  lw t0, 0(t0)
+  addi s0, s0, -4
+  beq s0, zero, done
+  jal zero, chase
+done:
+  lw a1, 4(t0)
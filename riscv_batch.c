@@ -0,0 +1,423 @@
+// Batch mode: run every job in a manifest on a work-stealing thread pool.
+//
+// Manifest format, one job per line ('#' starts a comment, blank lines are skipped):
+//     program_file [xN=value ...] [mem[ADDR]=value ...]
+// Values and addresses accept C notation (0x.. hex, negative decimal), and ADDR
+// may be any aligned 32-bit address. Each distinct program file is parsed once
+// and shared by every job that names it.
+//
+// One result line is printed per job, in manifest order, using the same
+// register/memory syntax as the manifest:
+//     job=N program=F status=halted|exited|limit|error [exit=N] cycles=C pc=0x.. [xN=0x.. ...] [mem[0x..]=0x.. ...]
+// (status=exited: the program called exit, with code N). What jobs write through
+// syscalls goes to the simulator's stdout as they run.
+//
+// Workers take tasks: one job each, or with ENGINE_LOCKSTEP up to LOCKSTEP_LANES
+// jobs of the same program that run together in one lockstep gang.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "riscv_cpu.h"
+
+// A distinct program file named by the manifest
+typedef struct {
+    char *path;
+    program_image image;
+    int count;                      // Instructions loaded (< 0 if the file cannot be used, see program_open())
+} batch_program;
+
+// One mem[ADDR]=value initialiser
+typedef struct {
+    uint32_t address;
+    int value;
+} batch_word;
+
+// One manifest line: initial state in, result line out
+typedef struct {
+    int program;                    // Index into batch.programs
+    int rf[32];                     // Initial registers
+    uint32_t rf_set;                // Registers the manifest gives (others keep the program's start state)
+    batch_word *mem;                // Initial memory words, applied in manifest order
+    int mem_count;
+    char *result;                   // Formatted result line once the job has run
+    uint64_t cycles;                // Cycles the job ran (for the summary)
+    int done;                       // Result ready to print (guarded by print_lock)
+} batch_job;
+
+// Per-worker deque of task indices: the owner pops from the bottom, thieves take from the top
+typedef struct {
+    pthread_mutex_t lock;
+    int *tasks;
+    int top, bottom;                // Remaining tasks are tasks[top..bottom)
+} batch_deque;
+
+typedef struct {
+    batch_program *programs;
+    int program_count;
+    batch_job *jobs;
+    int job_count;
+    int *task_jobs;                 // Job indices, grouped by task
+    int *task_start;                // Task i is task_jobs[task_start[i]..task_start[i + 1])
+    int task_count;
+    batch_deque *deques;
+    int worker_count;
+    int engine;
+    long long max_cycles;
+    pthread_mutex_t print_lock;
+    int next_print;                 // First job whose line has not been printed
+} batch;
+
+typedef struct {
+    batch *b;
+    int id;
+} batch_worker;
+
+// Index of the program loaded from path, parsing it on first use
+static int batch_program_index(batch *b, const char *path) {
+    for (int i = 0; i < b->program_count; i++) {
+        if (strcmp(b->programs[i].path, path) == 0) return i;
+    }
+    batch_program *grown = realloc(b->programs, (b->program_count + 1) * sizeof(*grown));
+    if (grown == NULL) return -1;
+    b->programs = grown;
+    batch_program *p = &b->programs[b->program_count];
+    p->path = strdup(path);
+    if (p->path == NULL) return -1;
+    p->count = program_open(&p->image, path, 0);
+    return b->program_count++;
+}
+
+// Apply one "xN=value" or "mem[ADDR]=value" token to a job (0 on success)
+static int batch_parse_init(batch_job *job, const char *token) {
+    uint32_t target;
+    int value;
+    int kind = parse_init(token, &target, &value);
+    if (kind == INIT_REG) {
+        if (target != 0) {              // x0 stays hardwired to zero
+            job->rf[target] = value;
+            job->rf_set |= 1u << target;
+        }
+        return 0;
+    }
+    if (kind == INIT_MEM) {
+        batch_word *grown = realloc(job->mem, (job->mem_count + 1) * sizeof(*grown));
+        if (grown == NULL) return -1;
+        job->mem = grown;
+        job->mem[job->mem_count++] = (batch_word){ target, value };
+        return 0;
+    }
+    return -1;
+}
+
+// Read the manifest into b->jobs (0 on success, -1 after reporting an error)
+static int batch_read_manifest(batch *b, const char *manifest) {
+    FILE *file = fopen(manifest, "r");
+    if (file == NULL) {
+        perror("Error opening manifest");
+        return -1;
+    }
+
+    char *line = NULL;                  // Grown by getline(): a job may list any number of values
+    size_t line_size = 0;
+    int line_no = 0;
+    int capacity = 0;
+    int result = 0;
+    while (result == 0 && getline(&line, &line_size, file) != -1) {
+        line_no++;
+        line[strcspn(line, "#\r\n")] = 0;
+
+        char *save;
+        char *token = strtok_r(line, " \t", &save);
+        if (token == NULL) continue;
+
+        if (b->job_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            batch_job *grown = realloc(b->jobs, capacity * sizeof(*grown));
+            if (grown == NULL) {
+                perror("run_batch");
+                result = -1;
+                break;
+            }
+            b->jobs = grown;
+        }
+        batch_job *job = &b->jobs[b->job_count];
+        memset(job, 0, sizeof(*job));
+        job->program = batch_program_index(b, token);
+        if (job->program < 0) {
+            perror("run_batch");
+            result = -1;
+            break;
+        }
+        while ((token = strtok_r(NULL, " \t", &save)) != NULL) {
+            if (batch_parse_init(job, token) != 0) {
+                fprintf(stderr, "%s:%d: invalid initial state '%s' (expected xN=value or mem[ADDR]=value)\n",
+                        manifest, line_no, token);
+                result = -1;
+                break;
+            }
+        }
+        b->job_count++;
+    }
+
+    free(line);
+    fclose(file);
+    return result;
+}
+
+// Split the jobs into tasks (0 on success)
+static int batch_make_tasks(batch *b) {
+    b->task_jobs = malloc(b->job_count * sizeof(*b->task_jobs));
+    b->task_start = malloc((b->job_count + 1) * sizeof(*b->task_start));
+    if (b->task_jobs == NULL || b->task_start == NULL) return -1;
+
+    if (b->engine != ENGINE_LOCKSTEP) {
+        for (int i = 0; i < b->job_count; i++) {
+            b->task_jobs[i] = i;
+            b->task_start[i] = i;
+        }
+        b->task_count = b->job_count;
+    } else {
+        // Gangs of up to LOCKSTEP_LANES jobs that share a program, in manifest order within each program
+        int filled = 0;
+        for (int p = 0; p < b->program_count; p++) {
+            int in_gang = 0;
+            for (int i = 0; i < b->job_count; i++) {
+                if (b->jobs[i].program != p) continue;
+                if (in_gang == 0 || in_gang == LOCKSTEP_LANES) {
+                    b->task_start[b->task_count++] = filled;
+                    in_gang = 0;
+                }
+                b->task_jobs[filled++] = i;
+                in_gang++;
+            }
+        }
+    }
+    b->task_start[b->task_count] = b->job_count;
+    return 0;
+}
+
+// Take a task for worker id: own deque first, then steal from the others
+static int batch_next_task(batch *b, int id) {
+    batch_deque *own = &b->deques[id];
+    int task = -1;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->top < own->bottom) task = own->tasks[--own->bottom];
+    pthread_mutex_unlock(&own->lock);
+    if (task >= 0) return task;
+
+    for (int i = 1; i < b->worker_count && task < 0; i++) {
+        batch_deque *victim = &b->deques[(id + i) % b->worker_count];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->top < victim->bottom) task = victim->tasks[victim->top++];
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return task;
+}
+
+static void batch_print_word(void *arg, uint32_t address, int value) {
+    fprintf(arg, " mem[0x%x]=0x%x", address, value);
+}
+
+// Format a finished job's result line (everything after "job=N program=F")
+static char *batch_format_result(cpu_context *cpu, int status) {
+    char *line = NULL;
+    size_t size;
+    FILE *out = open_memstream(&line, &size);
+    if (out == NULL) {
+        perror("run_batch");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(out, " status=%s", status == RUN_LIMIT ? "limit" : cpu->exited ? "exited" : "halted");
+    if (cpu->exited) fprintf(out, " exit=%d", cpu->exit_code);
+    fprintf(out, " cycles=%" PRIu64 " pc=0x%x", cpu->total_clock_cycles, cpu->pc);
+    for (int i = 1; i < 32; i++) {
+        if (cpu->rf[i] != 0) fprintf(out, " x%d=0x%x", i, cpu->rf[i]);
+    }
+    for_each_data_word(cpu, batch_print_word, out);
+    fclose(out);
+    return line;
+}
+
+static void batch_print_job(const batch *b, int index) {
+    const batch_job *job = &b->jobs[index];
+    const batch_program *p = &b->programs[job->program];
+
+    if (p->count < 0) {
+        printf("job=%d program=%s status=error error=%s\n", index, p->path, p->count == -1 ? "cannot-open" : "invalid-program");
+        return;
+    }
+    printf("job=%d program=%s%s\n", index, p->path, job->result);
+}
+
+// Load a job's program and initial state into cpu
+static void batch_start_job(batch *b, cpu_context *cpu, int *loaded, int index) {
+    const batch_job *job = &b->jobs[index];
+    if (*loaded != job->program) {  // Otherwise cpu_reset() restores the image
+        load_program(cpu, &b->programs[job->program].image);
+        *loaded = job->program;
+    }
+    cpu_reset(cpu);
+    for (int r = 1; r < 32; r++) {
+        if (job->rf_set & (1u << r)) cpu->rf[r] = job->rf[r];
+    }
+    for (int i = 0; i < job->mem_count; i++) {
+        mem_store(cpu, job->mem[i].address, job->mem[i].value); // Predecodes any word written over the program
+    }
+}
+
+// Record a job's final state
+static void batch_end_job(batch *b, cpu_context *cpu, int index, int status) {
+    syscall_flush(cpu);
+    b->jobs[index].result = batch_format_result(cpu, status);
+    b->jobs[index].cycles = cpu->total_clock_cycles;
+}
+
+// Mark a job finished and print every result that is now next in manifest order
+static void batch_finish_job(batch *b, int index) {
+    pthread_mutex_lock(&b->print_lock);
+    b->jobs[index].done = 1;
+    while (b->next_print < b->job_count && b->jobs[b->next_print].done) {
+        batch_print_job(b, b->next_print++);
+    }
+    pthread_mutex_unlock(&b->print_lock);
+}
+
+static void *batch_worker_main(void *arg) {
+    batch_worker *w = arg;
+    batch *b = w->b;
+
+    // Contexts reused for every job this worker runs (one per lockstep lane)
+    int lanes = b->engine == ENGINE_LOCKSTEP ? LOCKSTEP_LANES : 1;
+    cpu_context *harts[LOCKSTEP_LANES];
+    int loaded[LOCKSTEP_LANES];     // Program currently in each context
+    int status[LOCKSTEP_LANES];
+    for (int i = 0; i < lanes; i++) {
+        harts[i] = cpu_create();
+        harts[i]->trace_level = TRACE_NONE;
+        harts[i]->max_cycles = b->max_cycles;
+        loaded[i] = -1;
+    }
+
+    int task;
+    while ((task = batch_next_task(b, w->id)) >= 0) {
+        const int *jobs = &b->task_jobs[b->task_start[task]];
+        int n = b->task_start[task + 1] - b->task_start[task];
+        const batch_program *p = &b->programs[b->jobs[jobs[0]].program];
+
+        if (p->count >= 0) {            // Unreadable programs are reported when the result is printed
+            for (int i = 0; i < n; i++) batch_start_job(b, harts[i], &loaded[i], jobs[i]);
+            if (b->engine == ENGINE_LOCKSTEP) {
+                run_lockstep(harts, status, n);
+            } else {
+                status[0] = run_program(harts[0], b->engine);
+            }
+            for (int i = 0; i < n; i++) batch_end_job(b, harts[i], jobs[i], status[i]);
+        }
+        for (int i = 0; i < n; i++) {
+            batch_finish_job(b, jobs[i]);
+        }
+    }
+
+    for (int i = 0; i < lanes; i++) cpu_destroy(harts[i]);
+    return NULL;
+}
+
+static double batch_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Run every job in the manifest on threads workers (0 = one per online CPU).
+// Returns 0 if every job ran, -1 if the manifest or any program could not be read.
+int run_batch(const char *manifest, int threads, int engine, long long max_cycles) {
+    batch b = { .engine = engine, .max_cycles = max_cycles };
+    int result = batch_read_manifest(&b, manifest);
+
+    if (result == 0 && b.job_count > 0 && batch_make_tasks(&b) != 0) {
+        perror("run_batch");
+        result = -1;
+    }
+    if (result == 0 && b.job_count > 0) {
+        if (threads <= 0) {
+            long online = sysconf(_SC_NPROCESSORS_ONLN);
+            threads = online > 0 ? (int)online : 1;
+        }
+        b.worker_count = threads < b.task_count ? threads : b.task_count;
+
+        // Deal the tasks out round-robin so every worker starts with a share of each region of the manifest
+        int *slots = malloc(b.task_count * sizeof(*slots));
+        b.deques = calloc(b.worker_count, sizeof(*b.deques));
+        batch_worker *workers = calloc(b.worker_count, sizeof(*workers));
+        pthread_t *tids = calloc(b.worker_count, sizeof(*tids));
+        if (slots == NULL || b.deques == NULL || workers == NULL || tids == NULL) {
+            perror("run_batch");
+            exit(EXIT_FAILURE);
+        }
+        int *next = slots;
+        for (int w = 0; w < b.worker_count; w++) {
+            batch_deque *q = &b.deques[w];
+            pthread_mutex_init(&q->lock, NULL);
+            q->tasks = next;
+            // Reversed so the owner, popping from the bottom, runs its tasks in manifest order
+            int last = w + (b.task_count - 1 - w) / b.worker_count * b.worker_count;
+            for (int i = last; i >= w; i -= b.worker_count) {
+                q->tasks[q->bottom++] = i;
+            }
+            next += q->bottom;
+        }
+        pthread_mutex_init(&b.print_lock, NULL);
+
+        double start = batch_seconds();
+        for (int w = 0; w < b.worker_count; w++) {
+            workers[w] = (batch_worker){ &b, w };
+            if (pthread_create(&tids[w], NULL, batch_worker_main, &workers[w]) != 0) {
+                perror("pthread_create");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int w = 0; w < b.worker_count; w++) {
+            pthread_join(tids[w], NULL);
+        }
+        double elapsed = batch_seconds() - start;
+        fflush(stdout);
+
+        uint64_t cycles = 0;
+        for (int i = 0; i < b.job_count; i++) {
+            cycles += b.jobs[i].cycles;
+            if (b.programs[b.jobs[i].program].count < 0) result = -1;
+        }
+        fprintf(stderr, "Batch: %d jobs on %d threads, %" PRIu64 " cycles in %.6f s (%.0f cycles/s)\n",
+                b.job_count, b.worker_count, cycles, elapsed, elapsed > 0 ? cycles / elapsed : 0.0);
+
+        for (int w = 0; w < b.worker_count; w++) {
+            pthread_mutex_destroy(&b.deques[w].lock);
+        }
+        pthread_mutex_destroy(&b.print_lock);
+        free(tids);
+        free(workers);
+        free(b.deques);
+        free(slots);
+    }
+
+    for (int i = 0; i < b.program_count; i++) {
+        free(b.programs[i].path);
+        if (b.programs[i].count >= 0) program_close(&b.programs[i].image);
+    }
+    for (int i = 0; i < b.job_count; i++) {
+        free(b.jobs[i].mem);
+        free(b.jobs[i].result);
+    }
+    free(b.programs);
+    free(b.jobs);
+    free(b.task_jobs);
+    free(b.task_start);
+    return result;
+}
@@ -0,0 +1,312 @@
+// Branch prediction for the fetch path of the staged engine.
+//
+// run_staged() asks bpred_predict() for the next fetch address as soon as an
+// instruction is fetched, knowing only its pc, and reports the path actually
+// taken with bpred_update() after Writeback. Three direction predictors share
+// that interface:
+//   - static not-taken: always fetches pc + 4 (no BTB, no RAS)
+//   - bimodal: a table of 2-bit saturating counters indexed by pc
+//   - gshare: the same counters indexed by pc XOR a global history of conditional branch outcomes
+// Targets come from a direct-mapped branch target buffer (BTB). jalr used as a
+// return (jalr x0, 0(ra/t0)) is predicted from a return-address stack (RAS)
+// that calls (jal/jalr with rd = ra/t0) push.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "riscv_cpu.h"
+
+#define PER_PC_REPORT_LINES 20          // Branches listed in the per-PC part of the report
+
+enum { BTB_COND = PIPE_BRANCH_COND, BTB_JAL = PIPE_BRANCH_JAL, BTB_JALR = PIPE_BRANCH_JALR, BTB_RETURN };
+
+typedef struct {
+    uint32_t pc;                    // Tag: address of the branch (full, so entries never alias)
+    uint32_t target;                // Last taken target
+    uint8_t kind;                   // BTB_* (0: empty)
+} btb_entry;
+
+// Statistics for one static branch
+typedef struct {
+    uint32_t pc;
+    uint8_t kind;                   // PIPE_BRANCH_* (0: unused slot)
+    uint64_t executed, taken, mispredicted;
+} branch_site;
+
+typedef struct {
+    uint64_t executed, mispredicted;
+} branch_count;
+
+struct branch_predictor {
+    bpred_config config;
+    uint8_t *counters;              // 2-bit saturating counters (bimodal and gshare)
+    uint32_t history;               // Global history of branch outcomes, newest in bit 0 (gshare)
+    btb_entry *btb;
+    uint32_t *ras;                  // Circular return-address stack
+    int ras_top, ras_count;
+
+    branch_count by_kind[PIPE_BRANCH_COUNT];
+    uint64_t direction_mispredicted;    // Conditional branch direction wrong, whatever the BTB held
+    uint64_t btb_lookups, btb_hits;
+    uint64_t returns, returns_correct;
+    branch_site *sites;             // Open-addressed table of every branch executed, keyed by pc
+    uint32_t site_count, site_capacity;
+};
+
+static const char *const kind_names[] = { "none", "nottaken", "bimodal", "gshare" };
+static const char *const branch_names[] = { "", "branch", "jal", "jalr" };
+
+static void *bpred_alloc(size_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        perror("bpred_create");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+branch_predictor *bpred_create(const bpred_config *config) {
+    branch_predictor *bp = bpred_alloc(sizeof(*bp));
+    bp->config = *config;
+    if (config->kind != BPRED_NOT_TAKEN) {
+        bp->counters = bpred_alloc((size_t)config->entries);
+        memset(bp->counters, 1, (size_t)config->entries);  // Weakly not taken
+        if (config->btb_entries > 0) bp->btb = bpred_alloc(config->btb_entries * sizeof(*bp->btb));
+        if (config->ras_depth > 0) bp->ras = bpred_alloc(config->ras_depth * sizeof(*bp->ras));
+    }
+    bp->site_capacity = 64;
+    bp->sites = bpred_alloc(bp->site_capacity * sizeof(*bp->sites));
+    return bp;
+}
+
+void bpred_destroy(branch_predictor *bp) {
+    if (bp == NULL) return;
+    free(bp->counters);
+    free(bp->btb);
+    free(bp->ras);
+    free(bp->sites);
+    free(bp);
+}
+
+static uint8_t *counter(branch_predictor *bp, uint32_t pc) {
+    uint32_t index = pc >> 2;
+    if (bp->config.kind == BPRED_GSHARE) index ^= bp->history;
+    return &bp->counters[index & (uint32_t)(bp->config.entries - 1)];
+}
+
+static btb_entry *btb_slot(branch_predictor *bp, uint32_t pc) {
+    return &bp->btb[(pc >> 2) & (uint32_t)(bp->config.btb_entries - 1)];
+}
+
+// Next fetch address for the instruction at pc, using only what fetch knows (the pc)
+uint32_t bpred_predict(branch_predictor *bp, uint32_t pc) {
+    if (bp->btb == NULL) return pc + 4;
+    bp->btb_lookups++;
+    const btb_entry *e = btb_slot(bp, pc);
+    if (e->kind == 0 || e->pc != pc) return pc + 4;
+    bp->btb_hits++;
+    switch (e->kind) {
+    case BTB_COND:
+        return *counter(bp, pc) >= 2 ? e->target : pc + 4;
+    case BTB_RETURN:
+        if (bp->ras_count > 0) return bp->ras[(bp->ras_top + bp->config.ras_depth - 1) % bp->config.ras_depth];
+        return e->target;
+    default:
+        return e->target;
+    }
+}
+
+static branch_site *find_site(branch_predictor *bp, uint32_t pc) {
+    if (2 * (bp->site_count + 1) > bp->site_capacity) {
+        branch_site *old = bp->sites;
+        uint32_t old_capacity = bp->site_capacity;
+        bp->site_capacity *= 2;
+        bp->sites = bpred_alloc(bp->site_capacity * sizeof(*bp->sites));
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old[i].kind == 0) continue;
+            uint32_t j = (old[i].pc >> 2) & (bp->site_capacity - 1);
+            while (bp->sites[j].kind != 0) j = (j + 1) & (bp->site_capacity - 1);
+            bp->sites[j] = old[i];
+        }
+        free(old);
+    }
+    uint32_t i = (pc >> 2) & (bp->site_capacity - 1);
+    while (bp->sites[i].kind != 0 && bp->sites[i].pc != pc) i = (i + 1) & (bp->site_capacity - 1);
+    if (bp->sites[i].kind == 0) {
+        bp->sites[i].pc = pc;
+        bp->site_count++;
+    }
+    return &bp->sites[i];
+}
+
+// Train on the instruction the staged engine just executed at pc (fetched with the
+// prediction predicted). Returns 1 if fetch followed the wrong path.
+int bpred_update(branch_predictor *bp, const cpu_context *cpu, uint32_t rd, uint32_t rs1, uint32_t pc, uint32_t predicted) {
+    int kind = branch_kind(cpu);
+    int wrong = predicted != cpu->pc;
+    if (kind == PIPE_BRANCH_NONE) {
+        // Only a BTB entry left behind by rewritten code can send a non-branch elsewhere
+        if (wrong && bp->btb != NULL) btb_slot(bp, pc)->kind = 0;
+        return wrong;
+    }
+
+    int taken = kind != PIPE_BRANCH_COND || branch_taken(cpu);
+    int is_return = kind == PIPE_BRANCH_JALR && rd == 0 && (rs1 == 1 || rs1 == 5);
+    int is_call = kind != PIPE_BRANCH_COND && (rd == 1 || rd == 5);
+
+    bp->by_kind[kind].executed++;
+    bp->by_kind[kind].mispredicted += wrong;
+    branch_site *site = find_site(bp, pc);
+    site->kind = (uint8_t)kind;
+    site->executed++;
+    site->taken += taken;
+    site->mispredicted += wrong;
+
+    if (kind == PIPE_BRANCH_COND) {
+        if (bp->counters != NULL) {
+            uint8_t *c = counter(bp, pc);
+            bp->direction_mispredicted += (*c >= 2) != taken;
+            if (taken && *c < 3) (*c)++;
+            if (!taken && *c > 0) (*c)--;
+            bp->history = (bp->history << 1 | (uint32_t)taken) & ((1u << bp->config.history) - 1);
+        } else {
+            bp->direction_mispredicted += taken;
+        }
+    }
+
+    if (bp->btb != NULL && taken) {
+        btb_entry *e = btb_slot(bp, pc);
+        e->pc = pc;
+        e->target = cpu->pc;
+        e->kind = (uint8_t)(is_return ? BTB_RETURN : kind);
+    }
+    if (is_return) {
+        bp->returns++;
+        bp->returns_correct += !wrong;
+    }
+    if (bp->ras != NULL) {
+        if (is_return && bp->ras_count > 0) {
+            bp->ras_top = (bp->ras_top + bp->config.ras_depth - 1) % bp->config.ras_depth;
+            bp->ras_count--;
+        }
+        if (is_call) {
+            bp->ras[bp->ras_top] = pc + 4;
+            bp->ras_top = (bp->ras_top + 1) % bp->config.ras_depth;
+            if (bp->ras_count < bp->config.ras_depth) bp->ras_count++;  // Full: the oldest entry is overwritten
+        }
+    }
+    return wrong;
+}
+
+static int power_of_two(long n) {
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+// Parse a --bpred specification: KIND[,entries=N][,history=N][,btb=N][,ras=N] (-1 if invalid)
+int parse_bpred(const char *spec, bpred_config *config) {
+    config->kind = BPRED_GSHARE;
+    config->entries = 1024;
+    config->history = -1;               // Default: log2(entries)
+    config->btb_entries = 256;
+    config->ras_depth = 8;
+
+    size_t len = strcspn(spec, ",");
+    if (len > 0) {
+        int kind = -1;
+        for (int k = BPRED_NOT_TAKEN; k <= BPRED_GSHARE; k++) {
+            if (strlen(kind_names[k]) == len && strncmp(spec, kind_names[k], len) == 0) kind = k;
+        }
+        if (kind < 0) return -1;
+        config->kind = kind;
+    }
+    spec += len;
+    while (*spec == ',') {
+        spec++;
+        len = strcspn(spec, ",");
+        const char *eq = memchr(spec, '=', len);
+        if (eq == NULL) return -1;
+        char *end;
+        long value = strtol(eq + 1, &end, 0);
+        if (end != spec + len || value < 0 || value > (1L << 24)) return -1;
+        size_t name_len = (size_t)(eq - spec);
+        if (name_len == 7 && strncmp(spec, "entries", 7) == 0 && power_of_two(value)) config->entries = (int)value;
+        else if (name_len == 7 && strncmp(spec, "history", 7) == 0 && value <= 24) config->history = (int)value;
+        else if (name_len == 3 && strncmp(spec, "btb", 3) == 0 && (value == 0 || power_of_two(value))) config->btb_entries = (int)value;
+        else if (name_len == 3 && strncmp(spec, "ras", 3) == 0) config->ras_depth = (int)value;
+        else return -1;
+        spec += len;
+    }
+    if (*spec != '\0') return -1;
+
+    if (config->history < 0) {
+        config->history = 0;
+        while ((1 << config->history) < config->entries) config->history++;
+    }
+    if (config->kind != BPRED_GSHARE) config->history = 0;
+    if (config->kind == BPRED_NOT_TAKEN) config->btb_entries = config->ras_depth = 0;
+    return 0;
+}
+
+// Branches executed and mispredicted so far, all kinds together
+void bpred_counts(const branch_predictor *bp, uint64_t *executed, uint64_t *mispredicted) {
+    *executed = *mispredicted = 0;
+    for (int k = PIPE_BRANCH_COND; k < PIPE_BRANCH_COUNT; k++) {
+        *executed += bp->by_kind[k].executed;
+        *mispredicted += bp->by_kind[k].mispredicted;
+    }
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+static int by_mispredictions(const void *a, const void *b) {
+    const branch_site *x = a, *y = b;
+    if (x->mispredicted != y->mispredicted) return x->mispredicted < y->mispredicted ? 1 : -1;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+void bpred_report(const branch_predictor *bp, FILE *out) {
+    const bpred_config *c = &bp->config;
+    fprintf(out, "Branch predictor: %s", kind_names[c->kind]);
+    if (c->kind != BPRED_NOT_TAKEN) fprintf(out, ", %d counters", c->entries);
+    if (c->kind == BPRED_GSHARE) fprintf(out, ", %d history bits", c->history);
+    if (c->kind != BPRED_NOT_TAKEN) fprintf(out, ", BTB %d, RAS %d", c->btb_entries, c->ras_depth);
+    fprintf(out, "\n");
+
+    uint64_t executed, mispredicted;
+    bpred_counts(bp, &executed, &mispredicted);
+    fprintf(out, "  Branches: %" PRIu64 ", mispredicted %" PRIu64 " (%.2f%%)\n",
+            executed, mispredicted, percent(mispredicted, executed));
+    for (int k = PIPE_BRANCH_COND; k < PIPE_BRANCH_COUNT; k++) {
+        const branch_count *n = &bp->by_kind[k];
+        fprintf(out, "    %-4s %" PRIu64 ", mispredicted %" PRIu64 " (%.2f%%)",
+                branch_names[k], n->executed, n->mispredicted, percent(n->mispredicted, n->executed));
+        if (k == PIPE_BRANCH_COND) fprintf(out, ", direction wrong %" PRIu64, bp->direction_mispredicted);
+        if (k == PIPE_BRANCH_JALR) fprintf(out, ", returns %" PRIu64 " (%" PRIu64 " predicted)", bp->returns, bp->returns_correct);
+        fprintf(out, "\n");
+    }
+    if (bp->btb != NULL) {
+        fprintf(out, "  BTB: %" PRIu64 " lookups, %" PRIu64 " hits (%.2f%%)\n",
+                bp->btb_lookups, bp->btb_hits, percent(bp->btb_hits, bp->btb_lookups));
+    }
+
+    if (bp->site_count == 0) return;
+    branch_site *sites = malloc(bp->site_count * sizeof(*sites));
+    if (sites == NULL) return;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < bp->site_capacity; i++) {
+        if (bp->sites[i].kind != 0) sites[n++] = bp->sites[i];
+    }
+    qsort(sites, n, sizeof(*sites), by_mispredictions);
+    fprintf(out, "  Per branch (most mispredicted first):\n");
+    for (uint32_t i = 0; i < n && i < PER_PC_REPORT_LINES; i++) {
+        const branch_site *s = &sites[i];
+        fprintf(out, "    0x%08" PRIx32 " %-4s executed %" PRIu64 ", taken %" PRIu64 ", mispredicted %" PRIu64 " (%.2f%%)\n",
+                s->pc, branch_names[s->kind], s->executed, s->taken, s->mispredicted, percent(s->mispredicted, s->executed));
+    }
+    if (n > PER_PC_REPORT_LINES) fprintf(out, "    ... %" PRIu32 " more\n", n - PER_PC_REPORT_LINES);
+    free(sites);
+}
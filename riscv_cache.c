@@ -0,0 +1,402 @@
+// Cache hierarchy model for the staged engine: split L1 instruction and data
+// caches with an optional unified L2 behind them.
+//
+// Fetch() presents every instruction fetch to the L1I and Mem() every lw/sw to
+// the L1D. Only tags are modelled; data always comes from guest memory. Each
+// cache is set-associative with LRU, tree pseudo-LRU or random replacement.
+// Write-back caches allocate on a write miss and write dirty lines to the next
+// level when they are evicted. Write-through caches pass every write on and do
+// not allocate on a write miss.
+//
+// Misses are split into the three Cs. A miss to a line never touched before is
+// compulsory. A miss that a fully-associative LRU cache of the same size would
+// also take is a capacity miss. Any other miss is a conflict miss.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "riscv_cpu.h"
+
+#define PER_PC_REPORT_LINES 20          // PCs listed in the per-PC part of the report
+#define FA_NONE UINT32_MAX              // Null link in the fully-associative shadow cache
+
+typedef struct {
+    uint32_t tag;                   // Line number (address >> line_shift)
+    uint8_t valid, dirty;
+    uint64_t last_use;              // Access stamp (LRU)
+} cache_line;
+
+// Fully-associative LRU cache of the same capacity, used to tell capacity from conflict misses
+typedef struct {
+    uint32_t line, prev, next;      // prev/next: LRU order, most recent at head
+    uint32_t chain;                 // Next node in the same hash bucket
+} fa_node;
+
+typedef struct {
+    fa_node *nodes;
+    uint32_t *buckets;
+    uint32_t capacity, count, bucket_mask;
+    uint32_t head, tail;
+} fa_cache;
+
+// Accesses and misses for one PC
+typedef struct {
+    uint32_t pc;
+    uint64_t accesses, misses;      // accesses == 0: unused slot
+} cache_site;
+
+struct cache {
+    const char *name;
+    cache_config config;
+    uint32_t sets, line_shift;
+    cache_line *lines;              // sets * ways
+    uint32_t *plru;                 // Tree bits per set (PLRU)
+    uint64_t clock, rng;
+    struct cache *next;             // Next level (NULL: memory)
+
+    fa_cache shadow;
+    uint64_t *seen;                 // Open-addressed set of lines ever touched (stored + 1)
+    uint32_t seen_count, seen_capacity;
+    cache_site *sites;
+    uint32_t site_count, site_capacity;
+
+    uint64_t reads, writes, hits, writebacks;
+    uint64_t misses[MISS_COUNT];
+};
+
+static const char *const replacement_names[] = { "lru", "plru", "random" };
+
+static void *cache_alloc(size_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        perror("cache_create");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static uint32_t log2_of(uint32_t n) {
+    uint32_t bits = 0;
+    while ((1u << bits) < n) bits++;
+    return bits;
+}
+
+cache *cache_create(const char *name, const cache_config *config, cache *next) {
+    cache *c = cache_alloc(sizeof(*c));
+    c->name = name;
+    c->config = *config;
+    c->next = next;
+    c->line_shift = log2_of(config->line);
+    c->sets = config->size / (config->line * config->ways);
+    c->lines = cache_alloc((size_t)c->sets * config->ways * sizeof(*c->lines));
+    if (config->replacement == REPL_PLRU) c->plru = cache_alloc(c->sets * sizeof(*c->plru));
+    c->rng = 0x9e3779b97f4a7c15ull;
+
+    fa_cache *fa = &c->shadow;
+    fa->capacity = c->sets * config->ways;
+    fa->nodes = cache_alloc(fa->capacity * sizeof(*fa->nodes));
+    fa->bucket_mask = (1u << log2_of(2 * fa->capacity)) - 1;
+    fa->buckets = cache_alloc((fa->bucket_mask + 1) * sizeof(*fa->buckets));
+    memset(fa->buckets, 0xff, (fa->bucket_mask + 1) * sizeof(*fa->buckets));
+    fa->head = fa->tail = FA_NONE;
+
+    c->seen_capacity = 1024;
+    c->seen = cache_alloc(c->seen_capacity * sizeof(*c->seen));
+    c->site_capacity = 64;
+    c->sites = cache_alloc(c->site_capacity * sizeof(*c->sites));
+    return c;
+}
+
+void cache_destroy(cache *c) {
+    if (c == NULL) return;
+    free(c->lines);
+    free(c->plru);
+    free(c->shadow.nodes);
+    free(c->shadow.buckets);
+    free(c->seen);
+    free(c->sites);
+    free(c);
+}
+
+static uint32_t hash_line(uint32_t line) {
+    return line * 0x9e3779b1u;
+}
+
+static void fa_unlink(fa_cache *fa, uint32_t n) {
+    fa_node *node = &fa->nodes[n];
+    if (node->prev != FA_NONE) fa->nodes[node->prev].next = node->next;
+    else fa->head = node->next;
+    if (node->next != FA_NONE) fa->nodes[node->next].prev = node->prev;
+    else fa->tail = node->prev;
+}
+
+static void fa_push_front(fa_cache *fa, uint32_t n) {
+    fa->nodes[n].prev = FA_NONE;
+    fa->nodes[n].next = fa->head;
+    if (fa->head != FA_NONE) fa->nodes[fa->head].prev = n;
+    fa->head = n;
+    if (fa->tail == FA_NONE) fa->tail = n;
+}
+
+// Touch line in the shadow cache; returns 1 if it was present
+static int fa_access(fa_cache *fa, uint32_t line) {
+    uint32_t *bucket = &fa->buckets[hash_line(line) & fa->bucket_mask];
+    for (uint32_t n = *bucket; n != FA_NONE; n = fa->nodes[n].chain) {
+        if (fa->nodes[n].line == line) {
+            fa_unlink(fa, n);
+            fa_push_front(fa, n);
+            return 1;
+        }
+    }
+
+    uint32_t n;
+    if (fa->count < fa->capacity) {
+        n = fa->count++;
+    } else {
+        n = fa->tail;                   // Evict the least recently used line
+        fa_unlink(fa, n);
+        uint32_t *link = &fa->buckets[hash_line(fa->nodes[n].line) & fa->bucket_mask];
+        while (*link != n) link = &fa->nodes[*link].chain;
+        *link = fa->nodes[n].chain;
+    }
+    fa->nodes[n].line = line;
+    fa->nodes[n].chain = *bucket;
+    *bucket = n;
+    fa_push_front(fa, n);
+    return 0;
+}
+
+// Record line as touched; returns 1 the first time
+static int first_touch(cache *c, uint32_t line) {
+    if (2 * (c->seen_count + 1) > c->seen_capacity) {
+        uint64_t *old = c->seen;
+        uint32_t old_capacity = c->seen_capacity;
+        c->seen_capacity *= 2;
+        c->seen = cache_alloc(c->seen_capacity * sizeof(*c->seen));
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old[i] == 0) continue;
+            uint32_t j = hash_line((uint32_t)(old[i] - 1)) & (c->seen_capacity - 1);
+            while (c->seen[j] != 0) j = (j + 1) & (c->seen_capacity - 1);
+            c->seen[j] = old[i];
+        }
+        free(old);
+    }
+    uint64_t key = (uint64_t)line + 1;
+    uint32_t i = hash_line(line) & (c->seen_capacity - 1);
+    while (c->seen[i] != 0) {
+        if (c->seen[i] == key) return 0;
+        i = (i + 1) & (c->seen_capacity - 1);
+    }
+    c->seen[i] = key;
+    c->seen_count++;
+    return 1;
+}
+
+static cache_site *find_site(cache *c, uint32_t pc) {
+    if (2 * (c->site_count + 1) > c->site_capacity) {
+        cache_site *old = c->sites;
+        uint32_t old_capacity = c->site_capacity;
+        c->site_capacity *= 2;
+        c->sites = cache_alloc(c->site_capacity * sizeof(*c->sites));
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old[i].accesses == 0) continue;
+            uint32_t j = (old[i].pc >> 2) & (c->site_capacity - 1);
+            while (c->sites[j].accesses != 0) j = (j + 1) & (c->site_capacity - 1);
+            c->sites[j] = old[i];
+        }
+        free(old);
+    }
+    uint32_t i = (pc >> 2) & (c->site_capacity - 1);
+    while (c->sites[i].accesses != 0 && c->sites[i].pc != pc) i = (i + 1) & (c->site_capacity - 1);
+    if (c->sites[i].accesses == 0) {
+        c->sites[i].pc = pc;
+        c->site_count++;
+    }
+    return &c->sites[i];
+}
+
+// Mark way as most recently used in its set
+static void touch(cache *c, uint32_t set, uint32_t way) {
+    c->lines[set * c->config.ways + way].last_use = ++c->clock;
+    if (c->plru != NULL) {
+        // Each tree node on the path points away from the way just used
+        uint32_t levels = log2_of(c->config.ways), node = 0;
+        for (uint32_t l = 0; l < levels; l++) {
+            uint32_t right = (way >> (levels - 1 - l)) & 1;
+            if (right) c->plru[set] &= ~(1u << node);
+            else c->plru[set] |= 1u << node;
+            node = 2 * node + 1 + right;
+        }
+    }
+}
+
+static uint32_t victim(cache *c, uint32_t set) {
+    const cache_line *lines = &c->lines[set * c->config.ways];
+    for (uint32_t w = 0; w < c->config.ways; w++) {
+        if (!lines[w].valid) return w;
+    }
+    switch (c->config.replacement) {
+    case REPL_PLRU: {
+        uint32_t levels = log2_of(c->config.ways), node = 0, way = 0;
+        for (uint32_t l = 0; l < levels; l++) {
+            uint32_t right = (c->plru[set] >> node) & 1;
+            way = way << 1 | right;
+            node = 2 * node + 1 + right;
+        }
+        return way;
+    }
+    case REPL_RANDOM:
+        c->rng ^= c->rng << 13;
+        c->rng ^= c->rng >> 7;
+        c->rng ^= c->rng << 17;
+        return (uint32_t)(c->rng % c->config.ways);
+    default: {
+        uint32_t oldest = 0;
+        for (uint32_t w = 1; w < c->config.ways; w++) {
+            if (lines[w].last_use < lines[oldest].last_use) oldest = w;
+        }
+        return oldest;
+    }
+    }
+}
+
+// Present an access by the instruction at pc to c (and, on a miss or write-through,
+// to the levels behind it). Returns 1 on a hit.
+int cache_access(cache *c, uint32_t address, int is_write, uint32_t pc) {
+    uint32_t line = address >> c->line_shift;
+    uint32_t set = line & (c->sets - 1);
+    cache_line *lines = &c->lines[set * c->config.ways];
+
+    if (is_write) c->writes++;
+    else c->reads++;
+    cache_site *site = find_site(c, pc);
+    site->accesses++;
+    int compulsory = first_touch(c, line);
+    int fits = fa_access(&c->shadow, line);
+
+    for (uint32_t w = 0; w < c->config.ways; w++) {
+        if (lines[w].valid && lines[w].tag == line) {
+            c->hits++;
+            touch(c, set, w);
+            if (is_write) {
+                if (c->config.write_back) lines[w].dirty = 1;
+                else if (c->next != NULL) cache_access(c->next, address, 1, pc);
+            }
+            return 1;
+        }
+    }
+
+    site->misses++;
+    c->misses[compulsory ? MISS_COMPULSORY : !fits ? MISS_CAPACITY : MISS_CONFLICT]++;
+    if (is_write && !c->config.write_back) {
+        if (c->next != NULL) cache_access(c->next, address, 1, pc);   // No write-allocate
+        return 0;
+    }
+
+    if (c->next != NULL) cache_access(c->next, address, 0, pc);
+    uint32_t w = victim(c, set);
+    if (lines[w].valid && lines[w].dirty) {
+        c->writebacks++;
+        if (c->next != NULL) cache_access(c->next, lines[w].tag << c->line_shift, 1, pc);
+    }
+    lines[w].valid = 1;
+    lines[w].tag = line;
+    lines[w].dirty = (uint8_t)is_write;
+    touch(c, set, w);
+    return 0;
+}
+
+static int power_of_two(long n) {
+    return n > 0 && (n & (n - 1)) == 0;
+}
+
+// Parse a cache specification: [size=N[K|M]][,ways=N][,line=N][,repl=lru|plru|random][,write=wb|wt]
+// on top of the defaults already in config (-1 if invalid)
+int parse_cache(const char *spec, cache_config *config) {
+    while (*spec != '\0') {
+        size_t len = strcspn(spec, ",");
+        const char *eq = memchr(spec, '=', len);
+        if (eq == NULL) return -1;
+        size_t name_len = (size_t)(eq - spec);
+        const char *value = eq + 1;
+        size_t value_len = len - name_len - 1;
+        char *end;
+        long n = strtol(value, &end, 0);
+        if (end < spec + len && (*end == 'K' || *end == 'k')) n <<= 10, end++;
+        else if (end < spec + len && (*end == 'M' || *end == 'm')) n <<= 20, end++;
+        int numeric = end == spec + len && n > 0 && n <= (1L << 30);
+
+        if (name_len == 4 && strncmp(spec, "size", 4) == 0 && numeric) config->size = (uint32_t)n;
+        else if (name_len == 4 && strncmp(spec, "ways", 4) == 0 && numeric) config->ways = (uint32_t)n;
+        else if (name_len == 4 && strncmp(spec, "line", 4) == 0 && numeric) config->line = (uint32_t)n;
+        else if (name_len == 4 && strncmp(spec, "repl", 4) == 0) {
+            int found = -1;
+            for (int r = REPL_LRU; r <= REPL_RANDOM; r++) {
+                if (strlen(replacement_names[r]) == value_len && strncmp(value, replacement_names[r], value_len) == 0) found = r;
+            }
+            if (found < 0) return -1;
+            config->replacement = found;
+        } else if (name_len == 5 && strncmp(spec, "write", 5) == 0 && value_len == 2 && strncmp(value, "wb", 2) == 0) {
+            config->write_back = 1;
+        } else if (name_len == 5 && strncmp(spec, "write", 5) == 0 && value_len == 2 && strncmp(value, "wt", 2) == 0) {
+            config->write_back = 0;
+        } else {
+            return -1;
+        }
+        spec += len;
+        if (*spec == ',') spec++;
+    }
+
+    if (!power_of_two(config->line) || config->line < 4) return -1;
+    if (config->size < config->line * config->ways || config->size % (config->line * config->ways) != 0) return -1;
+    if (!power_of_two(config->size / (config->line * config->ways))) return -1;
+    if (config->replacement == REPL_PLRU && (!power_of_two(config->ways) || config->ways > 32)) return -1;
+    return 0;
+}
+
+// Accesses and misses (of every kind) so far
+void cache_counts(const cache *c, uint64_t *accesses, uint64_t *misses) {
+    *accesses = c->reads + c->writes;
+    *misses = c->misses[MISS_COMPULSORY] + c->misses[MISS_CAPACITY] + c->misses[MISS_CONFLICT];
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+static int by_misses(const void *a, const void *b) {
+    const cache_site *x = a, *y = b;
+    if (x->misses != y->misses) return x->misses < y->misses ? 1 : -1;
+    return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+void cache_report(const cache *c, FILE *out) {
+    const cache_config *k = &c->config;
+    uint64_t accesses, misses;
+    cache_counts(c, &accesses, &misses);
+    fprintf(out, "%s cache: %" PRIu32 " bytes, %" PRIu32 "-way, %" PRIu32 "-byte lines, %s, %s\n",
+            c->name, k->size, k->ways, k->line, replacement_names[k->replacement],
+            k->write_back ? "write-back" : "write-through");
+    fprintf(out, "  Accesses: %" PRIu64 " (reads %" PRIu64 ", writes %" PRIu64 "), hits %" PRIu64
+            ", misses %" PRIu64 " (%.2f%%)\n", accesses, c->reads, c->writes, c->hits, misses, percent(misses, accesses));
+    fprintf(out, "  Misses: compulsory %" PRIu64 ", capacity %" PRIu64 ", conflict %" PRIu64 "; writebacks %" PRIu64 "\n",
+            c->misses[MISS_COMPULSORY], c->misses[MISS_CAPACITY], c->misses[MISS_CONFLICT], c->writebacks);
+
+    if (misses == 0) return;
+    cache_site *sites = malloc(c->site_count * sizeof(*sites));
+    if (sites == NULL) return;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < c->site_capacity; i++) {
+        if (c->sites[i].misses != 0) sites[n++] = c->sites[i];
+    }
+    qsort(sites, n, sizeof(*sites), by_misses);
+    fprintf(out, "  Per PC (most misses first):\n");
+    for (uint32_t i = 0; i < n && i < PER_PC_REPORT_LINES; i++) {
+        fprintf(out, "    0x%08" PRIx32 " accesses %" PRIu64 ", misses %" PRIu64 " (%.2f%%)\n",
+                sites[i].pc, sites[i].accesses, sites[i].misses, percent(sites[i].misses, sites[i].accesses));
+    }
+    if (n > PER_PC_REPORT_LINES) fprintf(out, "    ... %" PRIu32 " more\n", n - PER_PC_REPORT_LINES);
+    free(sites);
+}
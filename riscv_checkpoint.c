@@ -0,0 +1,215 @@
+// Checkpoints: snapshots of a run that a later run can restore and continue from.
+//
+// A checkpoint file is a log of records. The first record is a full snapshot:
+// pc, registers, cycle count, hpm event counts, exit status, program break
+// and every non-zero page of guest memory. Each
+// later record stores only the pages written since the record before it
+// (tracked with the dirty bits in riscv_mem.c). Frequent checkpoints therefore
+// cost about as much as the memory the program actually touches. Restoring
+// replays the records in order up to the requested cycle count.
+//
+// Every record carries a hash of the program image. A snapshot is only
+// restored into a run of the same program. Host files the guest has open
+// cannot be saved: a restored run finds them closed, and taking a checkpoint
+// while any are open prints a warning.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "riscv_cpu.h"
+
+#define CHECKPOINT_MAGIC "RVCK"
+#define CHECKPOINT_VERSION 3
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t program_hash;
+    uint64_t cycles;                // total_clock_cycles when the record was taken
+    uint32_t pc;
+    uint32_t full;                  // 1: every page (first record), 0: pages written since the previous record
+    int32_t rf[32];
+    uint32_t page_count;            // Pages that follow, each a uint32_t page number and PAGE_SIZE bytes
+    uint32_t exited;                // The program had called exit, passing exit_code
+    int32_t exit_code;
+    uint32_t brk;                   // Program break
+    uint64_t open_files;            // Open guest descriptors (syscall_state)
+    uint64_t hpm_events[HPM_COUNT]; // Behind the guest's hpmcounters
+} checkpoint_header;
+
+// FNV-1a over the segments, code range and entry point of the loaded program
+static uint64_t program_hash(const program_image *image) {
+    uint64_t h = 0xcbf29ce484222325ull;
+#define HASH_BYTES(p, n) do { \
+        const uint8_t *bytes_ = (const uint8_t *)(p); \
+        for (size_t i_ = 0; i_ < (size_t)(n); i_++) h = (h ^ bytes_[i_]) * 0x100000001b3ull; \
+    } while (0)
+    for (int i = 0; i < image->segment_count; i++) {
+        HASH_BYTES(&image->segments[i].address, 4);
+        HASH_BYTES(&image->segments[i].size, 4);
+        HASH_BYTES(image->segments[i].data, image->segments[i].size);
+    }
+    HASH_BYTES(&image->code_start, 4);
+    HASH_BYTES(&image->code_end, 4);
+    HASH_BYTES(&image->entry, 4);
+#undef HASH_BYTES
+    return h;
+}
+
+static int page_is_zero(const uint8_t *page) {
+    static const uint8_t zero[PAGE_SIZE];
+    return memcmp(page, zero, PAGE_SIZE) == 0;
+}
+
+// Append one record to out; full records hold every non-zero page, the others the dirty ones
+static int write_record(cpu_context *cpu, FILE *out, int full, const syscall_state *sys) {
+    checkpoint_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CHECKPOINT_MAGIC, 4);
+    h.version = CHECKPOINT_VERSION;
+    h.program_hash = program_hash(cpu->image);
+    h.cycles = cpu->total_clock_cycles;
+    h.pc = cpu->pc;
+    h.full = (uint32_t)full;
+    memcpy(h.rf, cpu->rf, sizeof(h.rf));
+    h.exited = (uint32_t)cpu->exited;
+    h.exit_code = cpu->exit_code;
+    h.brk = sys->brk;
+    h.open_files = sys->open_files;
+    memcpy(h.hpm_events, cpu->hpm_events, sizeof(h.hpm_events));
+
+    // Count first, so the header can be written ahead of the pages
+    uint32_t vpn = 0;
+    uint8_t *page;
+    while ((page = mem_next_page(&cpu->mem, &vpn)) != NULL) {
+        if (full ? !page_is_zero(page) : mem_page_dirty(&cpu->mem, vpn)) h.page_count++;
+        if (++vpn == 0) break;
+    }
+    if (fwrite(&h, sizeof(h), 1, out) != 1) return -1;
+    vpn = 0;
+    while ((page = mem_next_page(&cpu->mem, &vpn)) != NULL) {
+        if (full ? !page_is_zero(page) : mem_page_dirty(&cpu->mem, vpn)) {
+            if (fwrite(&vpn, sizeof(vpn), 1, out) != 1 || fwrite(page, PAGE_SIZE, 1, out) != 1) return -1;
+        }
+        if (++vpn == 0) break;
+    }
+    mem_clean(&cpu->mem);
+    return fflush(out) == 0 ? 0 : -1;
+}
+
+// Append a record of cpu's current state, warning (once per run) about open files it cannot hold
+static int checkpoint_now(cpu_context *cpu, FILE *out, int full, int *warned) {
+    syscall_state sys;
+    syscall_save(cpu, &sys);
+    if ((sys.open_files & ~SYSCALL_STD_FILES) && !*warned) {
+        fprintf(stderr, "Warning: checkpoint at cycle %" PRIu64 " taken with guest files open; "
+                "a restored run will find them closed\n", cpu->total_clock_cycles);
+        *warned = 1;
+    }
+    return write_record(cpu, out, full, &sys);
+}
+
+// Run to completion with the interpreter, appending a record to opt->path at the
+// requested cycle counts (or once at the end if none were requested)
+int run_checkpointed(cpu_context *cpu, const checkpoint_options *opt) {
+    FILE *out = fopen(opt->path, "wb");
+    if (out == NULL) {
+        perror(opt->path);
+        return -1;
+    }
+
+    int records = 0, warned = 0, status;
+    for (;;) {
+        uint64_t now = cpu->total_clock_cycles, pause_at = UINT64_MAX;
+        if (opt->at > now) pause_at = opt->at;
+        if (opt->every > 0 && now / opt->every * opt->every + opt->every < pause_at) {
+            pause_at = now / opt->every * opt->every + opt->every;
+        }
+        status = run_predecoded(cpu, pause_at);
+        if (status != RUN_PAUSED) break;
+        if (checkpoint_now(cpu, out, records == 0, &warned) != 0) goto write_error;
+        records++;
+    }
+    if (opt->at == 0 && opt->every == 0) {
+        if (checkpoint_now(cpu, out, 1, &warned) != 0) goto write_error;
+        records++;
+    }
+
+    long size = ftell(out);
+    if (fclose(out) != 0) {
+        perror(opt->path);
+        return -1;
+    }
+    if (cpu->trace_level >= TRACE_FINAL) {
+        printf("Wrote %d checkpoint%s to %s (%ld bytes)\n", records, records == 1 ? "" : "s", opt->path, size);
+    }
+    return status;
+
+write_error:
+    perror(opt->path);
+    fclose(out);
+    return -1;
+}
+
+// Restore the last record in path taken at or before cycle count at (UINT64_MAX:
+// the last one). The program must already be loaded. Returns 0 on success.
+int checkpoint_restore(cpu_context *cpu, const char *path, uint64_t at) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    uint64_t hash = program_hash(cpu->image);
+    checkpoint_header h, restored;
+    int records = 0;
+    while (fread(&h, sizeof(h), 1, in) == 1) {
+        if (memcmp(h.magic, CHECKPOINT_MAGIC, 4) != 0 || h.version != CHECKPOINT_VERSION
+                || (records == 0 && !h.full)) {
+            fprintf(stderr, "%s: not a checkpoint file\n", path);
+            goto fail;
+        }
+        if (h.program_hash != hash) {
+            fprintf(stderr, "%s: checkpoint was taken from a different program\n", path);
+            goto fail;
+        }
+        if (h.cycles > at) break;           // Records are in cycle order
+        if (h.full) mem_zero(&cpu->mem);
+        for (uint32_t i = 0; i < h.page_count; i++) {
+            uint32_t vpn;
+            if (fread(&vpn, sizeof(vpn), 1, in) != 1
+                    || fread(mem_page(&cpu->mem, vpn << PAGE_SHIFT, 1), PAGE_SIZE, 1, in) != 1) {
+                fprintf(stderr, "%s: truncated checkpoint\n", path);
+                goto fail;
+            }
+        }
+        restored = h;
+        records++;
+    }
+    fclose(in);
+    if (records == 0) {
+        if (at == UINT64_MAX) fprintf(stderr, "%s: no checkpoints in file\n", path);
+        else fprintf(stderr, "%s: no checkpoint at or before cycle %" PRIu64 "\n", path, at);
+        return -1;
+    }
+
+    cpu->pc = restored.pc;
+    memcpy(cpu->rf, restored.rf, sizeof(cpu->rf));
+    cpu->total_clock_cycles = restored.cycles;
+    memcpy(cpu->hpm_events, restored.hpm_events, sizeof(cpu->hpm_events));
+    cpu->exited = (int)restored.exited;
+    cpu->exit_code = restored.exit_code;
+    syscall_restore(cpu, &(syscall_state){ restored.brk, restored.open_files });
+    predecode_program(cpu);                 // The snapshot may hold rewritten code
+    cpu->code_version++;
+    if (cpu->trace_level >= TRACE_FINAL) {
+        printf("Restored checkpoint at cycle %" PRIu64 " from %s\n", restored.cycles, path);
+    }
+    return 0;
+
+fail:
+    fclose(in);
+    return -1;
+}
@@ -0,0 +1,110 @@
+// Performance counters: what the guest can read through the Zicsr instructions,
+// and where the host spends its time in run_staged().
+//
+// Guest side (Zicntr and the hpm counters). csrrw/csrrs/csrrc and their
+// immediate forms read:
+//   cycle, time, instret (0xC00-0xC02, high halves 0xC80-0xC82) and
+//   mcycle, minstret (0xB00, 0xB02, high halves 0xB80, 0xB82):
+//       total_clock_cycles. The CPU retires one instruction per cycle, and
+//       time ticks at the clock rate, so runs stay repeatable.
+//   hpmcounter3..31 (0xC03-0xC1F) and mhpmcounter3..31 (0xB03-0xB1F), high
+//       halves 0x80 above: hpm_events[n - 3], the HPM_* events, or 0 past them.
+// The counters are read-only. A write (csrrw, or csrrs/csrrc with a non-zero
+// source) or any other CSR prints "Unsupported CSR" and reads 0, the way an
+// unknown opcode runs as a NOP.
+//
+// The staged engine counts the events where the datapath decides them:
+// ControlUnit() the decode category, Mem() loads, stores and atomics, and
+// Writeback() branches, taken branches and jumps. run_predecoded() counts the
+// same events per micro-op, but only for programs that read an hpmcounter
+// (uses_counters), so other programs keep the fast dispatch.
+//
+// Host side: with --stage-times, run_staged() reads host_ticks() around each
+// stage function, and stage_timers_report() turns the totals into
+// nanoseconds per instruction using the wall time of the same runs. Reading
+// the timer is not free, so its measured cost is taken out of each stage.
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "riscv_cpu.h"
+
+#define CSR_MCYCLE        0xB00
+#define CSR_MHPMCOUNTER3  0xB03
+#define CSR_CYCLE         0xC00
+#define CSR_HPMCOUNTER3   0xC03
+#define CSR_HIGH          0x080     // Offset of the upper 32 bits of a counter (cycleh, ...)
+
+// Whether csr is one of the counters; *value receives its 64-bit value
+static int counter_value(const cpu_context *cpu, uint32_t csr, uint64_t *value) {
+    uint32_t base = csr & ~(uint32_t)CSR_HIGH;
+    if (base < CSR_MCYCLE || (base > CSR_MCYCLE + 31 && base < CSR_CYCLE) || base > CSR_CYCLE + 31) return 0;
+    uint32_t n = base & 31;
+    if (n == 1 && base == CSR_MCYCLE + 1) return 0;             // No mtime CSR (it is memory-mapped)
+    if (n < 3) *value = cpu->total_clock_cycles;                // cycle, time, instret
+    else *value = n - 3 < HPM_COUNT ? cpu->hpm_events[n - 3] : 0;
+    return 1;
+}
+
+// Carry out the CSR instruction and return the value it writes to rd. rs1_val
+// is the source register's value (unused by the immediate forms).
+int csr_access(cpu_context *cpu, uint32_t instruction, uint32_t rs1_val) {
+    uint32_t csr = instruction >> 20;
+    uint32_t funct3 = (instruction >> 12) & 7;
+    uint32_t rs1 = (instruction >> 15) & 0x1F;
+    int writes = (funct3 & 3) == 1 || rs1 != 0;                 // csrrw(i) always writes; csrrs/c only a non-zero source
+    uint64_t value;
+    (void)rs1_val;                  // Every supported CSR is read-only
+
+    if (writes || !counter_value(cpu, csr, &value)) {
+        if (cpu->trace_level >= TRACE_FINAL) printf("Unsupported CSR 0x%03x at PC=0x%x\n", csr, cpu->pc);
+        return 0;
+    }
+    return (int)(uint32_t)(csr & CSR_HIGH ? value >> 32 : value);
+}
+
+// Whether instruction is a CSR instruction that reads an event counter (hpmcounter3 and up)
+int csr_reads_events(uint32_t instruction) {
+    if (decode_lookup(instruction)->op != OP_CSR) return 0;
+    uint32_t base = (instruction >> 20) & ~(uint32_t)CSR_HIGH;
+    return (base >= CSR_MHPMCOUNTER3 && base <= CSR_MCYCLE + 31)
+        || (base >= CSR_HPMCOUNTER3 && base <= CSR_CYCLE + 31);
+}
+
+// Ticks two back-to-back host_ticks() calls take: what each timed call adds to its stage
+static uint64_t timer_overhead(void) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t t0 = host_ticks();
+        uint64_t t1 = host_ticks();
+        if (t1 - t0 < best) best = t1 - t0;
+    }
+    return best;
+}
+
+// Print the host time spent in each stage, per instruction and as a share of the
+// runs. The cost of reading the timer is taken out of each stage and shown apart.
+void stage_timers_report(const stage_timers *t, FILE *out) {
+    static const char *const names[TIMER_COUNT] = {
+        "fetch", "decode", "execute", "memory", "writeback", "models", "output",
+    };
+    double ns_per_tick = t->run_ticks ? t->run_seconds * 1e9 / (double)t->run_ticks : 0.0;
+    double per_instr = t->instructions ? ns_per_tick / (double)t->instructions : 0.0;
+    uint64_t overhead = timer_overhead(), timed = 0, timers = 0;
+
+    fprintf(out, "Host time by stage: %" PRIu64 " instructions in %.6f s (%.1f ns/instruction)\n",
+            t->instructions, t->run_seconds, t->instructions ? t->run_seconds * 1e9 / (double)t->instructions : 0.0);
+    for (int s = 0; s < TIMER_COUNT; s++) {
+        uint64_t cost = t->calls[s] * overhead < t->ticks[s] ? t->calls[s] * overhead : t->ticks[s];
+        uint64_t ticks = t->ticks[s] - cost;
+        timed += ticks;
+        timers += cost;
+        fprintf(out, "  %-10s %8.1f ns/instruction %5.1f%%\n", names[s], (double)ticks * per_instr,
+                t->run_ticks ? 100.0 * (double)ticks / (double)t->run_ticks : 0.0);
+    }
+    uint64_t other = t->run_ticks > timed + timers ? t->run_ticks - timed - timers : 0;
+    fprintf(out, "  %-10s %8.1f ns/instruction %5.1f%%\n", "other", (double)other * per_instr,
+            t->run_ticks ? 100.0 * (double)other / (double)t->run_ticks : 0.0);
+    fprintf(out, "  %-10s %8.1f ns/instruction %5.1f%%\n", "timers", (double)timers * per_instr,
+            t->run_ticks ? 100.0 * (double)timers / (double)t->run_ticks : 0.0);
+}
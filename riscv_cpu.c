@@ -2,33 +2,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <time.h>
 
-// Global variables
-uint32_t pc = 0;                // Program counter
-uint32_t next_pc = 0;           // Next program counter (PC + 4)
-uint32_t branch_target = 0;     // Branch target address (for BEQ)
-uint32_t jump_target = 0;       // Jump target address (for JAL/JALR)
-int alu_zero = 0;               // ALU zero flag
-int total_clock_cycles = 0;     // Total clock cycles
-
-// Control signals
-int RegWrite = 0;               // Control signal for register write
-int MemtoReg = 0;               // Control signal for memory to register
-int MemRead = 0;                // Control signal for memory read
-int MemWrite = 0;               // Control signal for memory write
-int ALUSrc = 0;                 // Control signal for ALU source (0: rs2, 1: imm)
-int Branch = 0;                 // Control signal for branch (BEQ)
-int ALUOp0 = 0;                 // Control signal for ALU operation (bit 0)
-int ALUOp1 = 0;                 // Control signal for ALU operation (bit 1)
-int Jump = 0;                   // Control signal for unconditional jump (JAL/JALR)
-
-// Memory and registers
-int rf[32] = {0};               // Register file (32 registers)
-int d_mem[32] = {0};            // Data memory (32 words)
-
-// Instruction memory - will be filled from input file
-uint32_t instr_mem[100];        // Instruction memory
-int instr_count = 0;            // Number of instructions (signed int is okay here)
+#include "riscv_cpu.h"
 
 // Function to extract bits from instruction
 uint32_t extract_bits(uint32_t instruction, int start, int length) {
@@ -46,209 +23,155 @@ int32_t sign_extend(uint32_t value, int bit_width) {
 }
 
 
-// Function to set ALU control based on ALUOp and funct fields
-uint32_t ALUControl(int ALUOp0, int ALUOp1, uint32_t funct3, uint32_t funct7) {
-    if (ALUOp0 == 0 && ALUOp1 == 0) { // Load/Store/JALR
-        return 0b0010; // ADD (for address calculation)
-    } else if (ALUOp0 == 1 && ALUOp1 == 0) { // Branch (BEQ)
-        return 0b0110; // SUB (for comparison)
-    } else if (ALUOp0 == 0 && ALUOp1 == 1) { // R-type or I-type ALU
-        if (funct3 == 0) { // add, addi, sub
-            if (funct7 == 0x20 && !ALUSrc) { // Check ALUSrc to distinguish sub from addi
-                 return 0b0110; // sub
-            } else {
-                 return 0b0010; // add, addi
-            }
-        } else if (funct3 == 7) { // and, andi
-            return 0b0000; // and
-        } else if (funct3 == 6) { // or, ori
-            return 0b0001; // or
-        }
-    }
-    // Default or unrecognized, default to ADD
-    // printf("Warning: Unhandled ALUOp/funct combination. Defaulting to ADD.\n");
-    return 0b0010;
-}
-
-// Control Unit function
-void ControlUnit(uint32_t opcode) {
-    // Reset all control signals
-    RegWrite = 0;
-    MemtoReg = 0;
-    MemRead = 0;
-    MemWrite = 0;
-    ALUSrc = 0;
-    Branch = 0;
-    ALUOp0 = 0;
-    ALUOp1 = 0;
-    Jump = 0; // Reset Jump signal
-
-    // Set control signals based on opcode
-    switch (opcode) {
-        case 0x33: // R-type (add, sub, and, or)
-            RegWrite = 1;
-            ALUOp1 = 1; // ALU performs R-type operation
-            break;
-        case 0x13: // I-type arithmetic (addi, andi, ori)
-            RegWrite = 1;
-            ALUSrc = 1; // ALU source is immediate
-            ALUOp1 = 1; // ALU performs I-type operation
-            break;
-        case 0x03: // I-type load (lw)
-            RegWrite = 1;
-            ALUSrc = 1;  // ALU source is immediate (for address calc)
-            MemRead = 1;
-            MemtoReg = 1; // Data comes from memory
-            ALUOp0 = 0; ALUOp1 = 0; // ALU does ADD for address calculation
-            break;
-        case 0x23: // S-type (sw)
-            ALUSrc = 1; // ALU source is immediate (for address calc)
-            MemWrite = 1;
-            ALUOp0 = 0; ALUOp1 = 0; // ALU does ADD for address calculation
-            break;
-        case 0x63: // SB-type (beq)
-            Branch = 1;
-            ALUOp0 = 1; // ALU does SUB for comparison
-            break;
-        case 0x6F: // J-type (JAL) - UJ-type technically
-             RegWrite = 1; // Writes PC+4 to rd
-             Jump = 1;     // Unconditional jump
-             // No ALU operation needed for target address calculation (PC + imm)
-             // No memory access
-             break;
-        case 0x67: // I-type (JALR)
-             RegWrite = 1; // Writes PC+4 to rd
-             Jump = 1;     // Unconditional jump
-             ALUSrc = 1;   // ALU source is immediate (offset)
-             ALUOp0 = 0; ALUOp1 = 0; // ALU does ADD for target address (rs1 + imm)
-             break;
-        default:
-            printf("Unknown opcode: 0x%x\n", opcode);
-            // Potentially halt or handle error
-            break;
+// Load the control signals from a decode-table control mask
+void set_control_signals(cpu_context *cpu, uint32_t ctrl) {
+    cpu->RegWrite = (ctrl & CTRL_REG_WRITE) != 0;
+    cpu->MemtoReg = (ctrl & CTRL_MEM_TO_REG) != 0;
+    cpu->MemRead  = (ctrl & CTRL_MEM_READ) != 0;
+    cpu->MemWrite = (ctrl & CTRL_MEM_WRITE) != 0;
+    cpu->ALUSrc   = (ctrl & CTRL_ALU_SRC) != 0;
+    cpu->Branch   = (ctrl & CTRL_BRANCH) != 0;
+    cpu->ALUOp0   = (ctrl & CTRL_ALU_OP0) != 0;
+    cpu->ALUOp1   = (ctrl & CTRL_ALU_OP1) != 0;
+    cpu->Jump     = (ctrl & CTRL_JUMP) != 0;
+    cpu->ALUSrcA  = (ctrl & CTRL_ALU_A_PC) ? ALU_A_PC : (ctrl & CTRL_ALU_A_ZERO) ? ALU_A_ZERO : ALU_A_RS1;
+    cpu->BranchNZ = (ctrl & CTRL_BRANCH_NZ) != 0;
+    cpu->System   = (ctrl & CTRL_SYSTEM) != 0;
+    cpu->Csr      = (ctrl & CTRL_CSR) != 0;
+}
+
+// Control Unit function: one decode-table lookup on opcode, funct3 and funct7
+void ControlUnit(cpu_context *cpu, uint32_t instruction) {
+    const instr_desc *desc = decode_lookup(instruction);
+    set_control_signals(cpu, desc->ctrl);
+    cpu->ALUCtrl = desc->alu;
+    cpu->Atomic = op_is_atomic(desc->op) ? desc->op : 0;
+
+    // Performance counters: the decode category (Mem() and Writeback() count the rest)
+    int event = op_event(desc->op);
+    if (event >= HPM_ALU) cpu->hpm_events[event]++;
+
+    if (!(desc->ctrl & CTRL_VALID) && cpu->trace_level >= TRACE_FINAL) {
+        printf("Unknown opcode: 0x%x\n", instruction & 0x7F);
+        // Potentially halt or handle error
     }
 }
 
 // Fetch function
-uint32_t Fetch() {
+uint32_t Fetch(cpu_context *cpu) {
     // Cast instr_count to uint32_t for comparison to avoid sign-compare warning
-    if ((pc / 4) >= (uint32_t)instr_count) {
-         printf("Attempting to fetch beyond program boundary. PC=0x%x\n", pc);
+    if (code_index(cpu, cpu->pc) >= (uint32_t)cpu->instr_count) {
+         printf("Attempting to fetch beyond program boundary. PC=0x%x\n", cpu->pc);
          // Handle end of program, maybe return a NOP or specific error code
          return 0; // Return NOP (addi x0, x0, 0)
     }
-    // Get instruction from instruction memory
-    uint32_t instruction = instr_mem[pc / 4];
+    // Get instruction from the unified memory
+    uint32_t instruction = mem_peek(&cpu->mem, cpu->pc & ~3U);
+    if (cpu->icache != NULL) cache_access(cpu->icache, cpu->pc, 0, cpu->pc);
 
     // Update next PC (potential value for non-branch/jump or link register)
-    next_pc = pc + 4;
+    cpu->next_pc = cpu->pc + 4;
 
     return instruction;
 }
 
+// Immediate generation and sign extension based on the instruction's format
+int32_t imm_gen(uint32_t instruction) {
+    switch (decode_lookup(instruction)->format) {
+        case FMT_I: case FMT_SHIFT: case FMT_LOAD: case FMT_JALR: { // I-type (addi, lw, jalr, etc.)
+            uint32_t imm_i = extract_bits(instruction, 20, 12);
+            return sign_extend(imm_i, 12);
+        }
+        case FMT_S: { // S-type (sw)
+            uint32_t imm_4_0 = extract_bits(instruction, 7, 5);
+            uint32_t imm_11_5 = extract_bits(instruction, 25, 7);
+            uint32_t imm_s = (imm_11_5 << 5) | imm_4_0;
+            return sign_extend(imm_s, 12);
+        }
+        case FMT_B: { // SB-type (beq, bne, blt, ...)
+            uint32_t imm_11   = extract_bits(instruction, 7, 1);
+            uint32_t imm_4_1  = extract_bits(instruction, 8, 4);
+            uint32_t imm_10_5 = extract_bits(instruction, 25, 6);
+            uint32_t imm_12   = extract_bits(instruction, 31, 1); // imm[12] is bit 31
+            uint32_t imm_b = (imm_12 << 12) | (imm_11 << 11) | (imm_10_5 << 5) | (imm_4_1 << 1);
+            return sign_extend(imm_b, 13); // Branch immediate is 13 bits
+        }
+        case FMT_U: // U-type (lui, auipc): upper 20 bits, low 12 zero
+            return (int32_t)(instruction & 0xFFFFF000u);
+        case FMT_J: { // UJ-type (JAL)
+            uint32_t imm_19_12 = extract_bits(instruction, 12, 8);
+            uint32_t imm_11    = extract_bits(instruction, 20, 1);
+            uint32_t imm_10_1  = extract_bits(instruction, 21, 10);
+            uint32_t imm_20    = extract_bits(instruction, 31, 1); // imm[20] is bit 31
+            // Reconstruct the immediate: imm[20|10:1|11|19:12]0
+            uint32_t imm_j = (imm_20 << 20) | (imm_19_12 << 12) | (imm_11 << 11) | (imm_10_1 << 1);
+            return sign_extend(imm_j, 21); // JAL immediate is 21 bits
+        }
+        default:
+            return 0; // Default immediate
+    }
+}
+
 // Decode function
-void Decode(uint32_t instruction, int *rs1_val, int *rs2_val, uint32_t *rd, uint32_t *rs1, uint32_t *rs2, uint32_t *funct3, uint32_t *funct7, int *imm) {
+void Decode(cpu_context *cpu, uint32_t instruction, int *rs1_val, int *rs2_val, uint32_t *rd, uint32_t *rs1, uint32_t *rs2, uint32_t *funct3, uint32_t *funct7, int *imm) {
     // Extract fields from instruction
-    uint32_t opcode = instruction & 0x7F;
     *rd = (instruction >> 7) & 0x1F;
     *funct3 = (instruction >> 12) & 0x7;
     *rs1 = (instruction >> 15) & 0x1F;
     *rs2 = (instruction >> 20) & 0x1F;
     *funct7 = (instruction >> 25) & 0x7F;
 
-    // Call Control Unit to set control signals based on opcode
-    ControlUnit(opcode);
+    // Call Control Unit to set control signals based on opcode, funct3 and funct7
+    ControlUnit(cpu, instruction);
 
     // Read values from register file (handle x0)
-    *rs1_val = (*rs1 == 0) ? 0 : rf[*rs1];
-    *rs2_val = (*rs2 == 0) ? 0 : rf[*rs2];
+    *rs1_val = (*rs1 == 0) ? 0 : cpu->rf[*rs1];
+    *rs2_val = (*rs2 == 0) ? 0 : cpu->rf[*rs2];
 
     // Immediate generation and sign extension based on instruction type/opcode
-    *imm = 0; // Default immediate
-    if (opcode == 0x13 || opcode == 0x03 || opcode == 0x67) { // I-type (addi, lw, jalr, etc.)
-        uint32_t imm_i = extract_bits(instruction, 20, 12);
-        *imm = sign_extend(imm_i, 12);
-    } else if (opcode == 0x23) { // S-type (sw)
-        uint32_t imm_4_0 = extract_bits(instruction, 7, 5);
-        uint32_t imm_11_5 = extract_bits(instruction, 25, 7);
-        uint32_t imm_s = (imm_11_5 << 5) | imm_4_0;
-        *imm = sign_extend(imm_s, 12);
-    } else if (opcode == 0x63) { // SB-type (beq)
-        uint32_t imm_11   = extract_bits(instruction, 7, 1);
-        uint32_t imm_4_1  = extract_bits(instruction, 8, 4);
-        uint32_t imm_10_5 = extract_bits(instruction, 25, 6);
-        uint32_t imm_12   = extract_bits(instruction, 31, 1); // imm[12] is bit 31
-        uint32_t imm_b = (imm_12 << 12) | (imm_11 << 11) | (imm_10_5 << 5) | (imm_4_1 << 1);
-        *imm = sign_extend(imm_b, 13); // Branch immediate is 13 bits
-    } else if (opcode == 0x6F) { // UJ-type (JAL)
-        uint32_t imm_19_12 = extract_bits(instruction, 12, 8);
-        uint32_t imm_11    = extract_bits(instruction, 20, 1);
-        uint32_t imm_10_1  = extract_bits(instruction, 21, 10);
-        uint32_t imm_20    = extract_bits(instruction, 31, 1); // imm[20] is bit 31
-        // Reconstruct the immediate: imm[20|10:1|11|19:12]0
-        uint32_t imm_j = (imm_20 << 20) | (imm_19_12 << 12) | (imm_11 << 11) | (imm_10_1 << 1);
-        *imm = sign_extend(imm_j, 21); // JAL immediate is 21 bits
-    }
+    *imm = imm_gen(instruction);
 }
 
 
 // Execute function - Removed unused rs1 and rs2 index parameters
-int Execute(int rs1_val, int rs2_val, int imm, uint32_t funct3, uint32_t funct7) {
-    int alu_result = 0;
-    // Operand1 is always rs1_val (or PC for some calculations not done in ALU)
+int Execute(cpu_context *cpu, int rs1_val, int rs2_val, int imm, uint32_t funct3, uint32_t funct7) {
+    (void)funct3; (void)funct7;     // The control unit already resolved the ALU operation
+    // Operand1 is rs1_val, or the PC (auipc) or zero (lui)
     // Operand2 depends on ALUSrc
-    int operand2 = ALUSrc ? imm : rs2_val;
+    int operand1 = cpu->ALUSrcA == ALU_A_PC ? (int)cpu->pc : cpu->ALUSrcA == ALU_A_ZERO ? 0 : rs1_val;
+    int operand2 = cpu->ALUSrc ? imm : rs2_val;
 
-    // Determine ALU operation based on control signals and funct fields
-    uint32_t alu_ctrl = ALUControl(ALUOp0, ALUOp1, funct3, funct7);
+    // Perform the ALU operation chosen by ControlUnit (an atomic's address is rs1 alone;
+    // its ALU operation is applied to the memory word by Mem())
+    int alu_result = cpu->Atomic ? rs1_val : (int)alu_compute(cpu->ALUCtrl, (uint32_t)operand1, (uint32_t)operand2);
 
-    // Perform ALU operation
-    switch (alu_ctrl) {
-        case 0b0000: // AND
-            alu_result = rs1_val & operand2;
-            break;
-        case 0b0001: // OR
-            alu_result = rs1_val | operand2;
-            break;
-        case 0b0010: // ADD
-            alu_result = rs1_val + operand2;
-            break;
-        case 0b0110: // SUB
-            alu_result = rs1_val - operand2;
-            break;
-        default:
-            printf("Unknown ALU control: 0x%x\n", alu_ctrl);
-            alu_result = 0; // Default result
-            break;
-    }
-
-    // Set zero flag based on the SUB operation for BEQ
-    if (Branch) { // Only set zero flag based on comparison for BEQ
-        alu_zero = ((rs1_val - rs2_val) == 0); // BEQ compares rs1 and rs2 directly
+    // Set zero flag from the comparison for branches (SUB for beq/bne, SLT/SLTU for the others)
+    if (cpu->Branch) {
+        cpu->alu_zero = (alu_result == 0);
     } else {
-        alu_zero = 0; // Ensure alu_zero is not set by other instructions
+        cpu->alu_zero = 0; // Ensure alu_zero is not set by other instructions
     }
 
 
     // Calculate branch/jump targets
-    if (Branch) {
-        branch_target = pc + imm; // BEQ target = PC + sign_extended_offset
+    if (cpu->Branch) {
+        cpu->branch_target = cpu->pc + imm; // Branch target = PC + sign_extended_offset
     }
-    if (Jump) {
+    if (cpu->Jump) {
          // Cast instr_count to uint32_t for comparison
-        uint32_t current_instr_index = pc / 4;
-        if (current_instr_index >= (uint32_t)instr_count) {
+        uint32_t current_instr_index = code_index(cpu, cpu->pc);
+        if (current_instr_index >= (uint32_t)cpu->instr_count) {
              printf("Error: Trying to decode instruction for Jump target calculation beyond program boundary.\n");
              // Handle appropriately, maybe set jump_target to a safe default or error state
-             jump_target = pc + 4; // Default to next instruction to prevent crash
+             cpu->jump_target = cpu->pc + 4; // Default to next instruction to prevent crash
         } else {
-             uint32_t instruction = instr_mem[current_instr_index];
+             uint32_t instruction = mem_peek(&cpu->mem, cpu->pc & ~3U);
              uint32_t opcode = instruction & 0x7F; // Get opcode again to differentiate JAL/JALR
              if (opcode == 0x6F) { // JAL
-                 jump_target = pc + imm; // JAL target = PC + sign_extended_offset
+                 cpu->jump_target = cpu->pc + imm; // JAL target = PC + sign_extended_offset
              } else if (opcode == 0x67) { // JALR
                  // Target = (rs1_val + imm) & ~1 (set LSB to 0)
-                 jump_target = (rs1_val + imm) & (~1U);
+                 cpu->jump_target = (rs1_val + imm) & (~1U);
              }
         }
     }
@@ -258,337 +181,1038 @@ int Execute(int rs1_val, int rs2_val, int imm, uint32_t funct3, uint32_t funct7)
 }
 
 
-// Memory function
-int Mem(int alu_result, int rs2_val) {
-    int mem_data = 0;
+// Load a word for lw (a misaligned load prints an error and reads 0)
+int mem_load(cpu_context *cpu, uint32_t address) {
+    if (address % 4 != 0) {
+        if (cpu->trace_level >= TRACE_FINAL) printf("Error: Unaligned memory access at address 0x%x\n", address);
+        return 0;
+    }
+    return (int)mem_peek(&cpu->mem, address);
+}
 
-    // Check for memory access validity (address should be word-aligned and within bounds)
-     if ((MemRead || MemWrite)) {
-          if(alu_result % 4 != 0) {
-               printf("Error: Unaligned memory access at address 0x%x\n", alu_result);
-               // Handle error appropriately, maybe exit or return specific error code
-               return 0; // Or some error indicator
-          }
-          int mem_index = alu_result / 4;
-          if (mem_index < 0 || mem_index >= 32) {
-               printf("Error: Memory access out of bounds. Address: 0x%x, Index: %d\n", alu_result, mem_index);
-               // Handle error appropriately
-               return 0; // Or some error indicator
-          }
+// After value was stored at the word address: if that word is part of the program,
+// predecode it again and return 1
+static int code_rewritten(cpu_context *cpu, uint32_t address, uint32_t value) {
+    uint32_t offset = address - cpu->mem.code_start;
+    if (offset >= cpu->mem.code_end - cpu->mem.code_start) return 0;
+    predecode(cpu, value, &cpu->d_prog[offset / 4]);
+    cpu->d_prog_threaded = 0;
+    cpu->code_version++;
+    return 1;
+}
 
-          // Proceed with memory operation
-          if (MemRead) {
-               mem_data = d_mem[mem_index];
-              // printf("MEM: Read 0x%x from address 0x%x (index %d)\n", mem_data, alu_result, mem_index);
-          }
-          if (MemWrite) {
-               d_mem[mem_index] = rs2_val;
-              // printf("MEM: Wrote 0x%x to address 0x%x (index %d)\n", rs2_val, alu_result, mem_index);
+// Store a word for sw (a misaligned store prints an error and is dropped).
+// Returns 1 if the store rewrote an instruction, after predecoding it again.
+int mem_store(cpu_context *cpu, uint32_t address, int value) {
+    if (address % 4 != 0) {
+        if (cpu->trace_level >= TRACE_FINAL) printf("Error: Unaligned memory access at address 0x%x\n", address);
+        return 0;
+    }
+    mem_poke(&cpu->mem, address, (uint32_t)value);
+    return code_rewritten(cpu, address, (uint32_t)value);
+}
+
+// Run an RV32A atomic (op: OP_LR..OP_AMOMAXU; alu: how an AMO combines the memory word
+// with value) on the word at address, and set *result to what it writes to rd: the old
+// word, or for sc.w 0 on success and 1 on failure. Each one is a single host atomic
+// operation on the guest page, so harts sharing memory see it as indivisible. lr.w
+// records the value it read, and sc.w stores only if the word still holds that value
+// (a store of the same value in between goes unnoticed). A misaligned address prints
+// an error, reads 0 and stores nothing. Returns 1 if the store rewrote an instruction.
+int mem_atomic(cpu_context *cpu, int op, int alu, uint32_t address, uint32_t value, int *result) {
+    *result = 0;
+    if (address % 4 != 0) {
+        if (cpu->trace_level >= TRACE_FINAL) printf("Error: Unaligned memory access at address 0x%x\n", address);
+        cpu->reserved = 0;
+        return 0;
+    }
+    const tlb_entry *e = &cpu->mem.write_tlb[(address >> PAGE_SHIFT) & (TLB_ENTRIES - 1)];
+    uint8_t *page = e->vpn == address >> PAGE_SHIFT ? e->page : mem_page(&cpu->mem, address, 1);
+    uint32_t *word = (uint32_t *)(page + (address & (PAGE_SIZE - 1)));
+    uint32_t old;
+
+    switch (op) {
+        case OP_LR:
+            old = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+            cpu->reserved = 1;
+            cpu->reservation = address;
+            cpu->reserved_value = old;
+            *result = (int)old;
+            return 0;
+        case OP_SC:
+            old = cpu->reserved_value;
+            *result = !(cpu->reserved && cpu->reservation == address
+                        && __atomic_compare_exchange_n(word, &old, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+            cpu->reserved = 0;
+            if (*result) return 0;
+            break;
+        default:
+            switch (alu) {
+                case ALU_B:   old = __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST); break;
+                case ALU_ADD: old = __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST); break;
+                case ALU_XOR: old = __atomic_fetch_xor(word, value, __ATOMIC_SEQ_CST); break;
+                case ALU_AND: old = __atomic_fetch_and(word, value, __ATOMIC_SEQ_CST); break;
+                case ALU_OR:  old = __atomic_fetch_or(word, value, __ATOMIC_SEQ_CST); break;
+                default:      // min/max: retry until no other hart wrote the word in between
+                    old = __atomic_load_n(word, __ATOMIC_RELAXED);
+                    while (!__atomic_compare_exchange_n(word, &old, alu_compute(alu, old, value), 0,
+                                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                    }
+                    break;
+            }
+            *result = (int)old;
+            break;
+    }
+    return code_rewritten(cpu, address, __atomic_load_n(word, __ATOMIC_RELAXED));
+}
+
+// Load a byte or halfword for lb/lh/lbu/lhu (funct3); a misaligned halfword prints an error and reads 0
+int mem_load_narrow(cpu_context *cpu, uint32_t address, uint32_t funct3) {
+    if (address & funct3 & 1) {
+        if (cpu->trace_level >= TRACE_FINAL) printf("Error: Unaligned memory access at address 0x%x\n", address);
+        return 0;
+    }
+    uint32_t word = mem_peek(&cpu->mem, address & ~3U) >> (8 * (address & 3));
+    switch (funct3) {
+        case 0:  return (int8_t)word;
+        case 1:  return (int16_t)word;
+        case 4:  return (uint8_t)word;
+        default: return (uint16_t)word;
+    }
+}
+
+// Store a byte or halfword for sb/sh (funct3) by rewriting the word that holds it.
+// A misaligned halfword prints an error and is dropped. Returns 1 if it rewrote an instruction.
+int mem_store_narrow(cpu_context *cpu, uint32_t address, int value, uint32_t funct3) {
+    if (address & funct3) {
+        if (cpu->trace_level >= TRACE_FINAL) printf("Error: Unaligned memory access at address 0x%x\n", address);
+        return 0;
+    }
+    uint32_t shift = 8 * (address & 3), mask = (funct3 == 0 ? 0xFFu : 0xFFFFu) << shift;
+    uint32_t word = mem_peek(&cpu->mem, address & ~3U);
+    word = (word & ~mask) | (((uint32_t)value << shift) & mask);
+    return mem_store(cpu, address & ~3U, (int)word);
+}
+
+// Memory function (funct3 gives the access width)
+int Mem(cpu_context *cpu, int alu_result, int rs2_val, uint32_t funct3) {
+    int mem_data = 0;
+
+    // The mem_load/mem_store functions check alignment and report misaligned accesses
+    uint32_t size = 1u << (funct3 & 3);
+    if (cpu->dcache != NULL && (cpu->MemRead || cpu->MemWrite) && !(alu_result & (size - 1))) {
+        cache_access(cpu->dcache, (uint32_t)alu_result, cpu->MemWrite, cpu->pc);
+    }
+    if (cpu->Atomic) cpu->hpm_events[HPM_ATOMICS]++;
+    else if (cpu->MemRead) cpu->hpm_events[HPM_LOADS]++;
+    else if (cpu->MemWrite) cpu->hpm_events[HPM_STORES]++;
+     if (cpu->MemRead && !cpu->Atomic) {
+          if (size == 4) mem_data = mem_load(cpu, (uint32_t)alu_result);
+          else mem_data = mem_load_narrow(cpu, (uint32_t)alu_result, funct3);
+         // printf("MEM: Read 0x%x from address 0x%x\n", mem_data, alu_result);
+     } else if (cpu->MemWrite || cpu->Atomic) {
+          uint32_t word = (uint32_t)alu_result & ~3U;
+          uint32_t old = cpu->trace_out != NULL ? mem_peek(&cpu->mem, word) : 0;
+          if (cpu->Atomic) mem_atomic(cpu, cpu->Atomic, cpu->ALUCtrl, (uint32_t)alu_result, (uint32_t)rs2_val, &mem_data);
+          else if (size == 4) mem_store(cpu, (uint32_t)alu_result, rs2_val);
+          else mem_store_narrow(cpu, (uint32_t)alu_result, rs2_val, funct3);
+          // Delta trace: record the word only if the store changed it
+          if (cpu->trace_out != NULL && mem_peek(&cpu->mem, word) != old) {
+              trace_mem(cpu->trace_out, word, mem_peek(&cpu->mem, word));
           }
+         // printf("MEM: Wrote 0x%x to address 0x%x\n", rs2_val, alu_result);
      }
 
     return mem_data;
 }
 
 // Writeback function
-void Writeback(uint32_t rd, int alu_result, int mem_data) {
+void Writeback(cpu_context *cpu, uint32_t rd, int alu_result, int mem_data) {
     int write_data = 0;
 
     // Determine data to write back
-    if (Jump) { // For JAL/JALR, write PC+4 (stored in next_pc)
-        write_data = next_pc;
-    } else if (MemtoReg) { // For LW
+    if (cpu->Jump) { // For JAL/JALR, write PC+4 (stored in next_pc)
+        write_data = cpu->next_pc;
+    } else if (cpu->MemtoReg) { // For LW
         write_data = mem_data;
     } else { // For R-type and I-type ALU
         write_data = alu_result;
     }
 
     // Write to register file if RegWrite is asserted and rd is not x0
-    if (RegWrite && rd != 0) {
+    if (cpu->RegWrite && rd != 0) {
         //printf("WB: Writing 0x%x to x%u\n", write_data, rd);
-        rf[rd] = write_data;
+        if (cpu->trace_out != NULL && cpu->rf[rd] != write_data) trace_reg(cpu->trace_out, rd, (uint32_t)write_data);
+        cpu->rf[rd] = write_data;
     }
 
     // Update PC for the next cycle
-    if (Jump) { // JAL or JALR taken
-        pc = jump_target;
+    if (cpu->Branch) cpu->hpm_events[HPM_BRANCHES]++;
+    if (cpu->Jump) { // JAL or JALR taken
+        cpu->hpm_events[HPM_JUMPS]++;
+        cpu->pc = cpu->jump_target;
         //printf("WB: Jumping to 0x%x\n", pc);
-    } else if (Branch && alu_zero) { // BEQ taken
-        pc = branch_target;
+    } else if (branch_taken(cpu)) { // Conditional branch taken
+        cpu->hpm_events[HPM_TAKEN]++;
+        cpu->pc = cpu->branch_target;
         //printf("WB: Branching to 0x%x\n", pc);
     } else { // Default: PC = PC + 4
-        pc = next_pc;
+        cpu->pc = cpu->next_pc;
        // printf("WB: Proceeding to 0x%x\n", pc);
     }
 
     // Increment clock cycle count AFTER the instruction completes
-    total_clock_cycles++;
+    cpu->total_clock_cycles++;
 }
 
 
-// Function to decode and print instruction information
-void print_instruction(uint32_t instruction) {
-    uint32_t opcode = instruction & 0x7F;
-    uint32_t rd = (instruction >> 7) & 0x1F;
-    uint32_t funct3 = (instruction >> 12) & 0x7;
-    uint32_t rs1 = (instruction >> 15) & 0x1F;
-    uint32_t rs2 = (instruction >> 20) & 0x1F;
-    uint32_t funct7 = (instruction >> 25) & 0x7F;
-    int imm_i, imm_s, imm_b, imm_j; // Signed immediates - removed unused imm_u
-
-    // Calculate immediates for printing
-    imm_i = sign_extend(extract_bits(instruction, 20, 12), 12); // I-type, JALR
-    uint32_t imm_s_raw = (extract_bits(instruction, 25, 7) << 5) | extract_bits(instruction, 7, 5);
-    imm_s = sign_extend(imm_s_raw, 12); // S-type
-    uint32_t imm_b_raw = (extract_bits(instruction, 31, 1) << 12) | (extract_bits(instruction, 7, 1) << 11) | (extract_bits(instruction, 25, 6) << 5) | (extract_bits(instruction, 8, 4) << 1);
-    imm_b = sign_extend(imm_b_raw, 13); // SB-type
-    uint32_t imm_j_raw = (extract_bits(instruction, 31, 1) << 20) | (extract_bits(instruction, 12, 8) << 12) | (extract_bits(instruction, 20, 1) << 11) | (extract_bits(instruction, 21, 10) << 1);
-    imm_j = sign_extend(imm_j_raw, 21); // UJ-type (JAL)
-
-
-    printf("--- Instruction 0x%08x (@PC=0x%x) ---\n", instruction, pc);
-
-    switch (opcode) {
-        case 0x33: // R-type
-            printf("  Type: R | ");
-            if (funct3 == 0 && funct7 == 0) printf("add x%u, x%u, x%u\n", rd, rs1, rs2);
-            else if (funct3 == 0 && funct7 == 0x20) printf("sub x%u, x%u, x%u\n", rd, rs1, rs2);
-            else if (funct3 == 7 && funct7 == 0) printf("and x%u, x%u, x%u\n", rd, rs1, rs2);
-            else if (funct3 == 6 && funct7 == 0) printf("or x%u, x%u, x%u\n", rd, rs1, rs2);
-            else printf("Unknown R-type (funct3=0x%x, funct7=0x%x)\n", funct3, funct7);
-            break;
-        case 0x13: // I-type arithmetic
-            printf("  Type: I | ");
-            if (funct3 == 0) printf("addi x%u, x%u, %d\n", rd, rs1, imm_i);
-            else if (funct3 == 7) printf("andi x%u, x%u, %d\n", rd, rs1, imm_i);
-            else if (funct3 == 6) printf("ori x%u, x%u, %d\n", rd, rs1, imm_i);
-            else printf("Unknown I-type arithmetic (funct3=0x%x)\n", funct3);
-            break;
-        case 0x03: // I-type load
-            printf("  Type: I | ");
-            if (funct3 == 2) printf("lw x%u, %d(x%u)\n", rd, imm_i, rs1);
-            else printf("Unknown I-type load (funct3=0x%x)\n", funct3);
+// Translate one instruction into a predecoded micro-op
+void predecode(cpu_context *cpu, uint32_t instruction, decoded_instr *d) {
+    const instr_desc *desc = decode_lookup(instruction);
+
+    memset(d, 0, sizeof(*d));
+    d->raw = instruction;
+    d->op = desc->op;
+    d->rd = (instruction >> 7) & 0x1F;
+    d->rs1 = (instruction >> 15) & 0x1F;
+    d->rs2 = (instruction >> 20) & 0x1F;
+    d->imm = imm_gen(instruction);
+    d->alu_ctrl = desc->alu;
+    d->ctrl = desc->ctrl;
+    if (desc->op == OP_CSR && csr_reads_events(instruction)) cpu->uses_counters = 1;
+}
+
+// Predecode the program image in memory and terminate it with the OP_HALT sentinel
+void predecode_program(cpu_context *cpu) {
+    cpu->uses_counters = 0;
+    for (int i = 0; i < cpu->instr_count; i++) {
+        predecode(cpu, mem_peek(&cpu->mem, cpu->mem.code_start + 4 * (uint32_t)i), &cpu->d_prog[i]);
+    }
+    cpu->uses_syscalls = 0;
+    for (int i = 0; i < cpu->instr_count; i++) cpu->uses_syscalls |= cpu->d_prog[i].op == OP_ECALL;
+    memset(&cpu->d_prog[cpu->instr_count], 0, sizeof(cpu->d_prog[0]));
+    cpu->d_prog[cpu->instr_count].op = OP_HALT;
+    cpu->d_prog_threaded = 0;
+}
+
+// Superinstruction (FUSE_*) for the micro-op pair first, second. A store or atomic
+// never comes first: it could rewrite the second instruction after it was fused.
+static int fuse_pair(int first, int second) {
+    switch (first) {
+        case OP_ADDI:
+            switch (second) {
+                case OP_BEQ:  return FUSE_ADDI_BEQ;
+                case OP_BNE:  return FUSE_ADDI_BNE;
+                case OP_BLT:  return FUSE_ADDI_BLT;
+                case OP_BGE:  return FUSE_ADDI_BGE;
+                case OP_BLTU: return FUSE_ADDI_BLTU;
+                case OP_BGEU: return FUSE_ADDI_BGEU;
+                case OP_ADDI: return FUSE_ADDI_ADDI;
+                case OP_SW:   return FUSE_ADDI_SW;
+            }
             break;
-        case 0x23: // S-type
-            printf("  Type: S | ");
-            if (funct3 == 2) printf("sw x%u, %d(x%u)\n", rs2, imm_s, rs1);
-            else printf("Unknown S-type (funct3=0x%x)\n", funct3);
+        case OP_ANDI:
+            if (second == OP_BEQ) return FUSE_ANDI_BEQ;
+            if (second == OP_BNE) return FUSE_ANDI_BNE;
             break;
-        case 0x63: // SB-type
-            printf("  Type: B | ");
-            if (funct3 == 0) printf("beq x%u, x%u, %d (target 0x%x)\n", rs1, rs2, imm_b, pc + imm_b);
-            else printf("Unknown SB-type (funct3=0x%x)\n", funct3);
+        case OP_BEQ: if (second == OP_JAL) return FUSE_BEQ_JAL; break;
+        case OP_BNE: if (second == OP_JAL) return FUSE_BNE_JAL; break;
+        case OP_ADD:
+            if (second == OP_ADD) return FUSE_ADD_ADD;
+            if (second == OP_SW) return FUSE_ADD_SW;
             break;
-        case 0x6F: // UJ-type (JAL)
-             printf("  Type: J | jal x%u, %d (target 0x%x)\n", rd, imm_j, pc + imm_j);
-             break;
-        case 0x67: // I-type (JALR)
-             printf("  Type: I | jalr x%u, x%u, %d\n", rd, rs1, imm_i);
-             break;
-        default:
-            printf("  Unknown instruction type (opcode 0x%x)\n", opcode);
+        case OP_SLLI: if (second == OP_ADD) return FUSE_SLLI_ADD; break;
+        case OP_LUI:  if (second == OP_ADDI) return FUSE_LUI_ADDI; break;
+        case OP_LW:
+            if (second == OP_ADD) return FUSE_LW_ADD;
+            if (second == OP_LW) return FUSE_LW_LW;
             break;
     }
+    return FUSE_NONE;
+}
+
+// Mark every slot that starts a superinstruction with the slot after it. Run
+// whenever d_prog changes, so a rewritten instruction is never run fused with
+// its old neighbour. Programs that count events run every micro-op on its own.
+static void fuse_program(cpu_context *cpu) {
+    for (int i = 0; i < cpu->instr_count; i++) {   // The last slot's neighbour is the OP_HALT sentinel
+        decoded_instr *d = &cpu->d_prog[i];
+        d->fused = cpu->no_fusion || cpu->uses_counters ? FUSE_NONE : (uint8_t)fuse_pair(d[0].op, d[1].op);
+    }
+    cpu->d_prog[cpu->instr_count].fused = FUSE_NONE;
+}
+
+// Function to decode and print instruction information
+void print_instruction(cpu_context *cpu, uint32_t instruction) {
+    const instr_desc *desc = decode_lookup(instruction);
+    char text[64];
+
+    printf("--- Instruction 0x%08x (@PC=0x%x) ---\n", instruction, cpu->pc);
+    if (desc->format == FMT_NONE) {
+        printf("  Unknown instruction type (opcode 0x%x)\n", instruction & 0x7F);
+    } else {
+        disassemble(instruction, cpu->pc, text, sizeof(text));
+        printf("  Type: %c | %s\n", "?RIIIISBUJRIII"[desc->format], text);
+    }
     // printf("  Control Signals: RegW=%d, MemR=%d, MemW=%d, MemToReg=%d, ALUSrc=%d, ALUOp=%d%d, Branch=%d, Jump=%d\n",
     //        RegWrite, MemRead, MemWrite, MemtoReg, ALUSrc, ALUOp1, ALUOp0, Branch, Jump);
 }
 
-// Print register file and data memory state (only non-zero values)
-void print_state(int final_state) {
-    if (!final_state) {
-         printf("----- State after cycle %d -----\n", total_clock_cycles);
-    } else {
-         printf("Total clock cycles: %d\n", total_clock_cycles);
+// ABI names for print_state(cpu)
+static const char *const abi_names[32] = {
+    "", " (ra)", " (sp)", " (gp)", " (tp)", " (t0)", " (t1)", " (t2)",
+    " (s0/fp)", " (s1)", " (a0)", " (a1)", " (a2)", " (a3)", " (a4)", " (a5)",
+    " (a6)", " (a7)", " (s2)", " (s3)", " (s4)", " (s5)", " (s6)", " (s7)",
+    " (s8)", " (s9)", " (s10)", " (s11)", " (t3)", " (t4)", " (t5)", " (t6)",
+};
+
+// Visit every non-zero data word in address order. Only allocated pages are scanned, and
+// program words that still hold the loaded instruction are skipped.
+void for_each_data_word(cpu_context *cpu, void (*fn)(void *arg, uint32_t address, int value), void *arg) {
+    const guest_mem *m = &cpu->mem;
+    uint32_t vpn = 0;
+    const uint8_t *page;
+    while ((page = mem_next_page(m, &vpn)) != NULL) {
+        for (uint32_t offset = 0; offset < PAGE_SIZE; offset += 4) {
+            if (offset % 64 == 0) {         // Skip all-zero 64-byte blocks without looking at each word
+                uint64_t block[8], any = 0;
+                memcpy(block, page + offset, sizeof(block));
+                for (int i = 0; i < 8; i++) any |= block[i];
+                if (any == 0) {
+                    offset += 60;
+                    continue;
+                }
+            }
+            int value;
+            memcpy(&value, page + offset, 4);
+            if (value == 0) continue;
+            uint32_t address = (vpn << PAGE_SHIFT) + offset;
+            uint32_t code_offset = address - m->code_start;
+            if (code_offset < m->code_end - m->code_start && (uint32_t)value == cpu->instr_mem[code_offset / 4]) continue;
+            fn(arg, address, value);
+        }
+        if (++vpn == 0) break;              // Wrapped past the last page
     }
-     printf("PC: 0x%x\n", pc);
+}
 
+static void print_data_word(void *arg, uint32_t address, int value) {
+    printf("  0x%x = 0x%x (%d)\n", address, value, value);
+    *(int *)arg = 1;
+}
+
+static void print_registers(cpu_context *cpu) {
     printf("\nRegister File (non-zero):\n");
     int rf_changed = 0;
     for (int i = 0; i < 32; i++) {
-        if (rf[i] != 0) {
+        if (cpu->rf[i] != 0) {
             // Map register number to ABI name for readability
-            const char* abi_name = "";
-            switch(i) {
-                case 1: abi_name = " (ra)"; break; 
-                case 2: abi_name = " (sp)"; break;
-                case 3: abi_name = " (gp)"; break; 
-                case 4: abi_name = " (tp)"; break;
-                case 5: abi_name = " (t0)"; break; 
-                case 6: abi_name = " (t1)"; break; 
-                case 7: abi_name = " (t2)"; break;
-                case 8: abi_name = " (s0/fp)"; break; 
-                case 9: abi_name = " (s1)"; break;
-                case 10: abi_name = " (a0)"; break; 
-                case 11: abi_name = " (a1)"; break;
-                case 12: abi_name = " (a2)"; break; 
-                case 13: abi_name = " (a3)"; break;
-                case 14: abi_name = " (a4)"; break; 
-                case 15: abi_name = " (a5)"; break;
-                case 16: abi_name = " (a6)"; break; 
-                case 17: abi_name = " (a7)"; break;
-                case 18: abi_name = " (s2)"; break; 
-                case 19: abi_name = " (s3)"; break;
-                case 20: abi_name = " (s4)"; break; 
-                case 21: abi_name = " (s5)"; break;
-                case 22: abi_name = " (s6)"; break; 
-                case 23: abi_name = " (s7)"; break;
-                case 24: abi_name = " (s8)"; break; 
-                case 25: abi_name = " (s9)"; break;
-                case 26: abi_name = " (s10)"; break; 
-                case 27: abi_name = " (s11)"; break;
-                case 28: abi_name = " (t3)"; break; 
-                case 29: abi_name = " (t4)"; break;
-                case 30: abi_name = " (t5)"; break; 
-                case 31: abi_name = " (t6)"; break;
-            }
-            printf("  x%d%s = 0x%x (%d)\n", i, abi_name, rf[i], rf[i]);
+            printf("  x%d%s = 0x%x (%d)\n", i, abi_names[i], cpu->rf[i], cpu->rf[i]);
             rf_changed = 1;
         }
     }
      if (!rf_changed) printf("  All zero.\n");
+}
 
+static void print_memory(cpu_context *cpu) {
     printf("\nData Memory (non-zero):\n");
     int mem_changed = 0;
-    for (int i = 0; i < 32; i++) {
-        if (d_mem[i] != 0) {
-            printf("  0x%x = 0x%x (%d)\n", i * 4, d_mem[i], d_mem[i]);
-            mem_changed = 1;
-        }
-    }
+    for_each_data_word(cpu, print_data_word, &mem_changed);
     if (!mem_changed) printf("  All zero.\n");
     printf("-----------------------------\n\n");
 }
 
-
-// Function to read instructions from file (binary strings)
-void read_program(const char* filename) {
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
+// Print register file and data memory state (only non-zero values)
+void print_state(cpu_context *cpu, int final_state) {
+    if (!final_state) {
+         printf("----- State after cycle %" PRIu64 " -----\n", cpu->total_clock_cycles);
+    } else {
+         printf("Total clock cycles: %" PRIu64 "\n", cpu->total_clock_cycles);
     }
+     printf("PC: 0x%x\n", cpu->pc);
+    print_registers(cpu);
+    print_memory(cpu);
+}
 
-    char line[100]; // Assuming max line length
-    instr_count = 0;
-    printf("Loading program from %s...\n", filename);
+// Print the final state of harts that share memory: each one's cycle count, PC
+// and registers, then the memory once
+void print_harts(cpu_context **harts, int count) {
+    for (int h = 0; h < count; h++) {
+        printf("Hart %d: %" PRIu64 " clock cycles, PC: 0x%x\n", h, harts[h]->total_clock_cycles, harts[h]->pc);
+        print_registers(harts[h]);
+        printf("\n");
+    }
+    print_memory(harts[0]);
+}
 
-    while (fgets(line, sizeof(line), file) && instr_count < 100) {
-        // Remove trailing newline or carriage return
-        line[strcspn(line, "\r\n")] = 0;
 
-        // Check if line is 32 chars long and contains only 0s and 1s
-        if (strlen(line) == 32 && strspn(line, "01") == 32) {
-            uint32_t instruction = 0;
-            for (int i = 0; i < 32; i++) {
-                if (line[i] == '1') {
-                    instruction |= (1U << (31 - i));
-                }
-            }
-            instr_mem[instr_count++] = instruction;
-           // printf("Loaded instruction %d: 0x%08x\n", instr_count - 1, instruction);
-        } else if (strlen(line) > 0) { // Ignore empty lines but warn about invalid ones
-             printf("Warning: Skipping invalid line in program file: '%s'\n", line);
-        }
+// Write the program's segments into memory and predecode its code
+static void install_program(cpu_context *cpu) {
+    const program_image *image = cpu->image;
+    for (int i = 0; i < image->segment_count; i++) {
+        mem_write(&cpu->mem, image->segments[i].address, image->segments[i].data, image->segments[i].size);
     }
+    mem_set_code(&cpu->mem, image->code_start, image->code_start + 4 * (uint32_t)cpu->instr_count);
+    for (int i = 0; i < cpu->instr_count; i++) {
+        cpu->instr_mem[i] = mem_peek(&cpu->mem, image->code_start + 4 * (uint32_t)i);
+    }
+
+    // Translate the image once so the run loop never re-decodes
+    predecode_program(cpu);
+    cpu->code_version++;
+}
 
-    fclose(file);
-    printf("Loaded %d instructions.\n\n", instr_count);
+// Set the pc and sp a run of the loaded program starts with
+static void start_program(cpu_context *cpu) {
+    cpu->pc = cpu->image->entry;
+    if (cpu->image->stack_top != 0) cpu->rf[2] = (int)cpu->image->stack_top;
 }
 
+// Make image the context's program. cpu_reset() copies it into memory, predecodes
+// it and points the pc at its entry, so a load followed by a reset installs it once.
+// The image must stay open while the context uses it.
+void load_program(cpu_context *cpu, const program_image *image) {
+    int count = (int)((image->code_end - image->code_start) / 4);
+    uint32_t *instr_mem = realloc(cpu->instr_mem, (count + 1) * sizeof(*instr_mem));
+    decoded_instr *d_prog = realloc(cpu->d_prog, (count + 1) * sizeof(*d_prog));
+    if (instr_mem == NULL || d_prog == NULL) {
+        perror("load_program");
+        exit(EXIT_FAILURE);
+    }
+    cpu->instr_mem = instr_mem;
+    cpu->d_prog = d_prog;
+    cpu->image = image;
+    cpu->instr_count = count;
+}
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <program_file.txt>\n", argv[0]);
-        return EXIT_FAILURE;
+// Load an image the context owns from now on, closing the one it owned before
+static void adopt_program(cpu_context *cpu, program_image *image) {
+    load_program(cpu, image);
+    if (cpu->own_image != NULL) {
+        program_close(cpu->own_image);
+        free(cpu->own_image);
     }
+    cpu->own_image = image;
+}
 
-    const char* filename = argv[1];
+// Function to read a program from file (text, raw binary or ELF); cpu_reset() starts it
+int read_program(cpu_context *cpu, const char* filename) {
+    program_image *image = malloc(sizeof(*image));
+    if (image == NULL) {
+        perror("read_program");
+        exit(EXIT_FAILURE);
+    }
 
-    // Determine if running part 1 or part 2 sample based on filename (simple check)
-    int is_part2 = (strstr(filename, "part2") != NULL);
+    if (cpu->trace_level >= TRACE_INSTR) printf("Loading program from %s...\n", filename);
+    int count = program_open(image, filename, cpu->trace_level >= TRACE_FINAL);
+    if (count < 0) {
+        if (count == -1) perror("Error opening file");
+        free(image);
+        return -1;
+    }
+    adopt_program(cpu, image);
+    if (cpu->trace_level >= TRACE_INSTR) printf("Loaded %d instructions.\n\n", cpu->instr_count);
+    return count;
+}
 
-    // Initialize Memory and Registers
-    memset(rf, 0, sizeof(rf)); // Clear register file
-    memset(d_mem, 0, sizeof(d_mem)); // Clear data memory
+// Load count instruction words at address 0, like a text program (-1 if out of memory).
+// cpu_reset() starts it.
+int read_program_words(cpu_context *cpu, const uint32_t *words, int count) {
+    program_image *image = malloc(sizeof(*image));
+    if (image == NULL || program_from_words(image, words, count) < 0) {
+        free(image);
+        return -1;
+    }
+    adopt_program(cpu, image);
+    return count;
+}
 
-    if (is_part2) {
-        printf("Initializing for Part 2 (JAL/JALR support)...\n");
-        // Initialize rf for sample_part2.txt
-        // s0=x8, a0=x10, a1=x11, a2=x12, a3=x13 (mapping ABI names)
-        rf[8] = 0x20;  // s0 = 0x20
-        rf[10] = 0x5;  // a0 = 0x5
-        rf[11] = 0x2;  // a1 = 0x2
-        rf[12] = 0xa;  // a2 = 0xa
-        rf[13] = 0xf;  // a3 = 0xf
-        // Data memory initialized to all zeros for part 2
-    } else {
-         printf("Initializing for Part 1...\n");
-        // Initialize rf for sample_part1.txt
-        rf[1] = 0x20;  // x1 = 0x20
-        rf[2] = 0x5;   // x2 = 0x5
-        rf[10] = 0x70; // x10 = 0x70
-        rf[11] = 0x4;  // x11 = 0x4
-        // Initialize data memory for sample_part1.txt
-        d_mem[28] = 0x5;  // Address 0x70 (index 28) = 0x5
-        d_mem[29] = 0x10; // Address 0x74 (index 29) = 0x10
+// Allocate a CPU context with default options and cleared state
+cpu_context *cpu_create(void) {
+    cpu_context *cpu = calloc(1, sizeof(*cpu));
+    if (cpu == NULL) {
+        perror("cpu_create");
+        exit(EXIT_FAILURE);
+    }
+    cpu->trace_level = TRACE_FINAL;
+    cpu->max_cycles = -1;
+    decode_init();
+    static const program_image empty_image;
+    mem_init(&cpu->mem);
+    load_program(cpu, &empty_image);
+    cpu_reset(cpu);
+    return cpu;
+}
+
+void cpu_destroy(cpu_context *cpu) {
+    if (cpu == NULL) return;
+    jit_destroy(cpu->jit);
+    pipeline_destroy(cpu->pipeline);
+    ooo_destroy(cpu->ooo);
+    bpred_destroy(cpu->bpred);
+    cache_destroy(cpu->icache);
+    cache_destroy(cpu->dcache);
+    cache_destroy(cpu->l2);
+    profile_destroy(cpu->profile);
+    syscall_release(cpu);
+    mem_clear(&cpu->mem);
+    if (cpu->own_image != NULL) {
+        program_close(cpu->own_image);
+        free(cpu->own_image);
     }
+    free(cpu->instr_mem);
+    free(cpu->d_prog);
+    free(cpu->stage_times);
+    free(cpu);
+}
+
+// Clear registers, memory, control signals and the cycle count, and return the PC and SP
+// to the program's start. The program is written back into memory, undoing any stores
+// the last run made to it.
+void cpu_reset(cpu_context *cpu) {
+    cpu->next_pc = 0;
+    cpu->branch_target = 0;
+    cpu->jump_target = 0;
+    cpu->alu_zero = 0;
+    cpu->total_clock_cycles = 0;
+    set_control_signals(cpu, 0);
+    cpu->Atomic = 0;
+    cpu->reserved = 0;
+    memset(cpu->rf, 0, sizeof(cpu->rf));
+    memset(cpu->hpm_events, 0, sizeof(cpu->hpm_events));
+    mem_zero(&cpu->mem);                // Pages stay allocated for the next run
+    install_program(cpu);
+    start_program(cpu);
+    syscall_reset(cpu);
+}
 
 
-    // Read program from file
-    read_program(filename);
+// Cycle count after which the run is stopped as a probable infinite loop. By default a
+// program that makes syscalls runs until it exits.
+uint64_t cycle_limit(cpu_context *cpu) {
+    if (cpu->max_cycles == 0 || (cpu->max_cycles < 0 && cpu->uses_syscalls)) return UINT64_MAX;
+    if (cpu->max_cycles > 0) return (uint64_t)cpu->max_cycles;
+    return (uint64_t)cpu->instr_count * 5;
+}
 
-    // Check if program loaded
-    if (instr_count == 0) {
-         fprintf(stderr, "Error: No valid instructions loaded from %s\n", filename);
-         return EXIT_FAILURE;
+// Tell an embedding program's on_mem callback about the access Mem() just made
+static void report_access(cpu_context *cpu, uint32_t pc, int alu_result, int rs2_val, int mem_data, uint32_t funct3) {
+    int size = cpu->Atomic ? 4 : 1 << (funct3 & 3);
+    uint32_t mask = size == 4 ? 0xFFFFFFFFu : (1u << (8 * size)) - 1;
+    if (cpu->Atomic == OP_SC) {
+        if (mem_data != 0) return;      // A failed sc.w does not reach memory
+        cpu->on_mem(cpu, cpu->mem_user, pc, (uint32_t)alu_result, (uint32_t)rs2_val, 4, RISCV_SIM_STORE);
+    } else if (cpu->Atomic) {
+        cpu->on_mem(cpu, cpu->mem_user, pc, (uint32_t)alu_result, (uint32_t)mem_data, 4,
+                    cpu->Atomic == OP_LR ? RISCV_SIM_LOAD : RISCV_SIM_ATOMIC);
+    } else if (cpu->MemRead) {
+        cpu->on_mem(cpu, cpu->mem_user, pc, (uint32_t)alu_result, (uint32_t)mem_data & mask, size, RISCV_SIM_LOAD);
+    } else {
+        cpu->on_mem(cpu, cpu->mem_user, pc, (uint32_t)alu_result, (uint32_t)rs2_val & mask, size, RISCV_SIM_STORE);
     }
+}
 
-    // Print initial state
-    printf("===== Initial State =====\n");
-    print_state(1); // Use flag 1 for initial/final state format
+// Run the program one instruction at a time through the Fetch/Decode/Execute/Mem/Writeback stages.
+// Returns RUN_PAUSED once total_clock_cycles reaches pause_at, or once the next
+// instruction is at cpu->stop_pc if stop_at_pc is set.
+int run_staged(cpu_context *cpu, uint64_t pause_at) {
+    uint64_t limit = cycle_limit(cpu);
+    int status = RUN_HALTED;
+    int64_t *entries = cpu->profile != NULL ? profile_start(cpu->profile, cpu) : NULL;
+    stage_timers *timers = cpu->stage_times;
+    uint64_t run_start = timers != NULL ? host_ticks() : 0;
+    double run_start_seconds = timers != NULL ? now_seconds() : 0.0;
+    uint64_t start_cycles = cpu->total_clock_cycles;
+
+    // Optional stage timer: charge the host time stmt takes to stage
+#define TIMED(stage, stmt) do { \
+        if (timers == NULL) { stmt; break; } \
+        uint64_t t0_ = host_ticks(); \
+        stmt; \
+        timers->ticks[stage] += host_ticks() - t0_; \
+        timers->calls[stage]++; \
+    } while (0)
 
-    // Execute program loop
-    printf("===== Program Execution =====\n");
     // Cast instr_count to uint32_t for comparison
-    while ((pc / 4) < (uint32_t)instr_count) {
+    while (!cpu->exited && code_index(cpu, cpu->pc) < (uint32_t)cpu->instr_count) {
+        if (cpu->total_clock_cycles >= pause_at) {
+            status = RUN_PAUSED;
+            break;
+        }
+        uint32_t pc = cpu->pc;
+        uint32_t code_version = cpu->code_version;
+        uint32_t instruction, predicted = pc + 4;
+
         // 1. Fetch
-        uint32_t instruction = Fetch();
+        TIMED(TIMER_FETCH, instruction = Fetch(cpu));
+        if (cpu->bpred != NULL) TIMED(TIMER_MODELS, predicted = bpred_predict(cpu->bpred, pc));
          // Cast instr_count to uint32_t for comparison
-         if (instruction == 0 && (pc/4) >= (uint32_t)instr_count) break; // Stop if fetch returned NOP due to end of program
+         if (instruction == 0 && code_index(cpu, cpu->pc) >= (uint32_t)cpu->instr_count) break; // Stop if fetch returned NOP due to end of program
 
         // Print instruction details
-        print_instruction(instruction);
+        if (cpu->trace_level >= TRACE_INSTR) TIMED(TIMER_OUTPUT, print_instruction(cpu, instruction));
 
         // Check for halt condition maybe? (e.g., specific instruction or error)
 
         // 2. Decode
         int rs1_val, rs2_val, imm;
         uint32_t rd, rs1, rs2, funct3, funct7;
-        Decode(instruction, &rs1_val, &rs2_val, &rd, &rs1, &rs2, &funct3, &funct7, &imm);
+        TIMED(TIMER_DECODE, Decode(cpu, instruction, &rs1_val, &rs2_val, &rd, &rs1, &rs2, &funct3, &funct7, &imm));
 
         // 3. Execute - Call site updated (removed rs1, rs2 indices)
-        int alu_result = Execute(rs1_val, rs2_val, imm, funct3, funct7);
+        int alu_result;
+        TIMED(TIMER_EXECUTE, alu_result = Execute(cpu, rs1_val, rs2_val, imm, funct3, funct7));
 
         // 4. Memory
-        int mem_data = Mem(alu_result, rs2_val);
+        int mem_data;
+        TIMED(TIMER_MEM, mem_data = Mem(cpu, alu_result, rs2_val, funct3));
+        if (cpu->on_mem != NULL && (cpu->MemRead || cpu->MemWrite || cpu->Atomic)) {
+            report_access(cpu, pc, alu_result, rs2_val, mem_data, funct3);
+        }
+
+        // ecall: the host carries out the syscall here (its result goes to a0)
+        if (cpu->System && (syscall_handle(cpu) & SYS_CODE) && entries != NULL) {
+            profile_code_changed(cpu->profile, cpu, pc + 4);
+        }
+        // CSR access: the counter's value goes to rd in place of loaded data
+        if (cpu->Csr) mem_data = csr_access(cpu, instruction, (uint32_t)rs1_val);
 
         // 5. Writeback (updates PC and total_clock_cycles)
-        Writeback(rd, alu_result, mem_data);
+        TIMED(TIMER_WRITEBACK, Writeback(cpu, rd, alu_result, mem_data));
+        if (cpu->trace_out != NULL) TIMED(TIMER_MODELS, trace_retire(cpu->trace_out, pc, instruction));
+        if (cpu->on_retire != NULL) cpu->on_retire(cpu, cpu->retire_user, pc, instruction);
+
+        // Optional branch predictor and timing model: train on the path taken, then
+        // clock the pipeline until this instruction is fetched
+        int mispredicted = -1;
+        if (cpu->bpred != NULL) TIMED(TIMER_MODELS, mispredicted = bpred_update(cpu->bpred, cpu, rd, rs1, pc, predicted));
+        if (cpu->pipeline != NULL) TIMED(TIMER_MODELS, pipeline_feed(cpu->pipeline, cpu, rd, rs1, rs2, pc, mispredicted));
+        if (cpu->ooo != NULL) TIMED(TIMER_MODELS, ooo_feed(cpu->ooo, cpu, rd, rs1, rs2, pc, (uint32_t)alu_result, mispredicted));
+        // Optional profile: count the transfer out of a branch or jump and follow calls and returns
+        int kind = branch_kind(cpu);
+        if (entries != NULL && cpu->code_version != code_version) profile_code_changed(cpu->profile, cpu, cpu->pc);
+        if (entries != NULL && kind != PIPE_BRANCH_NONE) {
+            uint32_t index = code_index(cpu, cpu->pc);
+            entries[index < (uint32_t)cpu->instr_count ? index : (uint32_t)cpu->instr_count]++;
+            if (kind != PIPE_BRANCH_COND && (rd == 1 || rd == 5)) {
+                profile_call(cpu->profile, cpu->pc, pc + 4, cpu->total_clock_cycles);
+            } else if (kind == PIPE_BRANCH_JALR && rd == 0 && (rs1 == 1 || rs1 == 5)) {
+                profile_return(cpu->profile, cpu->pc, cpu->total_clock_cycles);
+            }
+        }
 
         // Print state after instruction execution
-        print_state(0); // Use flag 0 for intermediate state format
+        if (cpu->trace_level >= TRACE_FULL) TIMED(TIMER_OUTPUT, print_state(cpu, 0)); // Use flag 0 for intermediate state format
+        if (cpu->exited) break;             // The program called exit
 
         // Simple loop safeguard
-        if (total_clock_cycles > instr_count * 5 && instr_count > 0) {
-             printf("Warning: Excessive clock cycles (%d). Potential infinite loop?\n", total_clock_cycles);
+        if (cpu->total_clock_cycles > limit) {
+             if (cpu->trace_level >= TRACE_FINAL) printf("Warning: Excessive clock cycles (%" PRIu64 "). Potential infinite loop?\n", cpu->total_clock_cycles);
+             status = RUN_LIMIT;
              break;
         }
+        if (cpu->stop_at_pc && cpu->pc == cpu->stop_pc) {
+            status = RUN_PAUSED;
+            break;
+        }
+    }
+    if (cpu->pipeline != NULL) pipeline_drain(cpu->pipeline);
+    if (cpu->profile != NULL) profile_stop(cpu->profile, cpu);
+    if (timers != NULL) {
+        timers->run_ticks += host_ticks() - run_start;
+        timers->run_seconds += now_seconds() - run_start_seconds;
+        timers->instructions += cpu->total_clock_cycles - start_cycles;
     }
+    return status;
+#undef TIMED
+}
 
-    printf("===== Program terminated. =====\n");
-    // Print final state
-    print_state(1); // Use flag 1 for initial/final state format
+// Run the program from the predecoded micro-ops in d_prog using threaded dispatch.
+// A slot that starts a superinstruction (fused) runs its pair with one dispatch;
+// a jump into the middle of a pair lands on the second slot's own handler.
+// Produces the same architectural state and trace output as run_staged().
+// Returns RUN_PAUSED once total_clock_cycles reaches pause_at (UINT64_MAX runs to completion).
+int run_predecoded(cpu_context *cpu, uint64_t pause_at) {
+    uint32_t cur_pc = cpu->pc;              // Kept local so the compiler can hold it in a register
+    uint64_t cycles = cpu->total_clock_cycles;
+    int *const rf = cpu->rf;
+    decoded_instr *const prog = cpu->d_prog;
+    const uint32_t count = (uint32_t)cpu->instr_count;
+    const uint32_t base = cpu->mem.code_start;
+    uint64_t limit = cycle_limit(cpu);
+    uint64_t stop = (limit < pause_at - 1) ? limit + 1 : pause_at; // One compare covers both
+    int trace = cpu->trace_level >= TRACE_INSTR;
+    int status = RUN_HALTED;
+    decoded_instr *d;
+
+    if (cpu->exited) return RUN_HALTED;
+    if (cycles >= pause_at) return RUN_PAUSED;
+    guest_profile *const profile = cpu->profile;
+    int64_t *const entries = profile != NULL ? profile_start(profile, cpu) : NULL; // Transfers into each d_prog slot
+
+#if defined(__GNUC__)
+    // Direct threading: point every micro-op at its handler label once up front
+    static const void *const handlers[OP_COUNT] = {
+        [OP_ADD] = &&op_add, [OP_SUB] = &&op_sub, [OP_AND] = &&op_and, [OP_OR] = &&op_or,
+        [OP_XOR] = &&op_xor, [OP_SLL] = &&op_sll, [OP_SRL] = &&op_srl, [OP_SRA] = &&op_sra,
+        [OP_SLT] = &&op_slt, [OP_SLTU] = &&op_sltu,
+        [OP_MUL] = &&op_mul, [OP_MULH] = &&op_mulh, [OP_MULHSU] = &&op_mulhsu, [OP_MULHU] = &&op_mulhu,
+        [OP_DIV] = &&op_div, [OP_DIVU] = &&op_divu, [OP_REM] = &&op_rem, [OP_REMU] = &&op_remu,
+        [OP_ADDI] = &&op_addi, [OP_ANDI] = &&op_andi, [OP_ORI] = &&op_ori, [OP_XORI] = &&op_xori,
+        [OP_SLLI] = &&op_slli, [OP_SRLI] = &&op_srli, [OP_SRAI] = &&op_srai,
+        [OP_SLTI] = &&op_slti, [OP_SLTIU] = &&op_sltiu, [OP_LUI] = &&op_lui, [OP_AUIPC] = &&op_auipc,
+        [OP_LB] = &&op_lb, [OP_LH] = &&op_lh, [OP_LW] = &&op_lw, [OP_LBU] = &&op_lbu, [OP_LHU] = &&op_lhu,
+        [OP_SB] = &&op_sb, [OP_SH] = &&op_sh, [OP_SW] = &&op_sw,
+        [OP_LR] = &&op_atomic, [OP_SC] = &&op_atomic, [OP_AMOSWAP] = &&op_atomic, [OP_AMOADD] = &&op_atomic,
+        [OP_AMOXOR] = &&op_atomic, [OP_AMOAND] = &&op_atomic, [OP_AMOOR] = &&op_atomic, [OP_AMOMIN] = &&op_atomic,
+        [OP_AMOMAX] = &&op_atomic, [OP_AMOMINU] = &&op_atomic, [OP_AMOMAXU] = &&op_atomic,
+        [OP_BEQ] = &&op_beq, [OP_BNE] = &&op_bne, [OP_BLT] = &&op_blt, [OP_BGE] = &&op_bge,
+        [OP_BLTU] = &&op_bltu, [OP_BGEU] = &&op_bgeu, [OP_JAL] = &&op_jal, [OP_JALR] = &&op_jalr,
+        [OP_ECALL] = &&op_ecall, [OP_CSR] = &&op_csr, [OP_FENCE] = &&op_nop, [OP_EBREAK] = &&op_nop,
+        [OP_UNKNOWN] = &&op_unknown, [OP_HALT] = &&op_halt,
+    };
+    static const void *const fused_handlers[FUSE_COUNT] = {
+        [FUSE_ADDI_BEQ] = &&fuse_addi_beq, [FUSE_ADDI_BNE] = &&fuse_addi_bne, [FUSE_ADDI_BLT] = &&fuse_addi_blt,
+        [FUSE_ADDI_BGE] = &&fuse_addi_bge, [FUSE_ADDI_BLTU] = &&fuse_addi_bltu, [FUSE_ADDI_BGEU] = &&fuse_addi_bgeu,
+        [FUSE_ANDI_BEQ] = &&fuse_andi_beq, [FUSE_ANDI_BNE] = &&fuse_andi_bne,
+        [FUSE_BEQ_JAL] = &&fuse_beq_jal, [FUSE_BNE_JAL] = &&fuse_bne_jal,
+        [FUSE_ADDI_ADDI] = &&fuse_addi_addi, [FUSE_ADD_ADD] = &&fuse_add_add, [FUSE_SLLI_ADD] = &&fuse_slli_add,
+        [FUSE_LUI_ADDI] = &&fuse_lui_addi, [FUSE_LW_ADD] = &&fuse_lw_add, [FUSE_LW_LW] = &&fuse_lw_lw,
+        [FUSE_ADD_SW] = &&fuse_add_sw, [FUSE_ADDI_SW] = &&fuse_addi_sw,
+    };
+#define THREAD_PROGRAM() do { \
+        fuse_program(cpu); \
+        for (int i = 0; i <= cpu->instr_count; i++) { \
+            decoded_instr *t = &cpu->d_prog[i]; \
+            if (cpu->uses_counters && t->op != OP_HALT) t->handler = &&op_count; \
+            else t->handler = t->fused != FUSE_NONE ? fused_handlers[t->fused] : handlers[t->op]; \
+        } \
+        cpu->d_prog_threaded = 1; \
+    } while (0)
+#define DISPATCH() goto *d->handler
+#else
+#define THREAD_PROGRAM() do { fuse_program(cpu); cpu->d_prog_threaded = 1; } while (0)
+#define DISPATCH() goto dispatch
+#endif
+    if (!cpu->d_prog_threaded) THREAD_PROGRAM();
+
+#define RS1 ((uint32_t)rf[d->rs1])
+#define RS2 ((uint32_t)rf[d->rs2])
+#define WRITE_RD(value) do { if (d->rd != 0) rf[d->rd] = (int)(value); } while (0)
+#define IS_LINK(r) ((r) == 1 || (r) == 5)  // ra/t0: a jump that writes one is a call, one that reads one with rd = x0 a return
+    // Retire the current instruction: count the cycle, trace, apply the safeguard
+#define RETIRE() do { \
+        cycles++; \
+        if (trace) { \
+            cpu->pc = cur_pc; cpu->total_clock_cycles = cycles; \
+            if (cpu->trace_level >= TRACE_FULL) print_state(cpu, 0); \
+        } \
+        if (cycles >= stop) goto stopped; \
+        if (trace && d->op != OP_HALT) print_instruction(cpu, d->raw); \
+    } while (0)
+#define STEP_DONE() do { RETIRE(); DISPATCH(); } while (0)
+#define NEXT_SEQ() do { d++; cur_pc += 4; STEP_DONE(); } while (0)
+    // Superinstruction: retire the first half and go straight to the second one's handler
+#define FUSE_NEXT(second) do { d++; cur_pc += 4; RETIRE(); goto second; } while (0)
+#define NEXT_JUMP(target) do { \
+        cur_pc = (target); \
+        d = ((cur_pc - base) / 4 < count) ? &prog[(cur_pc - base) / 4] : &prog[count]; \
+        if (entries != NULL) entries[d - prog]++; \
+        STEP_DONE(); \
+    } while (0)
+#define BRANCH(cond) do { \
+        if (cond) NEXT_JUMP(cur_pc + (uint32_t)d->imm); \
+        if (entries != NULL) entries[d - prog + 1]++;   /* Not taken still ends the basic block */ \
+        NEXT_SEQ(); \
+    } while (0)
+#define BRANCH_FUSED(cond, second) do { \
+        if (cond) NEXT_JUMP(cur_pc + (uint32_t)d->imm); \
+        if (entries != NULL) entries[d - prog + 1]++; \
+        FUSE_NEXT(second); \
+    } while (0)
+    // Performance counters: the events of the micro-op about to run (see Mem(), Writeback(), ControlUnit())
+#define COUNT_EVENTS() do { \
+        cpu->hpm_events[op_event(d->op)]++; \
+        if ((d->ctrl & CTRL_BRANCH) && (alu_compute(d->alu_ctrl, RS1, RS2) != 0) == ((d->ctrl & CTRL_BRANCH_NZ) != 0)) { \
+            cpu->hpm_events[HPM_TAKEN]++; \
+        } \
+    } while (0)
+#define LOAD(funct3) do { \
+        /* load_narrow()/store_narrow() hit the TLB inline like load_word()/store_word() */ \
+        int value = load_narrow(cpu, RS1 + (uint32_t)d->imm, funct3); \
+        WRITE_RD(value); \
+        NEXT_SEQ(); \
+    } while (0)
+#define STORE(funct3) do { \
+        if (store_narrow(cpu, RS1 + (uint32_t)d->imm, (int)RS2, funct3)) { \
+            THREAD_PROGRAM(); \
+            if (profile != NULL) profile_code_changed(profile, cpu, cur_pc + 4); \
+        } \
+        NEXT_SEQ(); \
+    } while (0)
+
+    d = ((cur_pc - base) / 4 < count) ? &prog[(cur_pc - base) / 4] : &prog[count];
+    if (trace && d->op != OP_HALT) { cpu->pc = cur_pc; print_instruction(cpu, d->raw); }
+    DISPATCH();
+
+#if !defined(__GNUC__)
+dispatch:
+    if (cpu->uses_counters && d->op != OP_HALT) COUNT_EVENTS();
+    switch (d->fused) {
+        case FUSE_ADDI_BEQ: goto fuse_addi_beq;
+        case FUSE_ADDI_BNE: goto fuse_addi_bne;
+        case FUSE_ADDI_BLT: goto fuse_addi_blt;
+        case FUSE_ADDI_BGE: goto fuse_addi_bge;
+        case FUSE_ADDI_BLTU: goto fuse_addi_bltu;
+        case FUSE_ADDI_BGEU: goto fuse_addi_bgeu;
+        case FUSE_ANDI_BEQ: goto fuse_andi_beq;
+        case FUSE_ANDI_BNE: goto fuse_andi_bne;
+        case FUSE_BEQ_JAL: goto fuse_beq_jal;
+        case FUSE_BNE_JAL: goto fuse_bne_jal;
+        case FUSE_ADDI_ADDI: goto fuse_addi_addi;
+        case FUSE_ADD_ADD: goto fuse_add_add;
+        case FUSE_SLLI_ADD: goto fuse_slli_add;
+        case FUSE_LUI_ADDI: goto fuse_lui_addi;
+        case FUSE_LW_ADD: goto fuse_lw_add;
+        case FUSE_LW_LW: goto fuse_lw_lw;
+        case FUSE_ADD_SW: goto fuse_add_sw;
+        case FUSE_ADDI_SW: goto fuse_addi_sw;
+        default: break;
+    }
+    switch (d->op) {
+        case OP_ADD: goto op_add;
+        case OP_SUB: goto op_sub;
+        case OP_AND: goto op_and;
+        case OP_OR: goto op_or;
+        case OP_XOR: goto op_xor;
+        case OP_SLL: goto op_sll;
+        case OP_SRL: goto op_srl;
+        case OP_SRA: goto op_sra;
+        case OP_SLT: goto op_slt;
+        case OP_SLTU: goto op_sltu;
+        case OP_MUL: goto op_mul;
+        case OP_MULH: goto op_mulh;
+        case OP_MULHSU: goto op_mulhsu;
+        case OP_MULHU: goto op_mulhu;
+        case OP_DIV: goto op_div;
+        case OP_DIVU: goto op_divu;
+        case OP_REM: goto op_rem;
+        case OP_REMU: goto op_remu;
+        case OP_ADDI: goto op_addi;
+        case OP_ANDI: goto op_andi;
+        case OP_ORI: goto op_ori;
+        case OP_XORI: goto op_xori;
+        case OP_SLLI: goto op_slli;
+        case OP_SRLI: goto op_srli;
+        case OP_SRAI: goto op_srai;
+        case OP_SLTI: goto op_slti;
+        case OP_SLTIU: goto op_sltiu;
+        case OP_LUI: goto op_lui;
+        case OP_AUIPC: goto op_auipc;
+        case OP_LB: goto op_lb;
+        case OP_LH: goto op_lh;
+        case OP_LW: goto op_lw;
+        case OP_LBU: goto op_lbu;
+        case OP_LHU: goto op_lhu;
+        case OP_SB: goto op_sb;
+        case OP_SH: goto op_sh;
+        case OP_SW: goto op_sw;
+        case OP_LR: case OP_SC: case OP_AMOSWAP: case OP_AMOADD: case OP_AMOXOR: case OP_AMOAND:
+        case OP_AMOOR: case OP_AMOMIN: case OP_AMOMAX: case OP_AMOMINU: case OP_AMOMAXU: goto op_atomic;
+        case OP_BEQ: goto op_beq;
+        case OP_BNE: goto op_bne;
+        case OP_BLT: goto op_blt;
+        case OP_BGE: goto op_bge;
+        case OP_BLTU: goto op_bltu;
+        case OP_BGEU: goto op_bgeu;
+        case OP_JAL: goto op_jal;
+        case OP_JALR: goto op_jalr;
+        case OP_ECALL: goto op_ecall;
+        case OP_CSR: goto op_csr;
+        case OP_FENCE: case OP_EBREAK: goto op_nop;
+        case OP_UNKNOWN: goto op_unknown;
+        default: goto op_halt;
+    }
+#else
+op_count:   // Programs that read the hpm counters come here before every micro-op
+    COUNT_EVENTS();
+    goto *handlers[d->op];
+#endif
+
+op_add:  WRITE_RD(RS1 + RS2); NEXT_SEQ();
+op_sub:  WRITE_RD(RS1 - RS2); NEXT_SEQ();
+op_and:  WRITE_RD(RS1 & RS2); NEXT_SEQ();
+op_or:   WRITE_RD(RS1 | RS2); NEXT_SEQ();
+op_xor:  WRITE_RD(RS1 ^ RS2); NEXT_SEQ();
+op_sll:  WRITE_RD(RS1 << (RS2 & 31)); NEXT_SEQ();
+op_srl:  WRITE_RD(RS1 >> (RS2 & 31)); NEXT_SEQ();
+op_sra:  WRITE_RD((int32_t)RS1 >> (RS2 & 31)); NEXT_SEQ();
+op_slt:  WRITE_RD((int32_t)RS1 < (int32_t)RS2); NEXT_SEQ();
+op_sltu: WRITE_RD(RS1 < RS2); NEXT_SEQ();
+op_mul:    WRITE_RD(RS1 * RS2); NEXT_SEQ();
+op_mulh:   WRITE_RD(alu_mulh(RS1, RS2)); NEXT_SEQ();
+op_mulhsu: WRITE_RD(alu_mulhsu(RS1, RS2)); NEXT_SEQ();
+op_mulhu:  WRITE_RD(alu_mulhu(RS1, RS2)); NEXT_SEQ();
+op_div:    WRITE_RD(alu_div(RS1, RS2)); NEXT_SEQ();
+op_divu:   WRITE_RD(alu_divu(RS1, RS2)); NEXT_SEQ();
+op_rem:    WRITE_RD(alu_rem(RS1, RS2)); NEXT_SEQ();
+op_remu:   WRITE_RD(alu_remu(RS1, RS2)); NEXT_SEQ();
+op_addi: WRITE_RD(RS1 + (uint32_t)d->imm); NEXT_SEQ();
+op_andi: WRITE_RD(RS1 & (uint32_t)d->imm); NEXT_SEQ();
+op_ori:  WRITE_RD(RS1 | (uint32_t)d->imm); NEXT_SEQ();
+op_xori: WRITE_RD(RS1 ^ (uint32_t)d->imm); NEXT_SEQ();
+op_slli: WRITE_RD(RS1 << (d->imm & 31)); NEXT_SEQ();
+op_srli: WRITE_RD(RS1 >> (d->imm & 31)); NEXT_SEQ();
+op_srai: WRITE_RD((int32_t)RS1 >> (d->imm & 31)); NEXT_SEQ();
+op_slti:  WRITE_RD((int32_t)RS1 < d->imm); NEXT_SEQ();
+op_sltiu: WRITE_RD(RS1 < (uint32_t)d->imm); NEXT_SEQ();
+op_lui:   WRITE_RD(d->imm); NEXT_SEQ();
+op_auipc: WRITE_RD(cur_pc + (uint32_t)d->imm); NEXT_SEQ();
+op_lb:  LOAD(0);
+op_lh:  LOAD(1);
+op_lbu: LOAD(4);
+op_lhu: LOAD(5);
+op_lw: {
+        // load_word()/store_word() hit the TLB inline; misses and faults go to mem_load()/mem_store()
+        int value = load_word(cpu, RS1 + (uint32_t)d->imm); // Even for rd = x0, which can still fault
+        WRITE_RD(value);
+        NEXT_SEQ();
+    }
+op_sw:
+    if (store_word(cpu, RS1 + (uint32_t)d->imm, (int)RS2)) { // Rewrote an instruction
+        THREAD_PROGRAM();
+        if (profile != NULL) profile_code_changed(profile, cpu, cur_pc + 4);
+    }
+    NEXT_SEQ();
+op_sb: STORE(0);
+op_sh: STORE(1);
+op_atomic: {
+        int value;
+        if (mem_atomic(cpu, d->op, d->alu_ctrl, RS1, RS2, &value)) { // Rewrote an instruction
+            THREAD_PROGRAM();
+            if (profile != NULL) profile_code_changed(profile, cpu, cur_pc + 4);
+        }
+        WRITE_RD(value);
+        NEXT_SEQ();
+    }
+op_beq:  BRANCH(RS1 == RS2);
+op_bne:  BRANCH(RS1 != RS2);
+op_blt:  BRANCH((int32_t)RS1 < (int32_t)RS2);
+op_bge:  BRANCH((int32_t)RS1 >= (int32_t)RS2);
+op_bltu: BRANCH(RS1 < RS2);
+op_bgeu: BRANCH(RS1 >= RS2);
+op_jal:
+    if (profile != NULL && IS_LINK(d->rd)) profile_call(profile, cur_pc + (uint32_t)d->imm, cur_pc + 4, cycles + 1);
+    WRITE_RD(cur_pc + 4);
+    NEXT_JUMP(cur_pc + (uint32_t)d->imm);
+op_jalr: {
+        uint32_t target = (RS1 + (uint32_t)d->imm) & ~1U; // Read rs1 before the link overwrites it
+        if (profile != NULL) {
+            if (IS_LINK(d->rd)) profile_call(profile, target, cur_pc + 4, cycles + 1);
+            else if (d->rd == 0 && IS_LINK(d->rs1)) profile_return(profile, target, cycles + 1);
+        }
+        WRITE_RD(cur_pc + 4);
+        NEXT_JUMP(target);
+    }
+op_ecall: {
+        cpu->pc = cur_pc;                   // The syscall sees the architectural state
+        cpu->total_clock_cycles = cycles;
+        int effects = syscall_handle(cpu);
+        if (effects & SYS_CODE) {           // A read rewrote instructions
+            THREAD_PROGRAM();
+            if (profile != NULL) profile_code_changed(profile, cpu, cur_pc + 4);
+        }
+        if (effects & SYS_EXIT) stop = cycles + 1;  // Retire the ecall, then stop
+        NEXT_SEQ();
+    }
+op_csr: {
+        cpu->pc = cur_pc;                   // The counters see the architectural state
+        cpu->total_clock_cycles = cycles;
+        int value = csr_access(cpu, d->raw, RS1);
+        WRITE_RD(value);
+        NEXT_SEQ();
+    }
+op_nop:     // fence, fence.i and ebreak
+    NEXT_SEQ();
+op_unknown:
+    if (cpu->trace_level >= TRACE_FINAL) printf("Unknown opcode: 0x%x\n", d->raw & 0x7F);
+    NEXT_SEQ();
+
+    // Superinstructions: the first half inline, then the second half's handler without a dispatch
+fuse_addi_beq:  WRITE_RD(RS1 + (uint32_t)d->imm); FUSE_NEXT(op_beq);
+fuse_addi_bne:  WRITE_RD(RS1 + (uint32_t)d->imm); FUSE_NEXT(op_bne);
+fuse_addi_blt:  WRITE_RD(RS1 + (uint32_t)d->imm); FUSE_NEXT(op_blt);
+fuse_addi_bge:  WRITE_RD(RS1 + (uint32_t)d->imm); FUSE_NEXT(op_bge);
+fuse_addi_bltu: WRITE_RD(RS1 + (uint32_t)d->imm); FUSE_NEXT(op_bltu);
+fuse_addi_bgeu: WRITE_RD(RS1 + (uint32_t)d->imm); FUSE_NEXT(op_bgeu);
+fuse_andi_beq:  WRITE_RD(RS1 & (uint32_t)d->imm); FUSE_NEXT(op_beq);
+fuse_andi_bne:  WRITE_RD(RS1 & (uint32_t)d->imm); FUSE_NEXT(op_bne);
+fuse_beq_jal:   BRANCH_FUSED(RS1 == RS2, op_jal);
+fuse_bne_jal:   BRANCH_FUSED(RS1 != RS2, op_jal);
+fuse_addi_addi: WRITE_RD(RS1 + (uint32_t)d->imm); FUSE_NEXT(op_addi);
+fuse_add_add:   WRITE_RD(RS1 + RS2); FUSE_NEXT(op_add);
+fuse_slli_add:  WRITE_RD(RS1 << (d->imm & 31)); FUSE_NEXT(op_add);
+fuse_lui_addi:  WRITE_RD(d->imm); FUSE_NEXT(op_addi);
+fuse_add_sw:    WRITE_RD(RS1 + RS2); FUSE_NEXT(op_sw);
+fuse_addi_sw:   WRITE_RD(RS1 + (uint32_t)d->imm); FUSE_NEXT(op_sw);
+fuse_lw_add: {
+        int value = load_word(cpu, RS1 + (uint32_t)d->imm);
+        WRITE_RD(value);
+        FUSE_NEXT(op_add);
+    }
+fuse_lw_lw: {
+        int value = load_word(cpu, RS1 + (uint32_t)d->imm);
+        WRITE_RD(value);
+        FUSE_NEXT(op_lw);
+    }
+
+stopped:
+    if (cpu->exited) {
+        status = RUN_HALTED;
+    } else if (cycles > limit) {
+        if (cpu->trace_level >= TRACE_FINAL) printf("Warning: Excessive clock cycles (%" PRIu64 "). Potential infinite loop?\n", cycles);
+        status = RUN_LIMIT;
+    } else {
+        status = RUN_PAUSED;
+    }
+op_halt:
+    cpu->pc = cur_pc;
+    cpu->total_clock_cycles = cycles;
+    if (profile != NULL) profile_stop(profile, cpu);
+    return status;
+
+#undef DISPATCH
+#undef RS1
+#undef RS2
+#undef WRITE_RD
+#undef IS_LINK
+#undef RETIRE
+#undef STEP_DONE
+#undef NEXT_SEQ
+#undef FUSE_NEXT
+#undef NEXT_JUMP
+#undef BRANCH
+#undef BRANCH_FUSED
+#undef COUNT_EVENTS
+#undef LOAD
+#undef STORE
+}
 
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+// Run the loaded program to completion with the selected engine
+int run_program(cpu_context *cpu, int engine) {
+    switch (engine) {
+        case ENGINE_STAGED:
+            return run_staged(cpu, UINT64_MAX);
+        case ENGINE_JIT:
+            return run_jit(cpu);
+        default:
+            return run_predecoded(cpu, UINT64_MAX);
+    }
+}
+
+// Monotonic wall-clock time in seconds
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,716 @@
+#ifndef RISCV_CPU_H
+#define RISCV_CPU_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "riscv_sim.h"
+
+// Output control
+enum { TRACE_NONE, TRACE_FINAL, TRACE_INSTR, TRACE_FULL };
+
+// Control-signal bitmask from the decode table (one bit per ControlUnit output)
+#define CTRL_REG_WRITE  (1u << 0)
+#define CTRL_MEM_TO_REG (1u << 1)
+#define CTRL_MEM_READ   (1u << 2)
+#define CTRL_MEM_WRITE  (1u << 3)
+#define CTRL_ALU_SRC    (1u << 4)
+#define CTRL_BRANCH     (1u << 5)
+#define CTRL_ALU_OP0    (1u << 6)
+#define CTRL_ALU_OP1    (1u << 7)
+#define CTRL_JUMP       (1u << 8)
+#define CTRL_VALID      (1u << 9)  // Instruction recognised by the control unit
+#define CTRL_ALU_A_PC   (1u << 10) // ALU operand A is the PC (auipc)
+#define CTRL_ALU_A_ZERO (1u << 11) // ALU operand A is zero (lui)
+#define CTRL_BRANCH_NZ  (1u << 12) // Branch taken when the ALU result is non-zero (bne, blt, bltu)
+#define CTRL_SYSTEM     (1u << 13) // Environment call: the host carries out a syscall (ecall)
+#define CTRL_CSR        (1u << 14) // CSR access: rd gets the CSR's value (csrrw/csrrs/csrrc and the immediate forms)
+
+// Predecoded micro-op handlers (one per behaviour the datapath can produce)
+enum {
+    OP_ADD, OP_SUB, OP_AND, OP_OR, OP_XOR,                  // R-type
+    OP_SLL, OP_SRL, OP_SRA, OP_SLT, OP_SLTU,
+    OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU,                   // M extension
+    OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+    OP_ADDI, OP_ANDI, OP_ORI, OP_XORI,                      // I-type arithmetic
+    OP_SLLI, OP_SRLI, OP_SRAI, OP_SLTI, OP_SLTIU,
+    OP_LUI, OP_AUIPC,
+    OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU, OP_SB, OP_SH, OP_SW,
+    OP_LR, OP_SC, OP_AMOSWAP, OP_AMOADD, OP_AMOXOR,         // A extension (OP_LR..OP_AMOMAXU)
+    OP_AMOAND, OP_AMOOR, OP_AMOMIN, OP_AMOMAX, OP_AMOMINU, OP_AMOMAXU,
+    OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,       // Control transfers (OP_BEQ..OP_JALR)
+    OP_JAL, OP_JALR,
+    OP_ECALL,                           // Syscall emulated by the host (riscv_syscall.c)
+    OP_CSR,                             // Zicsr access to the performance counters (riscv_counters.c)
+    OP_FENCE,                           // fence and fence.i: a NOP (accesses are already in order, stores to code are decoded again)
+    OP_EBREAK,                          // Breakpoint: a NOP, since no debugger is attached
+    OP_UNKNOWN,                         // Unrecognised instruction (behaves as a NOP)
+    OP_HALT,                            // Sentinel past the last instruction
+    OP_COUNT
+};
+
+// Superinstructions: hot pairs of adjacent micro-ops that run_predecoded() runs
+// through one handler (FUSE_first_second, set on the first instruction's slot)
+enum {
+    FUSE_NONE,
+    FUSE_ADDI_BEQ, FUSE_ADDI_BNE, FUSE_ADDI_BLT, FUSE_ADDI_BGE, FUSE_ADDI_BLTU, FUSE_ADDI_BGEU,
+    FUSE_ANDI_BEQ, FUSE_ANDI_BNE,                           // Counter or flag test, then branch
+    FUSE_BEQ_JAL, FUSE_BNE_JAL,                             // Loop exit test, then the jump back
+    FUSE_ADDI_ADDI, FUSE_ADD_ADD, FUSE_SLLI_ADD, FUSE_LUI_ADDI,
+    FUSE_LW_ADD, FUSE_LW_LW, FUSE_ADD_SW, FUSE_ADDI_SW,
+    FUSE_COUNT
+};
+
+// Whether a micro-op ends a basic block (any branch or jump)
+static inline int op_is_transfer(int op) {
+    return op >= OP_BEQ && op <= OP_JALR;
+}
+
+// Whether a micro-op is an RV32A atomic (lr.w, sc.w or an AMO)
+static inline int op_is_atomic(int op) {
+    return op >= OP_LR && op <= OP_AMOMAXU;
+}
+
+// Events counted for the guest's mhpmcounters (event i is mhpmcounter3 + i)
+enum {
+    HPM_LOADS, HPM_STORES, HPM_ATOMICS,     // Counted by Mem()
+    HPM_BRANCHES, HPM_TAKEN, HPM_JUMPS,     // Counted by Writeback() (HPM_TAKEN: taken conditional branches)
+    HPM_ALU, HPM_MULDIV, HPM_SYSTEM, HPM_UNKNOWN, // Decode categories, counted by ControlUnit()
+    HPM_COUNT
+};
+
+// The event every execution of a micro-op counts (taken branches also count HPM_TAKEN)
+static inline int op_event(int op) {
+    if (op >= OP_MUL && op <= OP_REMU) return HPM_MULDIV;
+    if (op <= OP_AUIPC) return HPM_ALU;
+    if (op <= OP_LHU) return HPM_LOADS;
+    if (op <= OP_SW) return HPM_STORES;
+    if (op <= OP_AMOMAXU) return HPM_ATOMICS;
+    if (op <= OP_BGEU) return HPM_BRANCHES;
+    if (op <= OP_JALR) return HPM_JUMPS;
+    if (op <= OP_EBREAK) return HPM_SYSTEM;
+    return HPM_UNKNOWN;
+}
+
+// ALU operations selected by the decoder (the first four keep the original ALUControl encodings)
+enum {
+    ALU_AND = 0x0, ALU_OR = 0x1, ALU_ADD = 0x2, ALU_SUB = 0x6,
+    ALU_XOR = 0x8, ALU_SLL, ALU_SRL, ALU_SRA, ALU_SLT, ALU_SLTU,
+    ALU_MUL, ALU_MULH, ALU_MULHSU, ALU_MULHU, ALU_DIV, ALU_DIVU, ALU_REM, ALU_REMU,
+    ALU_MIN, ALU_MAX, ALU_MINU, ALU_MAXU, ALU_B,        // AMO combining operations (ALU_B: amoswap)
+};
+
+// ALU operand A sources (cpu->ALUSrcA)
+enum { ALU_A_RS1, ALU_A_PC, ALU_A_ZERO };
+
+// RV32M division never traps: x / 0 is all ones, x % 0 is x, and INT32_MIN / -1 overflows to INT32_MIN
+static inline uint32_t alu_div(uint32_t a, uint32_t b) {
+    if (b == 0) return UINT32_MAX;
+    if (a == 0x80000000u && b == UINT32_MAX) return a;
+    return (uint32_t)((int32_t)a / (int32_t)b);
+}
+static inline uint32_t alu_divu(uint32_t a, uint32_t b) {
+    return b == 0 ? UINT32_MAX : a / b;
+}
+static inline uint32_t alu_rem(uint32_t a, uint32_t b) {
+    if (b == 0) return a;
+    if (a == 0x80000000u && b == UINT32_MAX) return 0;
+    return (uint32_t)((int32_t)a % (int32_t)b);
+}
+static inline uint32_t alu_remu(uint32_t a, uint32_t b) {
+    return b == 0 ? a : a % b;
+}
+
+// Upper halves of the 64-bit products (signed x signed, signed x unsigned, unsigned x unsigned)
+static inline uint32_t alu_mulh(uint32_t a, uint32_t b) {
+    return (uint32_t)((uint64_t)((int64_t)(int32_t)a * (int64_t)(int32_t)b) >> 32);
+}
+static inline uint32_t alu_mulhsu(uint32_t a, uint32_t b) {
+    return (uint32_t)((uint64_t)((int64_t)(int32_t)a * (int64_t)b) >> 32);
+}
+static inline uint32_t alu_mulhu(uint32_t a, uint32_t b) {
+    return (uint32_t)(((uint64_t)a * b) >> 32);
+}
+
+// The ALU: result of operation alu on operands a and b
+static inline uint32_t alu_compute(int alu, uint32_t a, uint32_t b) {
+    switch (alu) {
+        case ALU_AND:    return a & b;
+        case ALU_OR:     return a | b;
+        case ALU_ADD:    return a + b;
+        case ALU_SUB:    return a - b;
+        case ALU_XOR:    return a ^ b;
+        case ALU_SLL:    return a << (b & 31);
+        case ALU_SRL:    return a >> (b & 31);
+        case ALU_SRA:    return (uint32_t)((int32_t)a >> (b & 31));
+        case ALU_SLT:    return (int32_t)a < (int32_t)b;
+        case ALU_SLTU:   return a < b;
+        case ALU_MUL:    return a * b;
+        case ALU_MULH:   return alu_mulh(a, b);
+        case ALU_MULHSU: return alu_mulhsu(a, b);
+        case ALU_MULHU:  return alu_mulhu(a, b);
+        case ALU_DIV:    return alu_div(a, b);
+        case ALU_DIVU:   return alu_divu(a, b);
+        case ALU_REM:    return alu_rem(a, b);
+        case ALU_REMU:   return alu_remu(a, b);
+        case ALU_MIN:    return (int32_t)a < (int32_t)b ? a : b;
+        case ALU_MAX:    return (int32_t)a > (int32_t)b ? a : b;
+        case ALU_MINU:   return a < b ? a : b;
+        case ALU_MAXU:   return a > b ? a : b;
+        default:         return b;
+    }
+}
+
+// Instruction formats: where the operands and immediate sit, and how they are disassembled
+enum { FMT_NONE, FMT_R, FMT_I, FMT_SHIFT, FMT_LOAD, FMT_JALR, FMT_S, FMT_B, FMT_U, FMT_J, FMT_AMO, FMT_SYSTEM, FMT_CSR, FMT_FENCE };
+
+// One instruction of the ISA: its encoding and what the control unit does with it
+typedef struct {
+    const char *name;
+    uint8_t opcode;
+    int8_t funct3, funct7;      // -1: not part of the encoding
+    uint8_t format;             // FMT_*
+    uint8_t op;                 // Micro-op (OP_*)
+    uint8_t alu;                // ALU operation (ALU_*)
+    uint16_t ctrl;              // Control signals (CTRL_*)
+} instr_desc;
+
+// Decode table, generated from instr_descs[] by decode_init(): opcode, funct3 and
+// a 2-bit class of funct7 select the descriptor index (0: unknown instruction).
+// The RV32A word atomics all map to DECODE_AMO, and funct5 then selects from amo_table.
+#define DECODE_TABLE_SIZE (128 * 8 * 4)
+#define DECODE_AMO 0xFF
+#define DECODE_SYSTEM 0xFE          // SYSTEM funct3 0: ecall and ebreak are told apart by the whole word
+#define ECALL_WORD 0x00000073u
+#define EBREAK_WORD 0x00100073u
+extern const instr_desc instr_descs[];
+extern uint8_t decode_table[DECODE_TABLE_SIZE];
+extern uint8_t funct7_class[128];
+extern uint8_t amo_table[32];
+extern uint8_t ecall_index, ebreak_index;
+
+static inline const instr_desc *decode_lookup(uint32_t instruction) {
+    uint32_t key = (instruction & 0x7F) << 5 | ((instruction >> 12) & 7) << 2 | funct7_class[instruction >> 25];
+    uint32_t index = decode_table[key];
+    if (index == DECODE_AMO) index = amo_table[instruction >> 27];
+    else if (index == DECODE_SYSTEM) index = instruction == ECALL_WORD ? ecall_index : instruction == EBREAK_WORD ? ebreak_index : 0;
+    return &instr_descs[index];
+}
+
+// Predecoded instruction: everything Decode/ControlUnit derive, computed once at load
+typedef struct {
+    const void *handler;        // Dispatch target, threaded in by run_predecoded()
+    int32_t imm;                // Sign-extended immediate
+    uint32_t raw;               // Original instruction word (for print_instruction)
+    uint16_t ctrl;              // Control-signal bitmask (CTRL_*)
+    uint8_t op;                 // Handler index (OP_*)
+    uint8_t fused;              // Superinstruction with the next slot (FUSE_*), set by fuse_program()
+    uint8_t alu_ctrl;           // ALU operation (ALU_*)
+    uint8_t rd, rs1, rs2;       // Register indices
+} decoded_instr;
+
+// Why a run loop returned
+enum { RUN_HALTED, RUN_LIMIT, RUN_PAUSED };
+
+struct jit_cache;
+
+// 5-stage pipeline timing model (riscv_pipeline.c)
+#define PIPE_FWD_EX_MEM (1 << 0)    // EX/MEM -> EX forwarding of ALU results
+#define PIPE_FWD_MEM_WB (1 << 1)    // MEM/WB -> EX forwarding (ALU and load results)
+#define PIPE_FWD_RF     (1 << 2)    // Register file written in the first half of WB, read in the second half of ID
+#define PIPE_FWD_ALL    (PIPE_FWD_EX_MEM | PIPE_FWD_MEM_WB | PIPE_FWD_RF)
+
+enum { STALL_NONE, STALL_LOAD_USE, STALL_DATA, STALL_COUNT };     // Data hazard stall causes
+enum { PIPE_BRANCH_NONE, PIPE_BRANCH_COND, PIPE_BRANCH_JAL, PIPE_BRANCH_JALR, PIPE_BRANCH_COUNT };
+
+typedef struct {
+    uint64_t cycles;                            // Pipeline clock cycles
+    uint64_t retired;                           // Instructions that left WB
+    uint64_t stalls[STALL_COUNT];               // Bubbles inserted into EX, by cause
+    uint64_t control_stalls[PIPE_BRANCH_COUNT]; // Fetch bubbles behind a redirect, by instruction
+} pipeline_stats;
+
+typedef struct pipeline_model pipeline_model;
+
+// Out-of-order superscalar timing model (riscv_ooo.c)
+enum { OOO_FU_ALU, OOO_FU_MUL, OOO_FU_DIV, OOO_FU_MEM, OOO_FU_COUNT };     // Functional-unit classes, one issue queue each
+// Why an instruction waited to issue: an operand from each unit class (OOO_FU_MEM: a load), a store it loads from, or busy units
+enum { OOO_WAIT_STORE = OOO_FU_COUNT, OOO_WAIT_UNITS, OOO_WAIT_COUNT };
+enum { OOO_FULL_ROB, OOO_FULL_IQ, OOO_FULL_LSQ, OOO_FULL_SERIAL, OOO_FULL_COUNT };  // Why dispatch stalled
+
+typedef struct {
+    int fetch_width;                // Instructions fetched, renamed and dispatched per cycle
+    int issue_width;                // Instructions issued to the units per cycle
+    int commit_width;               // Instructions committed per cycle
+    int rob;                        // Reorder buffer entries
+    int iq;                         // Entries in each issue queue
+    int lsq;                        // Load/store queue entries
+    int depth;                      // Cycles from fetch to dispatch
+    int units[OOO_FU_COUNT];        // Functional units of each class (the dividers are not pipelined)
+    int latency[OOO_FU_COUNT];      // Result latency of each class (OOO_FU_MEM: loads)
+} ooo_config;
+
+typedef struct {
+    uint64_t cycles;                            // Cycles until the last instruction committed
+    uint64_t retired;                           // Instructions committed
+    uint64_t rob_held, iq_held, lsq_held;       // Entry-cycles held: sums of each instruction's stay
+    uint64_t dispatch_stalls[OOO_FULL_COUNT];   // Cycles dispatch waited, by cause
+    uint64_t fetch_stalls[PIPE_BRANCH_COUNT];   // Cycles fetch waited for a redirect, by instruction
+    uint64_t issue_waits[OOO_WAIT_COUNT];       // Instruction-cycles between dispatch and issue, by cause
+    uint64_t issued[OOO_FU_COUNT];              // Instructions issued to each unit class
+} ooo_stats;
+
+typedef struct ooo_model ooo_model;
+
+// Branch prediction (riscv_bpred.c)
+enum { BPRED_NOT_TAKEN = 1, BPRED_BIMODAL, BPRED_GSHARE };
+
+typedef struct {
+    int kind;                       // BPRED_*
+    int entries;                    // 2-bit direction counters (power of two)
+    int history;                    // Global history bits (gshare)
+    int btb_entries;                // Branch target buffer entries (power of two, 0: none)
+    int ras_depth;                  // Return-address stack entries (0: none)
+} bpred_config;
+
+typedef struct branch_predictor branch_predictor;
+
+// Cache hierarchy model (riscv_cache.c)
+enum { REPL_LRU, REPL_PLRU, REPL_RANDOM };
+enum { MISS_COMPULSORY, MISS_CAPACITY, MISS_CONFLICT, MISS_COUNT };
+
+typedef struct {
+    uint32_t size;                  // Capacity in bytes (power of two)
+    uint32_t ways;                  // Associativity
+    uint32_t line;                  // Line size in bytes (power of two)
+    int replacement;                // REPL_*
+    int write_back;                 // 1: write-back, write-allocate; 0: write-through, no write-allocate
+} cache_config;
+
+typedef struct cache cache;
+
+// Guest hot-spot profiler (--profile), defined in riscv_profile.c
+typedef struct guest_profile guest_profile;
+
+// Host time spent in each run_staged() stage (--stage-times), kept by riscv_counters.c
+enum { TIMER_FETCH, TIMER_DECODE, TIMER_EXECUTE, TIMER_MEM, TIMER_WRITEBACK, TIMER_MODELS, TIMER_OUTPUT, TIMER_COUNT };
+
+typedef struct {
+    uint64_t ticks[TIMER_COUNT];    // host_ticks() spent in each stage
+    uint64_t calls[TIMER_COUNT];    // Timed calls of each stage (each also pays for one timer read)
+    uint64_t run_ticks;             // ... and in run_staged() as a whole
+    double run_seconds;             // Wall time of the same runs (calibrates the ticks)
+    uint64_t instructions;          // Instructions those runs retired
+} stage_timers;
+
+// Cheap host timestamp for the stage timers: the time-stamp counter where there is one
+static inline uint64_t host_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Binary delta traces (--trace-file and the riscv_trace tool), defined in riscv_trace.c
+typedef struct trace_writer trace_writer;
+typedef struct trace_reader trace_reader;
+
+enum { TRACE_PC = 1, TRACE_REG = 2, TRACE_MEM = 4, TRACE_END = 0x80 };  // Record flags
+
+// One record read back from a trace
+typedef struct {
+    uint8_t flags;                  // TRACE_* (TRACE_END: the run stopped)
+    uint32_t pc;                    // Instruction's pc (end record: the final pc)
+    uint32_t instruction;
+    uint8_t rd;                     // With TRACE_REG: register written and its new value
+    uint32_t rd_value;
+    uint32_t address, value;        // With TRACE_MEM: memory word written and its new value
+    uint64_t cycles;                // Cycle count once the instruction retired
+    int status;                     // End record: RUN_*
+} trace_record;
+
+// Guest memory: a 32-bit address space of 4 KiB pages allocated on first write (riscv_mem.c)
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1u << PAGE_SHIFT)
+#define TLB_ENTRIES 64              // Entries per direct-mapped software TLB (power of two)
+#define TLB_INVALID UINT32_MAX      // vpn of an unused TLB entry
+
+typedef struct {
+    uint32_t vpn;                   // Virtual page number (address >> PAGE_SHIFT)
+    uint8_t *page;                  // Host address of that page
+} tlb_entry;
+
+typedef struct guest_mem {
+    tlb_entry read_tlb[TLB_ENTRIES];    // Pages that exist (loads)
+    tlb_entry write_tlb[TLB_ENTRIES];   // Pages that exist and hold no program code (stores)
+    uint8_t ***dir;                     // Two-level page table, allocated on the first write
+    uint32_t *vpns;                     // Allocated pages in address order
+    uint32_t page_count, page_capacity;
+    uint32_t code_start, code_end;      // Program image [code_start, code_end)
+    uint8_t *dirty;                     // One bit per page written since mem_clean() (NULL before the first write)
+    struct guest_mem *owner;            // Memory whose pages this one uses (another hart's, see mem_share()), NULL: its own
+    int shared;                         // Page-table walks take the shared lock (memory used by several harts)
+} guest_mem;
+
+// A loaded program file (riscv_loader.c): the segments to copy into memory and where to start
+#define STACK_TOP 0x7ffffff0u       // Initial sp for binary and ELF programs
+#define HART_STACK_SIZE (64u << 10) // Each further hart's sp starts this much lower (--harts)
+
+typedef struct {
+    uint32_t address;               // Guest address of the first byte
+    uint32_t size;                  // Bytes taken from data (the rest of the segment reads as zero)
+    const uint8_t *data;
+} program_segment;
+
+typedef struct program_image {
+    program_segment *segments;
+    int segment_count;
+    uint32_t code_start, code_end;  // Instructions are decoded from [code_start, code_end)
+    uint32_t entry;                 // Initial pc
+    uint32_t stack_top;             // Initial sp (0 leaves x2 alone, as for text programs)
+    uint32_t data_end;              // End of the highest segment, bss included (the initial program break)
+    void *map;                      // mmap'd file backing the segments (binary and ELF)
+    size_t map_size;
+    uint32_t *words;                // Parsed instructions backing the segment (text)
+} program_image;
+
+// Complete state of one simulated CPU. Every pipeline function takes the
+// context it operates on, so independent programs can run side by side.
+typedef struct cpu_context {
+    uint32_t pc;                    // Program counter
+    uint32_t next_pc;               // Next program counter (PC + 4)
+    uint32_t branch_target;         // Branch target address (conditional branches)
+    uint32_t jump_target;           // Jump target address (for JAL/JALR)
+    int alu_zero;                   // ALU zero flag
+    uint64_t total_clock_cycles;    // Total clock cycles
+
+    // Control signals
+    int RegWrite;                   // Control signal for register write
+    int MemtoReg;                   // Control signal for memory to register
+    int MemRead;                    // Control signal for memory read
+    int MemWrite;                   // Control signal for memory write
+    int ALUSrc;                     // Control signal for ALU source (0: rs2, 1: imm)
+    int Branch;                     // Control signal for conditional branch
+    int ALUOp0;                     // Control signal for ALU operation (bit 0)
+    int ALUOp1;                     // Control signal for ALU operation (bit 1)
+    int Jump;                       // Control signal for unconditional jump (JAL/JALR)
+    int ALUSrcA;                    // Control signal for ALU operand A (0: rs1, 1: PC, 2: zero)
+    int BranchNZ;                   // Control signal for branch on a non-zero ALU result
+    int ALUCtrl;                    // ALU operation chosen by the control unit (ALU_*)
+    int Atomic;                     // Control signal for an RV32A atomic (its OP_*, 0: none)
+    int System;                     // Control signal for an environment call (ecall)
+    int Csr;                        // Control signal for a CSR access (rd gets the CSR's value)
+
+    // Memory and registers
+    int rf[32];                     // Register file (32 registers)
+    guest_mem mem;                  // Unified instruction and data memory
+    uint32_t reservation;           // lr.w: reserved word and the value it read (see mem_atomic())
+    uint32_t reserved_value;
+    int reserved;                   // A reservation is held
+
+    // Program image - filled by read_program()/load_program() and copied into mem
+    const program_image *image;     // Segments written back by cpu_reset()
+    program_image *own_image;       // Image opened by read_program() (freed with the context)
+    uint32_t *instr_mem;            // Instruction words as loaded, from mem.code_start on
+    int instr_count;                // Number of instructions
+
+    // Predecoded program - filled by predecode_program() from mem
+    decoded_instr *d_prog;          // Predecoded program plus OP_HALT sentinel
+    int d_prog_threaded;            // Handler pointers and superinstructions filled in for the current d_prog
+    uint32_t code_version;          // Bumped whenever a store rewrites part of the program
+    int uses_syscalls;              // The program contains an ecall (it is expected to end with exit)
+    int uses_counters;              // The program reads an hpmcounter (run_predecoded() then counts events)
+
+    // Performance counters (riscv_counters.c); cycle, time and instret are total_clock_cycles
+    uint64_t hpm_events[HPM_COUNT]; // Events behind mhpmcounter3 and up
+    stage_timers *stage_times;      // Host time per run_staged() stage (NULL: not timing)
+
+    // Syscall emulation (riscv_syscall.c)
+    struct guest_sys *sys;          // Guest file table and program break, created by the first ecall
+    int syscalls_muted;             // Syscalls leave host files alone: writes are dropped, reads see end of file (sampling workers)
+    int exited;                     // The program called exit; exit_code is what it passed
+    int exit_code;
+
+    // Run options
+    int trace_level;                // none / final state only / per-instruction / full per-cycle state
+    int no_fusion;                  // run_predecoded() dispatches every instruction on its own (--no-fusion)
+    long long max_cycles;           // Loop safeguard: -1 = 5 cycles per loaded instruction (no limit for
+                                    // programs that exit through ecall), 0 = unlimited
+
+    struct jit_cache *jit;          // Code cache, created on the first run_jit()
+    pipeline_model *pipeline;       // Timing model fed by run_staged() (NULL when not timing)
+    ooo_model *ooo;                 // Out-of-order timing model fed by run_staged() (NULL: none)
+    branch_predictor *bpred;        // Predictor consulted by run_staged() (NULL: none)
+    cache *icache, *dcache;         // L1 caches seen by Fetch() and Mem() (NULL: not modelled)
+    cache *l2;                      // Unified L2 behind them (NULL: none)
+    guest_profile *profile;         // Hot-spot profile kept by the interpreters (NULL: not profiling)
+    trace_writer *trace_out;        // Delta trace written by run_staged() (NULL: not recording)
+
+    // Embedding (riscv_sim.c): callbacks and stop pc honoured by run_staged()
+    riscv_sim_retire_fn on_retire;  // After each instruction (NULL: none)
+    void *retire_user;
+    riscv_sim_mem_fn on_mem;        // After each load, store and atomic (NULL: none)
+    void *mem_user;
+    int stop_at_pc;                 // Pause once the next instruction is at stop_pc
+    uint32_t stop_pc;
+} cpu_context;
+
+// riscv_cpu.c
+cpu_context *cpu_create(void);
+void cpu_destroy(cpu_context *cpu);
+void cpu_reset(cpu_context *cpu);
+void predecode(cpu_context *cpu, uint32_t instruction, decoded_instr *d);
+void predecode_program(cpu_context *cpu);
+int mem_load(cpu_context *cpu, uint32_t address);
+int mem_store(cpu_context *cpu, uint32_t address, int value);
+int mem_load_narrow(cpu_context *cpu, uint32_t address, uint32_t funct3);
+int mem_store_narrow(cpu_context *cpu, uint32_t address, int value, uint32_t funct3);
+int mem_atomic(cpu_context *cpu, int op, int alu, uint32_t address, uint32_t value, int *result);
+int32_t imm_gen(uint32_t instruction);
+void for_each_data_word(cpu_context *cpu, void (*fn)(void *arg, uint32_t address, int value), void *arg);
+void load_program(cpu_context *cpu, const program_image *image);
+int read_program(cpu_context *cpu, const char *filename);
+int read_program_words(cpu_context *cpu, const uint32_t *words, int count);
+void print_state(cpu_context *cpu, int final_state);
+void print_harts(cpu_context **harts, int count);
+uint64_t cycle_limit(cpu_context *cpu);
+int run_staged(cpu_context *cpu, uint64_t pause_at);
+int run_predecoded(cpu_context *cpu, uint64_t pause_at);
+int run_program(cpu_context *cpu, int engine);
+double now_seconds(void);
+
+// Index into instr_mem/d_prog of the instruction at pc (>= instr_count when pc is outside the program)
+static inline uint32_t code_index(const cpu_context *cpu, uint32_t pc) {
+    return (pc - cpu->mem.code_start) / 4;
+}
+
+// Whether the conditional branch the control signals describe is taken (after Execute)
+static inline int branch_taken(const cpu_context *cpu) {
+    return cpu->Branch && cpu->alu_zero != cpu->BranchNZ;
+}
+
+// Which control-flow instruction the datapath's control signals describe (PIPE_BRANCH_*)
+static inline int branch_kind(const cpu_context *cpu) {
+    if (cpu->Jump) return cpu->ALUSrc ? PIPE_BRANCH_JALR : PIPE_BRANCH_JAL;
+    return cpu->Branch ? PIPE_BRANCH_COND : PIPE_BRANCH_NONE;
+}
+
+// riscv_loader.c
+int program_open(program_image *image, const char *filename, int warn);
+int program_from_words(program_image *image, const uint32_t *words, int count);
+void program_close(program_image *image);
+
+// riscv_mem.c
+void mem_init(guest_mem *m);
+void mem_clear(guest_mem *m);
+void mem_zero(guest_mem *m);
+void mem_set_code(guest_mem *m, uint32_t start, uint32_t end);
+uint8_t *mem_page(guest_mem *m, uint32_t address, int allocate);
+uint8_t *mem_next_page(const guest_mem *m, uint32_t *vpn);
+uint32_t mem_peek(guest_mem *m, uint32_t address);
+void mem_poke(guest_mem *m, uint32_t address, uint32_t value);
+void mem_write(guest_mem *m, uint32_t address, const void *src, uint32_t size);
+void mem_read(guest_mem *m, uint32_t address, void *dst, uint32_t size);
+void mem_clean(guest_mem *m);
+int mem_page_dirty(const guest_mem *m, uint32_t vpn);
+void mem_share(guest_mem *m, guest_mem *owner);
+
+// lw through the load TLB; anything else (miss, misaligned) goes to mem_load()
+static inline int load_word(cpu_context *cpu, uint32_t address) {
+    const tlb_entry *e = &cpu->mem.read_tlb[(address >> PAGE_SHIFT) & (TLB_ENTRIES - 1)];
+    if (e->vpn == address >> PAGE_SHIFT && !(address & 3)) {
+        return *(const int *)(e->page + (address & (PAGE_SIZE - 1)));
+    }
+    return mem_load(cpu, address);
+}
+
+// sw through the store TLB; returns 1 if the store rewrote program code (see mem_store())
+static inline int store_word(cpu_context *cpu, uint32_t address, int value) {
+    const tlb_entry *e = &cpu->mem.write_tlb[(address >> PAGE_SHIFT) & (TLB_ENTRIES - 1)];
+    if (e->vpn == address >> PAGE_SHIFT && !(address & 3)) {
+        *(int *)(e->page + (address & (PAGE_SIZE - 1))) = value;
+        return 0;
+    }
+    return mem_store(cpu, address, value);
+}
+
+// Byte and halfword loads through the load TLB; funct3 is that of lb/lh/lbu/lhu.
+// Misses and misaligned addresses go to mem_load_narrow().
+static inline int load_narrow(cpu_context *cpu, uint32_t address, uint32_t funct3) {
+    const tlb_entry *e = &cpu->mem.read_tlb[(address >> PAGE_SHIFT) & (TLB_ENTRIES - 1)];
+    if (e->vpn == address >> PAGE_SHIFT && !(address & (funct3 & 1))) {
+        const uint8_t *p = e->page + (address & (PAGE_SIZE - 1));
+        int16_t half;
+        switch (funct3) {
+            case 0: return *(const int8_t *)p;
+            case 4: return *p;
+            default:
+                memcpy(&half, p, 2);
+                return funct3 == 1 ? half : (uint16_t)half;
+        }
+    }
+    return mem_load_narrow(cpu, address, funct3);
+}
+
+// sb/sh through the store TLB; returns 1 if the store rewrote program code (see mem_store())
+static inline int store_narrow(cpu_context *cpu, uint32_t address, int value, uint32_t funct3) {
+    const tlb_entry *e = &cpu->mem.write_tlb[(address >> PAGE_SHIFT) & (TLB_ENTRIES - 1)];
+    if (e->vpn == address >> PAGE_SHIFT && !(address & funct3)) {
+        uint8_t *p = e->page + (address & (PAGE_SIZE - 1));
+        if (funct3 == 0) *p = (uint8_t)value;
+        else memcpy(p, &(uint16_t){ (uint16_t)value }, 2);
+        return 0;
+    }
+    return mem_store_narrow(cpu, address, value, funct3);
+}
+
+// riscv_syscall.c
+#define SYS_EXIT 1                  // syscall_handle(): the program exited
+#define SYS_CODE 2                  // syscall_handle(): a read rewrote part of the program
+int syscall_handle(cpu_context *cpu);
+void syscall_flush(cpu_context *cpu);
+void syscall_reset(cpu_context *cpu);
+void syscall_share(cpu_context *hart, cpu_context *boot);
+void syscall_release(cpu_context *cpu);
+
+// Syscall state outside registers and memory that a snapshot of a run carries
+typedef struct {
+    uint32_t brk;                   // Program break
+    uint64_t open_files;            // Bit fd set for each open guest descriptor
+} syscall_state;
+
+#define SYSCALL_STD_FILES 7ull      // open_files of a run that has not opened or closed anything
+void syscall_save(cpu_context *cpu, syscall_state *state);
+void syscall_restore(cpu_context *cpu, const syscall_state *state);
+
+// riscv_counters.c
+int csr_access(cpu_context *cpu, uint32_t instruction, uint32_t rs1_val);
+int csr_reads_events(uint32_t instruction);
+void stage_timers_report(const stage_timers *t, FILE *out);
+
+// riscv_decode.c
+void decode_init(void);
+const char *op_name(int op);
+void disassemble(uint32_t instruction, uint32_t pc, char *buf, size_t size);
+
+// riscv_pipeline.c
+pipeline_model *pipeline_create(int forwarding);
+void pipeline_destroy(pipeline_model *p);
+void pipeline_feed(pipeline_model *p, const cpu_context *cpu, uint32_t rd, uint32_t rs1, uint32_t rs2, uint32_t pc, int mispredicted);
+void pipeline_drain(pipeline_model *p);
+const pipeline_stats *pipeline_get_stats(const pipeline_model *p);
+int parse_forwarding(const char *list);
+void pipeline_report(const pipeline_model *p, FILE *out);
+
+// riscv_ooo.c
+int parse_ooo(const char *spec, ooo_config *config);
+ooo_model *ooo_create(const ooo_config *config);
+void ooo_destroy(ooo_model *m);
+void ooo_feed(ooo_model *m, const cpu_context *cpu, uint32_t rd, uint32_t rs1, uint32_t rs2, uint32_t pc, uint32_t addr, int mispredicted);
+const ooo_stats *ooo_get_stats(const ooo_model *m);
+void ooo_report(const ooo_model *m, FILE *out);
+
+// riscv_bpred.c
+branch_predictor *bpred_create(const bpred_config *config);
+void bpred_destroy(branch_predictor *bp);
+uint32_t bpred_predict(branch_predictor *bp, uint32_t pc);
+int bpred_update(branch_predictor *bp, const cpu_context *cpu, uint32_t rd, uint32_t rs1, uint32_t pc, uint32_t predicted);
+int parse_bpred(const char *spec, bpred_config *config);
+void bpred_report(const branch_predictor *bp, FILE *out);
+void bpred_counts(const branch_predictor *bp, uint64_t *executed, uint64_t *mispredicted);
+
+// riscv_cache.c
+cache *cache_create(const char *name, const cache_config *config, cache *next);
+void cache_destroy(cache *c);
+int cache_access(cache *c, uint32_t address, int is_write, uint32_t pc);
+int parse_cache(const char *spec, cache_config *config);
+void cache_report(const cache *c, FILE *out);
+void cache_counts(const cache *c, uint64_t *accesses, uint64_t *misses);
+
+// riscv_trace.c
+trace_writer *trace_create(const char *path, cpu_context *cpu);
+void trace_reg(trace_writer *t, uint32_t rd, uint32_t value);
+void trace_mem(trace_writer *t, uint32_t address, uint32_t value);
+void trace_retire(trace_writer *t, uint32_t pc, uint32_t instruction);
+int trace_close(trace_writer *t, const cpu_context *cpu, int status);
+trace_reader *trace_open(const char *path, guest_mem *mem, int32_t rf[32], uint32_t *pc);
+uint64_t trace_start_cycles(const trace_reader *r);
+void trace_code_range(const trace_reader *r, uint32_t *start, uint32_t *end);
+int trace_next(trace_reader *r, trace_record *rec);
+void trace_close_reader(trace_reader *r);
+
+// riscv_profile.c
+guest_profile *profile_create(void);
+void profile_destroy(guest_profile *p);
+int64_t *profile_start(guest_profile *p, cpu_context *cpu);
+void profile_stop(guest_profile *p, cpu_context *cpu);
+void profile_code_changed(guest_profile *p, cpu_context *cpu, uint32_t next_pc);
+void profile_call(guest_profile *p, uint32_t target, uint32_t return_pc, uint64_t cycles);
+void profile_return(guest_profile *p, uint32_t target, uint64_t cycles);
+void profile_report(const guest_profile *p, const cpu_context *cpu, FILE *out);
+int profile_write_folded(const guest_profile *p, const char *path);
+
+// riscv_checkpoint.c
+typedef struct {
+    const char *path;               // Checkpoint file to write
+    uint64_t at;                    // Take one checkpoint at this cycle count (0: none)
+    uint64_t every;                 // Take one every N cycles (0: none)
+} checkpoint_options;
+
+int run_checkpointed(cpu_context *cpu, const checkpoint_options *opt);
+int checkpoint_restore(cpu_context *cpu, const char *path, uint64_t at);
+
+// riscv_jit.c
+int run_jit(cpu_context *cpu);
+void jit_destroy(struct jit_cache *jit);
+
+// riscv_lockstep.c
+#define LOCKSTEP_LANES 64           // Harts per lockstep gang (a multiple of 16)
+void run_lockstep(cpu_context **harts, int *status, int count);
+
+// riscv_harts.c
+void hart_attach(cpu_context *hart, cpu_context *boot, int id);
+int run_harts(cpu_context **harts, int *status, int count, uint64_t quantum);
+
+// riscv_sim.c (the rest of the embedding interface is in riscv_sim.h)
+enum { INIT_REG, INIT_MEM };        // What an "xN=value" or "mem[ADDR]=value" token sets
+int parse_init(const char *token, uint32_t *target, int *value);
+
+// riscv_batch.c
+int run_batch(const char *manifest, int threads, int engine, long long max_cycles);
+
+// riscv_sample.c
+typedef struct {
+    uint64_t every;                 // Cycles from one sample's snapshot to the next
+    uint64_t warmup;                // Detailed cycles run before each measurement (not counted)
+    uint64_t length;                // Detailed cycles measured per sample
+    int threads;                    // Detailed workers (0: one per online CPU)
+    int forwarding;                 // Models built for every sample: --pipeline paths (-1: none),
+    const ooo_config *ooo;          // --ooo (NULL: none),
+    bpred_config bpred;             // --bpred (kind 0: none),
+    const cache_config *l1i, *l1d;  // the L1 caches (NULL: no cache model)
+    const cache_config *l2;         // and the L2 (NULL: none)
+} sample_options;
+
+int parse_sample(const char *spec, sample_options *opt);
+int run_sampled(cpu_context *cpu, const sample_options *opt);
+
+// riscv_fuzz.c
+typedef struct {
+    uint64_t cases;                 // Random programs to run
+    int length;                     // Instructions per program
+    uint64_t seed;                  // Case i is generated from (seed, i)
+} fuzz_options;
+
+int parse_fuzz(const char *spec, fuzz_options *opt);
+int run_fuzz(const fuzz_options *opt, int threads, int with_jit);
+
+// Execution engines
+enum { ENGINE_PREDECODED, ENGINE_STAGED, ENGINE_JIT, ENGINE_LOCKSTEP };
+
+#endif
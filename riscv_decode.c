@@ -0,0 +1,237 @@
+// RV32IMA instruction table (plus the Zicsr and Zifencei instructions) and the decode table generated from it.
+//
+// instr_descs[] lists every supported instruction once: its opcode, funct3
+// and funct7 (or -1 where the field is not part of the encoding), its
+// format, and the micro-op, ALU operation and control signals it decodes to.
+// decode_init() expands the list into decode_table[], a flat byte table keyed
+// on opcode, funct3 and a 2-bit class of funct7 (0x00, 0x20, 0x01 or other).
+// Decoding any instruction is then two table reads, however many
+// instructions the ISA has. The word atomics share one opcode and funct3 and
+// differ in funct5 (the top five bits of funct7, the low two being aq/rl), so
+// their decode_table entries hold DECODE_AMO and amo_table[funct5] holds the
+// descriptor index. ecall and ebreak share their opcode, funct3 and funct7,
+// so their entries hold DECODE_SYSTEM and the whole word picks one of them
+// (ecall_index, ebreak_index); any other word there is unknown. The control unit, the
+// predecoder and the disassembler all go through the same table.
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "riscv_cpu.h"
+
+// Control signals of each instruction class
+#define C_R      (CTRL_VALID | CTRL_REG_WRITE | CTRL_ALU_OP1)
+#define C_I      (CTRL_VALID | CTRL_REG_WRITE | CTRL_ALU_SRC | CTRL_ALU_OP1)
+#define C_LOAD   (CTRL_VALID | CTRL_REG_WRITE | CTRL_ALU_SRC | CTRL_MEM_READ | CTRL_MEM_TO_REG)
+#define C_STORE  (CTRL_VALID | CTRL_ALU_SRC | CTRL_MEM_WRITE)
+#define C_BR     (CTRL_VALID | CTRL_BRANCH | CTRL_ALU_OP0)                  // Taken when the ALU result is zero
+#define C_BR_NZ  (C_BR | CTRL_BRANCH_NZ)                                    // Taken when it is non-zero
+#define C_JAL    (CTRL_VALID | CTRL_REG_WRITE | CTRL_JUMP)
+#define C_JALR   (CTRL_VALID | CTRL_REG_WRITE | CTRL_JUMP | CTRL_ALU_SRC)
+#define C_LUI    (CTRL_VALID | CTRL_REG_WRITE | CTRL_ALU_SRC | CTRL_ALU_A_ZERO)
+#define C_AUIPC  (CTRL_VALID | CTRL_REG_WRITE | CTRL_ALU_SRC | CTRL_ALU_A_PC)
+#define C_LR     (CTRL_VALID | CTRL_REG_WRITE | CTRL_MEM_READ | CTRL_MEM_TO_REG)
+#define C_AMO    (C_LR | CTRL_MEM_WRITE)                                    // Also sc.w
+#define C_SYSTEM (CTRL_VALID | CTRL_SYSTEM)
+#define C_CSR    (CTRL_VALID | CTRL_REG_WRITE | CTRL_MEM_TO_REG | CTRL_CSR)  // The CSR's value comes back like loaded data
+
+#define OPCODE_AMO 0x2F
+
+const instr_desc instr_descs[] = {
+    // Index 0: anything the table does not match (a NOP with an "Unknown opcode" message)
+    { "unknown", 0x00, -1, -1,   FMT_NONE,  OP_UNKNOWN, ALU_ADD,    0 },
+
+    // RV32I
+    { "lui",     0x37, -1, -1,   FMT_U,     OP_LUI,     ALU_ADD,    C_LUI },
+    { "auipc",   0x17, -1, -1,   FMT_U,     OP_AUIPC,   ALU_ADD,    C_AUIPC },
+    { "jal",     0x6F, -1, -1,   FMT_J,     OP_JAL,     ALU_ADD,    C_JAL },
+    { "jalr",    0x67,  0, -1,   FMT_JALR,  OP_JALR,    ALU_ADD,    C_JALR },
+    { "beq",     0x63,  0, -1,   FMT_B,     OP_BEQ,     ALU_SUB,    C_BR },
+    { "bne",     0x63,  1, -1,   FMT_B,     OP_BNE,     ALU_SUB,    C_BR_NZ },
+    { "blt",     0x63,  4, -1,   FMT_B,     OP_BLT,     ALU_SLT,    C_BR_NZ },
+    { "bge",     0x63,  5, -1,   FMT_B,     OP_BGE,     ALU_SLT,    C_BR },
+    { "bltu",    0x63,  6, -1,   FMT_B,     OP_BLTU,    ALU_SLTU,   C_BR_NZ },
+    { "bgeu",    0x63,  7, -1,   FMT_B,     OP_BGEU,    ALU_SLTU,   C_BR },
+    { "lb",      0x03,  0, -1,   FMT_LOAD,  OP_LB,      ALU_ADD,    C_LOAD },
+    { "lh",      0x03,  1, -1,   FMT_LOAD,  OP_LH,      ALU_ADD,    C_LOAD },
+    { "lw",      0x03,  2, -1,   FMT_LOAD,  OP_LW,      ALU_ADD,    C_LOAD },
+    { "lbu",     0x03,  4, -1,   FMT_LOAD,  OP_LBU,     ALU_ADD,    C_LOAD },
+    { "lhu",     0x03,  5, -1,   FMT_LOAD,  OP_LHU,     ALU_ADD,    C_LOAD },
+    { "sb",      0x23,  0, -1,   FMT_S,     OP_SB,      ALU_ADD,    C_STORE },
+    { "sh",      0x23,  1, -1,   FMT_S,     OP_SH,      ALU_ADD,    C_STORE },
+    { "sw",      0x23,  2, -1,   FMT_S,     OP_SW,      ALU_ADD,    C_STORE },
+    { "addi",    0x13,  0, -1,   FMT_I,     OP_ADDI,    ALU_ADD,    C_I },
+    { "slti",    0x13,  2, -1,   FMT_I,     OP_SLTI,    ALU_SLT,    C_I },
+    { "sltiu",   0x13,  3, -1,   FMT_I,     OP_SLTIU,   ALU_SLTU,   C_I },
+    { "xori",    0x13,  4, -1,   FMT_I,     OP_XORI,    ALU_XOR,    C_I },
+    { "ori",     0x13,  6, -1,   FMT_I,     OP_ORI,     ALU_OR,     C_I },
+    { "andi",    0x13,  7, -1,   FMT_I,     OP_ANDI,    ALU_AND,    C_I },
+    { "slli",    0x13,  1, 0x00, FMT_SHIFT, OP_SLLI,    ALU_SLL,    C_I },
+    { "srli",    0x13,  5, 0x00, FMT_SHIFT, OP_SRLI,    ALU_SRL,    C_I },
+    { "srai",    0x13,  5, 0x20, FMT_SHIFT, OP_SRAI,    ALU_SRA,    C_I },
+    { "add",     0x33,  0, 0x00, FMT_R,     OP_ADD,     ALU_ADD,    C_R },
+    { "sub",     0x33,  0, 0x20, FMT_R,     OP_SUB,     ALU_SUB,    C_R },
+    { "sll",     0x33,  1, 0x00, FMT_R,     OP_SLL,     ALU_SLL,    C_R },
+    { "slt",     0x33,  2, 0x00, FMT_R,     OP_SLT,     ALU_SLT,    C_R },
+    { "sltu",    0x33,  3, 0x00, FMT_R,     OP_SLTU,    ALU_SLTU,   C_R },
+    { "xor",     0x33,  4, 0x00, FMT_R,     OP_XOR,     ALU_XOR,    C_R },
+    { "srl",     0x33,  5, 0x00, FMT_R,     OP_SRL,     ALU_SRL,    C_R },
+    { "sra",     0x33,  5, 0x20, FMT_R,     OP_SRA,     ALU_SRA,    C_R },
+    { "or",      0x33,  6, 0x00, FMT_R,     OP_OR,      ALU_OR,     C_R },
+    { "and",     0x33,  7, 0x00, FMT_R,     OP_AND,     ALU_AND,    C_R },
+    { "fence",   0x0F,  0, -1,   FMT_FENCE, OP_FENCE,   ALU_ADD,    CTRL_VALID },
+    { "ecall",   0x73,  0, 0x00, FMT_SYSTEM, OP_ECALL,  ALU_ADD,    C_SYSTEM },
+    { "ebreak",  0x73,  0, 0x00, FMT_SYSTEM, OP_EBREAK, ALU_ADD,    CTRL_VALID },
+
+    // Zifencei
+    { "fence.i", 0x0F,  1, -1,   FMT_FENCE, OP_FENCE,   ALU_ADD,    CTRL_VALID },
+
+    // Zicsr (the CSRs themselves are in riscv_counters.c)
+    { "csrrw",   0x73,  1, -1,   FMT_CSR,   OP_CSR,     ALU_ADD,    C_CSR },
+    { "csrrs",   0x73,  2, -1,   FMT_CSR,   OP_CSR,     ALU_ADD,    C_CSR },
+    { "csrrc",   0x73,  3, -1,   FMT_CSR,   OP_CSR,     ALU_ADD,    C_CSR },
+    { "csrrwi",  0x73,  5, -1,   FMT_CSR,   OP_CSR,     ALU_ADD,    C_CSR },
+    { "csrrsi",  0x73,  6, -1,   FMT_CSR,   OP_CSR,     ALU_ADD,    C_CSR },
+    { "csrrci",  0x73,  7, -1,   FMT_CSR,   OP_CSR,     ALU_ADD,    C_CSR },
+
+    // RV32M
+    { "mul",     0x33,  0, 0x01, FMT_R,     OP_MUL,     ALU_MUL,    C_R },
+    { "mulh",    0x33,  1, 0x01, FMT_R,     OP_MULH,    ALU_MULH,   C_R },
+    { "mulhsu",  0x33,  2, 0x01, FMT_R,     OP_MULHSU,  ALU_MULHSU, C_R },
+    { "mulhu",   0x33,  3, 0x01, FMT_R,     OP_MULHU,   ALU_MULHU,  C_R },
+    { "div",     0x33,  4, 0x01, FMT_R,     OP_DIV,     ALU_DIV,    C_R },
+    { "divu",    0x33,  5, 0x01, FMT_R,     OP_DIVU,    ALU_DIVU,   C_R },
+    { "rem",     0x33,  6, 0x01, FMT_R,     OP_REM,     ALU_REM,    C_R },
+    { "remu",    0x33,  7, 0x01, FMT_R,     OP_REMU,    ALU_REMU,   C_R },
+
+    // RV32A (funct7 holds funct5 << 2: aq and rl are ignored, accesses are always sequentially consistent)
+    { "lr.w",      OPCODE_AMO, 2, 0x02 << 2, FMT_AMO, OP_LR,      ALU_ADD,  C_LR },
+    { "sc.w",      OPCODE_AMO, 2, 0x03 << 2, FMT_AMO, OP_SC,      ALU_B,    C_AMO },
+    { "amoswap.w", OPCODE_AMO, 2, 0x01 << 2, FMT_AMO, OP_AMOSWAP, ALU_B,    C_AMO },
+    { "amoadd.w",  OPCODE_AMO, 2, 0x00 << 2, FMT_AMO, OP_AMOADD,  ALU_ADD,  C_AMO },
+    { "amoxor.w",  OPCODE_AMO, 2, 0x04 << 2, FMT_AMO, OP_AMOXOR,  ALU_XOR,  C_AMO },
+    { "amoand.w",  OPCODE_AMO, 2, 0x0C << 2, FMT_AMO, OP_AMOAND,  ALU_AND,  C_AMO },
+    { "amoor.w",   OPCODE_AMO, 2, 0x08 << 2, FMT_AMO, OP_AMOOR,   ALU_OR,   C_AMO },
+    { "amomin.w",  OPCODE_AMO, 2, 0x10 << 2, FMT_AMO, OP_AMOMIN,  ALU_MIN,  C_AMO },
+    { "amomax.w",  OPCODE_AMO, 2, 0x14 << 2, FMT_AMO, OP_AMOMAX,  ALU_MAX,  C_AMO },
+    { "amominu.w", OPCODE_AMO, 2, 0x18 << 2, FMT_AMO, OP_AMOMINU, ALU_MINU, C_AMO },
+    { "amomaxu.w", OPCODE_AMO, 2, 0x1C << 2, FMT_AMO, OP_AMOMAXU, ALU_MAXU, C_AMO },
+
+    { NULL, 0, 0, 0, 0, 0, 0, 0 }
+};
+
+uint8_t decode_table[DECODE_TABLE_SIZE];
+uint8_t funct7_class[128];
+uint8_t amo_table[32];
+uint8_t ecall_index, ebreak_index;
+
+static void build_decode_table(void) {
+    for (int f7 = 0; f7 < 128; f7++) {
+        funct7_class[f7] = f7 == 0x00 ? 0 : f7 == 0x20 ? 1 : f7 == 0x01 ? 2 : 3;
+    }
+    for (int i = 1; instr_descs[i].name != NULL; i++) {
+        const instr_desc *desc = &instr_descs[i];
+        if (desc->opcode == OPCODE_AMO) {
+            amo_table[desc->funct7 >> 2] = (uint8_t)i;
+            for (int cls = 0; cls < 4; cls++) decode_table[desc->opcode << 5 | desc->funct3 << 2 | cls] = DECODE_AMO;
+            continue;
+        }
+        if (desc->op == OP_ECALL || desc->op == OP_EBREAK) {
+            *(desc->op == OP_ECALL ? &ecall_index : &ebreak_index) = (uint8_t)i;
+            decode_table[desc->opcode << 5 | desc->funct3 << 2 | funct7_class[desc->funct7]] = DECODE_SYSTEM;
+            continue;
+        }
+        for (int f3 = 0; f3 < 8; f3++) {
+            if (desc->funct3 >= 0 && desc->funct3 != f3) continue;
+            for (int cls = 0; cls < 4; cls++) {
+                if (desc->funct7 >= 0 && funct7_class[desc->funct7] != cls) continue;
+                decode_table[desc->opcode << 5 | f3 << 2 | cls] = (uint8_t)i;
+            }
+        }
+    }
+}
+
+// Generate the decode table (once per process; called by cpu_create())
+void decode_init(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, build_decode_table);
+}
+
+// Mnemonic of a micro-op
+const char *op_name(int op) {
+    if (op == OP_CSR) return "csr";     // One micro-op for all six CSR instructions
+    for (int i = 1; instr_descs[i].name != NULL; i++) {
+        if (instr_descs[i].op == op) return instr_descs[i].name;
+    }
+    return op == OP_HALT ? "halt" : "unknown";
+}
+
+// Spell a fence's predecessor or successor set (bits 3..0: i, o, r, w) into set
+static void fence_set(uint32_t bits, char *set) {
+    int n = 0;
+    for (int b = 3; b >= 0; b--) {
+        if (bits & (1u << b)) set[n++] = "wroi"[b];
+    }
+    set[n] = '\0';
+}
+
+// Write the assembly form of instruction (at pc) into buf
+void disassemble(uint32_t instruction, uint32_t pc, char *buf, size_t size) {
+    const instr_desc *desc = decode_lookup(instruction);
+    uint32_t rd = (instruction >> 7) & 0x1F;
+    uint32_t rs1 = (instruction >> 15) & 0x1F;
+    uint32_t rs2 = (instruction >> 20) & 0x1F;
+    int32_t imm = imm_gen(instruction);
+
+    switch (desc->format) {
+        case FMT_R:
+            snprintf(buf, size, "%s x%u, x%u, x%u", desc->name, rd, rs1, rs2);
+            break;
+        case FMT_I:
+        case FMT_JALR:
+            snprintf(buf, size, "%s x%u, x%u, %d", desc->name, rd, rs1, imm);
+            break;
+        case FMT_SHIFT:
+            snprintf(buf, size, "%s x%u, x%u, %d", desc->name, rd, rs1, imm & 0x1F);
+            break;
+        case FMT_LOAD:
+            snprintf(buf, size, "%s x%u, %d(x%u)", desc->name, rd, imm, rs1);
+            break;
+        case FMT_S:
+            snprintf(buf, size, "%s x%u, %d(x%u)", desc->name, rs2, imm, rs1);
+            break;
+        case FMT_B:
+            snprintf(buf, size, "%s x%u, x%u, %d (target 0x%x)", desc->name, rs1, rs2, imm, pc + (uint32_t)imm);
+            break;
+        case FMT_U:
+            snprintf(buf, size, "%s x%u, 0x%x", desc->name, rd, (uint32_t)imm >> 12);
+            break;
+        case FMT_J:
+            snprintf(buf, size, "%s x%u, %d (target 0x%x)", desc->name, rd, imm, pc + (uint32_t)imm);
+            break;
+        case FMT_SYSTEM:
+            snprintf(buf, size, "%s", desc->name);
+            break;
+        case FMT_FENCE: // fence pred, succ (fence.i has no operands)
+            if (desc->op == OP_FENCE && desc->funct3 == 0) {
+                char pred[5], succ[5];
+                fence_set(instruction >> 24, pred);
+                fence_set(instruction >> 20, succ);
+                snprintf(buf, size, "%s %s, %s", desc->name, pred, succ);
+            } else {
+                snprintf(buf, size, "%s", desc->name);
+            }
+            break;
+        case FMT_CSR:   // The immediate forms take rs1 as a 5-bit constant
+            if (instruction & (4u << 12)) snprintf(buf, size, "%s x%u, 0x%03x, %u", desc->name, rd, instruction >> 20, rs1);
+            else snprintf(buf, size, "%s x%u, 0x%03x, x%u", desc->name, rd, instruction >> 20, rs1);
+            break;
+        case FMT_AMO:
+            if (desc->op == OP_LR) snprintf(buf, size, "%s x%u, (x%u)", desc->name, rd, rs1);
+            else snprintf(buf, size, "%s x%u, x%u, (x%u)", desc->name, rd, rs2, rs1);
+            break;
+        default:
+            snprintf(buf, size, ".word 0x%08x", instruction);
+            break;
+    }
+}
@@ -0,0 +1,659 @@
+// Differential fuzzing: random programs run on the simulator's engines and on
+// a small reference interpreter, and their final states compared.
+//
+// Each case is a straight-line program of random instructions drawn from
+// instr_descs[], so new table entries are fuzzed as soon as they are added.
+// Operands are random within a few rules that keep every program valid and
+// finite:
+//   - no instruction writes gp (x3), which points into a 4 KiB data window
+//     that every load, store and atomic addresses (aligned for its width)
+//   - branches and jal only jump forward, at most to just past the end
+//   - jalr comes as "auipc rX, 0; jalr rd, imm(rX)" with a forward imm
+// Registers and the data window start with random contents.
+//
+// ref_run() is written from the ISA manual and shares no code with the
+// simulator: it decodes the raw bits with a switch. After both have run, the
+// registers, pc, cycle count and a hash of the data window must agree for
+// run_predecoded(), run_staged() (ControlUnit, Decode and Execute) and, with
+// --jit, run_jit(). A failing case is minimised (shortened, instructions
+// deleted, initial state cleared) before it is reported.
+//
+// Worker threads take cases in blocks from a shared counter. Case i is
+// generated from a generator seeded with (seed, i), so a report can be
+// reproduced with the same seed whatever the thread count.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "riscv_cpu.h"
+
+#define FUZZ_MAX_LENGTH 512             // Keeps every forward branch offset in range
+#define FUZZ_BLOCK 256                  // Cases a worker takes at a time
+#define FUZZ_GP 0x10000u                // gp, the middle of the data window
+#define FUZZ_WINDOW 4096u               // Data window [FUZZ_GP - 2048, FUZZ_GP + 2048)
+#define FUZZ_WINDOW_BASE (FUZZ_GP - FUZZ_WINDOW / 2)
+#define FUZZ_NOP 0x00000013u            // addi x0, x0, 0
+#define FUZZ_ENGINES 3
+
+static const char *const engine_names[FUZZ_ENGINES] = { "interpreter", "staged", "jit" };
+
+// One generated test case
+typedef struct {
+    uint32_t code[FUZZ_MAX_LENGTH];
+    uint8_t group[FUZZ_MAX_LENGTH];     // Instructions that must be removed together, from here on (0: inside a group)
+    int length;
+    int32_t rf[32];                     // Initial registers (rf[3] is gp)
+    uint8_t window[FUZZ_WINDOW];        // Initial data window
+} fuzz_case;
+
+// Final state of one run
+typedef struct {
+    int32_t rf[32];
+    uint32_t pc;
+    uint64_t cycles;
+    uint8_t window[FUZZ_WINDOW];
+    uint64_t hash;                      // Of rf, pc, cycles and window
+} fuzz_result;
+
+typedef struct {
+    uint64_t cases, seed;
+    int length;
+    int engines;                        // FUZZ_ENGINES, or one less without --jit
+    int desc_count;                     // Entries in instr_descs[] (index 0 is "unknown")
+    uint64_t run;                       // Cases checked (atomic)
+    uint64_t next;                      // First case no worker has taken (atomic)
+    uint64_t instructions;              // Instructions generated (atomic)
+    int failed;                         // A worker has found a mismatch (atomic)
+    pthread_mutex_t lock;
+    uint64_t failed_index;              // Lowest failing case found (lock held)
+    fuzz_case *failure;
+} fuzzer;
+
+static uint64_t splitmix(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Random register contents biased towards the edge cases of the ALU
+static uint32_t random_value(uint64_t *rng) {
+    static const uint32_t edges[] = { 0, 1, 2, 31, 32, 0x7fffffffu, 0x80000000u, 0xffffffffu, 0xfffffffeu, 0x8000u, 0xffff8000u };
+    uint64_t r = splitmix(rng);
+    switch (r & 3) {
+        case 0:  return edges[(r >> 8) % (sizeof(edges) / sizeof(edges[0]))];
+        case 1:  return (uint32_t)(int32_t)(int8_t)(r >> 8);
+        default: return (uint32_t)(r >> 32);
+    }
+}
+
+// Random 12-bit immediate, biased the same way
+static int32_t random_imm12(uint64_t *rng) {
+    static const int32_t edges[] = { 0, 1, -1, 2047, -2048, 31, 32, 0x7ff, -0x7ff };
+    uint64_t r = splitmix(rng);
+    if (r & 1) return edges[(r >> 8) % (sizeof(edges) / sizeof(edges[0]))];
+    return (int32_t)((r >> 20) & 0xFFF) - 2048;
+}
+
+static uint32_t random_rd(uint64_t *rng) {
+    uint32_t rd = (uint32_t)(splitmix(rng) % 31);
+    return rd >= 3 ? rd + 1 : rd;       // Anything but gp
+}
+
+static uint32_t random_reg(uint64_t *rng) {
+    return (uint32_t)(splitmix(rng) & 31);
+}
+
+// Instruction encoders
+static uint32_t enc_r(uint32_t opcode, uint32_t funct3, uint32_t funct7, uint32_t rd, uint32_t rs1, uint32_t rs2) {
+    return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+static uint32_t enc_i(uint32_t opcode, uint32_t funct3, uint32_t rd, uint32_t rs1, int32_t imm) {
+    return ((uint32_t)imm & 0xFFF) << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+static uint32_t enc_s(uint32_t opcode, uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+    uint32_t u = (uint32_t)imm;
+    return ((u >> 5) & 0x7F) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | (u & 0x1F) << 7 | opcode;
+}
+static uint32_t enc_b(uint32_t opcode, uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+    uint32_t u = (uint32_t)imm;
+    return ((u >> 12) & 1) << 31 | ((u >> 5) & 0x3F) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12
+         | ((u >> 1) & 0xF) << 8 | ((u >> 11) & 1) << 7 | opcode;
+}
+static uint32_t enc_j(uint32_t opcode, uint32_t rd, int32_t imm) {
+    uint32_t u = (uint32_t)imm;
+    return ((u >> 20) & 1) << 31 | ((u >> 1) & 0x3FF) << 21 | ((u >> 11) & 1) << 20 | ((u >> 12) & 0xFF) << 12
+         | rd << 7 | opcode;
+}
+
+// Byte offset from instruction i to a random instruction after it (length: just past the end)
+static int32_t forward_offset(uint64_t *rng, int i, int length) {
+    return 4 * (int32_t)(1 + splitmix(rng) % (uint64_t)(length - i));
+}
+
+// Fill c with random case number index
+static void generate_case(const fuzzer *f, uint64_t index, fuzz_case *c) {
+    uint64_t rng = f->seed * 0x2545f4914f6cdd1dull ^ index;
+    splitmix(&rng);
+
+    c->length = f->length;
+    for (int r = 0; r < 32; r++) c->rf[r] = (int32_t)random_value(&rng);
+    c->rf[0] = 0;
+    c->rf[3] = (int32_t)FUZZ_GP;
+    for (uint32_t i = 0; i < FUZZ_WINDOW; i += 8) {
+        uint64_t r = splitmix(&rng);
+        memcpy(&c->window[i], &r, 8);
+    }
+
+    for (int i = 0; i < c->length; i++) {
+        const instr_desc *d = &instr_descs[1 + splitmix(&rng) % (uint64_t)(f->desc_count - 1)];
+        uint32_t f3 = d->funct3 >= 0 ? (uint32_t)d->funct3 : 0;
+        uint32_t f7 = d->funct7 >= 0 ? (uint32_t)d->funct7 : 0;
+        uint32_t width = 1u << (f3 & 3);                // Access size of loads and stores
+        int32_t imm;
+        c->group[i] = 1;
+        switch (d->format) {
+            case FMT_R:
+                c->code[i] = enc_r(d->opcode, f3, f7, random_rd(&rng), random_reg(&rng), random_reg(&rng));
+                break;
+            case FMT_I:
+                c->code[i] = enc_i(d->opcode, f3, random_rd(&rng), random_reg(&rng), random_imm12(&rng));
+                break;
+            case FMT_SHIFT:
+                c->code[i] = enc_i(d->opcode, f3, random_rd(&rng), random_reg(&rng),
+                                   (int32_t)(f7 << 5 | (uint32_t)(splitmix(&rng) & 31)));
+                break;
+            case FMT_LOAD:
+                imm = random_imm12(&rng) & ~(int32_t)(width - 1);
+                c->code[i] = enc_i(d->opcode, f3, random_rd(&rng), 3, imm);
+                break;
+            case FMT_S:
+                imm = random_imm12(&rng) & ~(int32_t)(width - 1);
+                c->code[i] = enc_s(d->opcode, f3, 3, random_reg(&rng), imm);
+                break;
+            case FMT_B:
+                c->code[i] = enc_b(d->opcode, f3, random_reg(&rng), random_reg(&rng), forward_offset(&rng, i, c->length));
+                break;
+            case FMT_J:
+                c->code[i] = enc_j(d->opcode, random_rd(&rng), forward_offset(&rng, i, c->length));
+                break;
+            case FMT_U:
+                c->code[i] = (random_value(&rng) & 0xFFFFF000u) | random_rd(&rng) << 7 | d->opcode;
+                break;
+            case FMT_JALR: {
+                if (i + 1 == c->length) {       // No room for the pair
+                    c->code[i] = FUZZ_NOP;
+                    break;
+                }
+                uint32_t base = random_rd(&rng);
+                if (base == 0) base = 1;
+                imm = forward_offset(&rng, i, c->length) | (int32_t)(splitmix(&rng) & 1);  // jalr clears bit 0
+                if (imm > 2047) imm = 4;        // Past the range of the immediate: just the next instruction
+                c->code[i] = 0x17u | base << 7;                                 // auipc base, 0
+                c->code[i + 1] = enc_i(d->opcode, f3, random_rd(&rng), base, imm);
+                c->group[i] = 2;
+                c->group[++i] = 0;
+                break;
+            }
+            case FMT_AMO: {
+                uint32_t rs2 = d->op == OP_LR ? 0 : random_reg(&rng);
+                f7 |= (uint32_t)(splitmix(&rng) & 3);                           // aq/rl
+                c->code[i] = enc_r(d->opcode, f3, f7, random_rd(&rng), 3, rs2);
+                break;
+            }
+            case FMT_FENCE:                     // Random pred/succ sets (fence.i ignores them)
+                c->code[i] = enc_i(d->opcode, f3, 0, 0, (int32_t)(splitmix(&rng) & 0xFF));
+                break;
+            case FMT_SYSTEM:                    // ebreak; ecall would make a syscall
+                c->code[i] = d->op == OP_EBREAK ? EBREAK_WORD : FUZZ_NOP;
+                break;
+            default:
+                c->code[i] = FUZZ_NOP;
+                break;
+        }
+    }
+}
+
+// Reference interpreter state
+typedef struct {
+    uint32_t x[32];
+    uint32_t pc;
+    uint64_t cycles;
+    uint8_t *window;
+    int reserved;
+    uint32_t reservation, reserved_value;
+} ref_state;
+
+static uint8_t *ref_addr(ref_state *s, uint32_t address, uint32_t size) {
+    uint32_t offset = address - FUZZ_WINDOW_BASE;
+    if (offset > FUZZ_WINDOW - size || address % size != 0) return NULL;
+    return &s->window[offset];
+}
+
+static uint32_t ref_load(ref_state *s, uint32_t address, uint32_t size) {
+    uint8_t *p = ref_addr(s, address, size);
+    uint32_t v = 0;
+    for (uint32_t i = 0; p != NULL && i < size; i++) v |= (uint32_t)p[i] << (8 * i);
+    return v;
+}
+
+static void ref_store(ref_state *s, uint32_t address, uint32_t size, uint32_t value) {
+    uint8_t *p = ref_addr(s, address, size);
+    for (uint32_t i = 0; p != NULL && i < size; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+// Run code (length instructions at address 0) to completion on the reference interpreter
+static void ref_run(ref_state *s, const uint32_t *code, int length) {
+    while (s->pc / 4 < (uint32_t)length && s->cycles < (uint64_t)length + 2) {
+        uint32_t in = code[s->pc / 4];
+        uint32_t opcode = in & 0x7F, rd = (in >> 7) & 0x1F, funct3 = (in >> 12) & 7;
+        uint32_t a = s->x[(in >> 15) & 0x1F], b = s->x[(in >> 20) & 0x1F], funct7 = in >> 25;
+        int32_t imm_i = (int32_t)in >> 20;
+        int32_t imm_s = ((int32_t)in >> 25) << 5 | (int32_t)((in >> 7) & 0x1F);
+        int32_t imm_b = ((int32_t)in >> 31) << 12 | (int32_t)((in >> 7) & 1) << 11
+                      | (int32_t)((in >> 25) & 0x3F) << 5 | (int32_t)((in >> 8) & 0xF) << 1;
+        int32_t imm_j = ((int32_t)in >> 31) << 20 | (int32_t)((in >> 12) & 0xFF) << 12
+                      | (int32_t)((in >> 20) & 1) << 11 | (int32_t)((in >> 21) & 0x3FF) << 1;
+        uint32_t next = s->pc + 4, result = 0;
+        int writes = 1;
+
+        switch (opcode) {
+            case 0x37: result = in & 0xFFFFF000u; break;
+            case 0x17: result = s->pc + (in & 0xFFFFF000u); break;
+            case 0x6F: result = next; next = s->pc + (uint32_t)imm_j; break;
+            case 0x67: result = next; next = (a + (uint32_t)imm_i) & ~1u; break;
+            case 0x63: {
+                int taken;
+                switch (funct3) {
+                    case 0:  taken = a == b; break;
+                    case 1:  taken = a != b; break;
+                    case 4:  taken = (int32_t)a < (int32_t)b; break;
+                    case 5:  taken = (int32_t)a >= (int32_t)b; break;
+                    case 6:  taken = a < b; break;
+                    default: taken = a >= b; break;
+                }
+                if (taken) next = s->pc + (uint32_t)imm_b;
+                writes = 0;
+                break;
+            }
+            case 0x03: {
+                uint32_t address = a + (uint32_t)imm_i;
+                switch (funct3) {
+                    case 0:  result = (uint32_t)(int32_t)(int8_t)ref_load(s, address, 1); break;
+                    case 1:  result = (uint32_t)(int32_t)(int16_t)ref_load(s, address, 2); break;
+                    case 2:  result = ref_load(s, address, 4); break;
+                    case 4:  result = ref_load(s, address, 1); break;
+                    default: result = ref_load(s, address, 2); break;
+                }
+                break;
+            }
+            case 0x23:
+                ref_store(s, a + (uint32_t)imm_s, 1u << funct3, b);
+                writes = 0;
+                break;
+            case 0x13: {
+                uint32_t u = (uint32_t)imm_i, shamt = u & 31;
+                switch (funct3) {
+                    case 0:  result = a + u; break;
+                    case 1:  result = a << shamt; break;
+                    case 2:  result = (int32_t)a < imm_i; break;
+                    case 3:  result = a < u; break;
+                    case 4:  result = a ^ u; break;
+                    case 5:  result = (funct7 & 0x20) ? (uint32_t)((int32_t)a >> shamt) : a >> shamt; break;
+                    case 6:  result = a | u; break;
+                    default: result = a & u; break;
+                }
+                break;
+            }
+            case 0x33:
+                if (funct7 == 0x01) {
+                    int64_t sa = (int32_t)a, sb = (int32_t)b;
+                    switch (funct3) {
+                        case 0: result = (uint32_t)(sa * sb); break;
+                        case 1: result = (uint32_t)((uint64_t)(sa * sb) >> 32); break;
+                        case 2: result = (uint32_t)((uint64_t)(sa * (int64_t)b) >> 32); break;
+                        case 3: result = (uint32_t)(((uint64_t)a * b) >> 32); break;
+                        case 4: result = b == 0 ? UINT32_MAX : (uint32_t)(sb == -1 ? -sa : sa / sb); break;
+                        case 5: result = b == 0 ? UINT32_MAX : a / b; break;
+                        case 6: result = b == 0 ? a : (uint32_t)(sb == -1 ? 0 : sa % sb); break;
+                        default: result = b == 0 ? a : a % b; break;
+                    }
+                    break;
+                }
+                switch (funct3) {
+                    case 0:  result = funct7 & 0x20 ? a - b : a + b; break;
+                    case 1:  result = a << (b & 31); break;
+                    case 2:  result = (int32_t)a < (int32_t)b; break;
+                    case 3:  result = a < b; break;
+                    case 4:  result = a ^ b; break;
+                    case 5:  result = funct7 & 0x20 ? (uint32_t)((int32_t)a >> (b & 31)) : a >> (b & 31); break;
+                    case 6:  result = a | b; break;
+                    default: result = a & b; break;
+                }
+                break;
+            case 0x2F: {
+                uint32_t funct5 = funct7 >> 2, old = ref_load(s, a, 4), value;
+                if (funct5 == 0x02) {                           // lr.w
+                    s->reserved = 1;
+                    s->reservation = a;
+                    s->reserved_value = old;
+                    result = old;
+                    break;
+                }
+                if (funct5 == 0x03) {                           // sc.w
+                    result = !(s->reserved && s->reservation == a && old == s->reserved_value);
+                    if (result == 0) ref_store(s, a, 4, b);
+                    s->reserved = 0;
+                    break;
+                }
+                switch (funct5) {
+                    case 0x01: value = b; break;
+                    case 0x00: value = old + b; break;
+                    case 0x04: value = old ^ b; break;
+                    case 0x0C: value = old & b; break;
+                    case 0x08: value = old | b; break;
+                    case 0x10: value = (int32_t)old < (int32_t)b ? old : b; break;
+                    case 0x14: value = (int32_t)old > (int32_t)b ? old : b; break;
+                    case 0x18: value = old < b ? old : b; break;
+                    default:   value = old > b ? old : b; break;
+                }
+                ref_store(s, a, 4, value);
+                result = old;
+                break;
+            }
+            case 0x0F:                          // fence, fence.i
+            case 0x73:                          // ebreak (the only SYSTEM word generated)
+            default:
+                writes = 0;
+                break;
+        }
+        if (writes && rd != 0) s->x[rd] = result;
+        s->pc = next;
+        s->cycles++;
+    }
+}
+
+static uint64_t hash_result(const fuzz_result *r) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < 32; i++) h = (h ^ (uint32_t)r->rf[i]) * 0x100000001b3ull;
+    h = (h ^ r->pc) * 0x100000001b3ull;
+    h = (h ^ r->cycles) * 0x100000001b3ull;
+    for (uint32_t i = 0; i < FUZZ_WINDOW; i += 8) {
+        uint64_t w;
+        memcpy(&w, &r->window[i], 8);
+        h = (h ^ w) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static void run_reference(const fuzz_case *c, fuzz_result *r) {
+    ref_state s = { .window = r->window };
+    for (int i = 0; i < 32; i++) s.x[i] = (uint32_t)c->rf[i];
+    memcpy(r->window, c->window, FUZZ_WINDOW);
+    ref_run(&s, c->code, c->length);
+    for (int i = 0; i < 32; i++) r->rf[i] = (int32_t)s.x[i];
+    r->pc = s.pc;
+    r->cycles = s.cycles;
+    r->hash = hash_result(r);
+}
+
+// Run c on one of the simulator's engines in cpu
+static void run_engine(cpu_context *cpu, const fuzz_case *c, int engine, fuzz_result *r) {
+    program_segment segment = { 0, 4 * (uint32_t)c->length, (const uint8_t *)c->code };
+    program_image image = { &segment, 1, 0, 4 * (uint32_t)c->length, 0, 0, 4 * (uint32_t)c->length, NULL, 0, NULL };
+    load_program(cpu, &image);
+    cpu_reset(cpu);
+    memcpy(cpu->rf, c->rf, sizeof(cpu->rf));
+    mem_write(&cpu->mem, FUZZ_WINDOW_BASE, c->window, FUZZ_WINDOW);
+    cpu->max_cycles = c->length + 1;    // Forward-only code never gets there (ref_run() stops at the same point)
+
+    switch (engine) {
+        case 0:  run_predecoded(cpu, UINT64_MAX); break;
+        case 1:  run_staged(cpu, UINT64_MAX); break;
+        default: run_jit(cpu); break;
+    }
+
+    memcpy(r->rf, cpu->rf, sizeof(r->rf));
+    r->pc = cpu->pc;
+    r->cycles = cpu->total_clock_cycles;
+    for (uint32_t offset = 0; offset < FUZZ_WINDOW; offset += PAGE_SIZE / 2) {
+        const uint8_t *page = mem_page(&cpu->mem, FUZZ_WINDOW_BASE + offset, 0);
+        uint32_t in_page = (FUZZ_WINDOW_BASE + offset) & (PAGE_SIZE - 1);
+        if (page != NULL) memcpy(&r->window[offset], page + in_page, PAGE_SIZE / 2);
+        else memset(&r->window[offset], 0, PAGE_SIZE / 2);
+    }
+    cpu->image = NULL;                  // image lives on this stack frame
+    r->hash = hash_result(r);
+}
+
+// Index of the first engine whose result differs from the reference (-1: none)
+static int check_case(const fuzzer *f, cpu_context *cpu, const fuzz_case *c, fuzz_result *ref, fuzz_result *got) {
+    run_reference(c, ref);
+    for (int e = 0; e < f->engines; e++) {
+        run_engine(cpu, c, e, got);
+        if (got->hash != ref->hash) return e;
+    }
+    return -1;
+}
+
+// Shrink a failing case while it still fails: shorter program, instruction
+// groups deleted, cleared registers and data window
+static void minimise(const fuzzer *f, cpu_context *cpu, fuzz_case *c) {
+    fuzz_result *ref = malloc(sizeof(*ref)), *got = malloc(sizeof(*got));
+    fuzz_case *trial = malloc(sizeof(*trial));
+    if (ref == NULL || got == NULL || trial == NULL) {
+        perror("run_fuzz");
+        exit(EXIT_FAILURE);
+    }
+#define STILL_FAILS() (check_case(f, cpu, trial, ref, got) >= 0)
+
+    for (int length = 1; length < c->length; length++) {
+        *trial = *c;
+        trial->length = length;
+        if (trial->group[length] == 0) continue;    // Would split an auipc/jalr pair
+        if (STILL_FAILS()) {
+            *c = *trial;
+            break;
+        }
+    }
+    // Deleting an instruction keeps every jump forward (its target may move past the end, which halts)
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (int i = c->length - 1; i >= 0; i--) {
+            if (c->group[i] == 0 || c->length == c->group[i]) continue;
+            *trial = *c;
+            int n = c->group[i];
+            memmove(&trial->code[i], &c->code[i + n], (size_t)(c->length - i - n) * sizeof(c->code[0]));
+            memmove(&trial->group[i], &c->group[i + n], (size_t)(c->length - i - n));
+            trial->length -= n;
+            if (STILL_FAILS()) {
+                *c = *trial;
+                changed = 1;
+            }
+        }
+    }
+    for (int r = 1; r < 32; r++) {
+        if (r == 3 || c->rf[r] == 0) continue;
+        *trial = *c;
+        trial->rf[r] = 0;
+        if (STILL_FAILS()) *c = *trial;
+    }
+    *trial = *c;
+    memset(trial->window, 0, FUZZ_WINDOW);
+    if (STILL_FAILS()) *c = *trial;
+#undef STILL_FAILS
+    free(trial);
+    free(got);
+    free(ref);
+}
+
+static void print_case_state(const char *name, const fuzz_result *r, const fuzz_result *ref) {
+    printf("  %-12s pc=0x%x cycles=%" PRIu64, name, r->pc, r->cycles);
+    for (int i = 1; i < 32; i++) {
+        if (ref == NULL ? r->rf[i] != 0 : r->rf[i] != ref->rf[i]) printf(" x%d=0x%x", i, (uint32_t)r->rf[i]);
+    }
+    printf("\n");
+}
+
+// Print a minimised failing case and how the engines disagree on it (for the
+// engines, only the registers that differ from the reference)
+static void report_failure(const fuzzer *f, uint64_t index, const fuzz_case *c) {
+    cpu_context *cpu = cpu_create();
+    cpu->trace_level = TRACE_NONE;
+    fuzz_result *ref = malloc(sizeof(*ref)), *got = malloc(sizeof(*got));
+    if (ref == NULL || got == NULL) {
+        perror("run_fuzz");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Mismatch in case %" PRIu64 " (seed %" PRIu64 "), minimised to %d instructions:\n", index, f->seed, c->length);
+    for (int i = 0; i < c->length; i++) {
+        char text[80];
+        disassemble(c->code[i], 4 * (uint32_t)i, text, sizeof(text));
+        printf("  0x%04x: %08x  %s\n", 4 * i, c->code[i], text);
+    }
+    printf("Initial registers:");
+    for (int i = 1; i < 32; i++) {
+        if (c->rf[i] != 0) printf(" x%d=0x%x", i, (uint32_t)c->rf[i]);
+    }
+    printf("\n");
+    int window_used = 0;
+    for (uint32_t i = 0; i < FUZZ_WINDOW; i++) window_used |= c->window[i];
+    printf("Initial data window [0x%x, 0x%x): %s\n", FUZZ_WINDOW_BASE, FUZZ_WINDOW_BASE + FUZZ_WINDOW,
+           window_used ? "random" : "zero");
+
+    run_reference(c, ref);
+    print_case_state("reference", ref, NULL);
+    for (int e = 0; e < f->engines; e++) {
+        run_engine(cpu, c, e, got);
+        if (got->hash == ref->hash) continue;
+        print_case_state(engine_names[e], got, ref);
+        for (uint32_t i = 0; i < FUZZ_WINDOW; i += 4) {
+            if (memcmp(&got->window[i], &ref->window[i], 4) == 0) continue;
+            uint32_t want, have;
+            memcpy(&want, &ref->window[i], 4);
+            memcpy(&have, &got->window[i], 4);
+            printf("    mem[0x%x] = 0x%x (reference 0x%x)\n", FUZZ_WINDOW_BASE + i, have, want);
+        }
+    }
+    free(got);
+    free(ref);
+    cpu_destroy(cpu);
+}
+
+static void *fuzz_worker_main(void *arg) {
+    fuzzer *f = arg;
+    cpu_context *cpu = cpu_create();
+    cpu->trace_level = TRACE_NONE;
+    fuzz_case *c = malloc(sizeof(*c));
+    fuzz_result *ref = malloc(sizeof(*ref)), *got = malloc(sizeof(*got));
+    if (c == NULL || ref == NULL || got == NULL) {
+        perror("run_fuzz");
+        exit(EXIT_FAILURE);
+    }
+
+    while (!__atomic_load_n(&f->failed, __ATOMIC_RELAXED)) {
+        uint64_t first = __atomic_fetch_add(&f->next, FUZZ_BLOCK, __ATOMIC_RELAXED);
+        if (first >= f->cases) break;
+        uint64_t last = first + FUZZ_BLOCK < f->cases ? first + FUZZ_BLOCK : f->cases, run = 0, instructions = 0;
+        for (uint64_t i = first; i < last; i++) {
+            generate_case(f, i, c);
+            run++;
+            instructions += (uint64_t)c->length;
+            if (check_case(f, cpu, c, ref, got) < 0) continue;
+
+            minimise(f, cpu, c);
+            pthread_mutex_lock(&f->lock);
+            if (f->failure == NULL || i < f->failed_index) {
+                if (f->failure == NULL) f->failure = malloc(sizeof(*f->failure));
+                if (f->failure != NULL) *f->failure = *c;
+                f->failed_index = i;
+            }
+            pthread_mutex_unlock(&f->lock);
+            __atomic_store_n(&f->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_add_fetch(&f->run, run, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&f->instructions, instructions, __ATOMIC_RELAXED);
+    }
+
+    free(got);
+    free(ref);
+    free(c);
+    cpu_destroy(cpu);
+    return NULL;
+}
+
+static double fuzz_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Parse a --fuzz specification: [cases=N][,length=N][,seed=N] on top of the defaults already in opt (-1 if invalid)
+int parse_fuzz(const char *spec, fuzz_options *opt) {
+    while (*spec != '\0') {
+        size_t len = strcspn(spec, ",");
+        const char *eq = memchr(spec, '=', len);
+        if (eq == NULL) return -1;
+        size_t name_len = (size_t)(eq - spec);
+        char *end;
+        unsigned long long n = strtoull(eq + 1, &end, 0);
+        if (end != spec + len || eq[1] == '-') return -1;
+
+        if (name_len == 5 && strncmp(spec, "cases", 5) == 0) opt->cases = n;
+        else if (name_len == 6 && strncmp(spec, "length", 6) == 0 && n >= 1 && n <= FUZZ_MAX_LENGTH) opt->length = (int)n;
+        else if (name_len == 4 && strncmp(spec, "seed", 4) == 0) opt->seed = n;
+        else return -1;
+        spec += len;
+        if (*spec == ',') spec++;
+    }
+    return 0;
+}
+
+// Run opt->cases random programs on threads workers (0 = one per online CPU),
+// comparing every engine with the reference interpreter (the JIT only when
+// with_jit is set). Returns 0 if they all agreed, 1 after reporting a mismatch.
+int run_fuzz(const fuzz_options *opt, int threads, int with_jit) {
+    fuzzer f = { .cases = opt->cases, .seed = opt->seed, .length = opt->length };
+    f.engines = with_jit ? FUZZ_ENGINES : FUZZ_ENGINES - 1;
+    decode_init();
+    f.desc_count = 1;
+    while (instr_descs[f.desc_count].name != NULL) f.desc_count++;
+    pthread_mutex_init(&f.lock, NULL);
+    if (threads <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (int)online : 1;
+    }
+
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    if (tids == NULL) {
+        perror("run_fuzz");
+        exit(EXIT_FAILURE);
+    }
+    double start = fuzz_seconds();
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, fuzz_worker_main, &f) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+    double elapsed = fuzz_seconds() - start;
+
+    if (f.failure != NULL) report_failure(&f, f.failed_index, f.failure);
+    printf("Fuzz: %" PRIu64 " cases (%" PRIu64 " instructions) on %d thread%s in %.3f s (%.0f cases/s)%s\n",
+           f.run, f.instructions, threads, threads == 1 ? "" : "s", elapsed, elapsed > 0 ? f.run / elapsed : 0.0,
+           f.failure != NULL ? "" : ", no mismatches");
+
+    int result = f.failure != NULL;
+    free(f.failure);
+    free(tids);
+    pthread_mutex_destroy(&f.lock);
+    return result;
+}
@@ -0,0 +1,155 @@
+// Multi-hart simulation: one host thread per hart, all sharing one guest memory.
+//
+// Hart 0 is the context the program was loaded into. hart_attach() turns a
+// fresh context into another hart of the same program: it shares hart 0's
+// pages (mem_share()) and syscall file table (syscall_share()) and gets its
+// own registers, pc, TLBs and copy of the predecoded program. Every hart
+// starts at the same pc with hart 0's registers, except that tp (x4) holds the hart id and, for programs the
+// loader gives a stack, sp is HART_STACK_SIZE lower per hart.
+//
+// Each hart runs under run_predecoded() on its own thread. With a quantum,
+// the harts run quantum cycles at a time and wait for each other at a barrier
+// between quanta, so no hart gets more than one quantum ahead of another. A
+// hart that halts, exits or hits the cycle limit leaves the barrier. Guest
+// synchronisation goes through the RV32A atomics (mem_atomic()), which use
+// host atomic operations on the shared pages.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "riscv_cpu.h"
+
+// Barrier between quanta that harts can leave when they stop
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;                    // Harts still taking part
+    int waiting;                    // Harts waiting for the rest of this quantum
+    uint64_t generation;            // Quanta completed
+} hart_barrier;
+
+typedef struct {
+    cpu_context *cpu;
+    hart_barrier *barrier;
+    uint64_t quantum;               // Cycles per quantum (0: run freely)
+    int status;                     // RUN_* once the hart stops
+} hart_thread;
+
+// Release the waiting harts if every running hart has arrived (lock held)
+static void barrier_release(hart_barrier *b) {
+    if (b->waiting > 0 && b->waiting == b->running) {
+        b->waiting = 0;
+        b->generation++;
+        pthread_cond_broadcast(&b->cond);
+    }
+}
+
+static void barrier_wait(hart_barrier *b) {
+    pthread_mutex_lock(&b->lock);
+    uint64_t generation = b->generation;
+    b->waiting++;
+    barrier_release(b);
+    while (b->generation == generation) pthread_cond_wait(&b->cond, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void barrier_leave(hart_barrier *b) {
+    pthread_mutex_lock(&b->lock);
+    b->running--;
+    barrier_release(b);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void *hart_main(void *arg) {
+    hart_thread *t = arg;
+    cpu_context *cpu = t->cpu;
+    if (t->quantum == 0) {
+        t->status = run_predecoded(cpu, UINT64_MAX);
+        return NULL;
+    }
+    uint64_t boundary = cpu->total_clock_cycles;
+    for (;;) {
+        boundary = boundary + t->quantum > boundary ? boundary + t->quantum : UINT64_MAX;
+        t->status = run_predecoded(cpu, boundary);
+        if (t->status != RUN_PAUSED) break;
+        barrier_wait(t->barrier);
+    }
+    barrier_leave(t->barrier);
+    return NULL;
+}
+
+// Make hart another hart (number id) of the program loaded in boot, sharing its memory
+void hart_attach(cpu_context *hart, cpu_context *boot, int id) {
+    int count = boot->instr_count;
+    uint32_t *instr_mem = realloc(hart->instr_mem, (count + 1) * sizeof(*instr_mem));
+    decoded_instr *d_prog = realloc(hart->d_prog, (count + 1) * sizeof(*d_prog));
+    if (instr_mem == NULL || d_prog == NULL) {
+        perror("hart_attach");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(instr_mem, boot->instr_mem, count * sizeof(*instr_mem));
+    memcpy(d_prog, boot->d_prog, (count + 1) * sizeof(*d_prog));
+    hart->instr_mem = instr_mem;
+    hart->d_prog = d_prog;
+    hart->d_prog_threaded = boot->d_prog_threaded;
+    hart->instr_count = count;
+    hart->uses_syscalls = boot->uses_syscalls;
+    hart->uses_counters = boot->uses_counters;
+    hart->image = boot->image;
+    mem_share(&hart->mem, &boot->mem);
+    syscall_share(hart, boot);
+
+    memcpy(hart->rf, boot->rf, sizeof(hart->rf));
+    hart->rf[4] = id;
+    if (boot->image->stack_top != 0) hart->rf[2] = (int)(boot->image->stack_top - (uint32_t)id * HART_STACK_SIZE);
+    hart->pc = boot->pc;
+    hart->total_clock_cycles = boot->total_clock_cycles;
+    hart->trace_level = boot->trace_level;
+    hart->max_cycles = boot->max_cycles;
+    hart->no_fusion = boot->no_fusion;
+}
+
+// Run count harts (harts[0] and those attached to it) on one thread each until
+// every one has stopped, keeping them within quantum cycles of each other
+// (0: no synchronisation). status[i] receives hart i's RUN_HALTED or RUN_LIMIT.
+// Returns -1 if the threads could not be started.
+int run_harts(cpu_context **harts, int *status, int count, uint64_t quantum) {
+    hart_barrier barrier = { .running = count };
+    hart_thread *threads = calloc(count, sizeof(*threads));
+    pthread_t *tids = calloc(count, sizeof(*tids));
+    if (threads == NULL || tids == NULL) {
+        perror("run_harts");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&barrier.lock, NULL);
+    pthread_cond_init(&barrier.cond, NULL);
+
+    int started = 0, result = 0;
+    for (; started < count; started++) {
+        threads[started] = (hart_thread){ harts[started], &barrier, quantum, RUN_HALTED };
+        if (pthread_create(&tids[started], NULL, hart_main, &threads[started]) != 0) {
+            perror("pthread_create");
+            result = -1;
+            break;
+        }
+    }
+    if (started < count) {
+        // Harts that never started must not hold up the others' barriers
+        pthread_mutex_lock(&barrier.lock);
+        barrier.running -= count - started;
+        barrier_release(&barrier);
+        pthread_mutex_unlock(&barrier.lock);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+        status[i] = threads[i].status;
+    }
+
+    pthread_cond_destroy(&barrier.cond);
+    pthread_mutex_destroy(&barrier.lock);
+    free(tids);
+    free(threads);
+    return result;
+}
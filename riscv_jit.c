@@ -0,0 +1,588 @@
+// Basic-block dynamic binary translator from RV32IMA to x86-64.
+//
+// Blocks run from a start PC up to and including the first branch, jal or jalr (or
+// JIT_MAX_BLOCK instructions). Guest registers stay in rf[] and data in guest
+// memory, so print_state() sees the same state as with the interpreter. Static
+// exits are linked lazily: the first time one is taken, its exit stub is patched
+// into a direct jump to the target block. jalr looks its target up in block_entry[].
+// Loads and stores probe the software TLBs inline; division and the atomics call out to C. A store that rewrites the program leaves
+// the block, and the dispatcher discards every translation before going on.
+// A block also ends before an ecall or a CSR instruction, which the dispatcher
+// single-steps through the interpreter so the syscall or counter sees the
+// architectural state. Programs that read the hpm counters run on the interpreter.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riscv_cpu.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define JIT_CACHE_SIZE (1 << 20)    // Bytes of executable code cache per CPU
+#define JIT_MAX_BLOCK 64            // Instructions per block before falling through
+#define JIT_MAX_INSTR_BYTES 160     // Upper bound on code emitted for one guest instruction
+
+// State shared between the dispatcher and generated code (r15 points at it)
+typedef struct {
+    int *rf;                // rbx while in generated code
+    guest_mem *mem;         // r12: the TLBs are at [r12 + 16 * slot]
+    uint64_t cycles;        // r13
+    uint64_t limit;         // r14: a block only runs if it cannot cross the cycle limit
+    void **table;           // Block entry per instruction index, for jalr
+    uint8_t *link_site;     // Exit stub to patch once the exit PC is translated (NULL if none)
+    uint32_t exit_pc;
+    cpu_context *cpu;       // First argument to the out-of-line helpers
+} jit_state;
+
+// Displacements from r15 used in the generated code
+_Static_assert(offsetof(jit_state, rf) == 0x00, "jit_state layout");
+_Static_assert(offsetof(jit_state, mem) == 0x08, "jit_state layout");
+_Static_assert(offsetof(jit_state, cycles) == 0x10, "jit_state layout");
+_Static_assert(offsetof(jit_state, limit) == 0x18, "jit_state layout");
+_Static_assert(offsetof(jit_state, table) == 0x20, "jit_state layout");
+_Static_assert(offsetof(jit_state, link_site) == 0x28, "jit_state layout");
+_Static_assert(offsetof(jit_state, exit_pc) == 0x30, "jit_state layout");
+_Static_assert(offsetof(jit_state, cpu) == 0x38, "jit_state layout");
+
+typedef uint32_t (*jit_entry_fn)(void *code, jit_state *st);
+
+// Code cache owned by one cpu_context (cpu->jit)
+struct jit_cache {
+    cpu_context *cpu;                   // Program being translated
+    uint8_t *base;                      // Start of the code cache
+    uint8_t *blocks;                    // First byte after the trampolines
+    uint8_t *ptr;                       // Next free byte
+    uint8_t *exit_chain;                // Exit with eax = PC, rcx = stub to link
+    uint8_t *exit_nolink;               // Exit with eax = PC, nothing to link
+    jit_entry_fn enter;
+    void **block_entry;                 // Translated block per instruction index
+    uint8_t *block_len;                 // Guest instructions in that block
+    int block_capacity;                 // Entries allocated in block_entry/block_len
+    int flushes;                        // Bumped whenever the cache is discarded
+    uint32_t code_version;              // cpu->code_version the blocks were translated from
+};
+typedef struct jit_cache jit_cache;
+
+// Code emission
+static void emit8(jit_cache *j, uint8_t b) { *j->ptr++ = b; }
+static void emit32(jit_cache *j, uint32_t v) { memcpy(j->ptr, &v, 4); j->ptr += 4; }
+static void emit64(jit_cache *j, uint64_t v) { memcpy(j->ptr, &v, 8); j->ptr += 8; }
+static void emit_bytes(jit_cache *j, const uint8_t *bytes, size_t n) { memcpy(j->ptr, bytes, n); j->ptr += n; }
+static void patch_rel8(uint8_t *at, const uint8_t *target) { *at = (uint8_t)(target - (at + 1)); }
+static void patch_rel32(uint8_t *at, const uint8_t *target) {
+    int32_t rel = (int32_t)(target - (at + 4));
+    memcpy(at, &rel, 4);
+}
+
+// opcode [rbx + 4*reg] forms: mov eax/ecx/edx/esi, add, sub, and, or, xor, cmp (reg field selects the register)
+static void emit_guest_reg_op(jit_cache *j, uint8_t opcode, uint8_t modrm, int reg) {
+    emit8(j, opcode);
+    emit8(j, modrm);
+    emit8(j, (uint8_t)(4 * reg));
+}
+#define EMIT_LOAD_EAX(reg)  emit_guest_reg_op(j, 0x8B, 0x43, reg)  // mov eax, [rbx + 4*reg]
+#define EMIT_LOAD_EDX(reg)  emit_guest_reg_op(j, 0x8B, 0x53, reg)  // mov edx, [rbx + 4*reg]
+#define EMIT_LOAD_ECX(reg)  emit_guest_reg_op(j, 0x8B, 0x4B, reg)  // mov ecx, [rbx + 4*reg]
+#define EMIT_LOAD_ESI(reg)  emit_guest_reg_op(j, 0x8B, 0x73, reg)  // mov esi, [rbx + 4*reg]
+#define EMIT_STORE_EAX(reg) emit_guest_reg_op(j, 0x89, 0x43, reg)  // mov [rbx + 4*reg], eax
+
+// Call a helper with rdi = cpu; any further arguments are already in esi/edx
+static void emit_call(jit_cache *j, const void *fn) {
+    emit8(j, 0x49); emit8(j, 0x8B); emit8(j, 0x7F); emit8(j, offsetof(jit_state, cpu)); // mov rdi, [r15 + cpu]
+    emit8(j, 0x48); emit8(j, 0xB8); emit64(j, (uint64_t)(uintptr_t)fn);  // mov rax, fn
+    emit8(j, 0xFF); emit8(j, 0xD0);                                      // call rax
+}
+
+static void emit_add_cycles(jit_cache *j, int n) {
+    emit8(j, 0x49); emit8(j, 0x83); emit8(j, 0xC5); emit8(j, (uint8_t)n);  // add r13, n
+}
+
+// Leave generated code with eax = target; link later if the target can have a block
+static void emit_exit(jit_cache *j, uint32_t target) {
+    uint32_t index = code_index(j->cpu, target);
+    if ((target & 3) == 0 && index < (uint32_t)j->cpu->instr_count && j->block_entry[index] != NULL) {
+        emit8(j, 0xE9);                 // jmp block (already translated)
+        j->ptr += 4;
+        patch_rel32(j->ptr - 4, j->block_entry[index]);
+        return;
+    }
+    emit8(j, 0xB8); emit32(j, target);  // mov eax, target
+    if ((target & 3) == 0 && index < (uint32_t)j->cpu->instr_count) {
+        // lea rcx, [rip - 12] (the start of this stub), patched into "jmp block" on first use
+        static const uint8_t lea_stub[] = { 0x48, 0x8D, 0x0D, 0xF4, 0xFF, 0xFF, 0xFF };
+        emit_bytes(j, lea_stub, sizeof(lea_stub));
+        emit8(j, 0xE9); j->ptr += 4; patch_rel32(j->ptr - 4, j->exit_chain);
+    } else {
+        emit8(j, 0xE9); j->ptr += 4; patch_rel32(j->ptr - 4, j->exit_nolink);
+    }
+}
+
+// Out-of-line paths shared with the interpreter's behaviour
+static int jit_load_slow(cpu_context *cpu, uint32_t address) {
+    return mem_load(cpu, address);
+}
+
+// Returns non-zero if the store rewrote an instruction
+static int jit_store_slow(cpu_context *cpu, uint32_t address, int value) {
+    return mem_store(cpu, address, value);
+}
+
+// div, divu, rem and remu, with the RISC-V results for division by zero and overflow
+static uint32_t jit_divide(cpu_context *cpu, uint32_t a, uint32_t b, uint32_t alu) {
+    (void)cpu;
+    return alu_compute((int)alu, a, b);
+}
+
+// lr.w, sc.w and the AMOs (packed: op | rd << 8 | alu << 16); returns non-zero if the store rewrote an instruction
+static int jit_atomic(cpu_context *cpu, uint32_t address, uint32_t value, uint32_t packed) {
+    int result;
+    int rewrote = mem_atomic(cpu, packed & 0xFF, (int)(packed >> 16), address, value, &result);
+    uint32_t rd = (packed >> 8) & 0x1F;
+    if (rd != 0) cpu->rf[rd] = result;
+    return rewrote;
+}
+
+static void jit_unknown_opcode(cpu_context *cpu, uint32_t opcode) {
+    if (cpu->trace_level >= TRACE_FINAL) printf("Unknown opcode: 0x%x\n", opcode);
+}
+
+// eax = rs1 + imm, then look the page up in the TLB at tlb_offset within guest_mem.
+// Branches to slow on a miss or an address with any align_mask bit set; otherwise rcx = host page,
+// eax = page offset.
+static void emit_tlb_lookup(jit_cache *j, const decoded_instr *d, uint32_t tlb_offset, uint8_t align_mask,
+                            uint8_t **jne_slow, uint8_t **jnz_slow) {
+    static const uint8_t slot[] = {
+        0x89, 0xC1,                                             // mov ecx, eax
+        0xC1, 0xE9, PAGE_SHIFT,                                 // shr ecx, PAGE_SHIFT (vpn)
+        0x89, 0xCE,                                             // mov esi, ecx
+        0x83, 0xE6, TLB_ENTRIES - 1,                            // and esi, TLB_ENTRIES - 1
+        0xC1, 0xE6, 0x04,                                       // shl esi, 4 (sizeof(tlb_entry))
+    };
+    EMIT_LOAD_EAX(d->rs1);
+    if (d->imm != 0) { emit8(j, 0x05); emit32(j, (uint32_t)d->imm); }  // add eax, imm
+    emit_bytes(j, slot, sizeof(slot));
+    emit8(j, 0x41); emit8(j, 0x3B); emit8(j, 0x8C); emit8(j, 0x34);   // cmp ecx, [r12 + rsi + vpn]
+    emit32(j, tlb_offset + offsetof(tlb_entry, vpn));
+    emit8(j, 0x75); *jne_slow = j->ptr++;                              // jne slow
+    emit8(j, 0xA8); emit8(j, align_mask);                              // test al, align_mask
+    emit8(j, 0x75); *jnz_slow = j->ptr++;                              // jnz slow
+    emit8(j, 0x49); emit8(j, 0x8B); emit8(j, 0x8C); emit8(j, 0x34);   // mov rcx, [r12 + rsi + page]
+    emit32(j, tlb_offset + offsetof(tlb_entry, page));
+    emit8(j, 0x25); emit32(j, PAGE_SIZE - 1);                          // and eax, PAGE_SIZE - 1
+}
+
+_Static_assert(sizeof(tlb_entry) == 16, "emit_tlb_lookup scales the slot by 16");
+
+// setcc al; movzx eax, al (cc: 0x9C for setl, 0x92 for setb)
+static void emit_set_eax(jit_cache *j, uint8_t cc) {
+    emit8(j, 0x0F); emit8(j, cc); emit8(j, 0xC0);
+    emit8(j, 0x0F); emit8(j, 0xB6); emit8(j, 0xC0);
+}
+
+// Translate one non-terminating instruction; index is its position in the block
+static void emit_instr(jit_cache *j, const decoded_instr *d, uint32_t at_pc, int index) {
+    uint8_t *jne_slow, *jnz_slow, *jmp_done;
+
+    switch (d->op) {
+        case OP_ADD: case OP_SUB: case OP_AND: case OP_OR: case OP_XOR: {
+            static const uint8_t alu_opcode[] = {
+                [OP_ADD] = 0x03, [OP_SUB] = 0x2B, [OP_AND] = 0x23, [OP_OR] = 0x0B, [OP_XOR] = 0x33,
+            };
+            if (d->rd == 0) break;
+            EMIT_LOAD_EAX(d->rs1);
+            emit_guest_reg_op(j, alu_opcode[d->op], 0x43, d->rs2);           // op eax, [rbx + 4*rs2]
+            EMIT_STORE_EAX(d->rd);
+            break;
+        }
+        case OP_SLL: case OP_SRL: case OP_SRA: {
+            static const uint8_t shift_modrm[] = { [OP_SLL] = 0xE0, [OP_SRL] = 0xE8, [OP_SRA] = 0xF8 };
+            if (d->rd == 0) break;
+            EMIT_LOAD_EAX(d->rs1);
+            EMIT_LOAD_ECX(d->rs2);
+            emit8(j, 0xD3); emit8(j, shift_modrm[d->op]);                    // shl/shr/sar eax, cl (x86 masks cl to 5 bits too)
+            EMIT_STORE_EAX(d->rd);
+            break;
+        }
+        case OP_SLT: case OP_SLTU:
+            if (d->rd == 0) break;
+            EMIT_LOAD_EAX(d->rs1);
+            emit_guest_reg_op(j, 0x3B, 0x43, d->rs2);                        // cmp eax, [rbx + 4*rs2]
+            emit_set_eax(j, d->op == OP_SLT ? 0x9C : 0x92);
+            EMIT_STORE_EAX(d->rd);
+            break;
+        case OP_MUL:
+            if (d->rd == 0) break;
+            EMIT_LOAD_EAX(d->rs1);
+            emit8(j, 0x0F); emit_guest_reg_op(j, 0xAF, 0x43, d->rs2);        // imul eax, [rbx + 4*rs2]
+            EMIT_STORE_EAX(d->rd);
+            break;
+        case OP_MULH: case OP_MULHSU: case OP_MULHU:
+            // The high word of a 64-bit product of the (sign- or zero-) extended operands
+            if (d->rd == 0) break;
+            if (d->op == OP_MULHU) EMIT_LOAD_EAX(d->rs1);
+            else { emit8(j, 0x48); emit_guest_reg_op(j, 0x63, 0x43, d->rs1); } // movsxd rax, [rbx + 4*rs1]
+            if (d->op == OP_MULH) { emit8(j, 0x48); emit_guest_reg_op(j, 0x63, 0x53, d->rs2); } // movsxd rdx, [rbx + 4*rs2]
+            else EMIT_LOAD_EDX(d->rs2);
+            emit8(j, 0x48); emit8(j, 0x0F); emit8(j, 0xAF); emit8(j, 0xC2);  // imul rax, rdx
+            emit8(j, 0x48); emit8(j, 0xC1); emit8(j, 0xE8); emit8(j, 32);    // shr rax, 32
+            EMIT_STORE_EAX(d->rd);
+            break;
+        case OP_DIV: case OP_DIVU: case OP_REM: case OP_REMU:
+            if (d->rd == 0) break;
+            EMIT_LOAD_ESI(d->rs1);
+            EMIT_LOAD_EDX(d->rs2);
+            emit8(j, 0xB9); emit32(j, d->alu_ctrl);                          // mov ecx, alu
+            emit_call(j, (const void *)jit_divide);
+            EMIT_STORE_EAX(d->rd);
+            break;
+        case OP_ADDI: case OP_ANDI: case OP_ORI: case OP_XORI: {
+            static const uint8_t alu_imm_opcode[] = { [OP_ADDI] = 0x05, [OP_ANDI] = 0x25, [OP_ORI] = 0x0D, [OP_XORI] = 0x35 };
+            if (d->rd == 0) break;
+            EMIT_LOAD_EAX(d->rs1);
+            emit8(j, alu_imm_opcode[d->op]); emit32(j, (uint32_t)d->imm);    // op eax, imm
+            EMIT_STORE_EAX(d->rd);
+            break;
+        }
+        case OP_SLLI: case OP_SRLI: case OP_SRAI: {
+            static const uint8_t shift_modrm[] = { [OP_SLLI] = 0xE0, [OP_SRLI] = 0xE8, [OP_SRAI] = 0xF8 };
+            if (d->rd == 0) break;
+            EMIT_LOAD_EAX(d->rs1);
+            emit8(j, 0xC1); emit8(j, shift_modrm[d->op]); emit8(j, (uint8_t)(d->imm & 31)); // shl/shr/sar eax, imm
+            EMIT_STORE_EAX(d->rd);
+            break;
+        }
+        case OP_SLTI: case OP_SLTIU:
+            if (d->rd == 0) break;
+            EMIT_LOAD_EAX(d->rs1);
+            emit8(j, 0x3D); emit32(j, (uint32_t)d->imm);                     // cmp eax, imm
+            emit_set_eax(j, d->op == OP_SLTI ? 0x9C : 0x92);
+            EMIT_STORE_EAX(d->rd);
+            break;
+        case OP_LUI: case OP_AUIPC:
+            if (d->rd == 0) break;
+            emit8(j, 0xC7); emit8(j, 0x43); emit8(j, (uint8_t)(4 * d->rd));  // mov dword [rbx + 4*rd], value
+            emit32(j, (uint32_t)d->imm + (d->op == OP_AUIPC ? at_pc : 0));
+            break;
+        case OP_LW: case OP_LB: case OP_LH: case OP_LBU: case OP_LHU: {
+            // movsx/movzx eax, byte/word [rcx + rax]
+            static const uint8_t narrow_load[] = { [OP_LB] = 0xBE, [OP_LH] = 0xBF, [OP_LBU] = 0xB6, [OP_LHU] = 0xB7 };
+            uint32_t funct3 = (d->raw >> 12) & 7;
+            emit_tlb_lookup(j, d, offsetof(guest_mem, read_tlb), d->op == OP_LW ? 3 : funct3 & 1, &jne_slow, &jnz_slow);
+            if (d->op == OP_LW) { emit8(j, 0x8B); }                          // mov eax, [rcx + rax]
+            else { emit8(j, 0x0F); emit8(j, narrow_load[d->op]); }
+            emit8(j, 0x04); emit8(j, 0x01);
+            emit8(j, 0xEB); jmp_done = j->ptr++;                             // jmp done
+            patch_rel8(jne_slow, j->ptr);
+            patch_rel8(jnz_slow, j->ptr);
+            emit8(j, 0x89); emit8(j, 0xC6);                                  // mov esi, eax
+            if (d->op == OP_LW) {
+                emit_call(j, (const void *)jit_load_slow);
+            } else {
+                emit8(j, 0xBA); emit32(j, funct3);                           // mov edx, funct3
+                emit_call(j, (const void *)mem_load_narrow);
+            }
+            patch_rel8(jmp_done, j->ptr);
+            if (d->rd != 0) EMIT_STORE_EAX(d->rd);
+            break;
+        }
+        case OP_SW: case OP_SB: case OP_SH: {
+            uint32_t funct3 = (d->raw >> 12) & 7;
+            emit_tlb_lookup(j, d, offsetof(guest_mem, write_tlb), d->op == OP_SW ? 3 : funct3, &jne_slow, &jnz_slow);
+            EMIT_LOAD_EDX(d->rs2);
+            if (d->op == OP_SB) emit8(j, 0x88);                              // mov [rcx + rax], dl
+            else if (d->op == OP_SH) { emit8(j, 0x66); emit8(j, 0x89); }     // mov [rcx + rax], dx
+            else emit8(j, 0x89);                                             // mov [rcx + rax], edx
+            emit8(j, 0x14); emit8(j, 0x01);
+            emit8(j, 0xEB); jmp_done = j->ptr++;                             // jmp done
+            patch_rel8(jne_slow, j->ptr);
+            patch_rel8(jnz_slow, j->ptr);
+            EMIT_LOAD_EAX(d->rs1);                                           // The lookup clobbered eax
+            if (d->imm != 0) { emit8(j, 0x05); emit32(j, (uint32_t)d->imm); }
+            emit8(j, 0x89); emit8(j, 0xC6);                                  // mov esi, eax
+            EMIT_LOAD_EDX(d->rs2);
+            if (d->op == OP_SW) {
+                emit_call(j, (const void *)jit_store_slow);
+            } else {
+                emit8(j, 0xB9); emit32(j, funct3);                           // mov ecx, funct3
+                emit_call(j, (const void *)mem_store_narrow);
+            }
+            // The store rewrote code: retire it and leave so the dispatcher retranslates
+            emit8(j, 0x85); emit8(j, 0xC0);                                  // test eax, eax
+            emit8(j, 0x74); uint8_t *jz_done = j->ptr++;                     // jz done
+            emit_add_cycles(j, index + 1);
+            emit8(j, 0xB8); emit32(j, at_pc + 4);                            // mov eax, at_pc + 4
+            emit8(j, 0xE9); j->ptr += 4; patch_rel32(j->ptr - 4, j->exit_nolink);
+            patch_rel8(jz_done, j->ptr);
+            patch_rel8(jmp_done, j->ptr);
+            break;
+        }
+        case OP_LR: case OP_SC: case OP_AMOSWAP: case OP_AMOADD: case OP_AMOXOR: case OP_AMOAND:
+        case OP_AMOOR: case OP_AMOMIN: case OP_AMOMAX: case OP_AMOMINU: case OP_AMOMAXU: {
+            EMIT_LOAD_ESI(d->rs1);
+            EMIT_LOAD_EDX(d->rs2);
+            emit8(j, 0xB9); emit32(j, d->op | (uint32_t)d->rd << 8 | (uint32_t)d->alu_ctrl << 16); // mov ecx, packed
+            emit_call(j, (const void *)jit_atomic);
+            // Leave as a store does if the atomic rewrote code
+            emit8(j, 0x85); emit8(j, 0xC0);                                  // test eax, eax
+            emit8(j, 0x74); uint8_t *jz_done = j->ptr++;                     // jz done
+            emit_add_cycles(j, index + 1);
+            emit8(j, 0xB8); emit32(j, at_pc + 4);                            // mov eax, at_pc + 4
+            emit8(j, 0xE9); j->ptr += 4; patch_rel32(j->ptr - 4, j->exit_nolink);
+            patch_rel8(jz_done, j->ptr);
+            break;
+        }
+        case OP_FENCE:
+        case OP_EBREAK:
+            break;                          // NOPs
+        default: // OP_UNKNOWN
+            emit8(j, 0xBE); emit32(j, d->raw & 0x7F);                        // mov esi, opcode
+            emit_call(j, (const void *)jit_unknown_opcode);
+            break;
+    }
+}
+
+// Translate one block ending in a control-flow terminator
+static void emit_terminator(jit_cache *j, const decoded_instr *d, uint32_t at_pc, int n) {
+    switch (d->op) {
+        case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU: {
+            // jcc to not_taken on the opposite condition: jne, je, jge, jl, jae, jb
+            static const uint8_t not_taken_cc[] = {
+                [OP_BEQ] = 0x85, [OP_BNE] = 0x84, [OP_BLT] = 0x8D, [OP_BGE] = 0x8C, [OP_BLTU] = 0x83, [OP_BGEU] = 0x82,
+            };
+            emit_add_cycles(j, n);                                         // Before cmp: add clobbers flags
+            EMIT_LOAD_EAX(d->rs1);
+            emit_guest_reg_op(j, 0x3B, 0x43, d->rs2);                      // cmp eax, [rbx + 4*rs2]
+            emit8(j, 0x0F); emit8(j, not_taken_cc[d->op]); j->ptr += 4;    // jcc not_taken
+            uint8_t *jcc_not_taken = j->ptr - 4;
+            emit_exit(j, at_pc + (uint32_t)d->imm);
+            patch_rel32(jcc_not_taken, j->ptr);
+            emit_exit(j, at_pc + 4);
+            break;
+        }
+        case OP_JAL:
+            if (d->rd != 0) { emit8(j, 0xC7); emit8(j, 0x43); emit8(j, 4 * d->rd); emit32(j, at_pc + 4); } // mov [rd], link
+            emit_add_cycles(j, n);
+            emit_exit(j, at_pc + (uint32_t)d->imm);
+            break;
+        case OP_JALR: {
+            static const uint8_t lookup[] = {
+                0x49, 0x8B, 0x4F, offsetof(jit_state, table),          // mov rcx, [r15 + table]
+                0x48, 0x8B, 0x0C, 0x51,                                // mov rcx, [rcx + rdx*2]
+                0x48, 0x85, 0xC9,                                      // test rcx, rcx
+            };
+            EMIT_LOAD_EAX(d->rs1);                                     // Target read before the link is written
+            if (d->imm != 0) { emit8(j, 0x05); emit32(j, (uint32_t)d->imm); }
+            emit8(j, 0x83); emit8(j, 0xE0); emit8(j, 0xFE);                // and eax, ~1
+            if (d->rd != 0) { emit8(j, 0xC7); emit8(j, 0x43); emit8(j, 4 * d->rd); emit32(j, at_pc + 4); }
+            emit_add_cycles(j, n);
+            emit8(j, 0x89); emit8(j, 0xC2);                                // mov edx, eax
+            emit8(j, 0x81); emit8(j, 0xEA); emit32(j, j->cpu->mem.code_start); // sub edx, code_start
+            emit8(j, 0x81); emit8(j, 0xFA); emit32(j, (uint32_t)j->cpu->instr_count * 4); // cmp edx, program size
+            emit8(j, 0x0F); emit8(j, 0x83); j->ptr += 4; patch_rel32(j->ptr - 4, j->exit_nolink); // jae
+            emit8(j, 0xA8); emit8(j, 0x03);                                // test al, 3
+            emit8(j, 0x0F); emit8(j, 0x85); j->ptr += 4; patch_rel32(j->ptr - 4, j->exit_nolink); // jnz
+            emit_bytes(j, lookup, sizeof(lookup));
+            emit8(j, 0x0F); emit8(j, 0x84); j->ptr += 4; patch_rel32(j->ptr - 4, j->exit_nolink); // jz
+            emit8(j, 0xFF); emit8(j, 0xE1);                                // jmp rcx
+            break;
+        }
+        default: // Block cut at JIT_MAX_BLOCK or the end of the program
+            emit_add_cycles(j, n);
+            emit_exit(j, at_pc);
+            break;
+    }
+}
+
+// Discard every translated block (all links point into the discarded code)
+static void jit_flush(jit_cache *j) {
+    int count = j->cpu->instr_count;
+    if (count > j->block_capacity) {
+        void **entry = realloc(j->block_entry, count * sizeof(*entry));
+        uint8_t *len = realloc(j->block_len, count * sizeof(*len));
+        if (entry == NULL || len == NULL) {
+            perror("JIT block table");
+            exit(EXIT_FAILURE);
+        }
+        j->block_entry = entry;
+        j->block_len = len;
+        j->block_capacity = count;
+    }
+    if (count > 0) memset(j->block_entry, 0, count * sizeof(*j->block_entry));
+    j->ptr = j->blocks;
+    j->flushes++;
+    j->code_version = j->cpu->code_version;
+}
+
+// Translate the block starting at instruction index start
+static void *jit_translate(jit_cache *j, int start) {
+    if (j->ptr + (JIT_MAX_BLOCK + 2) * JIT_MAX_INSTR_BYTES > j->base + JIT_CACHE_SIZE) {
+        jit_flush(j);
+    }
+
+    uint8_t *entry = j->ptr;
+    uint32_t block_pc = j->cpu->mem.code_start + (uint32_t)start * 4;
+    int n = 0;
+    while (n < JIT_MAX_BLOCK && start + n < j->cpu->instr_count) {
+        uint8_t op = j->cpu->d_prog[start + n].op;
+        if (op == OP_ECALL || op == OP_CSR) break;  // Left to the interpreter (run_jit() never starts a block at one)
+        n++;
+        if (op_is_transfer(op)) break;
+    }
+    j->block_entry[start] = entry;          // Registered first so loops back to the start link directly
+    j->block_len[start] = (uint8_t)n;
+
+    // Entry guard: leave to the interpreter if this block could cross the cycle limit
+    static const uint8_t guard[] = {
+        0x4C, 0x39, 0xF0,                                       // cmp rax, r14
+        0x76, 0x0A,                                             // jbe body
+    };
+    emit8(j, 0x49); emit8(j, 0x8D); emit8(j, 0x45); emit8(j, (uint8_t)n);  // lea rax, [r13 + n]
+    emit_bytes(j, guard, sizeof(guard));
+    emit8(j, 0xB8); emit32(j, block_pc);                                   // mov eax, block_pc
+    emit8(j, 0xE9); j->ptr += 4; patch_rel32(j->ptr - 4, j->exit_nolink);
+
+    for (int i = 0; i < n; i++) {
+        const decoded_instr *d = &j->cpu->d_prog[start + i];
+        uint32_t at_pc = block_pc + 4 * (uint32_t)i;
+        if (i == n - 1 && op_is_transfer(d->op)) {
+            emit_terminator(j, d, at_pc, n);
+            break;
+        }
+        emit_instr(j, d, at_pc, i);
+        if (i == n - 1) {
+            decoded_instr fallthrough = { .op = OP_HALT };
+            emit_terminator(j, &fallthrough, at_pc + 4, n);
+        }
+    }
+
+    return entry;
+}
+
+// Allocate a CPU's code cache and emit the entry/exit trampolines
+static jit_cache *jit_create(cpu_context *cpu) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_JIT
+    flags |= MAP_JIT;
+#endif
+    void *mem = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, flags, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("JIT code cache");
+        return NULL;
+    }
+    jit_cache *j = calloc(1, sizeof(*j));
+    if (j == NULL) {
+        munmap(mem, JIT_CACHE_SIZE);
+        return NULL;
+    }
+    j->cpu = cpu;
+    j->base = j->ptr = mem;
+
+    // enter(code, state): save callee-saved registers, load the pinned ones, jump to code
+    static const uint8_t enter[] = {
+        0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, // push rbx, rbp, r12-r15
+        0x48, 0x83, 0xEC, 0x08,                                     // sub rsp, 8 (16-byte alignment for calls)
+        0x49, 0x89, 0xF7,                                           // mov r15, rsi
+        0x49, 0x8B, 0x1F,                                           // mov rbx, [r15 + rf]
+        0x4D, 0x8B, 0x67, offsetof(jit_state, mem),                 // mov r12, [r15 + mem]
+        0x4D, 0x8B, 0x6F, offsetof(jit_state, cycles),              // mov r13, [r15 + cycles]
+        0x4D, 0x8B, 0x77, offsetof(jit_state, limit),               // mov r14, [r15 + limit]
+        0xFF, 0xE7,                                                 // jmp rdi
+    };
+    static const uint8_t leave_chain[] = {
+        0x49, 0x89, 0x4F, offsetof(jit_state, link_site),           // mov [r15 + link_site], rcx
+        0xEB, 0x08,                                                 // jmp exit_common
+    };
+    static const uint8_t leave_nolink[] = {
+        0x49, 0xC7, 0x47, offsetof(jit_state, link_site), 0, 0, 0, 0, // mov qword [r15 + link_site], 0
+    };
+    static const uint8_t leave_common[] = {
+        0x41, 0x89, 0x47, offsetof(jit_state, exit_pc),             // mov [r15 + exit_pc], eax
+        0x4D, 0x89, 0x6F, offsetof(jit_state, cycles),              // mov [r15 + cycles], r13
+        0x48, 0x83, 0xC4, 0x08,                                     // add rsp, 8
+        0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, // pop r15-r12, rbp, rbx
+        0xC3,                                                       // ret
+    };
+    j->enter = (jit_entry_fn)(uintptr_t)j->ptr;
+    emit_bytes(j, enter, sizeof(enter));
+    j->exit_chain = j->ptr;
+    emit_bytes(j, leave_chain, sizeof(leave_chain));
+    j->exit_nolink = j->ptr;
+    emit_bytes(j, leave_nolink, sizeof(leave_nolink));
+    emit_bytes(j, leave_common, sizeof(leave_common));
+    j->blocks = j->ptr;
+    return j;
+}
+
+void jit_destroy(jit_cache *j) {
+    if (j == NULL) return;
+    munmap(j->base, JIT_CACHE_SIZE);
+    free(j->block_entry);
+    free(j->block_len);
+    free(j);
+}
+
+// Run the program with translated blocks, single-stepping the interpreter where a
+// block cannot be used (unaligned PC, an ecall or CSR instruction, or a block that would cross the cycle limit).
+int run_jit(cpu_context *cpu) {
+    if (cpu->exited) return RUN_HALTED;
+    if (cpu->uses_counters) return run_predecoded(cpu, UINT64_MAX);   // Blocks do not count hpm events
+    if (cpu->jit == NULL && (cpu->jit = jit_create(cpu)) == NULL) {
+        fprintf(stderr, "JIT unavailable; using the interpreter\n");
+        return run_predecoded(cpu, UINT64_MAX);
+    }
+    jit_cache *j = cpu->jit;
+    jit_flush(j);                           // The program may have changed since the last run
+
+    jit_state st = { cpu->rf, &cpu->mem, 0, cycle_limit(cpu), NULL, NULL, 0, cpu };
+    uint8_t *pending_link = NULL;           // Exit stub waiting for the block at pc
+    for (;;) {
+        uint32_t index = code_index(cpu, cpu->pc);
+        if (index >= (uint32_t)cpu->instr_count) {
+            return RUN_HALTED;
+        }
+
+        if (j->code_version != cpu->code_version) {
+            jit_flush(j);                   // A store rewrote the program
+            pending_link = NULL;
+        }
+        if ((cpu->pc & 3) == 0 && cpu->d_prog[index].op != OP_ECALL && cpu->d_prog[index].op != OP_CSR) {
+            int flushes = j->flushes;
+            void *code = j->block_entry[index] ? j->block_entry[index] : jit_translate(j, (int)index);
+            if (j->flushes != flushes) pending_link = NULL;
+            if (pending_link != NULL) {
+                pending_link[0] = 0xE9;                             // jmp block
+                patch_rel32(pending_link + 1, code);
+                pending_link = NULL;
+            }
+            if (cpu->total_clock_cycles + j->block_len[index] <= st.limit) {
+                st.cycles = cpu->total_clock_cycles;
+                st.table = j->block_entry;
+                cpu->pc = j->enter(code, &st);
+                cpu->total_clock_cycles = st.cycles;
+                pending_link = st.link_site;
+                continue;
+            }
+        }
+
+        pending_link = NULL;
+        int status = run_predecoded(cpu, cpu->total_clock_cycles + 1);
+        if (status != RUN_PAUSED) return status;
+    }
+}
+
+#else
+
+int run_jit(cpu_context *cpu) {
+    fprintf(stderr, "JIT not supported on this host; using the interpreter\n");
+    return run_predecoded(cpu, UINT64_MAX);
+}
+
+void jit_destroy(struct jit_cache *jit) {
+    (void)jit;
+}
+
+#endif
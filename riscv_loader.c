@@ -0,0 +1,232 @@
+// Program loaders. Three input formats are accepted and told apart by content:
+//   - ELF: a statically linked little-endian RV32 executable. Every PT_LOAD
+//     segment is mapped at its p_vaddr, the executable segments form the code
+//     range, and execution starts at e_entry.
+//   - Text: one instruction per line as 32 '0'/'1' characters (the original
+//     format). A file whose first 4 KiB is printable ASCII, or holds such a
+//     line, is read this way.
+//   - Raw binary: little-endian instruction words, loaded at address 0.
+// Binary and ELF files are mmap'd, and their segments point into the mapping,
+// so loading costs one copy into guest memory per run and nothing else.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "riscv_cpu.h"
+
+// The parts of the ELF32 file and program headers the loader reads
+typedef struct {
+    uint8_t ident[16];
+    uint16_t type, machine;
+    uint32_t version, entry, phoff, shoff, flags;
+    uint16_t ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+} elf32_ehdr;
+
+typedef struct {
+    uint32_t type, offset, vaddr, paddr, filesz, memsz, flags, align;
+} elf32_phdr;
+
+#define ELF_CLASS32 1
+#define ELF_DATA_LSB 1
+#define ELF_TYPE_EXEC 2
+#define ELF_MACHINE_RISCV 243
+#define ELF_PT_LOAD 1
+#define ELF_PF_X 1
+
+#define TEXT_PROBE_BYTES 4096           // Bytes inspected to recognise the text format
+#define UTF8_BOM "\xEF\xBB\xBF"          // Byte order mark some editors put at the start of a text file
+
+static program_segment *add_segment(program_image *image, uint32_t address, uint32_t size, const uint8_t *data) {
+    program_segment *grown = realloc(image->segments, (image->segment_count + 1) * sizeof(*grown));
+    if (grown == NULL) {
+        perror("program_open");
+        exit(EXIT_FAILURE);
+    }
+    image->segments = grown;
+    program_segment *seg = &image->segments[image->segment_count++];
+    seg->address = address;
+    seg->size = size;
+    seg->data = data;
+    return seg;
+}
+
+// Parse a program file (binary strings, one instruction per line) into words.
+// Returns the number of instructions, or -1 if the file cannot be opened.
+static int parse_text(const char* filename, uint32_t **words, int warn) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    char line[100]; // Assuming max line length
+    int count = 0, capacity = 0;
+    *words = NULL;
+    int line_no = 0;
+    while (fgets(line, sizeof(line), file)) {
+        // Remove trailing newline or carriage return, and a byte order mark before the first line
+        line[strcspn(line, "\r\n")] = 0;
+        if (line_no++ == 0 && strncmp(line, UTF8_BOM, 3) == 0) memmove(line, line + 3, strlen(line + 3) + 1);
+
+        // Check if line is 32 chars long and contains only 0s and 1s
+        if (strlen(line) == 32 && strspn(line, "01") == 32) {
+            uint32_t instruction = 0;
+            for (int i = 0; i < 32; i++) {
+                if (line[i] == '1') {
+                    instruction |= (1U << (31 - i));
+                }
+            }
+            if (count == capacity) {
+                capacity = capacity ? 2 * capacity : 256;
+                uint32_t *grown = realloc(*words, capacity * sizeof(**words));
+                if (grown == NULL) {
+                    perror("parse_text");
+                    exit(EXIT_FAILURE);
+                }
+                *words = grown;
+            }
+            (*words)[count++] = instruction;
+           // printf("Loaded instruction %d: 0x%08x\n", count - 1, instruction);
+        } else if (strlen(line) > 0 && warn) { // Ignore empty lines but warn about invalid ones
+             printf("Warning: Skipping invalid line in program file: '%s'\n", line);
+        }
+    }
+
+    fclose(file);
+    return count;
+}
+
+// Whether a file starts like a text program: its first TEXT_PROBE_BYTES are
+// plain printable text, or hold at least one line of 32 '0'/'1' characters (so
+// a UTF-8 byte order mark or a stray non-ASCII byte does not make it binary).
+static int is_text(const uint8_t *bytes, size_t size) {
+    size_t probe = size > TEXT_PROBE_BYTES ? TEXT_PROBE_BYTES : size;
+    int printable = 1;
+    for (size_t i = 0; i < probe; i++) {
+        if ((bytes[i] < 0x20 || bytes[i] > 0x7E) && bytes[i] != '\n' && bytes[i] != '\r' && bytes[i] != '\t') printable = 0;
+    }
+    if (printable) return 1;
+
+    size_t start = probe >= 3 && memcmp(bytes, UTF8_BOM, 3) == 0 ? 3 : 0;
+    while (start < probe) {
+        const uint8_t *newline = memchr(bytes + start, '\n', probe - start);
+        if (newline == NULL && probe < size) break;     // The line runs past the probe
+        size_t end = newline != NULL ? (size_t)(newline - bytes) : probe;
+        size_t length = end > start && bytes[end - 1] == '\r' ? end - 1 - start : end - start;
+        size_t bits = 0;
+        while (bits < length && (bytes[start + bits] == '0' || bytes[start + bits] == '1')) bits++;
+        if (length == 32 && bits == 32) return 1;
+        start = end + 1;
+    }
+    return 0;
+}
+
+// Map the PT_LOAD segments of an ELF file (0 on success, -1 if it is not a usable RV32 executable)
+static int load_elf(program_image *image, const char *filename) {
+    const uint8_t *file = image->map;
+    elf32_ehdr eh;
+
+    if (image->map_size < sizeof(eh)) goto invalid;
+    memcpy(&eh, file, sizeof(eh));
+    if (eh.ident[4] != ELF_CLASS32 || eh.ident[5] != ELF_DATA_LSB || eh.machine != ELF_MACHINE_RISCV) goto invalid;
+    if (eh.type != ELF_TYPE_EXEC) goto invalid;
+    if (eh.phentsize != sizeof(elf32_phdr) || eh.phoff > image->map_size
+            || eh.phnum > (image->map_size - eh.phoff) / sizeof(elf32_phdr)) goto invalid;
+
+    uint64_t code_start = UINT64_MAX, code_end = 0, data_end = 0;
+    for (int i = 0; i < eh.phnum; i++) {
+        elf32_phdr ph;
+        memcpy(&ph, file + eh.phoff + i * sizeof(ph), sizeof(ph));
+        if (ph.type != ELF_PT_LOAD) continue;
+        if (ph.offset > image->map_size || ph.filesz > image->map_size - ph.offset || ph.filesz > ph.memsz) goto invalid;
+        add_segment(image, ph.vaddr, ph.filesz, file + ph.offset);
+        if ((uint64_t)ph.vaddr + ph.memsz > data_end) data_end = (uint64_t)ph.vaddr + ph.memsz;
+        if (ph.flags & ELF_PF_X) {
+            if (ph.vaddr < code_start) code_start = ph.vaddr;
+            if ((uint64_t)ph.vaddr + ph.memsz > code_end) code_end = (uint64_t)ph.vaddr + ph.memsz;
+        }
+    }
+    if (code_start == UINT64_MAX || (code_start & 3) || code_end > UINT32_MAX || data_end > UINT32_MAX) goto invalid;
+
+    image->code_start = (uint32_t)code_start;
+    image->code_end = (uint32_t)(code_start + (code_end - code_start) / 4 * 4);
+    image->entry = eh.entry;
+    image->stack_top = STACK_TOP;
+    image->data_end = (uint32_t)data_end;
+    return 0;
+
+invalid:
+    fprintf(stderr, "%s: not a statically linked little-endian RV32 ELF executable\n", filename);
+    return -1;
+}
+
+// Open a program in any supported format. Returns the number of instructions,
+// -1 if the file cannot be read (errno is set), or -2 if it is not a valid program.
+int program_open(program_image *image, const char *filename, int warn) {
+    memset(image, 0, sizeof(*image));
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0) {
+        image->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (image->map == MAP_FAILED) {
+            image->map = NULL;
+            close(fd);
+            return -1;
+        }
+        image->map_size = (size_t)st.st_size;
+    }
+    close(fd);                          // The mapping stays valid
+
+    const uint8_t *bytes = image->map;
+    if (image->map_size >= 4 && memcmp(bytes, "\x7f" "ELF", 4) == 0) {
+        if (load_elf(image, filename) != 0) {
+            program_close(image);
+            return -2;
+        }
+    } else if (is_text(bytes, image->map_size)) {
+        program_close(image);
+        int count = parse_text(filename, &image->words, warn);
+        if (count < 0) return -1;
+        add_segment(image, 0, 4 * (uint32_t)count, (const uint8_t *)image->words);
+        image->code_end = image->data_end = 4 * (uint32_t)count;
+    } else {
+        uint32_t size = (uint32_t)(image->map_size / 4 * 4);
+        if (size != image->map_size && warn) {
+            printf("Warning: Ignoring %u trailing bytes in program file\n", (unsigned)(image->map_size - size));
+        }
+        add_segment(image, 0, size, bytes);
+        image->code_end = image->data_end = size;
+        image->stack_top = STACK_TOP;
+    }
+    return (int)((image->code_end - image->code_start) / 4);
+}
+
+// Make an image of count instruction words at address 0, started like a text
+// program (sp left alone). Returns count, or -1 if out of memory.
+int program_from_words(program_image *image, const uint32_t *words, int count) {
+    memset(image, 0, sizeof(*image));
+    image->words = malloc((count > 0 ? count : 1) * sizeof(*image->words));
+    if (image->words == NULL) return -1;
+    memcpy(image->words, words, count * sizeof(*image->words));
+    add_segment(image, 0, 4 * (uint32_t)count, (const uint8_t *)image->words);
+    image->code_end = image->data_end = 4 * (uint32_t)count;
+    return count;
+}
+
+void program_close(program_image *image) {
+    if (image->map != NULL) munmap(image->map, image->map_size);
+    free(image->words);
+    free(image->segments);
+    memset(image, 0, sizeof(*image));
+}
@@ -0,0 +1,451 @@
+// Lockstep execution of many harts running the same program.
+//
+// A gang of LOCKSTEP_LANES harts shares one predecoded program. Registers are
+// stored struct-of-arrays (rf[reg][lane]), so one ALU micro-op is a handful of
+// vector instructions across the whole gang. On x86-64 Linux the run loop is
+// built for AVX-512, AVX2 and baseline SSE2, and the loader picks the best one.
+//
+// Divergence at branches and jalr is handled by masking. Each step runs the instruction
+// at the lowest PC among the running lanes, for exactly the lanes at that PC,
+// while the others wait; lanes therefore reconverge where their paths meet.
+// Every lane executes the same instruction sequence as a scalar run, so its
+// final state and cycle count are identical. Diagnostics are not printed.
+//
+// Each hart keeps its own cpu_context, and loads and stores go through that
+// context's memory one lane at a time, as do divisions and atomics. A lane about to store into the program image
+// leaves the gang and finishes alone under run_predecoded(), which handles
+// the self-modifying code. Lanes reaching an ecall or a CSR instruction leave
+// the same way, and programs that read the hpm counters never join a gang.
+#include <stdint.h>
+#include <string.h>
+
+#include "riscv_cpu.h"
+
+#define VEC_LANES 16                            // 32-bit lanes per lane_vec (one AVX-512 register)
+#define GANG_VECS (LOCKSTEP_LANES / VEC_LANES)
+
+_Static_assert(LOCKSTEP_LANES % VEC_LANES == 0, "LOCKSTEP_LANES must be a multiple of 16");
+
+typedef uint32_t lane_vec __attribute__((vector_size(VEC_LANES * 4)));
+typedef int32_t lane_vec_s __attribute__((vector_size(VEC_LANES * 4)));
+typedef int64_t lane_vec64s __attribute__((vector_size(VEC_LANES * 8)));
+typedef uint64_t lane_vec64 __attribute__((vector_size(VEC_LANES * 8)));
+
+// One clone per instruction set, selected at load time
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define LOCKSTEP_KERNEL __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+#endif
+#ifndef LOCKSTEP_KERNEL
+#define LOCKSTEP_KERNEL
+#endif
+
+// Helpers are forced inline so they are compiled for the caller's instruction set
+#define LANE_INLINE static inline __attribute__((always_inline))
+
+// Element l of a gang-wide vector array
+#define LANE(vecs, l) ((vecs)[(l) / VEC_LANES][(l) % VEC_LANES])
+
+typedef struct {
+    lane_vec rf[32][GANG_VECS];         // Register file, one lane per hart
+    lane_vec pc[GANG_VECS];             // Per-lane PC (not kept up to date while converged)
+    lane_vec active[GANG_VECS];         // All ones while the lane is still running
+    lane_vec64 cycles[GANG_VECS];       // Per-lane cycle count (converged steps are added lazily)
+    int status[LOCKSTEP_LANES];         // RUN_* once the lane stops (RUN_PAUSED: left to store into code or for an ecall)
+} gang;
+
+// Whether any lane of vecs[0..n) is non-zero
+LANE_INLINE int any_lane(const lane_vec *vecs, int n) {
+    lane_vec acc = vecs[0];
+    for (int v = 1; v < n; v++) acc |= vecs[v];
+    for (int i = 0; i < VEC_LANES; i++) {
+        if (acc[i]) return 1;
+    }
+    return 0;
+}
+
+LANE_INLINE int same_lanes(const lane_vec *a, const lane_vec *b) {
+    lane_vec acc = a[0] ^ b[0];
+    for (int v = 1; v < GANG_VECS; v++) acc |= a[v] ^ b[v];
+    for (int i = 0; i < VEC_LANES; i++) {
+        if (acc[i]) return 0;
+    }
+    return 1;
+}
+
+// Lowest PC among the running lanes
+LANE_INLINE uint32_t min_active_pc(const gang *g) {
+    lane_vec best = g->pc[0] | ~g->active[0];
+    for (int v = 1; v < GANG_VECS; v++) {
+        lane_vec pc = g->pc[v] | ~g->active[v];
+        lane_vec lower = (lane_vec)(pc < best);
+        best = (pc & lower) | (best & ~lower);
+    }
+    uint32_t min = best[0];
+    for (int i = 1; i < VEC_LANES; i++) {
+        if (best[i] < min) min = best[i];
+    }
+    return min;
+}
+
+// Cycles the running lanes can all still execute before one exceeds the limit
+LANE_INLINE uint64_t cycle_budget(const gang *g, uint64_t limit) {
+    uint64_t budget = UINT64_MAX;
+    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+        if (!LANE(g->active, l)) continue;
+        uint64_t cycles = LANE(g->cycles, l);
+        uint64_t left = cycles >= limit ? 0 : limit - cycles;
+        if (left < budget) budget = left;
+    }
+    return budget;
+}
+
+// Add n cycles to every lane in m
+LANE_INLINE void add_cycles(gang *g, const lane_vec *m, uint64_t n) {
+    for (int v = 0; v < GANG_VECS; v++) {
+        lane_vec64 minus_one = (lane_vec64)__builtin_convertvector((lane_vec_s)m[v], lane_vec64s); // Lanes in m: all ones
+        g->cycles[v] -= minus_one * n;
+    }
+}
+
+// rd = value for the lanes in m (x0 is never written)
+#define WRITE_RD(v, value) do { \
+        lane_vec value_ = (value); \
+        g->rf[d->rd][v] = (value_ & m[v]) | (g->rf[d->rd][v] & ~m[v]); \
+    } while (0)
+
+// high = the high word of the 64-bit product of a and b, each sign- or zero-extended
+LANE_INLINE void mul_high(lane_vec *high, const lane_vec *a, const lane_vec *b, int a_signed, int b_signed) {
+    lane_vec64 a64 = a_signed ? (lane_vec64)__builtin_convertvector((lane_vec_s)*a, lane_vec64s) : __builtin_convertvector(*a, lane_vec64);
+    lane_vec64 b64 = b_signed ? (lane_vec64)__builtin_convertvector((lane_vec_s)*b, lane_vec64s) : __builtin_convertvector(*b, lane_vec64);
+    *high = __builtin_convertvector((a64 * b64) >> 32, lane_vec);
+}
+
+// Stop every running lane in m, recording why
+LANE_INLINE void retire(gang *g, const lane_vec *m, int status) {
+    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+        if (LANE(m, l) && LANE(g->active, l)) {
+            LANE(g->active, l) = 0;
+            g->status[l] = status;
+        }
+    }
+}
+
+// Leave converged mode: charge the pending cycles and give every running lane the shared PC
+LANE_INLINE void diverge(gang *g, uint32_t leader, uint64_t pending) {
+    add_cycles(g, g->active, pending);
+    for (int v = 0; v < GANG_VECS; v++) {
+        g->pc[v] = (g->active[v] & leader) | (g->pc[v] & ~g->active[v]);
+    }
+}
+
+LOCKSTEP_KERNEL
+static void run_gang(gang *g, cpu_context **harts, const decoded_instr *prog, uint32_t count, uint64_t limit) {
+    lane_vec mask[GANG_VECS];           // Lanes executing this step (while diverged)
+    lane_vec target[GANG_VECS];         // Per-lane next PC after a branch/jalr
+    int converged = 0;                  // Every running lane is at leader
+    uint32_t leader = 0;                // PC of the instruction executed this step
+    uint64_t pending = 0;               // Converged steps not yet added to cycles
+    uint64_t budget = 0;                // Converged steps that fit under the cycle limit
+    uint32_t code_start = harts[0]->mem.code_start;
+    uint32_t code_size = harts[0]->mem.code_end - code_start;
+
+    for (;;) {
+        if (!converged) {
+            if (!any_lane(g->active, GANG_VECS)) return;
+            leader = min_active_pc(g);
+            for (int v = 0; v < GANG_VECS; v++) {
+                mask[v] = (lane_vec)(g->pc[v] == leader) & g->active[v];
+            }
+            if (same_lanes(mask, g->active)) {
+                converged = 1;
+                pending = 0;
+                budget = cycle_budget(g, limit);
+            }
+        }
+        const lane_vec *m = converged ? g->active : mask;
+
+        if ((leader - code_start) / 4 >= count) {       // Outside the program
+            if (converged) {
+                diverge(g, leader, pending);
+                converged = 0;
+            }
+            retire(g, m, RUN_HALTED);
+            continue;
+        }
+
+        const decoded_instr *d = &prog[(leader - code_start) / 4];
+        uint32_t next = leader + 4;                     // Next PC when it is the same for every lane
+        int split = 0;                                  // Next PC is per lane, in target[]
+        switch (d->op) {
+            case OP_ADD:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] + g->rf[d->rs2][v]);
+                break;
+            case OP_SUB:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] - g->rf[d->rs2][v]);
+                break;
+            case OP_AND:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] & g->rf[d->rs2][v]);
+                break;
+            case OP_OR:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] | g->rf[d->rs2][v]);
+                break;
+            case OP_XOR:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] ^ g->rf[d->rs2][v]);
+                break;
+            case OP_SLL:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] << (g->rf[d->rs2][v] & 31));
+                break;
+            case OP_SRL:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] >> (g->rf[d->rs2][v] & 31));
+                break;
+            case OP_SRA:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) {
+                    WRITE_RD(v, (lane_vec)((lane_vec_s)g->rf[d->rs1][v] >> (lane_vec_s)(g->rf[d->rs2][v] & 31)));
+                }
+                break;
+            case OP_SLT:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) {
+                    WRITE_RD(v, (lane_vec)((lane_vec_s)g->rf[d->rs1][v] < (lane_vec_s)g->rf[d->rs2][v]) & 1);
+                }
+                break;
+            case OP_SLTU:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, (lane_vec)(g->rf[d->rs1][v] < g->rf[d->rs2][v]) & 1);
+                break;
+            case OP_MUL:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] * g->rf[d->rs2][v]);
+                break;
+            case OP_MULH: case OP_MULHSU: case OP_MULHU: {
+                int a_signed = d->op != OP_MULHU, b_signed = d->op == OP_MULH;
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) {
+                    lane_vec high;
+                    mul_high(&high, &g->rf[d->rs1][v], &g->rf[d->rs2][v], a_signed, b_signed);
+                    WRITE_RD(v, high);
+                }
+                break;
+            }
+            case OP_DIV: case OP_DIVU: case OP_REM: case OP_REMU:
+                if (d->rd != 0) for (int l = 0; l < LOCKSTEP_LANES; l++) {
+                    if (!LANE(m, l)) continue;
+                    LANE(g->rf[d->rd], l) = alu_compute(d->alu_ctrl, LANE(g->rf[d->rs1], l), LANE(g->rf[d->rs2], l));
+                }
+                break;
+            case OP_ADDI:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] + (uint32_t)d->imm);
+                break;
+            case OP_ANDI:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] & (uint32_t)d->imm);
+                break;
+            case OP_ORI:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] | (uint32_t)d->imm);
+                break;
+            case OP_XORI:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] ^ (uint32_t)d->imm);
+                break;
+            case OP_SLLI:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] << (d->imm & 31));
+                break;
+            case OP_SRLI:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, g->rf[d->rs1][v] >> (d->imm & 31));
+                break;
+            case OP_SRAI:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, (lane_vec)((lane_vec_s)g->rf[d->rs1][v] >> (d->imm & 31)));
+                break;
+            case OP_SLTI:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, (lane_vec)((lane_vec_s)g->rf[d->rs1][v] < d->imm) & 1);
+                break;
+            case OP_SLTIU:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, (lane_vec)(g->rf[d->rs1][v] < (uint32_t)d->imm) & 1);
+                break;
+            case OP_LUI: case OP_AUIPC: {
+                uint32_t value = (uint32_t)d->imm + (d->op == OP_AUIPC ? leader : 0);
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, (lane_vec){ 0 } + value);
+                break;
+            }
+            case OP_LW: case OP_LB: case OP_LH: case OP_LBU: case OP_LHU: {
+                uint32_t funct3 = (d->raw >> 12) & 7;
+                for (int l = 0; l < LOCKSTEP_LANES; l++) {
+                    if (!LANE(m, l)) continue;
+                    uint32_t address = LANE(g->rf[d->rs1], l) + (uint32_t)d->imm;
+                    uint32_t value = (uint32_t)(d->op == OP_LW ? load_word(harts[l], address) : load_narrow(harts[l], address, funct3));
+                    if (d->rd != 0) LANE(g->rf[d->rd], l) = value;
+                }
+                break;
+            }
+            case OP_SW: case OP_SB: case OP_SH:
+            case OP_LR: case OP_SC: case OP_AMOSWAP: case OP_AMOADD: case OP_AMOXOR: case OP_AMOAND:
+            case OP_AMOOR: case OP_AMOMIN: case OP_AMOMAX: case OP_AMOMINU: case OP_AMOMAXU: {
+                // Lanes storing into the program leave before the store, with this instruction still to run
+                uint32_t funct3 = (d->raw >> 12) & 7, align = d->op == OP_SW || op_is_atomic(d->op) ? 3 : funct3;
+                int evict = 0;
+                for (int l = 0; l < LOCKSTEP_LANES; l++) {
+                    uint32_t address = LANE(g->rf[d->rs1], l) + (uint32_t)d->imm;
+                    if (LANE(m, l) && address - code_start < code_size && !(address & align)) evict = 1;
+                }
+                if (evict) {
+                    if (converged) {
+                        diverge(g, leader, pending);
+                        converged = 0;
+                        memcpy(mask, g->active, sizeof(mask));
+                        m = mask;
+                    }
+                    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+                        uint32_t address = LANE(g->rf[d->rs1], l) + (uint32_t)d->imm;
+                        if (!LANE(m, l) || address - code_start >= code_size || (address & align)) continue;
+                        LANE(mask, l) = 0;
+                        LANE(g->active, l) = 0;
+                        g->status[l] = RUN_PAUSED;
+                    }
+                }
+                for (int l = 0; l < LOCKSTEP_LANES; l++) {
+                    if (!LANE(m, l)) continue;
+                    uint32_t address = LANE(g->rf[d->rs1], l) + (uint32_t)d->imm;
+                    if (op_is_atomic(d->op)) {
+                        int value;
+                        mem_atomic(harts[l], d->op, d->alu_ctrl, address, LANE(g->rf[d->rs2], l), &value);
+                        if (d->rd != 0) LANE(g->rf[d->rd], l) = (uint32_t)value;
+                    } else if (d->op == OP_SW) {
+                        store_word(harts[l], address, (int)LANE(g->rf[d->rs2], l));
+                    } else {
+                        store_narrow(harts[l], address, (int)LANE(g->rf[d->rs2], l), funct3);
+                    }
+                }
+                break;
+            }
+            case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU: {
+                lane_vec taken_any = { 0 }, not_taken_any = { 0 };
+                for (int v = 0; v < GANG_VECS; v++) {
+                    lane_vec a = g->rf[d->rs1][v], b = g->rf[d->rs2][v], taken;
+                    switch (d->op) {
+                        case OP_BEQ:  taken = (lane_vec)(a == b); break;
+                        case OP_BNE:  taken = (lane_vec)(a != b); break;
+                        case OP_BLT:  taken = (lane_vec)((lane_vec_s)a < (lane_vec_s)b); break;
+                        case OP_BGE:  taken = (lane_vec)((lane_vec_s)a >= (lane_vec_s)b); break;
+                        case OP_BLTU: taken = (lane_vec)(a < b); break;
+                        default:      taken = (lane_vec)(a >= b); break;
+                    }
+                    target[v] = (taken & (leader + (uint32_t)d->imm)) | (~taken & next);
+                    taken_any |= taken & m[v];
+                    not_taken_any |= ~taken & m[v];
+                }
+                int some_taken = any_lane(&taken_any, 1), some_not_taken = any_lane(&not_taken_any, 1);
+                if (some_taken && some_not_taken) {
+                    split = 1;
+                } else if (some_taken) {
+                    next = leader + (uint32_t)d->imm;
+                }
+                break;
+            }
+            case OP_JAL:
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, (lane_vec){ 0 } + next);
+                next = leader + (uint32_t)d->imm;
+                break;
+            case OP_JALR:
+                for (int v = 0; v < GANG_VECS; v++) {
+                    target[v] = (g->rf[d->rs1][v] + (uint32_t)d->imm) & ~1U; // Read rs1 before the link overwrites it
+                }
+                if (d->rd != 0) for (int v = 0; v < GANG_VECS; v++) WRITE_RD(v, (lane_vec){ 0 } + next);
+                split = 1;                              // Targets are rechecked by the next step
+                break;
+            case OP_ECALL:
+            case OP_CSR:
+                // Lanes making a syscall or reading a counter (their own cycle count) leave before it, and finish alone
+                if (converged) {
+                    diverge(g, leader, pending);
+                    converged = 0;
+                }
+                for (int l = 0; l < LOCKSTEP_LANES; l++) {
+                    if (!LANE(m, l)) continue;
+                    LANE(g->active, l) = 0;
+                    g->status[l] = RUN_PAUSED;
+                }
+                continue;
+            default: // OP_FENCE, OP_EBREAK and OP_UNKNOWN behave as NOPs
+                break;
+        }
+
+        // Count the cycle, move the PCs and stop lanes that crossed the cycle limit
+        if (converged && !split) {
+            leader = next;
+            if (++pending <= budget) continue;
+            diverge(g, leader, pending);
+        } else {
+            if (converged) {
+                add_cycles(g, g->active, pending + 1);
+                memcpy(mask, g->active, sizeof(mask));
+                m = mask;
+            } else {
+                add_cycles(g, m, 1);
+            }
+            for (int v = 0; v < GANG_VECS; v++) {
+                lane_vec new_pc = split ? target[v] : (lane_vec){ 0 } + next;
+                g->pc[v] = (new_pc & m[v]) | (g->pc[v] & ~m[v]);
+            }
+        }
+        converged = 0;
+        for (int l = 0; l < LOCKSTEP_LANES; l++) {
+            if (LANE(g->active, l) && LANE(g->cycles, l) > limit) {
+                LANE(g->active, l) = 0;
+                g->status[l] = RUN_LIMIT;
+            }
+        }
+    }
+}
+
+#undef WRITE_RD
+
+// Whether the program image in cpu's memory is still the one that was loaded
+static int code_unmodified(cpu_context *cpu) {
+    for (int i = 0; i < cpu->instr_count; i++) {
+        if (mem_peek(&cpu->mem, cpu->mem.code_start + 4 * (uint32_t)i) != cpu->instr_mem[i]) return 0;
+    }
+    return 1;
+}
+
+// Run count harts LOCKSTEP_LANES at a time. Every hart must have the same program
+// loaded. Each starts from its context's registers, memory, pc and cycle count and
+// ends with the final state and status (RUN_HALTED or RUN_LIMIT), exactly as if it
+// had run alone under run_predecoded(). Harts whose initial memory already rewrote
+// the program, or whose program reads the hpm counters, run alone.
+void run_lockstep(cpu_context **harts, int *status, int count) {
+    gang g;
+
+    for (int base = 0; base < count; base += LOCKSTEP_LANES) {
+        int n = count - base < LOCKSTEP_LANES ? count - base : LOCKSTEP_LANES;
+        cpu_context **h = harts + base;
+
+        memset(&g, 0, sizeof(g));       // Unused lanes stay inactive
+        const decoded_instr *prog = NULL;
+        int alone[LOCKSTEP_LANES];
+        for (int l = 0; l < n; l++) {
+            alone[l] = !code_unmodified(h[l]) || h[l]->uses_counters;   // Gangs do not count hpm events
+            if (alone[l]) continue;
+            if (prog == NULL) prog = h[l]->d_prog;
+            for (int r = 0; r < 32; r++) {
+                LANE(g.rf[r], l) = (uint32_t)h[l]->rf[r];
+            }
+            LANE(g.pc, l) = h[l]->pc;
+            LANE(g.cycles, l) = h[l]->total_clock_cycles;
+            LANE(g.active, l) = ~0U;
+        }
+
+        if (prog != NULL) run_gang(&g, h, prog, (uint32_t)h[0]->instr_count, cycle_limit(h[0]));
+
+        for (int l = 0; l < n; l++) {
+            if (alone[l]) {
+                status[base + l] = run_predecoded(h[l], UINT64_MAX);
+                continue;
+            }
+            for (int r = 0; r < 32; r++) {
+                h[l]->rf[r] = (int)LANE(g.rf[r], l);
+            }
+            h[l]->pc = LANE(g.pc, l);
+            h[l]->total_clock_cycles = LANE(g.cycles, l);
+            status[base + l] = g.status[l];
+            if (status[base + l] == RUN_PAUSED) {
+                status[base + l] = run_predecoded(h[l], UINT64_MAX); // Rewrites its own code or makes syscalls
+            }
+        }
+    }
+}
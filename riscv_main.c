@@ -0,0 +1,480 @@
+// Command-line front end: parses the options, loads the program and its
+// initial state through the embedding interface (riscv_sim.h), and runs it on
+// the selected engine with the requested models and reports.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "riscv_cpu.h"
+
+// One --init token: a register or memory word the program starts with
+typedef struct {
+    int kind;                       // INIT_REG or INIT_MEM
+    uint32_t target;                // Register number or word address
+    int value;
+} init_value;
+
+// Append the tokens of one --init option to *init (-1 if one is invalid)
+static int add_init(const char *spec, init_value **init, int *count) {
+    char *copy = strdup(spec);
+    if (copy == NULL) return -1;
+    int result = 0;
+    char *save;
+    char *token = strtok_r(copy, ", \t", &save);
+    for (; token != NULL; token = strtok_r(NULL, ", \t", &save)) {
+        init_value v;
+        v.kind = parse_init(token, &v.target, &v.value);
+        init_value *grown = v.kind < 0 ? NULL : realloc(*init, (*count + 1) * sizeof(*grown));
+        if (grown == NULL) {
+            result = -1;
+            break;
+        }
+        *init = grown;
+        (*init)[(*count)++] = v;
+    }
+    free(copy);
+    return result;
+}
+
+// Parse a --trace level name (-1 if unrecognised)
+static int parse_trace_level(const char *name) {
+    static const char *const names[] = { "none", "final", "instr", "full" };
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <program>     (text, raw binary or RV32 ELF)\n", prog);
+    fprintf(stderr, "       %s [options] --batch=MANIFEST [--threads=N]\n", prog);
+    fprintf(stderr, "       %s --fuzz[=SPEC] [--threads=N] [--jit]\n", prog);
+    fprintf(stderr, "  --init=STATE      registers and memory words the program starts with: xN=VALUE and\n");
+    fprintf(stderr, "                    mem[ADDR]=VALUE, separated by commas or spaces (may be repeated)\n");
+    fprintf(stderr, "  --trace=LEVEL     none | final (default) | instr | full\n");
+    fprintf(stderr, "                    final: final state and throughput only\n");
+    fprintf(stderr, "                    instr: also print each instruction as it executes\n");
+    fprintf(stderr, "                    full:  also print the full state after every cycle\n");
+    fprintf(stderr, "  --max-cycles=N    stop after N cycles (0 = no limit, default 5 per instruction,\n");
+    fprintf(stderr, "                    none for programs that use ecall)\n");
+    fprintf(stderr, "  --staged          run the original Fetch/Decode/Execute/Mem/Writeback loop\n");
+    fprintf(stderr, "  --no-fusion       run each instruction through its own handler (no superinstructions)\n");
+    fprintf(stderr, "  --jit             translate basic blocks to x86-64 (trace levels none/final only)\n");
+    fprintf(stderr, "  --pipeline[=FWD]  time the run on a 5-stage pipeline (implies --staged); FWD is\n");
+    fprintf(stderr, "                    none or a comma list of ex,mem,rf forwarding paths (default all)\n");
+    fprintf(stderr, "  --ooo[=SPEC]      time the run on an out-of-order superscalar core (implies --staged);\n");
+    fprintf(stderr, "                    SPEC is [width=N][,fetch=N][,issue=N][,commit=N][,rob=N][,iq=N][,lsq=N]\n");
+    fprintf(stderr, "                    [,depth=N][,alu|mul|div|mem=UNITS][,alu-lat|mul-lat|div-lat|load-lat=N]\n");
+    fprintf(stderr, "  --bpred[=SPEC]    simulate branch prediction (implies --staged); SPEC is\n");
+    fprintf(stderr, "                    nottaken|bimodal|gshare (default) [,entries=N][,history=N][,btb=N][,ras=N]\n");
+    fprintf(stderr, "  --icache[=SPEC]   model L1 caches on fetch and lw/sw (implies --staged); SPEC is\n");
+    fprintf(stderr, "  --dcache[=SPEC]   [size=N[K|M]][,ways=N][,line=N][,repl=lru|plru|random][,write=wb|wt]\n");
+    fprintf(stderr, "  --l2[=SPEC]       add a unified L2 behind the L1 caches\n");
+    fprintf(stderr, "  --checkpoint=FILE write checkpoints to FILE (at the end of the run unless one of:)\n");
+    fprintf(stderr, "  --checkpoint-at=N      checkpoint when the cycle count reaches N\n");
+    fprintf(stderr, "  --checkpoint-every=N   checkpoint every N cycles (later ones hold only changed pages)\n");
+    fprintf(stderr, "  --restore=FILE[@N]     continue from the last checkpoint in FILE (at or before cycle N)\n");
+    fprintf(stderr, "  --profile[=FILE]  report hot instructions, basic blocks and the opcode mix;\n");
+    fprintf(stderr, "                    FILE receives the call stacks in folded (flame graph) format\n");
+    fprintf(stderr, "  --trace-file=FILE record each instruction's pc, word and register/memory change\n");
+    fprintf(stderr, "                    to FILE (binary, gzip-compressed if FILE ends in .gz; implies --staged)\n");
+    fprintf(stderr, "  --sample[=SPEC]   run the program functionally and time only sampled intervals in\n");
+    fprintf(stderr, "                    detail with the --pipeline/--ooo/--bpred/cache models (default --pipeline),\n");
+    fprintf(stderr, "                    on --threads workers; SPEC is [every=N][,warmup=N][,length=N] cycles\n");
+    fprintf(stderr, "                    (default every=1000000,warmup=10000,length=10000)\n");
+    fprintf(stderr, "  --stage-times     report the host time spent in each stage function (implies --staged)\n");
+    fprintf(stderr, "  --harts=N         run N harts of the program on N threads, sharing memory\n");
+    fprintf(stderr, "                    (hart id in tp; interpreter only, trace levels none/final)\n");
+    fprintf(stderr, "  --quantum=N       harts wait for each other every N cycles (default 10000, 0: never)\n");
+    fprintf(stderr, "  --batch=MANIFEST  run every job in MANIFEST on a thread pool, one result line per job\n");
+    fprintf(stderr, "  --fuzz[=SPEC]     run random programs on the interpreter, the staged engine (and with\n");
+    fprintf(stderr, "                    --jit the JIT) and a reference interpreter, and report the first\n");
+    fprintf(stderr, "                    mismatch, minimised; SPEC is [cases=N][,length=N][,seed=N]\n");
+    fprintf(stderr, "                    (default cases=1000000,length=32,seed=1)\n");
+    fprintf(stderr, "  --threads=N       batch/sample/fuzz worker threads (default: one per online CPU)\n");
+    fprintf(stderr, "  --lockstep        batch only: run jobs that share a program as SIMD lockstep gangs\n");
+}
+
+// Run the program loaded in cpu on count harts and print their final state.
+// Returns the exit status for main().
+static int run_hart_group(cpu_context *cpu, int count, uint64_t quantum) {
+    cpu_context **harts = calloc(count, sizeof(*harts));
+    int *status = calloc(count, sizeof(*status));
+    if (harts == NULL || status == NULL) {
+        perror("run_hart_group");
+        exit(EXIT_FAILURE);
+    }
+    harts[0] = cpu;
+    for (int i = 1; i < count; i++) {
+        harts[i] = cpu_create();
+        hart_attach(harts[i], cpu, i);
+    }
+
+    uint64_t start_cycles = cpu->total_clock_cycles * (uint64_t)count;
+    double start = now_seconds();
+    int result = run_harts(harts, status, count, quantum);
+    double elapsed = now_seconds() - start;
+
+    uint64_t cycles = 0;
+    for (int i = 0; i < count; i++) cycles += harts[i]->total_clock_cycles;
+    syscall_flush(cpu);
+    if (result == 0 && cpu->trace_level >= TRACE_FINAL) {
+        for (int i = 0; i < count; i++) {
+            if (harts[i]->exited) printf("Hart %d exited with code %d\n", i, harts[i]->exit_code);
+        }
+        print_harts(harts, count);
+        printf("Simulated %" PRIu64 " cycles on %d harts in %.6f s (%.0f cycles/s)\n",
+               cycles, count, elapsed, elapsed > 0 ? (cycles - start_cycles) / elapsed : 0.0);
+    }
+    for (int i = 1; i < count; i++) cpu_destroy(harts[i]);
+    free(status);
+    free(harts);
+    if (result != 0) return EXIT_FAILURE;
+    return cpu->exited ? cpu->exit_code & 0xFF : EXIT_SUCCESS;     // Hart 0's exit code
+}
+
+int main(int argc, char* argv[]) {
+    // Trace output goes through one large buffer instead of many small writes
+    static char stdout_buffer[1 << 20];
+    setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer));
+
+    const char* filename = NULL;
+    const char* manifest = NULL;
+    int engine = ENGINE_PREDECODED;
+    int trace_level = TRACE_FINAL;
+    long long max_cycles = -1;
+    int no_fusion = 0;                  // --no-fusion: run each instruction through its own handler
+    int stage_times = 0;                // --stage-times: host time per run_staged() stage
+    int threads = 0;
+    int forwarding = -1;                // --pipeline forwarding paths (-1: no timing model)
+    int out_of_order = 0;               // --ooo core
+    ooo_config ooo;
+    bpred_config bpred = { 0 };         // --bpred predictor (kind 0: none)
+    // --icache/--dcache/--l2 settings; any of them turns the cache model on
+    cache_config l1i = { 16 << 10, 2, 64, REPL_LRU, 1 };
+    cache_config l1d = { 16 << 10, 4, 64, REPL_LRU, 1 };
+    cache_config l2 = { 256 << 10, 8, 64, REPL_LRU, 1 };
+    int caches = 0, use_l2 = 0;
+    checkpoint_options checkpoint = { NULL, 0, 0 };
+    const char *restore = NULL;         // --restore file, and the cycle count to restore at
+    uint64_t restore_at = UINT64_MAX;
+    int profile = 0;                    // --profile, and where to write the folded call stacks
+    const char *folded = NULL;
+    const char *trace_file = NULL;      // --trace-file: binary delta trace of the run
+    int harts = 1;                      // --harts, and the cycles between their barriers
+    uint64_t quantum = 10000;
+    int sampling = 0;                   // --sample: functional run plus detailed samples
+    sample_options sample = { 1000000, 10000, 10000, 0, -1, NULL, { 0 }, NULL, NULL, NULL };
+    int fuzzing = 0;                    // --fuzz: differential testing against the reference interpreter
+    fuzz_options fuzz = { 1000000, 32, 1 };
+    init_value *init = NULL;            // --init: registers and memory words the program starts with
+    int init_count = 0;
+    cpu_context *cpu = NULL;
+    int result = EXIT_FAILURE;          // Every exit from here on goes through done
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--staged") == 0) {
+            engine = ENGINE_STAGED; // Original Fetch/Decode/Execute/Mem/Writeback loop (reference path)
+        } else if (strcmp(argv[i], "--stage-times") == 0) {
+            stage_times = 1;
+        } else if (strcmp(argv[i], "--no-fusion") == 0) {
+            no_fusion = 1;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            engine = ENGINE_JIT;
+        } else if (strcmp(argv[i], "--lockstep") == 0) {
+            engine = ENGINE_LOCKSTEP;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            forwarding = PIPE_FWD_ALL;
+        } else if (strncmp(argv[i], "--pipeline=", 11) == 0) {
+            forwarding = parse_forwarding(argv[i] + 11);
+            if (forwarding < 0) {
+                fprintf(stderr, "Unknown forwarding paths: %s\n", argv[i] + 11);
+                usage(argv[0]);
+                goto done;
+            }
+        } else if (strcmp(argv[i], "--ooo") == 0 || strncmp(argv[i], "--ooo=", 6) == 0) {
+            if (parse_ooo(argv[i][5] == '=' ? argv[i] + 6 : "", &ooo) < 0) {
+                fprintf(stderr, "Invalid out-of-order core: %s\n", argv[i]);
+                usage(argv[0]);
+                goto done;
+            }
+            out_of_order = 1;
+        } else if (strcmp(argv[i], "--bpred") == 0 || strncmp(argv[i], "--bpred=", 8) == 0) {
+            if (parse_bpred(argv[i][7] == '=' ? argv[i] + 8 : "", &bpred) < 0) {
+                fprintf(stderr, "Invalid branch predictor: %s\n", argv[i]);
+                usage(argv[0]);
+                goto done;
+            }
+        } else if (strncmp(argv[i], "--icache", 8) == 0 || strncmp(argv[i], "--dcache", 8) == 0
+                   || strncmp(argv[i], "--l2", 4) == 0) {
+            int is_l2 = argv[i][2] == 'l';
+            const char *spec = argv[i] + (is_l2 ? 4 : 8);
+            cache_config *config = is_l2 ? &l2 : argv[i][2] == 'i' ? &l1i : &l1d;
+            if ((*spec != '\0' && *spec != '=') || parse_cache(*spec == '=' ? spec + 1 : spec, config) < 0) {
+                fprintf(stderr, "Invalid cache configuration: %s\n", argv[i]);
+                usage(argv[0]);
+                goto done;
+            }
+            caches = 1;
+            use_l2 |= is_l2;
+        } else if (strncmp(argv[i], "--checkpoint=", 13) == 0) {
+            checkpoint.path = argv[i] + 13;
+        } else if (strncmp(argv[i], "--checkpoint-at=", 16) == 0) {
+            checkpoint.at = strtoull(argv[i] + 16, NULL, 0);
+        } else if (strncmp(argv[i], "--checkpoint-every=", 19) == 0) {
+            checkpoint.every = strtoull(argv[i] + 19, NULL, 0);
+        } else if (strncmp(argv[i], "--restore=", 10) == 0) {
+            restore = argv[i] + 10;
+            char *at = strrchr(argv[i], '@');
+            if (at != NULL) {
+                *at = '\0';
+                restore_at = strtoull(at + 1, NULL, 0);
+            }
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profile = 1;
+            folded = argv[i] + 10;
+        } else if (strcmp(argv[i], "--sample") == 0 || strncmp(argv[i], "--sample=", 9) == 0) {
+            if (parse_sample(argv[i][8] == '=' ? argv[i] + 9 : "", &sample) < 0) {
+                fprintf(stderr, "Invalid sampling: %s\n", argv[i]);
+                usage(argv[0]);
+                goto done;
+            }
+            sampling = 1;
+        } else if (strcmp(argv[i], "--fuzz") == 0 || strncmp(argv[i], "--fuzz=", 7) == 0) {
+            if (parse_fuzz(argv[i][6] == '=' ? argv[i] + 7 : "", &fuzz) < 0) {
+                fprintf(stderr, "Invalid fuzzing: %s\n", argv[i]);
+                usage(argv[0]);
+                goto done;
+            }
+            fuzzing = 1;
+        } else if (strncmp(argv[i], "--trace-file=", 13) == 0) {
+            trace_file = argv[i] + 13;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            trace_level = parse_trace_level(argv[i] + 8);
+            if (trace_level < 0) {
+                fprintf(stderr, "Unknown trace level: %s\n", argv[i] + 8);
+                usage(argv[0]);
+                goto done;
+            }
+        } else if (strncmp(argv[i], "--max-cycles=", 13) == 0) {
+            max_cycles = strtoll(argv[i] + 13, NULL, 0);
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            manifest = argv[i] + 8;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            threads = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--harts=", 8) == 0) {
+            harts = atoi(argv[i] + 8);
+            if (harts < 1) {
+                fprintf(stderr, "Invalid hart count: %s\n", argv[i] + 8);
+                usage(argv[0]);
+                goto done;
+            }
+        } else if (strncmp(argv[i], "--init=", 7) == 0) {
+            if (add_init(argv[i] + 7, &init, &init_count) < 0) {
+                fprintf(stderr, "Invalid initial state: %s (expected xN=value or mem[ADDR]=value)\n", argv[i] + 7);
+                usage(argv[0]);
+                goto done;
+            }
+        } else if (strncmp(argv[i], "--quantum=", 10) == 0) {
+            quantum = strtoull(argv[i] + 10, NULL, 0);
+        } else if (argv[i][0] == '-' || filename != NULL) {
+            usage(argv[0]);
+            goto done;
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (fuzzing) {
+        if (filename != NULL || manifest != NULL) {
+            fprintf(stderr, "--fuzz generates its own programs; it takes no program file or manifest\n");
+            goto done;
+        }
+        if (run_fuzz(&fuzz, threads, engine == ENGINE_JIT) == 0) result = EXIT_SUCCESS;
+        goto done;
+    }
+    if (manifest != NULL) {
+        if (forwarding >= 0 || out_of_order || bpred.kind || caches || profile || trace_file != NULL || harts > 1 || sampling || stage_times) {
+            fprintf(stderr, "Note: --pipeline, --ooo, --bpred, --profile, --trace-file, --harts, --sample, --stage-times and the cache model do not apply to --batch\n");
+        }
+        if (init_count > 0) fprintf(stderr, "Note: --init does not apply to --batch; the manifest gives each job's initial state\n");
+        if (run_batch(manifest, threads, engine, max_cycles) == 0) result = EXIT_SUCCESS;
+        goto done;
+    }
+    if (filename == NULL) {
+        usage(argv[0]);
+        goto done;
+    }
+    if ((checkpoint.at || checkpoint.every) && checkpoint.path == NULL) {
+        fprintf(stderr, "--checkpoint-at/--checkpoint-every need --checkpoint=FILE\n");
+        goto done;
+    }
+    if (checkpoint.path != NULL && (forwarding >= 0 || out_of_order || bpred.kind || caches || trace_file != NULL || stage_times)) {
+        fprintf(stderr, "--checkpoint cannot be combined with --pipeline, --ooo, --bpred, --trace-file, --stage-times or the cache model\n");
+        goto done;
+    }
+    if (harts > 1 && (checkpoint.path != NULL || restore != NULL || trace_file != NULL)) {
+        fprintf(stderr, "--harts cannot be combined with --checkpoint, --restore or --trace-file\n");
+        goto done;
+    }
+    if (harts > 1) {
+        if (forwarding >= 0 || out_of_order || bpred.kind || caches || profile || stage_times) {
+            fprintf(stderr, "Note: --pipeline, --ooo, --bpred, --profile, --stage-times and the cache model do not apply to --harts\n");
+            forwarding = -1;
+            out_of_order = 0;
+            bpred.kind = 0;
+            caches = profile = stage_times = 0;
+            folded = NULL;
+        }
+        if (engine != ENGINE_PREDECODED || trace_level >= TRACE_INSTR) {
+            fprintf(stderr, "Note: harts run the interpreter at trace level final or below\n");
+            if (trace_level >= TRACE_INSTR) trace_level = TRACE_FINAL;
+        }
+        engine = ENGINE_PREDECODED;     // Only run_predecoded() can stop at a quantum boundary
+    }
+    if (sampling && (checkpoint.path != NULL || trace_file != NULL || harts > 1)) {
+        fprintf(stderr, "--sample cannot be combined with --checkpoint, --trace-file or --harts\n");
+        goto done;
+    }
+    if (sampling) {
+        if (profile || stage_times) {
+            fprintf(stderr, "Note: --profile and --stage-times do not apply to --sample\n");
+            profile = stage_times = 0;
+            folded = NULL;
+        }
+        if (forwarding < 0 && !out_of_order && !bpred.kind && !caches) forwarding = PIPE_FWD_ALL;   // Something to estimate
+        sample.threads = threads;
+        sample.forwarding = forwarding;
+        if (out_of_order) sample.ooo = &ooo;
+        sample.bpred = bpred;
+        if (caches) {
+            sample.l1i = &l1i;
+            sample.l1d = &l1d;
+            if (use_l2) sample.l2 = &l2;
+        }
+        // The models are built for each sample by run_sampled(); the functional pass runs without them
+        forwarding = -1;
+        out_of_order = 0;
+        bpred.kind = 0;
+        caches = 0;
+        engine = ENGINE_PREDECODED;
+    }
+    if (engine == ENGINE_LOCKSTEP) {
+        fprintf(stderr, "Note: --lockstep only applies to --batch; using the interpreter\n");
+        engine = ENGINE_PREDECODED;
+    }
+    if (engine == ENGINE_JIT && trace_level >= TRACE_INSTR) {
+        fprintf(stderr, "Note: --jit does not trace individual instructions; using the interpreter\n");
+        engine = ENGINE_PREDECODED;
+    }
+    if (profile && engine == ENGINE_JIT) {
+        fprintf(stderr, "Note: --profile is kept by the interpreter\n");
+        engine = ENGINE_PREDECODED;     // Translated blocks do not count their transfers
+    }
+    if (checkpoint.path != NULL && engine != ENGINE_PREDECODED) {
+        fprintf(stderr, "Note: checkpoints are taken by the interpreter\n");
+        engine = ENGINE_PREDECODED;     // Only run_predecoded() can pause at an exact cycle count
+    }
+    if ((forwarding >= 0 || out_of_order || bpred.kind || caches || trace_file != NULL || stage_times) && engine != ENGINE_STAGED) {
+        if (engine != ENGINE_PREDECODED) fprintf(stderr, "Note: --pipeline, --ooo, --bpred, --trace-file, --stage-times and the cache model run the staged engine\n");
+        engine = ENGINE_STAGED;         // They are fed by the Fetch/Decode/Execute/Mem/Writeback loop
+    }
+
+    cpu = riscv_sim_create();
+    cpu->trace_level = trace_level;
+    cpu->max_cycles = max_cycles;
+    cpu->no_fusion = no_fusion;
+    if (forwarding >= 0) cpu->pipeline = pipeline_create(forwarding);
+    if (out_of_order) cpu->ooo = ooo_create(&ooo);
+    if (bpred.kind) cpu->bpred = bpred_create(&bpred);
+    if (caches) {
+        if (use_l2) cpu->l2 = cache_create("L2", &l2, NULL);
+        cpu->icache = cache_create("L1I", &l1i, cpu->l2);
+        cpu->dcache = cache_create("L1D", &l1d, cpu->l2);
+    }
+    if (profile) cpu->profile = profile_create();
+    if (stage_times && (cpu->stage_times = calloc(1, sizeof(*cpu->stage_times))) == NULL) {
+        perror("calloc");
+        goto done;
+    }
+
+    // Load the program, then the initial state given on the command line
+    if (riscv_sim_load_file(cpu, filename) < 0) {
+        goto done;
+    }
+    if (cpu->instr_count == 0) {
+        fprintf(stderr, "Error: No valid instructions loaded from %s\n", filename);
+        goto done;
+    }
+    for (int i = 0; i < init_count; i++) {
+        if (init[i].kind == INIT_REG) riscv_sim_set_reg(cpu, (int)init[i].target, (uint32_t)init[i].value);
+        else riscv_sim_write_mem(cpu, init[i].target, &init[i].value, 4);
+    }
+
+    // Continue from a snapshot of an earlier run of the same program
+    if (restore != NULL && checkpoint_restore(cpu, restore, restore_at) != 0) {
+        goto done;
+    }
+
+    // Start the delta trace from the state the run begins in
+    if (trace_file != NULL && (cpu->trace_out = trace_create(trace_file, cpu)) == NULL) {
+        goto done;
+    }
+
+    if (harts > 1) {
+        result = run_hart_group(cpu, harts, quantum);
+        goto done;
+    }
+
+    // Print initial state
+    if (trace_level >= TRACE_INSTR) {
+        printf("===== Initial State =====\n");
+        print_state(cpu, 1); // Use flag 1 for initial/final state format
+    }
+
+    // Execute program loop
+    if (trace_level >= TRACE_INSTR) printf("===== Program Execution =====\n");
+    double start = now_seconds();
+    uint64_t start_cycles = cpu->total_clock_cycles;
+    if (checkpoint.path != NULL) {
+        if (run_checkpointed(cpu, &checkpoint) < 0) goto done;
+    } else if (sampling) {
+        run_sampled(cpu, &sample);
+    } else {
+        int status = run_program(cpu, engine);
+        int failed = trace_close(cpu->trace_out, cpu, status) != 0;
+        cpu->trace_out = NULL;
+        if (failed) goto done;
+    }
+    double elapsed = now_seconds() - start;
+    uint64_t run_cycles = cpu->total_clock_cycles - start_cycles;
+    syscall_flush(cpu);                 // The guest's output comes before the final state
+
+    if (trace_level >= TRACE_INSTR) printf("===== Program terminated. =====\n");
+    // Print final state and simulation throughput
+    if (trace_level >= TRACE_FINAL) {
+        if (cpu->exited) printf("Program exited with code %d\n", cpu->exit_code);
+        print_state(cpu, 1); // Use flag 1 for initial/final state format
+        printf("Simulated %" PRIu64 " cycles in %.6f s (%.0f cycles/s)\n",
+               cpu->total_clock_cycles, elapsed, elapsed > 0 ? run_cycles / elapsed : 0.0);
+        if (cpu->pipeline != NULL) pipeline_report(cpu->pipeline, stdout);
+        if (cpu->ooo != NULL) ooo_report(cpu->ooo, stdout);
+        if (cpu->bpred != NULL) bpred_report(cpu->bpred, stdout);
+        if (cpu->icache != NULL) cache_report(cpu->icache, stdout);
+        if (cpu->dcache != NULL) cache_report(cpu->dcache, stdout);
+        if (cpu->l2 != NULL) cache_report(cpu->l2, stdout);
+        if (cpu->profile != NULL) profile_report(cpu->profile, cpu, stdout);
+        if (cpu->stage_times != NULL) stage_timers_report(cpu->stage_times, stdout);
+    }
+    if (folded != NULL && profile_write_folded(cpu->profile, folded) != 0) goto done;
+
+    // A program that called exit passes its code on, as a native run would
+    result = cpu->exited ? cpu->exit_code & 0xFF : EXIT_SUCCESS;
+
+done:
+    if (cpu != NULL) riscv_sim_destroy(cpu);
+    free(init);
+    return result;
+}
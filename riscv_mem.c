@@ -0,0 +1,229 @@
+// Sparse guest memory: a full 32-bit address space backed by 4 KiB pages that
+// are allocated the first time they are written. A two-level page table maps
+// virtual page numbers to host pages, and two small direct-mapped TLBs (one for
+// loads, one for stores) let the common access skip the walk. Pages that hold
+// the program image never enter the store TLB, so stores to code always reach
+// the slow path, where the caller can update its decoded copy of the program.
+//
+// Every page that enters the store TLB or is written through the slow path is
+// marked dirty. mem_clean() clears the marks and empties the store TLB, so the
+// first store to each page afterwards marks it again (used by checkpoints).
+//
+// Harts share one page table (mem_share()) but keep their own TLBs. Walks and
+// allocations of a shared table take one lock; TLB hits do not, and pages are
+// never freed while the harts run, so a TLB entry stays valid without it.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "riscv_cpu.h"
+
+#define DIR_BITS 10                             // Top-level index bits (the rest of the VPN indexes a leaf table)
+#define LEAF_ENTRIES (1u << (32 - PAGE_SHIFT - DIR_BITS))
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;    // Serialises walks of shared page tables
+
+static void *mem_alloc(size_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        perror("guest memory");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void tlb_flush(tlb_entry *tlb) {
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        tlb[i].vpn = TLB_INVALID;
+        tlb[i].page = NULL;
+    }
+}
+
+void mem_init(guest_mem *m) {
+    memset(m, 0, sizeof(*m));
+    tlb_flush(m->read_tlb);
+    tlb_flush(m->write_tlb);
+}
+
+#define DIR_INDEX(vpn) ((vpn) >> (32 - PAGE_SHIFT - DIR_BITS))
+#define LEAF_INDEX(vpn) ((vpn) & (LEAF_ENTRIES - 1))
+
+// Release every page (the address space reads as zero again); keeps the program image range.
+// Memory sharing another's pages (mem_share()) just stops sharing them.
+void mem_clear(guest_mem *m) {
+    for (uint32_t i = 0; i < m->page_count; i++) {
+        uint32_t vpn = m->vpns[i];
+        free(m->dir[DIR_INDEX(vpn)][LEAF_INDEX(vpn)]);
+        if (i + 1 == m->page_count || DIR_INDEX(m->vpns[i + 1]) != DIR_INDEX(vpn)) {
+            free(m->dir[DIR_INDEX(vpn)]);   // Last page in this leaf table (vpns is sorted)
+        }
+    }
+    free(m->dir);
+    free(m->vpns);
+    free(m->dirty);
+    uint32_t code_start = m->code_start, code_end = m->code_end;
+    mem_init(m);
+    m->code_start = code_start;
+    m->code_end = code_end;
+}
+
+static void mark_dirty(guest_mem *m, uint32_t vpn) {
+    if (m->dirty == NULL) m->dirty = mem_alloc(1u << (32 - PAGE_SHIFT - 3));
+    m->dirty[vpn >> 3] |= (uint8_t)(1u << (vpn & 7));
+}
+
+// Zero every page but keep it allocated (and in the TLBs), for reuse by the next run
+void mem_zero(guest_mem *m) {
+    for (uint32_t i = 0; i < m->page_count; i++) {
+        uint32_t vpn = m->vpns[i];
+        memset(m->dir[DIR_INDEX(vpn)][LEAF_INDEX(vpn)], 0, PAGE_SIZE);
+        mark_dirty(m, vpn);
+    }
+}
+
+// Forget which pages were written; the next store to each page marks it dirty again
+void mem_clean(guest_mem *m) {
+    if (m->dirty != NULL) {
+        for (uint32_t i = 0; i < m->page_count; i++) m->dirty[m->vpns[i] >> 3] = 0;
+    }
+    tlb_flush(m->write_tlb);
+}
+
+// Whether the page has been written since the last mem_clean()
+int mem_page_dirty(const guest_mem *m, uint32_t vpn) {
+    return m->dirty != NULL && (m->dirty[vpn >> 3] >> (vpn & 7)) & 1;
+}
+
+// Index of the first allocated page at or after vpn in m->vpns
+static uint32_t page_rank(const guest_mem *m, uint32_t vpn) {
+    uint32_t lo = 0, hi = m->page_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (m->vpns[mid] < vpn) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Mark [start, end) as the program image: stores there always take the slow path
+void mem_set_code(guest_mem *m, uint32_t start, uint32_t end) {
+    m->code_start = start;
+    m->code_end = end;
+    tlb_flush(m->write_tlb);
+}
+
+// Use owner's pages from now on (another hart's memory); m keeps its own TLBs.
+// Any pages m had are released. The program image range is copied from owner.
+void mem_share(guest_mem *m, guest_mem *owner) {
+    mem_clear(m);
+    m->owner = owner;
+    m->shared = owner->shared = 1;
+    mem_set_code(m, owner->code_start, owner->code_end);
+}
+
+// Walk m's page table for vpn, allocating the page (and marking it dirty) when allocate is set
+static uint8_t *page_walk(guest_mem *m, uint32_t vpn, int allocate) {
+    uint32_t hi = DIR_INDEX(vpn), lo = LEAF_INDEX(vpn);
+
+    if (m->dir == NULL || m->dir[hi] == NULL || m->dir[hi][lo] == NULL) {
+        if (!allocate) return NULL;
+        if (m->dir == NULL) m->dir = mem_alloc((1u << DIR_BITS) * sizeof(*m->dir));
+        if (m->dir[hi] == NULL) m->dir[hi] = mem_alloc(LEAF_ENTRIES * sizeof(**m->dir));
+        if (m->dir[hi][lo] == NULL) {
+            m->dir[hi][lo] = mem_alloc(PAGE_SIZE);
+            if (m->page_count == m->page_capacity) {
+                m->page_capacity = m->page_capacity ? 2 * m->page_capacity : 16;
+                uint32_t *grown = realloc(m->vpns, m->page_capacity * sizeof(*grown));
+                if (grown == NULL) {
+                    perror("guest memory");
+                    exit(EXIT_FAILURE);
+                }
+                m->vpns = grown;
+            }
+            uint32_t rank = page_rank(m, vpn);
+            memmove(&m->vpns[rank + 1], &m->vpns[rank], (m->page_count - rank) * sizeof(*m->vpns));
+            m->vpns[rank] = vpn;
+            m->page_count++;
+        }
+    }
+    if (allocate) mark_dirty(m, vpn);
+    return m->dir[hi][lo];
+}
+
+// Host address of the page holding address, or NULL if it was never written
+// (allocated instead when allocate is set). Refills the TLBs.
+uint8_t *mem_page(guest_mem *m, uint32_t address, int allocate) {
+    uint32_t vpn = address >> PAGE_SHIFT;
+    uint8_t *page;
+    if (m->shared) {
+        pthread_mutex_lock(&shared_lock);
+        page = page_walk(m->owner != NULL ? m->owner : m, vpn, allocate);
+        pthread_mutex_unlock(&shared_lock);
+    } else {
+        page = page_walk(m, vpn, allocate);
+    }
+    if (page == NULL) return NULL;
+
+    tlb_entry *r = &m->read_tlb[vpn & (TLB_ENTRIES - 1)];
+    r->vpn = vpn;
+    r->page = page;
+    uint64_t page_start = (uint64_t)vpn << PAGE_SHIFT;
+    if (allocate && (m->code_end <= page_start || m->code_start >= page_start + PAGE_SIZE)) {
+        tlb_entry *w = &m->write_tlb[vpn & (TLB_ENTRIES - 1)];
+        w->vpn = vpn;
+        w->page = page;
+    }
+    return page;
+}
+
+// Page after *vpn (inclusive) that has been allocated, in address order; NULL when there are none left
+uint8_t *mem_next_page(const guest_mem *m, uint32_t *vpn) {
+    if (m->owner != NULL) m = m->owner;
+    uint32_t rank = page_rank(m, *vpn);
+    if (rank == m->page_count) return NULL;
+    *vpn = m->vpns[rank];
+    return m->dir[DIR_INDEX(*vpn)][LEAF_INDEX(*vpn)];
+}
+
+// Word at a 4-byte aligned address without any fault checks (0 if never written)
+uint32_t mem_peek(guest_mem *m, uint32_t address) {
+    uint8_t *page = mem_page(m, address, 0);
+    uint32_t value = 0;
+    if (page != NULL) memcpy(&value, page + (address & (PAGE_SIZE - 1)), 4);
+    return value;
+}
+
+// Store a word at a 4-byte aligned address without any fault checks
+void mem_poke(guest_mem *m, uint32_t address, uint32_t value) {
+    memcpy(mem_page(m, address, 1) + (address & (PAGE_SIZE - 1)), &value, 4);
+}
+
+// Copy size bytes into memory starting at any address (used to load program segments)
+void mem_write(guest_mem *m, uint32_t address, const void *src, uint32_t size) {
+    const uint8_t *bytes = src;
+    while (size > 0) {
+        uint32_t offset = address & (PAGE_SIZE - 1);
+        uint32_t chunk = PAGE_SIZE - offset < size ? PAGE_SIZE - offset : size;
+        memcpy(mem_page(m, address, 1) + offset, bytes, chunk);
+        address += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+}
+
+// Copy size bytes out of memory starting at any address (pages never written read as zero)
+void mem_read(guest_mem *m, uint32_t address, void *dst, uint32_t size) {
+    uint8_t *bytes = dst;
+    while (size > 0) {
+        uint32_t offset = address & (PAGE_SIZE - 1);
+        uint32_t chunk = PAGE_SIZE - offset < size ? PAGE_SIZE - offset : size;
+        const uint8_t *page = mem_page(m, address, 0);
+        if (page != NULL) memcpy(bytes, page + offset, chunk);
+        else memset(bytes, 0, chunk);
+        address += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+}
@@ -0,0 +1,379 @@
+// Timing model of an out-of-order superscalar core: fetch, rename and dispatch
+// in order, issue out of order from per-class issue queues, commit in order
+// from a reorder buffer.
+//
+// Like the 5-stage model, it is driven by the staged engine: run_staged()
+// hands each instruction to ooo_feed() after it has completed functionally,
+// so values, addresses and branch outcomes always come from the datapath and
+// the model can never change the architectural state.
+//
+// Rather than clocking every structure each cycle, the model works out the
+// cycle of each event in an instruction's life in program order:
+//   - fetch: fetch_width instructions per cycle. A taken transfer ends the
+//     fetch group, and fetch waits for a redirect. Without a predictor (-1 from
+//     run_staged()), fetch falls through: jal redirects once decoded (depth
+//     cycles after fetch), branches and jalr once they execute. With --bpred,
+//     only mispredicted instructions redirect, once they execute.
+//   - dispatch: depth cycles after fetch, fetch_width per cycle, once the ROB,
+//     the instruction's issue queue and (for memory operations) the LSQ have
+//     a free entry. ecall and CSR accesses wait until every older
+//     instruction has committed. A stalled dispatch holds up fetch.
+//   - issue: the cycle after dispatch at the earliest, once the renamed
+//     sources are ready, at most issue_width per cycle and one per free unit.
+//     The oldest instruction gets the earliest slot. A load also waits for
+//     the data of an older, uncommitted store to the same word (store-to-load
+//     forwarding; addresses are known exactly, so there are no ordering
+//     violations to replay).
+//   - complete: issue plus the class latency (stores: 1). Dividers stay busy
+//     for their whole latency.
+//   - commit: at or after completion, in order, commit_width per cycle. The
+//     ROB and LSQ entries are freed then; issue queue entries at issue.
+// Renaming is modelled by keeping, for each architectural register, the cycle
+// its newest value is ready: only true dependences delay an instruction.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "riscv_cpu.h"
+
+#define OOO_MAX_ROB      512
+#define OOO_MAX_LATENCY  32
+#define CALENDAR_SIZE    (1 << 15)  // More cycles than the instructions in flight can span
+#define STORE_TABLE_SIZE 256        // Recent stores by word address, for forwarding
+
+// Issue slots and busy units in one cycle (valid while cycle matches)
+typedef struct {
+    uint64_t cycle;
+    uint8_t issued;
+    uint8_t busy[OOO_FU_COUNT];
+} issue_slot;
+
+typedef struct {
+    uint32_t word;                  // Address >> 2 (0 with commit 0: empty)
+    uint64_t ready;                 // Cycle the store's data can be forwarded
+    uint64_t commit;                // Cycle it leaves the LSQ
+} store_entry;
+
+// Issue cycles of the instructions in one issue queue (a min-heap)
+typedef struct {
+    uint64_t *issue;
+    int count;
+} issue_queue;
+
+struct ooo_model {
+    ooo_config config;
+
+    uint64_t reg_ready[32];         // Rename table: cycle each register's newest value is ready
+    uint8_t reg_class[32];          // and the unit class that produces it
+
+    uint64_t *rob_commit;           // Commit cycles of the last config.rob instructions (ring)
+    uint64_t *lsq_commit;           // Commit cycles of the last config.lsq memory operations (ring)
+    issue_queue queues[OOO_FU_COUNT];
+    issue_slot *calendar;           // Indexed by cycle % CALENDAR_SIZE
+    store_entry stores[STORE_TABLE_SIZE];
+    uint64_t seq, mem_seq;          // Instructions and memory operations fed so far
+
+    uint64_t fetch_cycle;           // Cycle of the current fetch group and its size
+    int fetch_used;
+    uint64_t redirect;              // Earliest cycle the next instruction can be fetched
+    int redirect_kind;              // PIPE_BRANCH_* that set it
+    uint64_t dispatch_cycle;        // Cycle of the latest dispatch and how many it held
+    int dispatch_used;
+    uint64_t commit_cycle;          // Cycle of the latest commit and how many it held
+    int commit_used;
+
+    ooo_stats stats;
+};
+
+static void *ooo_alloc(size_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        perror("ooo_create");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+ooo_model *ooo_create(const ooo_config *config) {
+    ooo_model *m = ooo_alloc(sizeof(*m));
+    m->config = *config;
+    m->rob_commit = ooo_alloc(config->rob * sizeof(*m->rob_commit));
+    m->lsq_commit = ooo_alloc(config->lsq * sizeof(*m->lsq_commit));
+    for (int q = 0; q < OOO_FU_COUNT; q++) m->queues[q].issue = ooo_alloc(config->iq * sizeof(uint64_t));
+    m->calendar = ooo_alloc(CALENDAR_SIZE * sizeof(*m->calendar));
+    return m;
+}
+
+void ooo_destroy(ooo_model *m) {
+    if (m == NULL) return;
+    for (int q = 0; q < OOO_FU_COUNT; q++) free(m->queues[q].issue);
+    free(m->calendar);
+    free(m->lsq_commit);
+    free(m->rob_commit);
+    free(m);
+}
+
+static uint64_t queue_min(const issue_queue *q) {
+    return q->issue[0];
+}
+
+static void queue_pop(issue_queue *q) {
+    uint64_t last = q->issue[--q->count];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= q->count) break;
+        if (child + 1 < q->count && q->issue[child + 1] < q->issue[child]) child++;
+        if (q->issue[child] >= last) break;
+        q->issue[i] = q->issue[child];
+        i = child;
+    }
+    if (q->count > 0) q->issue[i] = last;
+}
+
+static void queue_push(issue_queue *q, uint64_t issue) {
+    int i = q->count++;
+    while (i > 0 && q->issue[(i - 1) / 2] > issue) {
+        q->issue[i] = q->issue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    q->issue[i] = issue;
+}
+
+static issue_slot *slot_at(ooo_model *m, uint64_t cycle) {
+    issue_slot *s = &m->calendar[cycle & (CALENDAR_SIZE - 1)];
+    if (s->cycle != cycle) {
+        memset(s, 0, sizeof(*s));
+        s->cycle = cycle;
+    }
+    return s;
+}
+
+// First cycle from ready on with a free issue slot and a free unit of class fu
+// for busy cycles, which the instruction then takes
+static uint64_t schedule(ooo_model *m, uint64_t ready, int fu, int busy) {
+    const ooo_config *c = &m->config;
+    for (uint64_t cycle = ready;; cycle++) {
+        if (slot_at(m, cycle)->issued >= c->issue_width) continue;
+        int available = 1;
+        for (int i = 0; i < busy && available; i++) available = slot_at(m, cycle + i)->busy[fu] < c->units[fu];
+        if (!available) continue;
+        slot_at(m, cycle)->issued++;
+        for (int i = 0; i < busy; i++) slot_at(m, cycle + i)->busy[fu]++;
+        return cycle;
+    }
+}
+
+// Raise *cycle to at least floor, charging the difference to *stall
+static void wait_until(uint64_t *cycle, uint64_t floor, uint64_t *stall) {
+    if (floor > *cycle) {
+        *stall += floor - *cycle;
+        *cycle = floor;
+    }
+}
+
+// Time the instruction the staged engine just executed at pc. The datapath's
+// control signals still describe it; cpu->pc is where it went next and addr
+// the address it accessed (loads, stores and atomics). mispredicted is as for
+// pipeline_feed().
+void ooo_feed(ooo_model *m, const cpu_context *cpu, uint32_t rd, uint32_t rs1, uint32_t rs2, uint32_t pc, uint32_t addr, int mispredicted) {
+    const ooo_config *c = &m->config;
+    ooo_stats *st = &m->stats;
+
+    // Registers read and written, as for the 5-stage model
+    uint32_t sources[2] = { 0, 0 }, dest = 0;
+    if (cpu->RegWrite || cpu->MemRead || cpu->MemWrite || cpu->Branch || cpu->Jump) {
+        if (cpu->RegWrite) dest = rd;
+        if ((!cpu->Jump || cpu->ALUSrc) && cpu->ALUSrcA == ALU_A_RS1) sources[0] = rs1;
+        if (((!cpu->ALUSrc || cpu->MemWrite) && !cpu->Jump) || cpu->Atomic) sources[1] = rs2;
+    }
+    int memory = cpu->MemRead || cpu->MemWrite || cpu->Atomic;
+    int fu = memory ? OOO_FU_MEM
+           : cpu->ALUCtrl >= ALU_DIV && cpu->ALUCtrl <= ALU_REMU && !cpu->ALUSrc ? OOO_FU_DIV
+           : cpu->ALUCtrl >= ALU_MUL && cpu->ALUCtrl <= ALU_MULHU && !cpu->ALUSrc ? OOO_FU_MUL
+           : OOO_FU_ALU;
+    int is_load = cpu->MemRead || cpu->Atomic;
+
+    // Fetch
+    uint64_t fetch = m->fetch_cycle;
+    if (m->fetch_used >= c->fetch_width) fetch++;
+    wait_until(&fetch, m->redirect, &st->fetch_stalls[m->redirect_kind]);
+    if (fetch != m->fetch_cycle) {
+        m->fetch_cycle = fetch;
+        m->fetch_used = 0;
+    }
+    m->fetch_used++;
+
+    // Rename and dispatch
+    uint64_t dispatch = fetch + (uint64_t)c->depth;
+    if (dispatch < m->dispatch_cycle) dispatch = m->dispatch_cycle;
+    if (dispatch == m->dispatch_cycle && m->dispatch_used >= c->fetch_width) dispatch++;
+    if (m->seq >= (uint64_t)c->rob) {
+        wait_until(&dispatch, m->rob_commit[m->seq % c->rob] + 1, &st->dispatch_stalls[OOO_FULL_ROB]);
+    }
+    issue_queue *queue = &m->queues[fu];
+    for (;;) {
+        while (queue->count > 0 && queue_min(queue) < dispatch) queue_pop(queue);
+        if (queue->count < c->iq) break;
+        wait_until(&dispatch, queue_min(queue) + 1, &st->dispatch_stalls[OOO_FULL_IQ]);
+    }
+    if (memory && m->mem_seq >= (uint64_t)c->lsq) {
+        wait_until(&dispatch, m->lsq_commit[m->mem_seq % c->lsq] + 1, &st->dispatch_stalls[OOO_FULL_LSQ]);
+    }
+    if (cpu->System || cpu->Csr) {
+        wait_until(&dispatch, m->commit_cycle + 1, &st->dispatch_stalls[OOO_FULL_SERIAL]);
+    }
+    if (dispatch != m->dispatch_cycle) {
+        m->dispatch_cycle = dispatch;
+        m->dispatch_used = 0;
+    }
+    m->dispatch_used++;
+    if (dispatch - (uint64_t)c->depth > m->fetch_cycle) {
+        m->fetch_cycle = dispatch - (uint64_t)c->depth;   // The front end backs up behind dispatch
+        m->fetch_used = 0;
+    }
+
+    // Issue: operands, then a store this load reads from, then a free unit
+    uint64_t ready = dispatch + 1;
+    int waited_on = -1;
+    for (int i = 0; i < 2; i++) {
+        if (sources[i] != 0 && m->reg_ready[sources[i]] > ready) {
+            ready = m->reg_ready[sources[i]];
+            waited_on = m->reg_class[sources[i]];
+        }
+    }
+    if (waited_on >= 0) st->issue_waits[waited_on] += ready - (dispatch + 1);
+    store_entry *store = &m->stores[(addr >> 2) & (STORE_TABLE_SIZE - 1)];
+    if (is_load && store->word == addr >> 2 && store->commit > dispatch) {
+        wait_until(&ready, store->ready, &st->issue_waits[OOO_WAIT_STORE]);
+    }
+    int latency = fu == OOO_FU_MEM && !is_load ? 1 : c->latency[fu];
+    uint64_t issue = schedule(m, ready, fu, fu == OOO_FU_DIV ? latency : 1);
+    st->issue_waits[OOO_WAIT_UNITS] += issue - ready;
+    st->issued[fu]++;
+    queue_push(queue, issue);
+    uint64_t complete = issue + (uint64_t)latency;
+    if (dest != 0) {
+        m->reg_ready[dest] = complete;
+        m->reg_class[dest] = (uint8_t)fu;
+    }
+
+    // Redirect the instructions that follow
+    int kind = branch_kind(cpu);
+    int taken = cpu->pc != pc + 4;
+    int redirect = mispredicted >= 0 ? kind != PIPE_BRANCH_NONE && mispredicted
+                                     : kind == PIPE_BRANCH_JAL || kind == PIPE_BRANCH_JALR || (kind == PIPE_BRANCH_COND && taken);
+    if (redirect) {
+        m->redirect = kind == PIPE_BRANCH_JAL && mispredicted < 0 ? fetch + (uint64_t)c->depth : complete;
+        m->redirect_kind = kind;
+    } else if (taken) {
+        m->fetch_used = c->fetch_width;     // A predicted taken transfer ends the fetch group
+    }
+
+    // Commit
+    uint64_t commit = complete > m->commit_cycle ? complete : m->commit_cycle;
+    if (commit == m->commit_cycle && m->commit_used >= c->commit_width) commit++;
+    if (commit != m->commit_cycle) {
+        m->commit_cycle = commit;
+        m->commit_used = 0;
+    }
+    m->commit_used++;
+    m->rob_commit[m->seq++ % c->rob] = commit;
+    if (memory) {
+        m->lsq_commit[m->mem_seq++ % c->lsq] = commit;
+        st->lsq_held += commit - dispatch + 1;
+        if (cpu->MemWrite || cpu->Atomic) *store = (store_entry){ addr >> 2, complete, commit };
+    }
+
+    st->cycles = commit + 1;
+    st->retired++;
+    st->rob_held += commit - dispatch + 1;
+    st->iq_held += issue - dispatch;
+}
+
+const ooo_stats *ooo_get_stats(const ooo_model *m) {
+    return &m->stats;
+}
+
+// Parse an --ooo spec: [width=N][,fetch=N][,issue=N][,commit=N][,rob=N][,iq=N][,lsq=N][,depth=N]
+// [,alu=N][,mul=N][,div=N][,mem=N] (units) [,alu-lat=N][,mul-lat=N][,div-lat=N][,load-lat=N]
+int parse_ooo(const char *spec, ooo_config *config) {
+    static const char *const unit_names[OOO_FU_COUNT] = { "alu", "mul", "div", "mem" };
+    static const char *const latency_names[OOO_FU_COUNT] = { "alu-lat", "mul-lat", "div-lat", "load-lat" };
+    *config = (ooo_config){
+        .fetch_width = 4, .issue_width = 4, .commit_width = 4,
+        .rob = 128, .iq = 32, .lsq = 32, .depth = 4,
+        .units = { 4, 1, 1, 2 },
+        .latency = { 1, 3, 20, 3 },
+    };
+
+    while (*spec != '\0') {
+        size_t len = strcspn(spec, ",");
+        const char *eq = memchr(spec, '=', len);
+        if (eq == NULL) return -1;
+        char *end;
+        long value = strtol(eq + 1, &end, 0);
+        if (end != spec + len || value < 1) return -1;
+        size_t name_len = (size_t)(eq - spec);
+        int *field = NULL;
+        long max = 16;                  // Widths and unit counts
+        if (name_len == 5 && strncmp(spec, "width", 5) == 0) {
+            if (value > max) return -1;
+            config->fetch_width = config->issue_width = config->commit_width = (int)value;
+        } else if (name_len == 5 && strncmp(spec, "fetch", 5) == 0) field = &config->fetch_width;
+        else if (name_len == 5 && strncmp(spec, "issue", 5) == 0) field = &config->issue_width;
+        else if (name_len == 6 && strncmp(spec, "commit", 6) == 0) field = &config->commit_width;
+        else if (name_len == 3 && strncmp(spec, "rob", 3) == 0) field = &config->rob, max = OOO_MAX_ROB;
+        else if (name_len == 2 && strncmp(spec, "iq", 2) == 0) field = &config->iq, max = OOO_MAX_ROB;
+        else if (name_len == 3 && strncmp(spec, "lsq", 3) == 0) field = &config->lsq, max = OOO_MAX_ROB;
+        else if (name_len == 5 && strncmp(spec, "depth", 5) == 0) field = &config->depth, max = OOO_MAX_LATENCY;
+        else {
+            for (int fu = 0; fu < OOO_FU_COUNT && field == NULL; fu++) {
+                if (strlen(unit_names[fu]) == name_len && strncmp(spec, unit_names[fu], name_len) == 0) {
+                    field = &config->units[fu];
+                } else if (strlen(latency_names[fu]) == name_len && strncmp(spec, latency_names[fu], name_len) == 0) {
+                    field = &config->latency[fu];
+                    max = OOO_MAX_LATENCY;
+                }
+            }
+            if (field == NULL) return -1;
+        }
+        if (field != NULL) {
+            if (value > max) return -1;
+            *field = (int)value;
+        }
+        spec += len;
+        if (*spec == ',') spec++;
+    }
+    return 0;
+}
+
+void ooo_report(const ooo_model *m, FILE *out) {
+    static const char *const wait_names[OOO_WAIT_COUNT] = { "ALU", "mul", "div", "load", "store", "units" };
+    const ooo_config *c = &m->config;
+    const ooo_stats *s = &m->stats;
+    double cycles = s->cycles ? (double)s->cycles : 1.0;
+    uint64_t control = s->fetch_stalls[PIPE_BRANCH_COND] + s->fetch_stalls[PIPE_BRANCH_JAL] + s->fetch_stalls[PIPE_BRANCH_JALR];
+
+    fprintf(out, "Out-of-order: %" PRIu64 " cycles, %" PRIu64 " instructions committed, IPC %.3f"
+            " (width %d/%d/%d, ROB %d, IQ %d, LSQ %d)\n",
+            s->cycles, s->retired, s->retired ? (double)s->retired / cycles : 0.0,
+            c->fetch_width, c->issue_width, c->commit_width, c->rob, c->iq, c->lsq);
+    fprintf(out, "  Average occupancy: ROB %.1f, issue queues %.1f, LSQ %.1f\n",
+            (double)s->rob_held / cycles, (double)s->iq_held / cycles, (double)s->lsq_held / cycles);
+    fprintf(out, "  Issued: ALU %" PRIu64 ", mul %" PRIu64 ", div %" PRIu64 ", memory %" PRIu64 "\n",
+            s->issued[OOO_FU_ALU], s->issued[OOO_FU_MUL], s->issued[OOO_FU_DIV], s->issued[OOO_FU_MEM]);
+    fprintf(out, "  Dispatch stall cycles: ROB full %" PRIu64 ", IQ full %" PRIu64 ", LSQ full %" PRIu64
+            ", serialising %" PRIu64 "\n",
+            s->dispatch_stalls[OOO_FULL_ROB], s->dispatch_stalls[OOO_FULL_IQ],
+            s->dispatch_stalls[OOO_FULL_LSQ], s->dispatch_stalls[OOO_FULL_SERIAL]);
+    fprintf(out, "  Fetch stall cycles: %" PRIu64 " (branch %" PRIu64 ", jal %" PRIu64 ", jalr %" PRIu64 ")\n",
+            control, s->fetch_stalls[PIPE_BRANCH_COND], s->fetch_stalls[PIPE_BRANCH_JAL], s->fetch_stalls[PIPE_BRANCH_JALR]);
+    fprintf(out, "  Issue wait (instruction-cycles):");
+    for (int w = 0; w < OOO_WAIT_COUNT; w++) {
+        fprintf(out, "%s %s %" PRIu64, w ? "," : "", wait_names[w], s->issue_waits[w]);
+    }
+    fprintf(out, "\n");
+}
@@ -0,0 +1,197 @@
+// Timing model of the classic 5-stage in-order pipeline (IF, ID, EX, MEM, WB).
+//
+// The model is driven by the staged engine: after each instruction completes
+// functionally, run_staged() hands it to pipeline_feed(), which clocks the
+// pipeline until that instruction has been fetched. Only timing is modelled;
+// values always come from the functional datapath.
+//
+// Hazards:
+//   - Data: a source register must be available when the instruction enters EX.
+//     The enabled forwarding paths (PIPE_FWD_*) decide how early a result can be
+//     used; otherwise the instruction waits in ID. A load followed by a use of
+//     its result always costs at least one cycle (load-use).
+//   - Control: without a branch predictor, fetch predicts not taken. jal is
+//     redirected in ID (1 bubble); branches and jalr are resolved in EX (2 bubbles
+//     when they redirect). With one (--bpred), only mispredicted instructions
+//     redirect, at the same stages.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "riscv_cpu.h"
+
+enum { STAGE_IF, STAGE_ID, STAGE_EX, STAGE_MEM, STAGE_WB, STAGE_COUNT };
+
+// Timing-relevant part of one instruction (a bubble has valid = 0)
+typedef struct {
+    uint8_t valid;
+    uint8_t rd;                     // Register written (0 if none)
+    uint8_t rs1, rs2;               // Registers read (0 if unused)
+    uint8_t is_load;
+    uint8_t redirect;               // PIPE_BRANCH_* if it changes the fetch stream, else 0
+    uint8_t resolve;                // Stage whose end makes the target known
+} pipe_instr;
+
+struct pipeline_model {
+    // stage[STAGE_ID] is the IF/ID register, stage[STAGE_EX] the ID/EX register, and so on
+    pipe_instr stage[STAGE_COUNT];
+    int forwarding;                 // PIPE_FWD_* paths enabled
+    pipeline_stats stats;
+};
+
+pipeline_model *pipeline_create(int forwarding) {
+    pipeline_model *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+        perror("pipeline_create");
+        exit(EXIT_FAILURE);
+    }
+    p->forwarding = forwarding;
+    return p;
+}
+
+void pipeline_destroy(pipeline_model *p) {
+    free(p);
+}
+
+// Cause of the stall if the instruction in ID cannot enter EX at the next edge (0 if it can)
+static int data_hazard(const pipeline_model *p) {
+    const pipe_instr *id = &p->stage[STAGE_ID];
+    if (!id->valid) return 0;
+
+    int sources[2] = { id->rs1, id->rs2 };
+    int cause = 0;
+    for (int i = 0; i < 2; i++) {
+        if (sources[i] == 0) continue;
+        // The youngest older writer of the register decides when its value is available
+        for (int s = STAGE_EX; s <= STAGE_WB; s++) {
+            const pipe_instr *producer = &p->stage[s];
+            if (!producer->valid || producer->rd != sources[i]) continue;
+            int ready;
+            if (s == STAGE_EX) {        // In MEM when we are in EX: EX/MEM forwarding of an ALU result
+                ready = (p->forwarding & PIPE_FWD_EX_MEM) && !producer->is_load;
+                if (!ready && producer->is_load && (p->forwarding & PIPE_FWD_MEM_WB)) {
+                    return STALL_LOAD_USE;
+                }
+            } else if (s == STAGE_MEM) { // In WB when we are in EX: MEM/WB forwarding
+                ready = (p->forwarding & PIPE_FWD_MEM_WB) != 0;
+            } else {                    // Writing back now: only if ID reads the register file after WB writes it
+                ready = (p->forwarding & PIPE_FWD_RF) != 0;
+            }
+            if (!ready) cause = STALL_DATA;
+            break;
+        }
+    }
+    return cause;
+}
+
+// Whether a redirecting instruction has not been resolved yet, so fetch has nothing to fetch
+static int fetch_blocked(const pipeline_model *p, int *kind) {
+    for (int s = STAGE_IF; s <= STAGE_EX; s++) {
+        const pipe_instr *in = &p->stage[s];
+        if (in->valid && in->redirect && s <= in->resolve) {
+            *kind = in->redirect;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// One clock edge. next is the next instruction on the executed path (NULL once
+// there are none). Returns 1 if next was fetched.
+static int pipeline_cycle(pipeline_model *p, const pipe_instr *next) {
+    int stall = data_hazard(p);
+
+    p->stage[STAGE_WB] = p->stage[STAGE_MEM];
+    p->stage[STAGE_MEM] = p->stage[STAGE_EX];
+    int fetched = 0;
+    if (stall) {
+        memset(&p->stage[STAGE_EX], 0, sizeof(pipe_instr)); // Bubble; ID and IF hold
+        p->stats.stalls[stall]++;
+    } else {
+        p->stage[STAGE_EX] = p->stage[STAGE_ID];
+        p->stage[STAGE_ID] = p->stage[STAGE_IF];
+        memset(&p->stage[STAGE_IF], 0, sizeof(pipe_instr));
+        int kind;
+        if (fetch_blocked(p, &kind)) {
+            if (next != NULL) p->stats.control_stalls[kind]++;
+        } else if (next != NULL) {
+            p->stage[STAGE_IF] = *next;
+            fetched = 1;
+        }
+    }
+
+    p->stats.cycles++;
+    if (p->stage[STAGE_WB].valid) p->stats.retired++;
+    return fetched;
+}
+
+// Time the instruction the staged engine just executed at pc. The datapath's
+// control signals still describe it; cpu->pc is where it went next.
+// mispredicted says whether the branch predictor sent fetch down the wrong
+// path (-1 without a predictor: fetch falls through to pc + 4).
+void pipeline_feed(pipeline_model *p, const cpu_context *cpu, uint32_t rd, uint32_t rs1, uint32_t rs2, uint32_t pc, int mispredicted) {
+    pipe_instr in = { .valid = 1 };
+    int recognised = cpu->RegWrite || cpu->MemRead || cpu->MemWrite || cpu->Branch || cpu->Jump;
+    if (recognised) {
+        if (cpu->RegWrite) in.rd = (uint8_t)rd;
+        if ((!cpu->Jump || cpu->ALUSrc) && cpu->ALUSrcA == ALU_A_RS1) in.rs1 = (uint8_t)rs1; // All but jal, lui and auipc read rs1
+        if ((!cpu->ALUSrc || cpu->MemWrite) && !cpu->Jump) in.rs2 = (uint8_t)rs2;
+    }
+    in.is_load = (uint8_t)cpu->MemRead;
+    int kind = branch_kind(cpu);
+    int redirect;
+    if (mispredicted >= 0) redirect = kind != PIPE_BRANCH_NONE && mispredicted;
+    else redirect = kind == PIPE_BRANCH_JAL || kind == PIPE_BRANCH_JALR || (kind == PIPE_BRANCH_COND && cpu->pc != pc + 4);
+    if (redirect) {
+        in.redirect = (uint8_t)kind;
+        in.resolve = kind == PIPE_BRANCH_JAL ? STAGE_ID : STAGE_EX;
+    }
+
+    while (!pipeline_cycle(p, &in)) {
+    }
+}
+
+// Clock the pipeline until every fed instruction has left WB
+void pipeline_drain(pipeline_model *p) {
+    for (;;) {
+        int busy = 0;
+        for (int s = STAGE_IF; s < STAGE_WB; s++) busy |= p->stage[s].valid;
+        if (!busy) break;
+        pipeline_cycle(p, NULL);
+    }
+    memset(p->stage, 0, sizeof(p->stage));
+}
+
+const pipeline_stats *pipeline_get_stats(const pipeline_model *p) {
+    return &p->stats;
+}
+
+// Parse a --pipeline forwarding list: "none", or a comma-separated subset of ex,mem,rf (-1 if invalid)
+int parse_forwarding(const char *list) {
+    if (strcmp(list, "none") == 0) return 0;
+    int forwarding = 0;
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        if (len == 2 && strncmp(list, "ex", 2) == 0) forwarding |= PIPE_FWD_EX_MEM;
+        else if (len == 3 && strncmp(list, "mem", 3) == 0) forwarding |= PIPE_FWD_MEM_WB;
+        else if (len == 2 && strncmp(list, "rf", 2) == 0) forwarding |= PIPE_FWD_RF;
+        else return -1;
+        list += len;
+        if (*list == ',') list++;
+    }
+    return forwarding;
+}
+
+void pipeline_report(const pipeline_model *p, FILE *out) {
+    const pipeline_stats *s = &p->stats;
+    uint64_t control = s->control_stalls[PIPE_BRANCH_COND] + s->control_stalls[PIPE_BRANCH_JAL]
+                     + s->control_stalls[PIPE_BRANCH_JALR];
+    fprintf(out, "Pipeline: %" PRIu64 " cycles, %" PRIu64 " instructions retired, CPI %.3f\n",
+            s->cycles, s->retired, s->retired ? (double)s->cycles / s->retired : 0.0);
+    fprintf(out, "  Stall cycles: load-use %" PRIu64 ", data %" PRIu64 ", control %" PRIu64
+            " (branch %" PRIu64 ", jal %" PRIu64 ", jalr %" PRIu64 ")\n",
+            s->stalls[STALL_LOAD_USE], s->stalls[STALL_DATA], control,
+            s->control_stalls[PIPE_BRANCH_COND], s->control_stalls[PIPE_BRANCH_JAL], s->control_stalls[PIPE_BRANCH_JALR]);
+}
@@ -0,0 +1,322 @@
+// Guest hot-spot profiler (--profile).
+//
+// The interpreters do not count every instruction. Instead they record each
+// control transfer into the instruction it lands on: a branch taken or not taken,
+// jal and jalr. They also record where each run starts and stops. An
+// instruction then executed as often as the one before it, if that one is
+// not a branch or jump, plus the transfers into it. So per-PC counts are exact
+// and cost one increment per branch. The counts are folded into totals when a
+// run stops and whenever a store rewrites the program, since the rewrite can
+// change which instructions are branches.
+//
+// Calls (jal/jalr with rd = ra/t0) and returns (jalr x0, 0(ra/t0)) also drive
+// a shadow call stack. The cycles between two call events are charged to the
+// stack that was current, and the stacks are written in the folded format
+// ("outer;inner count") that flame graph tools read.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "riscv_cpu.h"
+
+#define PROFILE_MAX_DEPTH 256           // Deeper calls are charged to the deepest frame
+#define PROFILE_REPORT_LINES 20         // Instructions and blocks listed in the report
+#define NODE_NONE UINT32_MAX
+
+// One distinct call stack: a function entry called from its parent's stack
+typedef struct {
+    uint32_t parent;
+    uint32_t function;              // Entry pc of the function
+    uint32_t chain;                 // Next node in the same hash bucket
+    uint64_t cycles;                // Instructions executed with exactly this stack
+} stack_node;
+
+typedef struct {
+    uint32_t node;
+    uint32_t return_pc;             // Where the call that made this frame returns to
+} stack_frame;
+
+struct guest_profile {
+    int64_t *entries;               // Transfers into each instruction, + starts - stops ([count]: outside the program)
+    uint32_t count;
+    uint64_t *counts;               // Executions of each instruction, as of the last fold
+    uint8_t *ops;                   // Micro-op of each instruction since the last fold
+    uint8_t *entered;               // 1: control has arrived other than from the instruction before
+    uint64_t mix[OP_COUNT];         // Executions of each micro-op
+    uint32_t resumed;               // Index the current stretch of entries started at
+
+    stack_node *nodes;
+    uint32_t node_count, node_capacity;
+    uint32_t *buckets;              // Hash of (parent, function) -> node
+    uint32_t bucket_mask;
+    stack_frame stack[PROFILE_MAX_DEPTH];
+    int depth;                      // Frames in use (stack[0] is the entry function)
+    uint64_t last_cycles;           // Cycle count at the last call event
+};
+
+static void *profile_alloc(size_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        perror("profile");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+guest_profile *profile_create(void) {
+    guest_profile *p = profile_alloc(sizeof(*p));
+    p->node_capacity = 256;
+    p->nodes = profile_alloc(p->node_capacity * sizeof(*p->nodes));
+    p->bucket_mask = 511;
+    p->buckets = profile_alloc((p->bucket_mask + 1) * sizeof(*p->buckets));
+    memset(p->buckets, 0xff, (p->bucket_mask + 1) * sizeof(*p->buckets));
+    return p;
+}
+
+void profile_destroy(guest_profile *p) {
+    if (p == NULL) return;
+    free(p->entries);
+    free(p->counts);
+    free(p->ops);
+    free(p->entered);
+    free(p->nodes);
+    free(p->buckets);
+    free(p);
+}
+
+static uint32_t node_hash(uint32_t parent, uint32_t function) {
+    return (parent * 0x9e3779b1u) ^ (function >> 2);
+}
+
+// The node for function called with parent as the current stack (created on first use)
+static uint32_t stack_node_for(guest_profile *p, uint32_t parent, uint32_t function) {
+    uint32_t *bucket = &p->buckets[node_hash(parent, function) & p->bucket_mask];
+    for (uint32_t n = *bucket; n != NODE_NONE; n = p->nodes[n].chain) {
+        if (p->nodes[n].parent == parent && p->nodes[n].function == function) return n;
+    }
+
+    if (p->node_count == p->node_capacity) {
+        p->node_capacity *= 2;
+        stack_node *grown = realloc(p->nodes, p->node_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            perror("profile");
+            exit(EXIT_FAILURE);
+        }
+        p->nodes = grown;
+        // Keep the table at most half full
+        free(p->buckets);
+        p->bucket_mask = 2 * p->node_capacity - 1;
+        p->buckets = profile_alloc((p->bucket_mask + 1) * sizeof(*p->buckets));
+        memset(p->buckets, 0xff, (p->bucket_mask + 1) * sizeof(*p->buckets));
+        for (uint32_t i = 0; i < p->node_count; i++) {
+            uint32_t *b = &p->buckets[node_hash(p->nodes[i].parent, p->nodes[i].function) & p->bucket_mask];
+            p->nodes[i].chain = *b;
+            *b = i;
+        }
+        bucket = &p->buckets[node_hash(parent, function) & p->bucket_mask];
+    }
+    uint32_t n = p->node_count++;
+    p->nodes[n].parent = parent;
+    p->nodes[n].function = function;
+    p->nodes[n].cycles = 0;
+    p->nodes[n].chain = *bucket;
+    *bucket = n;
+    return n;
+}
+
+static uint32_t entry_index(const guest_profile *p, const cpu_context *cpu, uint32_t pc) {
+    uint32_t index = code_index(cpu, pc);
+    return index < p->count ? index : p->count;
+}
+
+// Start (or resume) profiling a run at pc. Returns the transfer counters the
+// run loop increments, indexed like d_prog.
+int64_t *profile_start(guest_profile *p, cpu_context *cpu) {
+    uint32_t count = (uint32_t)cpu->instr_count;
+    if (p->entries == NULL) {
+        p->entries = profile_alloc((count + 1) * sizeof(*p->entries));
+        p->counts = profile_alloc((count + 1) * sizeof(*p->counts));
+        p->ops = profile_alloc((count + 1) * sizeof(*p->ops));
+        p->entered = profile_alloc((count + 1) * sizeof(*p->entered));
+        p->count = count;
+        for (uint32_t i = 0; i < count; i++) p->ops[i] = cpu->d_prog[i].op;
+    }
+    if (p->depth == 0) {
+        p->stack[0].node = stack_node_for(p, NODE_NONE, cpu->pc);
+        p->stack[0].return_pc = 0;
+        p->depth = 1;
+        p->last_cycles = cpu->total_clock_cycles;
+        p->entered[entry_index(p, cpu, cpu->pc)] = 1;     // The entry point starts a block
+    }
+    p->resumed = entry_index(p, cpu, cpu->pc);
+    p->entries[p->resumed]++;
+    return p->entries;
+}
+
+// Add the executions recorded in entries to the totals. The current stretch
+// must be stopped at index stopped, so each instruction's count is its
+// transfers in since the last one that does not fall through into it.
+static void fold(guest_profile *p, const cpu_context *cpu, uint32_t stopped) {
+    int64_t running = 0;
+    for (uint32_t i = 0; i < p->count; i++) {
+        if (i > 0 && op_is_transfer(p->ops[i - 1])) running = 0;
+        running += p->entries[i];
+        if (running > 0) {
+            p->counts[i] += (uint64_t)running;
+            p->mix[p->ops[i]] += (uint64_t)running;
+        }
+        // Transfers alone (not where the stretch started or stopped) make block leaders
+        if (p->entries[i] - (i == p->resumed) + (i == stopped) > 0) p->entered[i] = 1;
+    }
+    memset(p->entries, 0, (p->count + 1) * sizeof(*p->entries));
+    for (uint32_t i = 0; i < p->count; i++) p->ops[i] = cpu->d_prog[i].op;
+}
+
+// The run loop stopped at pc (the instruction there did not execute)
+void profile_stop(guest_profile *p, cpu_context *cpu) {
+    uint32_t index = entry_index(p, cpu, cpu->pc);
+    p->entries[index]--;
+    fold(p, cpu, index);
+    p->nodes[p->stack[p->depth - 1].node].cycles += cpu->total_clock_cycles - p->last_cycles;
+    p->last_cycles = cpu->total_clock_cycles;
+}
+
+// A store rewrote part of the program; execution continues at next_pc
+void profile_code_changed(guest_profile *p, cpu_context *cpu, uint32_t next_pc) {
+    uint32_t index = entry_index(p, cpu, next_pc);
+    p->entries[index]--;                // Stop here under the old code...
+    fold(p, cpu, index);
+    p->resumed = index;                 // ...and start again under the new
+    p->entries[index]++;
+}
+
+// A call to target that returns to return_pc; cycles counts the call itself
+void profile_call(guest_profile *p, uint32_t target, uint32_t return_pc, uint64_t cycles) {
+    stack_frame *top = &p->stack[p->depth - 1];
+    p->nodes[top->node].cycles += cycles - p->last_cycles;
+    p->last_cycles = cycles;
+    if (p->depth == PROFILE_MAX_DEPTH) return;
+    p->stack[p->depth].node = stack_node_for(p, top->node, target);
+    p->stack[p->depth].return_pc = return_pc;
+    p->depth++;
+}
+
+// A return to target; unwinds to the frame whose call returns there (none: stays put)
+void profile_return(guest_profile *p, uint32_t target, uint64_t cycles) {
+    p->nodes[p->stack[p->depth - 1].node].cycles += cycles - p->last_cycles;
+    p->last_cycles = cycles;
+    for (int d = p->depth - 1; d > 0; d--) {
+        if (p->stack[d].return_pc == target) {
+            p->depth = d;
+            return;
+        }
+    }
+}
+
+typedef struct {
+    uint32_t first, length;
+    uint64_t entered, executed;
+} hot_block;
+
+static const uint64_t *sort_counts;     // For qsort of instruction indices
+
+static int by_count(const void *a, const void *b) {
+    uint64_t x = sort_counts[*(const uint32_t *)a], y = sort_counts[*(const uint32_t *)b];
+    if (x != y) return x < y ? 1 : -1;
+    return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+static int by_executed(const void *a, const void *b) {
+    const hot_block *x = a, *y = b;
+    if (x->executed != y->executed) return x->executed < y->executed ? 1 : -1;
+    return x->first < y->first ? -1 : 1;
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+    return whole ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+void profile_report(const guest_profile *p, const cpu_context *cpu, FILE *out) {
+    if (p->entries == NULL) return;
+    const uint64_t *counts = p->counts, *mix = p->mix;
+    uint32_t base = cpu->mem.code_start;
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < p->count; i++) total += counts[i];
+    fprintf(out, "Profile: %" PRIu64 " instructions executed\n", total);
+    fprintf(out, "  Opcode mix:");
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (mix[op]) fprintf(out, " %s %" PRIu64 " (%.1f%%)", op_name(op), mix[op], percent(mix[op], total));
+    }
+    fprintf(out, "\n");
+
+    // Hottest instructions
+    uint32_t *order = profile_alloc((p->count + 1) * sizeof(*order));
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < p->count; i++) {
+        if (counts[i]) order[n++] = i;
+    }
+    sort_counts = counts;
+    qsort(order, n, sizeof(*order), by_count);
+    fprintf(out, "  Hot instructions:\n");
+    for (uint32_t i = 0; i < n && i < PROFILE_REPORT_LINES; i++) {
+        uint32_t k = order[i];
+        fprintf(out, "    0x%08" PRIx32 " %-7s 0x%08" PRIx32 " %" PRIu64 " (%.2f%%)\n",
+                base + 4 * k, op_name(p->ops[k]), cpu->d_prog[k].raw,
+                counts[k], percent(counts[k], total));
+    }
+
+    // Basic blocks: a block starts where control arrives and ends at a branch or jump
+    hot_block *blocks = profile_alloc((p->count + 1) * sizeof(*blocks));
+    uint32_t block_count = 0;
+    for (uint32_t i = 0; i < p->count; i++) {
+        int leader = i == 0 || op_is_transfer(p->ops[i - 1]) || p->entered[i];
+        if (leader) {
+            blocks[block_count].first = i;
+            blocks[block_count].entered = counts[i];
+            block_count++;
+        }
+        hot_block *b = &blocks[block_count - 1];
+        b->length++;
+        b->executed += counts[i];
+    }
+    qsort(blocks, block_count, sizeof(*blocks), by_executed);
+    fprintf(out, "  Hot basic blocks:\n");
+    for (uint32_t i = 0; i < block_count && i < PROFILE_REPORT_LINES && blocks[i].executed; i++) {
+        const hot_block *b = &blocks[i];
+        fprintf(out, "    0x%08" PRIx32 "-0x%08" PRIx32 " %" PRIu32 " instruction%s, entered %" PRIu64
+                ", executed %" PRIu64 " (%.2f%%)\n", base + 4 * b->first, base + 4 * (b->first + b->length - 1),
+                b->length, b->length == 1 ? "" : "s", b->entered, b->executed, percent(b->executed, total));
+    }
+    free(blocks);
+    free(order);
+}
+
+static void write_stack(FILE *out, const guest_profile *p, uint32_t node) {
+    if (p->nodes[node].parent != NODE_NONE) {
+        write_stack(out, p, p->nodes[node].parent);
+        fputc(';', out);
+    }
+    fprintf(out, "0x%08" PRIx32, p->nodes[node].function);
+}
+
+// Write the call stacks in folded format (one "frame;frame;... instructions" line each)
+int profile_write_folded(const guest_profile *p, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return -1;
+    }
+    for (uint32_t i = 0; i < p->node_count; i++) {
+        if (p->nodes[i].cycles == 0) continue;
+        write_stack(out, p, i);
+        fprintf(out, " %" PRIu64 "\n", p->nodes[i].cycles);
+    }
+    if (fclose(out) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,409 @@
+// Sampled simulation: a fast functional run plus detailed re-simulation of
+// evenly spaced intervals on a thread pool.
+//
+// The functional pass runs the whole program under run_predecoded() with no
+// output and, every opt->every cycles, takes an in-memory snapshot: pc,
+// registers, cycle count and the pages of guest memory. Pages that were not
+// written since the previous snapshot (the dirty bits in riscv_mem.c) are
+// shared with it instead of copied, so a snapshot costs about as much as the
+// memory written in one period.
+//
+// Worker threads pick the snapshots up as they appear, restore each into a
+// context of their own with fresh timing models (--pipeline, --ooo, --bpred
+// and the caches, configured as for a full run) and run it under run_staged():
+// first opt->warmup cycles to warm the models, then opt->length measured cycles.
+//
+// Each sample yields counts (pipeline cycles, mispredictions, misses) over the
+// instructions it measured. Whole-program rates are ratio estimates over all
+// samples, with a 95% confidence interval from the spread between samples,
+// and are scaled to the instruction count of the functional pass.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "riscv_cpu.h"
+
+enum { METRIC_CYCLES, METRIC_OOO_CYCLES, METRIC_MISPREDICTED, METRIC_L1I, METRIC_L1D, METRIC_L2, METRIC_COUNT };
+
+static const char *const metric_names[] = {
+    "CPI", "out-of-order CPI", "branch mispredictions", "L1I misses", "L1D misses", "L2 misses"
+};
+
+// Copy of one guest page, shared by consecutive snapshots while the page is unchanged
+typedef struct {
+    int refs;                       // Snapshots holding the copy (atomic)
+    uint8_t data[PAGE_SIZE];
+} page_copy;
+
+typedef struct {
+    uint32_t vpn;
+    page_copy *copy;
+} snapshot_page;
+
+typedef struct {
+    snapshot_page *pages;           // In address order
+    uint32_t count;
+} page_list;
+
+// One sample: the state it starts from, then what the detailed run measured
+typedef struct {
+    uint64_t cycles;                // total_clock_cycles at the snapshot
+    uint32_t pc;
+    int32_t rf[32];
+    syscall_state sys;              // Program break and open descriptors
+    uint64_t hpm_events[HPM_COUNT]; // For programs that read their hpmcounters
+    page_list memory;               // Every allocated page (empty once restored)
+
+    uint64_t instructions;          // Instructions measured (after the warm-up)
+    uint64_t counts[METRIC_COUNT];  // Events over those instructions
+} sample_point;
+
+typedef struct {
+    const sample_options *opt;
+    const program_image *image;
+    sample_point **samples;
+    int sample_count, sample_capacity;
+    int next_sample;                // First sample no worker has taken
+    int done;                       // The functional pass has taken its last snapshot
+    pthread_mutex_t lock;
+    pthread_cond_t more;            // Signalled when a snapshot is added or the pass finishes
+} sampler;
+
+static void *sample_alloc(size_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        perror("run_sampled");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static double sample_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Parse a --sample specification: [every=N][,warmup=N][,length=N] on top of the
+// defaults already in opt (-1 if invalid)
+int parse_sample(const char *spec, sample_options *opt) {
+    while (*spec != '\0') {
+        size_t len = strcspn(spec, ",");
+        const char *eq = memchr(spec, '=', len);
+        if (eq == NULL) return -1;
+        size_t name_len = (size_t)(eq - spec);
+        char *end;
+        unsigned long long n = strtoull(eq + 1, &end, 0);
+        if (end != spec + len || eq[1] == '-') return -1;
+
+        if (name_len == 5 && strncmp(spec, "every", 5) == 0) opt->every = n;
+        else if (name_len == 6 && strncmp(spec, "warmup", 6) == 0) opt->warmup = n;
+        else if (name_len == 6 && strncmp(spec, "length", 6) == 0) opt->length = n;
+        else return -1;
+        spec += len;
+        if (*spec == ',') spec++;
+    }
+    if (opt->length == 0 || opt->every < opt->warmup + opt->length) return -1;
+    return 0;
+}
+
+// Snapshot cpu, sharing the copies of pages that are clean since the pages in held
+static sample_point *take_snapshot(cpu_context *cpu, const page_list *held) {
+    sample_point *s = sample_alloc(sizeof(*s));
+    s->cycles = cpu->total_clock_cycles;
+    s->pc = cpu->pc;
+    memcpy(s->rf, cpu->rf, sizeof(s->rf));
+    syscall_save(cpu, &s->sys);
+    memcpy(s->hpm_events, cpu->hpm_events, sizeof(s->hpm_events));
+
+    uint32_t vpn = 0, n = 0;
+    while (mem_next_page(&cpu->mem, &vpn) != NULL) {
+        s->memory.count++;
+        if (++vpn == 0) break;
+    }
+    s->memory.pages = sample_alloc((s->memory.count ? s->memory.count : 1) * sizeof(*s->memory.pages));
+
+    uint32_t shared = 0;            // Walks held->pages alongside (both are in address order)
+    uint8_t *page;
+    vpn = 0;
+    while (n < s->memory.count && (page = mem_next_page(&cpu->mem, &vpn)) != NULL) {
+        while (shared < held->count && held->pages[shared].vpn < vpn) shared++;
+        snapshot_page *p = &s->memory.pages[n++];
+        p->vpn = vpn;
+        if (shared < held->count && held->pages[shared].vpn == vpn && !mem_page_dirty(&cpu->mem, vpn)) {
+            p->copy = held->pages[shared].copy;
+            __atomic_add_fetch(&p->copy->refs, 1, __ATOMIC_RELAXED);
+        } else {
+            p->copy = sample_alloc(sizeof(*p->copy));
+            p->copy->refs = 1;
+            memcpy(p->copy->data, page, PAGE_SIZE);
+        }
+        if (++vpn == 0) break;
+    }
+    mem_clean(&cpu->mem);
+    return s;
+}
+
+// Drop one reference to every page in list
+static void release_pages(page_list *list) {
+    for (uint32_t i = 0; i < list->count; i++) {
+        if (__atomic_sub_fetch(&list->pages[i].copy->refs, 1, __ATOMIC_ACQ_REL) == 0) free(list->pages[i].copy);
+    }
+    free(list->pages);
+    list->pages = NULL;
+    list->count = 0;
+}
+
+// Make held a second reference to the pages of s (the functional pass keeps it to share them with the next snapshot)
+static void hold_pages(page_list *held, const sample_point *s) {
+    release_pages(held);
+    held->count = s->memory.count;
+    held->pages = sample_alloc((held->count ? held->count : 1) * sizeof(*held->pages));
+    memcpy(held->pages, s->memory.pages, held->count * sizeof(*held->pages));
+    for (uint32_t i = 0; i < held->count; i++) __atomic_add_fetch(&held->pages[i].copy->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void add_sample(sampler *sp, sample_point *s) {
+    pthread_mutex_lock(&sp->lock);
+    if (sp->sample_count == sp->sample_capacity) {
+        sp->sample_capacity = sp->sample_capacity ? sp->sample_capacity * 2 : 64;
+        sample_point **grown = realloc(sp->samples, sp->sample_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            perror("run_sampled");
+            exit(EXIT_FAILURE);
+        }
+        sp->samples = grown;
+    }
+    sp->samples[sp->sample_count++] = s;
+    pthread_cond_signal(&sp->more);
+    pthread_mutex_unlock(&sp->lock);
+}
+
+// Wait for a sample no worker has taken (NULL once the pass is over and all are taken)
+static sample_point *next_sample(sampler *sp) {
+    sample_point *s = NULL;
+    pthread_mutex_lock(&sp->lock);
+    while (sp->next_sample == sp->sample_count && !sp->done) pthread_cond_wait(&sp->more, &sp->lock);
+    if (sp->next_sample < sp->sample_count) s = sp->samples[sp->next_sample++];
+    pthread_mutex_unlock(&sp->lock);
+    return s;
+}
+
+// Event counts of cpu's models so far
+static void read_counts(const cpu_context *cpu, uint64_t counts[METRIC_COUNT]) {
+    uint64_t accesses;
+    memset(counts, 0, METRIC_COUNT * sizeof(*counts));
+    if (cpu->pipeline != NULL) counts[METRIC_CYCLES] = pipeline_get_stats(cpu->pipeline)->cycles;
+    if (cpu->ooo != NULL) counts[METRIC_OOO_CYCLES] = ooo_get_stats(cpu->ooo)->cycles;
+    if (cpu->bpred != NULL) bpred_counts(cpu->bpred, &accesses, &counts[METRIC_MISPREDICTED]);
+    if (cpu->icache != NULL) cache_counts(cpu->icache, &accesses, &counts[METRIC_L1I]);
+    if (cpu->dcache != NULL) cache_counts(cpu->dcache, &accesses, &counts[METRIC_L1D]);
+    if (cpu->l2 != NULL) cache_counts(cpu->l2, &accesses, &counts[METRIC_L2]);
+}
+
+// Run cpu under run_staged() until its cycle count reaches target or the program halts
+static int run_staged_until(cpu_context *cpu, uint64_t target) {
+    if (cpu->total_clock_cycles >= target) return RUN_PAUSED;
+    cpu->max_cycles = target > 1 ? (long long)(target - 1) : 1;    // run_staged() stops once past the limit
+    return run_staged(cpu, UINT64_MAX);
+}
+
+// Restore sample s into cpu, then warm up and measure it with fresh models
+static void simulate_sample(const sampler *sp, cpu_context *cpu, sample_point *s) {
+    const sample_options *opt = sp->opt;
+    cpu_reset(cpu);
+    for (uint32_t i = 0; i < s->memory.count; i++) {
+        const snapshot_page *p = &s->memory.pages[i];
+        memcpy(mem_page(&cpu->mem, p->vpn << PAGE_SHIFT, 1), p->copy->data, PAGE_SIZE);
+    }
+    cpu->pc = s->pc;
+    memcpy(cpu->rf, s->rf, sizeof(cpu->rf));
+    cpu->total_clock_cycles = s->cycles;
+    syscall_restore(cpu, &s->sys);      // Files open in the functional pass become placeholders
+    memcpy(cpu->hpm_events, s->hpm_events, sizeof(cpu->hpm_events));
+    predecode_program(cpu);             // The snapshot may hold rewritten code
+    cpu->code_version++;
+    release_pages(&s->memory);
+
+    if (opt->forwarding >= 0) cpu->pipeline = pipeline_create(opt->forwarding);
+    if (opt->ooo != NULL) cpu->ooo = ooo_create(opt->ooo);
+    if (opt->bpred.kind) cpu->bpred = bpred_create(&opt->bpred);
+    if (opt->l1i != NULL) {
+        if (opt->l2 != NULL) cpu->l2 = cache_create("L2", opt->l2, NULL);
+        cpu->icache = cache_create("L1I", opt->l1i, cpu->l2);
+        cpu->dcache = cache_create("L1D", opt->l1d, cpu->l2);
+    }
+
+    uint64_t before[METRIC_COUNT], after[METRIC_COUNT];
+    if (run_staged_until(cpu, s->cycles + opt->warmup) != RUN_HALTED) {
+        uint64_t start = cpu->total_clock_cycles;
+        read_counts(cpu, before);
+        run_staged_until(cpu, start + opt->length);
+        read_counts(cpu, after);
+        s->instructions = cpu->total_clock_cycles - start;
+        for (int m = 0; m < METRIC_COUNT; m++) s->counts[m] = after[m] - before[m];
+    }
+
+    pipeline_destroy(cpu->pipeline);
+    ooo_destroy(cpu->ooo);
+    bpred_destroy(cpu->bpred);
+    cache_destroy(cpu->icache);
+    cache_destroy(cpu->dcache);
+    cache_destroy(cpu->l2);
+    cpu->pipeline = NULL;
+    cpu->ooo = NULL;
+    cpu->bpred = NULL;
+    cpu->icache = cpu->dcache = cpu->l2 = NULL;
+}
+
+static void *sample_worker_main(void *arg) {
+    sampler *sp = arg;
+    cpu_context *cpu = cpu_create();
+    cpu->trace_level = TRACE_NONE;
+    cpu->syscalls_muted = 1;            // The functional pass already did the samples' I/O
+    load_program(cpu, sp->image);
+
+    sample_point *s;
+    while ((s = next_sample(sp)) != NULL) simulate_sample(sp, cpu, s);
+    cpu_destroy(cpu);
+    return NULL;
+}
+
+// Two-sided 95% Student t quantile for df degrees of freedom
+static double t95(int df) {
+    static const double table[] = {
+        0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    if (df < 1) return 0.0;
+    if (df <= 30) return table[df];
+    return df <= 60 ? 2.000 : df <= 120 ? 1.980 : 1.960;
+}
+
+// Ratio estimate of metric m per measured instruction and its 95% half-width
+static void estimate(sample_point *const *samples, int count, int m, double *rate, double *bound) {
+    double events = 0, instructions = 0;
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (samples[i]->instructions == 0) continue;
+        events += (double)samples[i]->counts[m];
+        instructions += (double)samples[i]->instructions;
+        n++;
+    }
+    *rate = instructions > 0 ? events / instructions : 0.0;
+    *bound = 0.0;
+    if (n < 2) return;
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        if (samples[i]->instructions == 0) continue;
+        double residual = (double)samples[i]->counts[m] - *rate * (double)samples[i]->instructions;
+        sum += residual * residual;
+    }
+    double mean = instructions / n;
+    *bound = t95(n - 1) * sqrt(sum / ((double)n * (n - 1))) / mean;
+}
+
+static void sample_report(const sampler *sp, uint64_t total, double functional, double elapsed, int threads) {
+    const sample_options *opt = sp->opt;
+    int measured = 0;
+    uint64_t detailed_instructions = 0;
+    for (int i = 0; i < sp->sample_count; i++) {
+        if (sp->samples[i]->instructions > 0) measured++;
+        detailed_instructions += sp->samples[i]->instructions;
+    }
+    printf("Sampling: %d samples of %" PRIu64 " cycles (warm-up %" PRIu64 ") every %" PRIu64 " cycles, %d thread%s\n",
+           measured, opt->length, opt->warmup, opt->every, threads, threads == 1 ? "" : "s");
+    printf("  Functional pass: %" PRIu64 " instructions in %.6f s; detailed: %" PRIu64 " instructions (%.2f%%); %.6f s in all\n",
+           total, functional, detailed_instructions, total ? 100.0 * detailed_instructions / total : 0.0, elapsed);
+
+    int enabled[METRIC_COUNT] = {
+        opt->forwarding >= 0, opt->ooo != NULL, opt->bpred.kind != 0, opt->l1i != NULL, opt->l1i != NULL, opt->l2 != NULL
+    };
+    printf("  Estimates (95%% confidence):\n");
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        if (!enabled[m]) continue;
+        double rate, bound;
+        estimate(sp->samples, sp->sample_count, m, &rate, &bound);
+        if (m == METRIC_CYCLES || m == METRIC_OOO_CYCLES) {
+            printf("    %-22s %.4f +/- %.4f", metric_names[m], rate, bound);
+        } else {
+            printf("    %-22s %.3f +/- %.3f per 1000 instructions", metric_names[m], rate * 1000, bound * 1000);
+        }
+        printf(" => %.0f +/- %.0f %s\n", rate * total, bound * total,
+               m == METRIC_CYCLES || m == METRIC_OOO_CYCLES ? "cycles" : "events");
+    }
+    if (measured < 2) printf("  (fewer than two samples measured: no error bound)\n");
+}
+
+// Run the loaded program to completion with the interpreter, re-simulating
+// sampled intervals in detail on opt->threads workers, and print the estimates.
+// Returns the functional run's RUN_HALTED or RUN_LIMIT.
+int run_sampled(cpu_context *cpu, const sample_options *opt) {
+    sampler sp = { .opt = opt, .image = cpu->image };
+    pthread_mutex_init(&sp.lock, NULL);
+    pthread_cond_init(&sp.more, NULL);
+
+    int threads = opt->threads;
+    if (threads <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (int)online : 1;
+    }
+    pthread_t *tids = sample_alloc(threads * sizeof(*tids));
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, sample_worker_main, &sp) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Functional pass: snapshot at every period boundary, counted from where the run starts
+    double start = sample_seconds();
+    int trace_level = cpu->trace_level;
+    cpu->trace_level = TRACE_NONE;
+    uint64_t first = cpu->total_clock_cycles;
+    page_list held = { NULL, 0 };
+    int status;
+    for (uint64_t boundary = first;;) {
+        sample_point *s = take_snapshot(cpu, &held);
+        hold_pages(&held, s);           // Before a worker can restore s and release its pages
+        add_sample(&sp, s);
+        boundary = boundary + opt->every > boundary ? boundary + opt->every : UINT64_MAX;
+        status = run_predecoded(cpu, boundary);
+        if (status != RUN_PAUSED) break;
+    }
+    release_pages(&held);
+    cpu->trace_level = trace_level;
+    double functional = sample_seconds() - start;
+
+    pthread_mutex_lock(&sp.lock);
+    sp.done = 1;
+    pthread_cond_broadcast(&sp.more);
+    pthread_mutex_unlock(&sp.lock);
+    for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+    double elapsed = sample_seconds() - start;      // The workers overlap the functional pass
+
+    if (trace_level >= TRACE_INSTR) {
+        for (int i = 0; i < sp.sample_count; i++) {
+            const sample_point *s = sp.samples[i];
+            printf("Sample %d: cycle %" PRIu64 ", %" PRIu64 " instructions measured", i, s->cycles, s->instructions);
+            if (opt->forwarding >= 0 && s->instructions > 0) printf(", CPI %.4f", (double)s->counts[METRIC_CYCLES] / s->instructions);
+            if (opt->ooo != NULL && s->instructions > 0) printf(", out-of-order CPI %.4f", (double)s->counts[METRIC_OOO_CYCLES] / s->instructions);
+            printf("\n");
+        }
+    }
+    if (trace_level >= TRACE_FINAL) sample_report(&sp, cpu->total_clock_cycles - first, functional, elapsed, threads);
+
+    for (int i = 0; i < sp.sample_count; i++) free(sp.samples[i]);
+    free(sp.samples);
+    free(tids);
+    pthread_cond_destroy(&sp.more);
+    pthread_mutex_destroy(&sp.lock);
+    return status;
+}
@@ -0,0 +1,142 @@
+// Embedding interface (riscv_sim.h). A riscv_sim is a cpu_context, so the
+// command-line client (riscv_main.c) can mix these calls with the options the
+// interface does not cover (engines, timing models, checkpoints).
+//
+// Runs go to the fastest engine that can honour them: run_predecoded() pauses
+// at an exact cycle count on its own, while callbacks and stop pcs are only
+// checked by run_staged(). Both produce the same architectural state.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riscv_cpu.h"
+
+// The public statuses are the engines' own
+_Static_assert((int)RISCV_SIM_HALTED == RUN_HALTED && (int)RISCV_SIM_LIMIT == RUN_LIMIT
+               && (int)RISCV_SIM_PAUSED == RUN_PAUSED, "riscv_sim.h run statuses must match RUN_*");
+
+riscv_sim *riscv_sim_create(void) {
+    cpu_context *cpu = cpu_create();
+    cpu->trace_level = TRACE_NONE;
+    cpu->max_cycles = 0;
+    return cpu;
+}
+
+void riscv_sim_destroy(riscv_sim *sim) {
+    cpu_destroy(sim);
+}
+
+int riscv_sim_load_file(riscv_sim *sim, const char *path) {
+    int count = read_program(sim, path);
+    if (count < 0) return -1;
+    cpu_reset(sim);
+    return count;
+}
+
+int riscv_sim_load_words(riscv_sim *sim, const uint32_t *words, int count) {
+    if (count < 0 || read_program_words(sim, words, count) < 0) return -1;
+    cpu_reset(sim);
+    return count;
+}
+
+void riscv_sim_reset(riscv_sim *sim) {
+    cpu_reset(sim);
+}
+
+uint32_t riscv_sim_get_reg(const riscv_sim *sim, int reg) {
+    return reg > 0 && reg < 32 ? (uint32_t)sim->rf[reg] : 0;
+}
+
+void riscv_sim_set_reg(riscv_sim *sim, int reg, uint32_t value) {
+    if (reg > 0 && reg < 32) sim->rf[reg] = (int)value;
+}
+
+uint32_t riscv_sim_get_pc(const riscv_sim *sim) {
+    return sim->pc;
+}
+
+void riscv_sim_set_pc(riscv_sim *sim, uint32_t pc) {
+    sim->pc = pc;
+}
+
+uint64_t riscv_sim_cycles(const riscv_sim *sim) {
+    return sim->total_clock_cycles;
+}
+
+void riscv_sim_read_mem(riscv_sim *sim, uint32_t address, void *dst, uint32_t size) {
+    mem_read(&sim->mem, address, dst, size);
+}
+
+void riscv_sim_write_mem(riscv_sim *sim, uint32_t address, const void *src, uint32_t size) {
+    mem_write(&sim->mem, address, src, size);
+    uint32_t code_size = sim->mem.code_end - sim->mem.code_start;
+    if (size > 0 && (address - sim->mem.code_start < code_size || sim->mem.code_start - address < size)) {
+        predecode_program(sim);     // Part of the program was replaced
+        sim->code_version++;
+    }
+}
+
+void riscv_sim_set_cycle_limit(riscv_sim *sim, uint64_t limit) {
+    sim->max_cycles = limit < (uint64_t)INT64_MAX ? (long long)limit : 0;
+}
+
+int riscv_sim_run(riscv_sim *sim, uint64_t count) {
+    uint64_t start = sim->total_clock_cycles;
+    uint64_t pause_at = count != 0 && start + count > start ? start + count : UINT64_MAX;
+    int status;
+    if (sim->on_retire != NULL || sim->on_mem != NULL || sim->stop_at_pc) status = run_staged(sim, pause_at);
+    else status = run_predecoded(sim, pause_at);
+    syscall_flush(sim);
+    return status;
+}
+
+int riscv_sim_run_until(riscv_sim *sim, uint32_t pc, uint64_t count) {
+    sim->stop_at_pc = 1;
+    sim->stop_pc = pc;
+    int status = riscv_sim_run(sim, count);
+    sim->stop_at_pc = 0;
+    return status;
+}
+
+int riscv_sim_exited(const riscv_sim *sim, int *code) {
+    if (sim->exited && code != NULL) *code = sim->exit_code;
+    return sim->exited;
+}
+
+void riscv_sim_on_retire(riscv_sim *sim, riscv_sim_retire_fn fn, void *user) {
+    sim->on_retire = fn;
+    sim->retire_user = user;
+}
+
+void riscv_sim_on_mem(riscv_sim *sim, riscv_sim_mem_fn fn, void *user) {
+    sim->on_mem = fn;
+    sim->mem_user = user;
+}
+
+// Parse one "xN=value" (INIT_REG, *target = N) or "mem[ADDR]=value" (INIT_MEM,
+// *target = ADDR, word-aligned) initial-state token. Values and addresses
+// accept C notation. Returns -1 if the token is neither.
+int parse_init(const char *token, uint32_t *target, int *value) {
+    char *end;
+    if (token[0] == 'x') {
+        long reg = strtol(token + 1, &end, 10);
+        if (end == token + 1 || *end != '=' || reg < 0 || reg > 31) return -1;
+        long long v = strtoll(end + 1, &end, 0);
+        if (*end != '\0') return -1;
+        *target = (uint32_t)reg;
+        *value = (int)v;
+        return INIT_REG;
+    }
+    if (strncmp(token, "mem[", 4) == 0) {
+        long long address = strtoll(token + 4, &end, 0);
+        if (end == token + 4 || strncmp(end, "]=", 2) != 0) return -1;
+        if (address < 0 || address > UINT32_MAX || address % 4 != 0) return -1;
+        long long v = strtoll(end + 2, &end, 0);
+        if (*end != '\0') return -1;
+        *target = (uint32_t)address;
+        *value = (int)v;
+        return INIT_MEM;
+    }
+    return -1;
+}
@@ -0,0 +1,102 @@
+#ifndef RISCV_SIM_H
+#define RISCV_SIM_H
+
+// Embedding interface of the RV32IMA simulator (libriscv_sim.a, libriscv_sim.so).
+//
+// A riscv_sim is one simulated CPU with its own memory. Load a program, set
+// up registers and memory, then run it in steps:
+//
+//     riscv_sim *sim = riscv_sim_create();
+//     if (riscv_sim_load_file(sim, "program.elf") < 0) ...
+//     riscv_sim_set_reg(sim, 10, 42);
+//     int status = riscv_sim_run_until(sim, 0x1f4, 0);
+//     uint32_t result = riscv_sim_get_reg(sim, 10);
+//     riscv_sim_destroy(sim);
+//
+// Nothing is printed unless the guest writes to stdout through ecall.
+// Separate simulators can run on separate threads; one simulator must only be
+// used by one thread at a time.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The library is built with hidden visibility; only these functions are exported
+#if defined(__GNUC__)
+#define RISCV_SIM_API __attribute__((visibility("default")))
+#else
+#define RISCV_SIM_API
+#endif
+
+typedef struct cpu_context riscv_sim;
+
+// Why a run returned
+enum {
+    RISCV_SIM_HALTED,               // The pc left the program, or the program called exit
+    RISCV_SIM_LIMIT,                // The cycle limit was passed
+    RISCV_SIM_PAUSED                // The instruction count ran out or the stop pc was reached
+};
+
+// How a memory access reached memory (riscv_sim_mem_fn)
+enum { RISCV_SIM_LOAD, RISCV_SIM_STORE, RISCV_SIM_ATOMIC };
+
+// Called after each instruction retires: its pc and instruction word. The
+// simulator's state already holds its results.
+typedef void (*riscv_sim_retire_fn)(riscv_sim *sim, void *user, uint32_t pc, uint32_t instruction);
+
+// Called for each load, store and atomic: the address, size in bytes and the
+// value loaded, stored, or (atomics) read before the update.
+typedef void (*riscv_sim_mem_fn)(riscv_sim *sim, void *user, uint32_t pc, uint32_t address,
+                                 uint32_t value, int size, int kind);
+
+RISCV_SIM_API riscv_sim *riscv_sim_create(void);
+RISCV_SIM_API void riscv_sim_destroy(riscv_sim *sim);
+
+// Load a program file (text, raw binary or RV32 ELF; see README) or
+// instruction words placed at address 0. Either resets the simulator to the
+// program's start state: zero registers and memory, the pc at the entry point
+// and, for binary and ELF files, sp at the top of the stack. Returns the
+// number of instructions, or -1 if the program could not be loaded.
+RISCV_SIM_API int riscv_sim_load_file(riscv_sim *sim, const char *path);
+RISCV_SIM_API int riscv_sim_load_words(riscv_sim *sim, const uint32_t *words, int count);
+
+// Return to the loaded program's start state (registers, memory, pc, cycles)
+RISCV_SIM_API void riscv_sim_reset(riscv_sim *sim);
+
+// Registers x0-x31 (writes to x0 are ignored), pc and the cycle count
+RISCV_SIM_API uint32_t riscv_sim_get_reg(const riscv_sim *sim, int reg);
+RISCV_SIM_API void riscv_sim_set_reg(riscv_sim *sim, int reg, uint32_t value);
+RISCV_SIM_API uint32_t riscv_sim_get_pc(const riscv_sim *sim);
+RISCV_SIM_API void riscv_sim_set_pc(riscv_sim *sim, uint32_t pc);
+RISCV_SIM_API uint64_t riscv_sim_cycles(const riscv_sim *sim);
+
+// Copy size bytes from or to guest memory. Writing over the program replaces
+// its instructions.
+RISCV_SIM_API void riscv_sim_read_mem(riscv_sim *sim, uint32_t address, void *dst, uint32_t size);
+RISCV_SIM_API void riscv_sim_write_mem(riscv_sim *sim, uint32_t address, const void *src, uint32_t size);
+
+// Stop runs once the cycle count passes limit (0, the default: never)
+RISCV_SIM_API void riscv_sim_set_cycle_limit(riscv_sim *sim, uint64_t limit);
+
+// Run at most count instructions (0: no count), or until the program halts or
+// passes the cycle limit. riscv_sim_run_until() also stops when the next
+// instruction is at pc, after running at least one. Returns RISCV_SIM_*.
+RISCV_SIM_API int riscv_sim_run(riscv_sim *sim, uint64_t count);
+RISCV_SIM_API int riscv_sim_run_until(riscv_sim *sim, uint32_t pc, uint64_t count);
+
+// Whether the program called exit, and the code it passed
+RISCV_SIM_API int riscv_sim_exited(const riscv_sim *sim, int *code);
+
+// Install or (with NULL) remove a callback. Runs with a callback or a stop pc
+// take the staged engine, which is several times slower than the interpreter.
+RISCV_SIM_API void riscv_sim_on_retire(riscv_sim *sim, riscv_sim_retire_fn fn, void *user);
+RISCV_SIM_API void riscv_sim_on_mem(riscv_sim *sim, riscv_sim_mem_fn fn, void *user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RISCV_SIM_H
@@ -0,0 +1,448 @@
+// Syscall emulation: ecall runs a Linux-style system call on the host.
+//
+// The guest follows the RISC-V Linux convention: a7 holds the syscall number,
+// a0-a5 the arguments, and the result (or a negative errno) comes back in a0.
+// Supported are read, write, openat, close, lseek, unlinkat, brk, exit and
+// exit_group; anything else returns -ENOSYS. Guest file descriptors index a
+// table of host descriptors; 0, 1 and 2 start out as the simulator's own stdin,
+// stdout and stderr.
+//
+// Output is coalesced. Writes to guest stdout go into the simulator's stdout
+// stream (1 MiB buffer, shared with the trace output so the two stay in
+// order), and writes to any other file collect in a SYS_BUFFER_SIZE buffer
+// per descriptor that reaches the host in one write() when it fills. Buffers
+// are flushed before a read (so a prompt appears before the guest waits for
+// input), before lseek and close, at exit and when the run ends.
+//
+// A muted context (a sampling worker replaying part of a run whose I/O the
+// functional pass already did) never touches host files: writes are dropped,
+// reads see end of file, and openat hands out placeholder descriptors
+// (MUTED_FD) that lseek, close and unlinkat accept without a host call.
+//
+// Under --trace-file, read() returns at most the bytes up to the next word
+// boundary (a short read, which the guest must handle anyway), so the data it
+// stores fits the one memory word a trace record holds.
+//
+// exit and exit_group stop the hart that calls them with cpu->exited set; the
+// engines then return RUN_HALTED. Harts share one file table (syscall_share())
+// and serialise their syscalls on its lock, but exit_group only stops the
+// calling hart.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "riscv_cpu.h"
+
+#define SYS_MAX_FILES 64                // Guest file descriptors
+#define SYS_BUFFER_SIZE (64u << 10)     // Output collected per descriptor before a host write()
+#define SYS_READ_MAX (1u << 20)         // Bytes moved by one read() (the guest sees a short read)
+#define SYS_PATH_MAX 4096               // Longest path the guest can pass
+#define SYS_STACK_RESERVE (64u << 20)   // The program break stays this far below the initial sp
+#define MUTED_FD INT_MAX                // host_fd of a descriptor a muted context opened
+
+// Linux syscall numbers (asm-generic, as used by RV32)
+enum {
+    NR_UNLINKAT = 35, NR_OPENAT = 56, NR_CLOSE = 57, NR_LSEEK = 62, NR_READ = 63, NR_WRITE = 64,
+    NR_EXIT = 93, NR_EXIT_GROUP = 94, NR_BRK = 214,
+};
+
+// Linux open flags and *at() constants as the guest passes them
+#define GUEST_O_ACCMODE 03
+#define GUEST_O_CREAT   0100
+#define GUEST_O_EXCL    0200
+#define GUEST_O_TRUNC   01000
+#define GUEST_O_APPEND  02000
+#define GUEST_AT_FDCWD  (-100)
+#define GUEST_AT_REMOVEDIR 0x200
+
+// Linux errno values returned to the guest
+enum {
+    GUEST_ENOENT = 2, GUEST_EIO = 5, GUEST_EBADF = 9, GUEST_ENOMEM = 12, GUEST_EACCES = 13,
+    GUEST_EFAULT = 14, GUEST_EEXIST = 17, GUEST_ENOTDIR = 20, GUEST_EISDIR = 21, GUEST_EINVAL = 22,
+    GUEST_EMFILE = 24, GUEST_ENOSPC = 28, GUEST_ESPIPE = 29, GUEST_EROFS = 30, GUEST_ENAMETOOLONG = 36,
+    GUEST_ENOSYS = 38, GUEST_ENOTEMPTY = 39, GUEST_EOVERFLOW = 75,
+};
+
+_Static_assert(SYS_MAX_FILES <= 64, "syscall_state.open_files has one bit per descriptor");
+
+typedef struct {
+    int host_fd;                    // -1: descriptor not open
+    int owned;                      // Opened by the guest (the host descriptor is closed with it)
+    uint32_t pending;               // Bytes waiting in buffer
+    uint8_t *buffer;                // Output buffer, allocated by the first buffered write
+} guest_file;
+
+struct guest_sys {
+    pthread_mutex_t lock;           // Held for each syscall (harts share the table)
+    int users;                      // Contexts sharing this state
+    uint32_t brk_start, brk;        // Initial and current program break
+    guest_file files[SYS_MAX_FILES];
+};
+
+// Negative Linux errno for a host errno
+static int32_t guest_error(int host) {
+    switch (host) {
+        case ENOENT:       return -GUEST_ENOENT;
+        case EBADF:        return -GUEST_EBADF;
+        case ENOMEM:       return -GUEST_ENOMEM;
+        case EACCES:       return -GUEST_EACCES;
+        case EPERM:        return -GUEST_EACCES;
+        case EEXIST:       return -GUEST_EEXIST;
+        case ENOTDIR:      return -GUEST_ENOTDIR;
+        case EISDIR:       return -GUEST_EISDIR;
+        case EINVAL:       return -GUEST_EINVAL;
+        case EMFILE:       return -GUEST_EMFILE;
+        case ENFILE:       return -GUEST_EMFILE;
+        case ENOSPC:       return -GUEST_ENOSPC;
+        case ESPIPE:       return -GUEST_ESPIPE;
+        case EROFS:        return -GUEST_EROFS;
+        case ENAMETOOLONG: return -GUEST_ENAMETOOLONG;
+        case ENOTEMPTY:    return -GUEST_ENOTEMPTY;
+        case EOVERFLOW:    return -GUEST_EOVERFLOW;
+        default:           return -GUEST_EIO;
+    }
+}
+
+// Break and standard descriptors of a program that has not run yet (owned files already closed)
+static void sys_init(struct guest_sys *s, const cpu_context *cpu) {
+    s->brk_start = s->brk = (cpu->image->data_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    for (int fd = 0; fd < SYS_MAX_FILES; fd++) {
+        s->files[fd].host_fd = fd <= 2 ? fd : -1;
+        s->files[fd].owned = 0;
+        s->files[fd].pending = 0;
+    }
+}
+
+static struct guest_sys *sys_state(cpu_context *cpu) {
+    if (cpu->sys == NULL) {
+        struct guest_sys *s = calloc(1, sizeof(*s));
+        if (s == NULL) {
+            perror("syscall emulation");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&s->lock, NULL);
+        s->users = 1;
+        sys_init(s, cpu);
+        cpu->sys = s;
+    }
+    return cpu->sys;
+}
+
+// Write out a descriptor's buffered output (0, or a negative errno if the host write failed)
+static int32_t flush_file(guest_file *f) {
+    uint32_t done = 0;
+    int32_t result = 0;
+    while (done < f->pending) {
+        ssize_t n = write(f->host_fd, f->buffer + done, f->pending - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            result = n < 0 ? guest_error(errno) : -GUEST_EIO;
+            break;
+        }
+        done += (uint32_t)n;
+    }
+    f->pending = 0;
+    return result;
+}
+
+static void flush_all(struct guest_sys *s) {
+    for (int fd = 0; fd < SYS_MAX_FILES; fd++) {
+        if (s->files[fd].pending > 0) flush_file(&s->files[fd]);
+    }
+    fflush(stdout);
+}
+
+// Flush, close and forget every file the guest opened
+static void close_owned(struct guest_sys *s) {
+    flush_all(s);
+    for (int fd = 0; fd < SYS_MAX_FILES; fd++) {
+        guest_file *f = &s->files[fd];
+        if (f->owned) close(f->host_fd);
+        f->owned = 0;
+        f->host_fd = -1;
+        free(f->buffer);
+        f->buffer = NULL;
+    }
+}
+
+static guest_file *lookup(struct guest_sys *s, int32_t fd) {
+    if (fd < 0 || fd >= SYS_MAX_FILES || s->files[fd].host_fd < 0) return NULL;
+    return &s->files[fd];
+}
+
+// Copy a NUL-terminated guest string into path (0, or a negative errno)
+static int32_t read_path(cpu_context *cpu, uint32_t address, char *path) {
+    for (uint32_t i = 0; i < SYS_PATH_MAX; i++) {
+        mem_read(&cpu->mem, address + i, &path[i], 1);
+        if (path[i] == '\0') return 0;
+    }
+    return -GUEST_ENAMETOOLONG;
+}
+
+static int32_t sys_write(struct guest_sys *s, cpu_context *cpu, int32_t fd, uint32_t address, uint32_t size) {
+    guest_file *f = lookup(s, fd);
+    if (f == NULL) return -GUEST_EBADF;
+    if (size > INT32_MAX) size = INT32_MAX;
+    if (cpu->syscalls_muted) return (int32_t)size;
+
+    if (f->host_fd == STDOUT_FILENO) {
+        // Through the simulator's stdout buffer, in order with its own output
+        uint8_t chunk[PAGE_SIZE];
+        for (uint32_t done = 0; done < size; ) {
+            uint32_t n = size - done < PAGE_SIZE ? size - done : PAGE_SIZE;
+            mem_read(&cpu->mem, address + done, chunk, n);
+            if (fwrite(chunk, 1, n, stdout) != n) return done > 0 ? (int32_t)done : -GUEST_EIO;
+            done += n;
+        }
+        return (int32_t)size;
+    }
+
+    if (f->buffer == NULL && (f->buffer = malloc(SYS_BUFFER_SIZE)) == NULL) return -GUEST_ENOMEM;
+    for (uint32_t done = 0; done < size; ) {
+        if (f->pending == SYS_BUFFER_SIZE) {
+            int32_t error = flush_file(f);
+            if (error < 0) return done > 0 ? (int32_t)done : error;
+        }
+        uint32_t n = SYS_BUFFER_SIZE - f->pending;
+        if (n > size - done) n = size - done;
+        mem_read(&cpu->mem, address + done, f->buffer + f->pending, n);
+        f->pending += n;
+        done += n;
+    }
+    return (int32_t)size;
+}
+
+// read() into guest memory; sets SYS_CODE in *effects if the data landed on the program
+static int32_t sys_read(struct guest_sys *s, cpu_context *cpu, int32_t fd, uint32_t address, uint32_t size, int *effects) {
+    guest_file *f = lookup(s, fd);
+    if (f == NULL) return -GUEST_EBADF;
+    if (cpu->syscalls_muted || size == 0) return 0;
+    flush_all(s);                       // Prompts appear before the guest waits for input
+    if (size > SYS_READ_MAX) size = SYS_READ_MAX;
+    // A delta trace record holds one memory word: while tracing, reads stop at a word boundary
+    if (cpu->trace_out != NULL && size > 4 - (address & 3)) size = 4 - (address & 3);
+
+    uint8_t *data = malloc(size);
+    if (data == NULL) return -GUEST_ENOMEM;
+    ssize_t n;
+    do {
+        n = read(f->host_fd, data, size);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        free(data);
+        return n < 0 ? guest_error(errno) : 0;
+    }
+    mem_write(&cpu->mem, address, data, (uint32_t)n);
+    free(data);
+
+    uint32_t end = address + (uint32_t)n;
+    if (cpu->trace_out != NULL) trace_mem(cpu->trace_out, address & ~3U, mem_peek(&cpu->mem, address & ~3U));
+    if (address < cpu->mem.code_end && end > cpu->mem.code_start) {
+        predecode_program(cpu);         // The input rewrote instructions
+        cpu->code_version++;
+        *effects |= SYS_CODE;
+    }
+    return (int32_t)n;
+}
+
+static int32_t sys_openat(struct guest_sys *s, cpu_context *cpu, int32_t dirfd, uint32_t path_address,
+                          uint32_t flags, uint32_t mode) {
+    char path[SYS_PATH_MAX];
+    int32_t error = read_path(cpu, path_address, path);
+    if (error < 0) return error;
+    int host_dir = AT_FDCWD;
+    if (dirfd != GUEST_AT_FDCWD) {
+        guest_file *dir = lookup(s, dirfd);
+        if (dir == NULL) return -GUEST_EBADF;
+        host_dir = dir->host_fd;
+    }
+    int fd = 0;
+    while (fd < SYS_MAX_FILES && s->files[fd].host_fd >= 0) fd++;
+    if (fd == SYS_MAX_FILES) return -GUEST_EMFILE;
+
+    static const int access_modes[] = { O_RDONLY, O_WRONLY, O_RDWR, O_RDWR };
+    int host_flags = access_modes[flags & GUEST_O_ACCMODE];
+    if (flags & GUEST_O_CREAT) host_flags |= O_CREAT;
+    if (flags & GUEST_O_EXCL) host_flags |= O_EXCL;
+    if (flags & GUEST_O_TRUNC) host_flags |= O_TRUNC;
+    if (flags & GUEST_O_APPEND) host_flags |= O_APPEND;
+    int host_fd = MUTED_FD;             // A muted context does not create, truncate or even open the file
+    if (!cpu->syscalls_muted) {
+        host_fd = openat(host_dir, path, host_flags | O_CLOEXEC, (mode_t)(mode & 07777));
+        if (host_fd < 0) return guest_error(errno);
+    }
+
+    s->files[fd].host_fd = host_fd;
+    s->files[fd].owned = !cpu->syscalls_muted;
+    s->files[fd].pending = 0;
+    return fd;
+}
+
+static int32_t sys_close(struct guest_sys *s, cpu_context *cpu, int32_t fd) {
+    guest_file *f = lookup(s, fd);
+    if (f == NULL) return -GUEST_EBADF;
+    if (cpu->syscalls_muted) {
+        f->host_fd = -1;                // Only the functional pass has the file open on the host
+        f->owned = 0;
+        return 0;
+    }
+    int32_t result = flush_file(f);
+    if (f->host_fd == STDOUT_FILENO) fflush(stdout);
+    if (f->owned && close(f->host_fd) != 0 && result == 0) result = guest_error(errno);
+    f->host_fd = -1;
+    f->owned = 0;
+    return result;
+}
+
+static int32_t sys_lseek(struct guest_sys *s, cpu_context *cpu, int32_t fd, int32_t offset, uint32_t whence) {
+    guest_file *f = lookup(s, fd);
+    if (f == NULL) return -GUEST_EBADF;
+    if (whence > 2) return -GUEST_EINVAL;
+    if (cpu->syscalls_muted) return whence == 0 && offset >= 0 ? offset : 0;
+    int32_t error = flush_file(f);
+    if (error < 0) return error;
+    static const int host_whence[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+    off_t position = lseek(f->host_fd, offset, host_whence[whence]);
+    if (position < 0) return guest_error(errno);
+    return position > INT32_MAX ? -GUEST_EOVERFLOW : (int32_t)position;
+}
+
+static int32_t sys_unlinkat(struct guest_sys *s, cpu_context *cpu, int32_t dirfd, uint32_t path_address, uint32_t flags) {
+    char path[SYS_PATH_MAX];
+    int32_t error = read_path(cpu, path_address, path);
+    if (error < 0) return error;
+    int host_dir = AT_FDCWD;
+    if (dirfd != GUEST_AT_FDCWD) {
+        guest_file *dir = lookup(s, dirfd);
+        if (dir == NULL) return -GUEST_EBADF;
+        host_dir = dir->host_fd;
+    }
+    if (cpu->syscalls_muted) return 0;
+    if (unlinkat(host_dir, path, (flags & GUEST_AT_REMOVEDIR) ? AT_REMOVEDIR : 0) != 0) return guest_error(errno);
+    return 0;
+}
+
+// brk(address): move the break if address is between the initial break and the stack, and return the break
+static int32_t sys_brk(struct guest_sys *s, cpu_context *cpu, uint32_t address) {
+    uint32_t stack = cpu->image->stack_top != 0 ? cpu->image->stack_top : STACK_TOP;
+    if (address >= s->brk_start && address <= stack - SYS_STACK_RESERVE) s->brk = address;
+    return (int32_t)s->brk;
+}
+
+// Carry out the syscall the ecall at cpu->pc asks for and put its result in a0.
+// Returns SYS_EXIT if the program exited (cpu->exited is set) and SYS_CODE if
+// a read rewrote part of the program (it has been predecoded again).
+int syscall_handle(cpu_context *cpu) {
+    struct guest_sys *s = sys_state(cpu);
+    uint32_t *a = (uint32_t *)&cpu->rf[10];    // a0-a7
+    int effects = 0;
+    int32_t result;
+
+    pthread_mutex_lock(&s->lock);
+    switch (a[7]) {
+        case NR_READ:       result = sys_read(s, cpu, (int32_t)a[0], a[1], a[2], &effects); break;
+        case NR_WRITE:      result = sys_write(s, cpu, (int32_t)a[0], a[1], a[2]); break;
+        case NR_OPENAT:     result = sys_openat(s, cpu, (int32_t)a[0], a[1], a[2], a[3]); break;
+        case NR_CLOSE:      result = sys_close(s, cpu, (int32_t)a[0]); break;
+        case NR_LSEEK:      result = sys_lseek(s, cpu, (int32_t)a[0], (int32_t)a[1], a[2]); break;
+        case NR_UNLINKAT:   result = sys_unlinkat(s, cpu, (int32_t)a[0], a[1], a[2]); break;
+        case NR_BRK:        result = sys_brk(s, cpu, a[0]); break;
+        case NR_EXIT:
+        case NR_EXIT_GROUP:
+            flush_all(s);
+            cpu->exited = 1;
+            cpu->exit_code = (int32_t)a[0];
+            pthread_mutex_unlock(&s->lock);
+            return SYS_EXIT;                    // a0 keeps the exit code
+        default:
+            if (cpu->trace_level >= TRACE_FINAL) printf("Unsupported syscall: %u\n", a[7]);
+            result = -GUEST_ENOSYS;
+            break;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (cpu->trace_out != NULL && cpu->rf[10] != result) trace_reg(cpu->trace_out, 10, (uint32_t)result);
+    cpu->rf[10] = result;
+    return effects;
+}
+
+// Write out the guest's buffered output
+void syscall_flush(cpu_context *cpu) {
+    if (cpu->sys == NULL) return;
+    pthread_mutex_lock(&cpu->sys->lock);
+    flush_all(cpu->sys);
+    pthread_mutex_unlock(&cpu->sys->lock);
+}
+
+// Start the next run of the loaded program: close the files the last one opened,
+// reset the program break and clear the exit status (called by cpu_reset())
+void syscall_reset(cpu_context *cpu) {
+    cpu->exited = 0;
+    cpu->exit_code = 0;
+    if (cpu->sys == NULL) return;
+    pthread_mutex_lock(&cpu->sys->lock);
+    close_owned(cpu->sys);
+    sys_init(cpu->sys, cpu);
+    pthread_mutex_unlock(&cpu->sys->lock);
+}
+
+// Record the program break and which guest descriptors are open (checkpoints, sample snapshots)
+void syscall_save(cpu_context *cpu, syscall_state *state) {
+    struct guest_sys *s = sys_state(cpu);
+    pthread_mutex_lock(&s->lock);
+    state->brk = s->brk;
+    state->open_files = 0;
+    for (int fd = 0; fd < SYS_MAX_FILES; fd++) {
+        if (s->files[fd].host_fd >= 0) state->open_files |= 1ull << fd;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Set the program break and descriptors of a restored run of the loaded program.
+// Host files cannot be reopened: a muted context gets placeholders for the files
+// that were open, any other context finds them closed. Standard descriptors that
+// were closed are closed again.
+void syscall_restore(cpu_context *cpu, const syscall_state *state) {
+    struct guest_sys *s = sys_state(cpu);
+    pthread_mutex_lock(&s->lock);
+    s->brk = state->brk;
+    for (int fd = 0; fd < SYS_MAX_FILES; fd++) {
+        guest_file *f = &s->files[fd];
+        int open = (state->open_files >> fd) & 1;
+        if (!open && fd <= 2 && !f->owned) f->host_fd = -1;
+        else if (open && f->host_fd < 0 && cpu->syscalls_muted) f->host_fd = MUTED_FD;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Make hart use boot's file table and program break (another hart of the same program)
+void syscall_share(cpu_context *hart, cpu_context *boot) {
+    syscall_release(hart);
+    struct guest_sys *s = sys_state(boot);
+    pthread_mutex_lock(&s->lock);
+    s->users++;
+    pthread_mutex_unlock(&s->lock);
+    hart->sys = s;
+}
+
+// Flush the context's output and drop its reference to the file table
+// (closing the guest's files with the last one; called by cpu_destroy())
+void syscall_release(cpu_context *cpu) {
+    struct guest_sys *s = cpu->sys;
+    if (s == NULL) return;
+    cpu->sys = NULL;
+    pthread_mutex_lock(&s->lock);
+    flush_all(s);
+    int last = --s->users == 0;
+    pthread_mutex_unlock(&s->lock);
+    if (!last) return;
+    close_owned(s);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
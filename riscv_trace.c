@@ -0,0 +1,347 @@
+// Binary delta traces (--trace-file) and the reader used by the riscv_trace tool.
+//
+// A trace starts with a snapshot of the initial state: pc, cycle count,
+// registers and every non-zero page of guest memory. After that comes one
+// record per retired instruction, holding only what the instruction changed:
+//
+//   flags (1 byte)          TRACE_PC | TRACE_REG | TRACE_MEM
+//   pc (4)                  only with TRACE_PC: the pc was not the previous one + 4
+//   instruction word (4)
+//   rd (1), value (4)       only with TRACE_REG: a register changed
+//   address (4), value (4)  only with TRACE_MEM: a memory word changed
+//
+// Writeback() and Mem() report a register or word only when its value
+// changed, so a record costs 5 to 18 bytes. A final TRACE_END record holds
+// the cycle count, pc and run status. Records go through a 64 KiB buffer. A
+// file name ending in ".gz" is written through zlib (when built with it).
+// The reader accepts both forms.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riscv_cpu.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define TRACE_MAGIC "RVDT"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_SIZE (64 << 10)
+#define TRACE_RECORD_MAX 32             // Bytes one record can take (an end record is 17)
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t cycles;                    // total_clock_cycles before the first record
+    uint32_t pc;
+    uint32_t code_start, code_end;      // Program image, for the replay's final-state print
+    uint32_t page_count;                // Pages that follow, each a uint32_t page number and PAGE_SIZE bytes
+    int32_t rf[32];
+} trace_header;
+
+// Output or input stream: a stdio file or, with zlib, a gzip file
+typedef struct {
+    FILE *file;
+#ifdef HAVE_ZLIB
+    gzFile gz;
+#endif
+} trace_stream;
+
+static int stream_write(trace_stream *s, const void *data, size_t size) {
+#ifdef HAVE_ZLIB
+    if (s->gz != NULL) return gzwrite(s->gz, data, (unsigned)size) == (int)size ? 0 : -1;
+#endif
+    return fwrite(data, 1, size, s->file) == size ? 0 : -1;
+}
+
+static size_t stream_read(trace_stream *s, void *data, size_t size) {
+#ifdef HAVE_ZLIB
+    if (s->gz != NULL) {
+        int n = gzread(s->gz, data, (unsigned)size);
+        return n > 0 ? (size_t)n : 0;
+    }
+#endif
+    return fread(data, 1, size, s->file);
+}
+
+static int stream_close(trace_stream *s) {
+#ifdef HAVE_ZLIB
+    if (s->gz != NULL) return gzclose(s->gz) == Z_OK ? 0 : -1;
+#endif
+    return fclose(s->file) == 0 ? 0 : -1;
+}
+
+struct trace_writer {
+    trace_stream out;
+    const char *path;
+    uint32_t expected_pc;               // pc of the next record unless it carries TRACE_PC
+    uint8_t pending_flags;              // Changes reported for the instruction being retired
+    uint8_t pending_rd;
+    uint32_t pending_rd_value, pending_address, pending_value;
+    int failed;
+    size_t used;
+    uint8_t buffer[TRACE_BUFFER_SIZE];
+};
+
+static void put32(uint8_t *p, uint32_t v) { memcpy(p, &v, 4); }
+static uint32_t get32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+static void writer_flush(trace_writer *t) {
+    if (t->used > 0 && !t->failed && stream_write(&t->out, t->buffer, t->used) != 0) {
+        perror(t->path);
+        t->failed = 1;
+    }
+    t->used = 0;
+}
+
+static int ends_with(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// Open path and write the snapshot of cpu's current state. Returns NULL on error.
+trace_writer *trace_create(const char *path, cpu_context *cpu) {
+    trace_writer *t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        perror("trace_create");
+        return NULL;
+    }
+    t->path = path;
+    if (ends_with(path, ".gz")) {
+#ifdef HAVE_ZLIB
+        t->out.gz = gzopen(path, "wb1");    // Fast level: the records are very repetitive anyway
+        if (t->out.gz == NULL) {
+            perror(path);
+            free(t);
+            return NULL;
+        }
+#else
+        fprintf(stderr, "%s: compressed traces need a build with zlib\n", path);
+        free(t);
+        return NULL;
+#endif
+    } else if ((t->out.file = fopen(path, "wb")) == NULL) {
+        perror(path);
+        free(t);
+        return NULL;
+    }
+
+    trace_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACE_MAGIC, 4);
+    h.version = TRACE_VERSION;
+    h.cycles = cpu->total_clock_cycles;
+    h.pc = cpu->pc;
+    h.code_start = cpu->mem.code_start;
+    h.code_end = cpu->mem.code_end;
+    memcpy(h.rf, cpu->rf, sizeof(h.rf));
+    static const uint8_t zero[PAGE_SIZE];
+    uint32_t vpn = 0;
+    uint8_t *page;
+    while ((page = mem_next_page(&cpu->mem, &vpn)) != NULL) {
+        if (memcmp(page, zero, PAGE_SIZE) != 0) h.page_count++;
+        if (++vpn == 0) break;
+    }
+    int failed = stream_write(&t->out, &h, sizeof(h)) != 0;
+    vpn = 0;
+    while (!failed && (page = mem_next_page(&cpu->mem, &vpn)) != NULL) {
+        if (memcmp(page, zero, PAGE_SIZE) != 0) {
+            failed = stream_write(&t->out, &vpn, sizeof(vpn)) != 0 || stream_write(&t->out, page, PAGE_SIZE) != 0;
+        }
+        if (++vpn == 0) break;
+    }
+    if (failed) {
+        perror(path);
+        stream_close(&t->out);
+        free(t);
+        return NULL;
+    }
+    t->expected_pc = cpu->pc;
+    return t;
+}
+
+// The instruction being retired changed register rd to value
+void trace_reg(trace_writer *t, uint32_t rd, uint32_t value) {
+    t->pending_flags |= TRACE_REG;
+    t->pending_rd = (uint8_t)rd;
+    t->pending_rd_value = value;
+}
+
+// The instruction being retired changed the word at address to value
+void trace_mem(trace_writer *t, uint32_t address, uint32_t value) {
+    t->pending_flags |= TRACE_MEM;
+    t->pending_address = address;
+    t->pending_value = value;
+}
+
+// Append the record of the instruction at pc along with the changes reported for it
+void trace_retire(trace_writer *t, uint32_t pc, uint32_t instruction) {
+    if (t->used > TRACE_BUFFER_SIZE - TRACE_RECORD_MAX) writer_flush(t);
+    uint8_t *p = t->buffer + t->used;
+    uint8_t flags = t->pending_flags | (pc != t->expected_pc ? TRACE_PC : 0);
+    *p++ = flags;
+    if (flags & TRACE_PC) { put32(p, pc); p += 4; }
+    put32(p, instruction); p += 4;
+    if (flags & TRACE_REG) { *p++ = t->pending_rd; put32(p, t->pending_rd_value); p += 4; }
+    if (flags & TRACE_MEM) { put32(p, t->pending_address); put32(p + 4, t->pending_value); p += 8; }
+    t->used = (size_t)(p - t->buffer);
+    t->pending_flags = 0;
+    t->expected_pc = pc + 4;
+}
+
+// Write the end record (final cycle count, pc and run status) and close the file.
+// Returns 0 if the whole trace was written.
+int trace_close(trace_writer *t, const cpu_context *cpu, int status) {
+    if (t == NULL) return 0;
+    if (t->used > TRACE_BUFFER_SIZE - TRACE_RECORD_MAX) writer_flush(t);
+    uint8_t *p = t->buffer + t->used;
+    uint64_t cycles = cpu->total_clock_cycles;
+    *p++ = TRACE_END;
+    memcpy(p, &cycles, 8);
+    put32(p + 8, cpu->pc);
+    put32(p + 12, (uint32_t)status);
+    t->used += 17;
+    writer_flush(t);
+    int failed = t->failed;
+    if (stream_close(&t->out) != 0 && !failed) {
+        perror(t->path);
+        failed = 1;
+    }
+    free(t);
+    return failed ? -1 : 0;
+}
+
+struct trace_reader {
+    trace_stream in;
+    const char *path;
+    trace_header header;
+    uint32_t next_pc;
+    uint64_t cycles;                    // Cycle count after the last record read
+    int ended;
+    size_t used, size;
+    uint8_t buffer[TRACE_BUFFER_SIZE];
+};
+
+// Make at least n bytes available in the buffer (fewer only at the end of the file)
+static size_t reader_fill(trace_reader *r, size_t n) {
+    if (r->size - r->used >= n) return r->size - r->used;
+    memmove(r->buffer, r->buffer + r->used, r->size - r->used);
+    r->size -= r->used;
+    r->used = 0;
+    while (r->size < n) {
+        size_t got = stream_read(&r->in, r->buffer + r->size, TRACE_BUFFER_SIZE - r->size);
+        if (got == 0) break;
+        r->size += got;
+    }
+    return r->size;
+}
+
+// Open a trace and load its initial state into mem, rf and pc. Returns NULL on error.
+trace_reader *trace_open(const char *path, guest_mem *mem, int32_t rf[32], uint32_t *pc) {
+    trace_reader *r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        perror("trace_open");
+        return NULL;
+    }
+    r->path = path;
+#ifdef HAVE_ZLIB
+    r->in.gz = gzopen(path, "rb");      // Also reads uncompressed files
+    if (r->in.gz == NULL) {
+#else
+    r->in.file = fopen(path, "rb");
+    if (r->in.file == NULL) {
+#endif
+        perror(path);
+        free(r);
+        return NULL;
+    }
+
+    trace_header *h = &r->header;
+    if (stream_read(&r->in, h, sizeof(*h)) != sizeof(*h) || memcmp(h->magic, TRACE_MAGIC, 4) != 0
+            || h->version != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        goto fail;
+    }
+    for (uint32_t i = 0; i < h->page_count; i++) {
+        uint32_t vpn;
+        if (stream_read(&r->in, &vpn, sizeof(vpn)) != sizeof(vpn)
+                || stream_read(&r->in, mem_page(mem, vpn << PAGE_SHIFT, 1), PAGE_SIZE) != PAGE_SIZE) {
+            fprintf(stderr, "%s: truncated trace\n", path);
+            goto fail;
+        }
+    }
+    mem_set_code(mem, h->code_start, h->code_end);
+    memcpy(rf, h->rf, sizeof(h->rf));
+    *pc = r->next_pc = h->pc;
+    r->cycles = h->cycles;
+    return r;
+
+fail:
+    stream_close(&r->in);
+    free(r);
+    return NULL;
+}
+
+// Cycle count of the state the trace starts from
+uint64_t trace_start_cycles(const trace_reader *r) {
+    return r->header.cycles;
+}
+
+// Read the next record. Returns 1 for a retired instruction, 0 at the end
+// record (rec then holds the final cycle count, pc and status), -1 on error.
+int trace_next(trace_reader *r, trace_record *rec) {
+    if (r->ended) return 0;
+    memset(rec, 0, sizeof(*rec));
+    size_t avail = reader_fill(r, TRACE_RECORD_MAX);
+    if (avail == 0) {
+        fprintf(stderr, "%s: trace ends without an end record (cycle %llu)\n", r->path, (unsigned long long)r->cycles);
+        return -1;
+    }
+    const uint8_t *p = r->buffer + r->used;
+    uint8_t flags = *p;
+    size_t need = flags == TRACE_END ? 17 : 5 + (flags & TRACE_PC ? 4 : 0) + (flags & TRACE_REG ? 5 : 0) + (flags & TRACE_MEM ? 8 : 0);
+    if (avail < need || (flags != TRACE_END && (flags & ~(TRACE_PC | TRACE_REG | TRACE_MEM)))) {
+        fprintf(stderr, "%s: corrupt or truncated trace at cycle %llu\n", r->path, (unsigned long long)r->cycles);
+        return -1;
+    }
+    r->used += need;
+    p++;
+    rec->flags = flags;
+    if (flags == TRACE_END) {
+        memcpy(&rec->cycles, p, 8);
+        rec->pc = get32(p + 8);
+        rec->status = (int)get32(p + 12);
+        r->ended = 1;
+        return 0;
+    }
+    if (flags & TRACE_PC) { r->next_pc = get32(p); p += 4; }
+    rec->pc = r->next_pc;
+    rec->instruction = get32(p); p += 4;
+    if (flags & TRACE_REG) {
+        if (*p >= 32) {                 // Readers index the register file with it
+            fprintf(stderr, "%s: corrupt trace at cycle %llu (register %u)\n", r->path, (unsigned long long)r->cycles + 1, *p);
+            return -1;
+        }
+        rec->rd = *p;
+        rec->rd_value = get32(p + 1);
+        p += 5;
+    }
+    if (flags & TRACE_MEM) { rec->address = get32(p); rec->value = get32(p + 4); }
+    r->next_pc = rec->pc + 4;
+    rec->cycles = ++r->cycles;
+    return 1;
+}
+
+// Program image bounds recorded in the trace
+void trace_code_range(const trace_reader *r, uint32_t *start, uint32_t *end) {
+    *start = r->header.code_start;
+    *end = r->header.code_end;
+}
+
+void trace_close_reader(trace_reader *r) {
+    if (r == NULL) return;
+    stream_close(&r->in);
+    free(r);
+}
@@ -0,0 +1,273 @@
+// riscv_trace: offline tool for the binary delta traces written by --trace-file.
+//
+//   riscv_trace replay TRACE [--at=N]    rebuild and print the state after cycle N
+//                                        (default: the end of the run)
+//   riscv_trace diff TRACE_A TRACE_B     report the first instruction where two runs differ
+//   riscv_trace dump TRACE [--from=N] [--count=M]
+//                                        print the records from cycle N on, one per line
+//
+// replay prints the state in the same format as the simulator's final state,
+// so it can be compared with the output of the original run.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "riscv_cpu.h"
+
+static const char *const abi_names[32] = {
+    "", " (ra)", " (sp)", " (gp)", " (tp)", " (t0)", " (t1)", " (t2)",
+    " (s0/fp)", " (s1)", " (a0)", " (a1)", " (a2)", " (a3)", " (a4)", " (a5)",
+    " (a6)", " (a7)", " (s2)", " (s3)", " (s4)", " (s5)", " (s6)", " (s7)",
+    " (s8)", " (s9)", " (s10)", " (s11)", " (t3)", " (t4)", " (t5)", " (t6)",
+};
+
+static const char *const status_names[] = { "halted", "limit", "paused" };
+
+// Architectural state rebuilt from a trace
+typedef struct {
+    trace_reader *reader;
+    guest_mem mem;
+    int32_t rf[32];
+    uint32_t pc;
+    uint64_t cycles;
+    uint32_t code_start, code_end;
+    uint32_t *code;                     // Program words as the trace starts (print skips them unchanged)
+} replay_state;
+
+static int replay_open(replay_state *s, const char *path) {
+    memset(s, 0, sizeof(*s));
+    mem_init(&s->mem);
+    s->reader = trace_open(path, &s->mem, s->rf, &s->pc);
+    if (s->reader == NULL) return -1;
+    s->cycles = trace_start_cycles(s->reader);
+    trace_code_range(s->reader, &s->code_start, &s->code_end);
+    uint32_t words = (s->code_end - s->code_start) / 4;
+    s->code = malloc((words + 1) * sizeof(*s->code));
+    if (s->code == NULL) {
+        perror("riscv_trace");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < words; i++) s->code[i] = mem_peek(&s->mem, s->code_start + 4 * i);
+    return 0;
+}
+
+static void replay_close(replay_state *s) {
+    trace_close_reader(s->reader);
+    mem_clear(&s->mem);
+    free(s->code);
+}
+
+// Apply one retired instruction's changes
+static void replay_apply(replay_state *s, const trace_record *rec) {
+    if (rec->flags & TRACE_REG) s->rf[rec->rd] = (int32_t)rec->rd_value;
+    if (rec->flags & TRACE_MEM) mem_poke(&s->mem, rec->address, rec->value);
+    s->cycles = rec->cycles;
+}
+
+static void print_replayed_state(replay_state *s) {
+    printf("Total clock cycles: %" PRIu64 "\n", s->cycles);
+    printf("PC: 0x%x\n", s->pc);
+
+    printf("\nRegister File (non-zero):\n");
+    int any = 0;
+    for (int i = 0; i < 32; i++) {
+        if (s->rf[i] != 0) {
+            printf("  x%d%s = 0x%x (%d)\n", i, abi_names[i], s->rf[i], s->rf[i]);
+            any = 1;
+        }
+    }
+    if (!any) printf("  All zero.\n");
+
+    printf("\nData Memory (non-zero):\n");
+    any = 0;
+    uint32_t vpn = 0;
+    const uint8_t *page;
+    while ((page = mem_next_page(&s->mem, &vpn)) != NULL) {
+        for (uint32_t offset = 0; offset < PAGE_SIZE; offset += 4) {
+            int value;
+            memcpy(&value, page + offset, 4);
+            if (value == 0) continue;
+            uint32_t address = (vpn << PAGE_SHIFT) + offset;
+            uint32_t code_offset = address - s->code_start;
+            if (code_offset < s->code_end - s->code_start && (uint32_t)value == s->code[code_offset / 4]) continue;
+            printf("  0x%x = 0x%x (%d)\n", address, value, value);
+            any = 1;
+        }
+        if (++vpn == 0) break;
+    }
+    if (!any) printf("  All zero.\n");
+    printf("-----------------------------\n\n");
+}
+
+static void print_record(const char *prefix, const trace_record *rec) {
+    if (rec->flags == TRACE_END) {
+        printf("%send of run at cycle %" PRIu64 ", pc 0x%x, %s\n", prefix, rec->cycles, rec->pc,
+               rec->status >= 0 && rec->status < 3 ? status_names[rec->status] : "?");
+        return;
+    }
+    printf("%scycle %" PRIu64 " pc 0x%08x insn 0x%08x", prefix, rec->cycles, rec->pc, rec->instruction);
+    if (rec->flags & TRACE_REG) printf("  x%u = 0x%x", rec->rd, rec->rd_value);
+    if (rec->flags & TRACE_MEM) printf("  mem[0x%x] = 0x%x", rec->address, rec->value);
+    printf("\n");
+}
+
+// Print the state once the cycle count reaches at (UINT64_MAX: the end of the run)
+static int cmd_replay(const char *path, uint64_t at) {
+    replay_state s;
+    if (replay_open(&s, path) != 0) return EXIT_FAILURE;
+    if (at < s.cycles) {
+        fprintf(stderr, "%s: the trace starts at cycle %" PRIu64 "\n", path, s.cycles);
+        replay_close(&s);
+        return EXIT_FAILURE;
+    }
+    trace_record rec;
+    int result;
+    while ((result = trace_next(s.reader, &rec)) > 0) {
+        if (s.cycles == at) break;          // rec is the next instruction: the state is complete
+        replay_apply(&s, &rec);
+    }
+    if (result < 0) {
+        replay_close(&s);
+        return EXIT_FAILURE;
+    }
+    s.pc = rec.pc;
+    if (result == 0 && at != UINT64_MAX && s.cycles < at) {
+        printf("Run ended at cycle %" PRIu64 " (%s)\n", s.cycles, rec.status >= 0 && rec.status < 3 ? status_names[rec.status] : "?");
+    }
+    print_replayed_state(&s);
+    replay_close(&s);
+    return EXIT_SUCCESS;
+}
+
+static int same_record(const trace_record *a, const trace_record *b) {
+    if (a->flags != b->flags || a->pc != b->pc) return 0;
+    if (a->flags == TRACE_END) return a->cycles == b->cycles && a->status == b->status;
+    if (a->instruction != b->instruction) return 0;
+    if ((a->flags & TRACE_REG) && (a->rd != b->rd || a->rd_value != b->rd_value)) return 0;
+    if ((a->flags & TRACE_MEM) && (a->address != b->address || a->value != b->value)) return 0;
+    return 1;
+}
+
+// Compare the initial states, then the records in order, and report the first difference
+static int cmd_diff(const char *path_a, const char *path_b) {
+    replay_state a, b;
+    if (replay_open(&a, path_a) != 0) return 2;
+    if (replay_open(&b, path_b) != 0) {
+        replay_close(&a);
+        return 2;
+    }
+
+    int status = 0;
+    if (a.cycles != b.cycles || a.pc != b.pc || memcmp(a.rf, b.rf, sizeof(a.rf)) != 0) {
+        printf("Initial states differ: cycle %" PRIu64 "/%" PRIu64 ", pc 0x%x/0x%x\n", a.cycles, b.cycles, a.pc, b.pc);
+        for (int i = 0; i < 32; i++) {
+            if (a.rf[i] != b.rf[i]) printf("  x%d%s = 0x%x / 0x%x\n", i, abi_names[i], a.rf[i], b.rf[i]);
+        }
+        status = 1;
+    }
+    // Memory: every word of every page either side has
+    for (int side = 0; side < 2 && status == 0; side++) {
+        guest_mem *m = side ? &b.mem : &a.mem;
+        uint32_t vpn = 0;
+        while (status == 0 && mem_next_page(m, &vpn) != NULL) {
+            for (uint32_t offset = 0; offset < PAGE_SIZE; offset += 4) {
+                uint32_t address = (vpn << PAGE_SHIFT) + offset;
+                uint32_t va = mem_peek(&a.mem, address), vb = mem_peek(&b.mem, address);
+                if (va != vb) {
+                    printf("Initial memory differs: 0x%x = 0x%x / 0x%x\n", address, va, vb);
+                    status = 1;
+                    break;
+                }
+            }
+            if (++vpn == 0) break;
+        }
+    }
+
+    uint64_t count = 0;
+    while (status == 0) {
+        trace_record ra, rb;
+        int ga = trace_next(a.reader, &ra), gb = trace_next(b.reader, &rb);
+        if (ga < 0 || gb < 0) {
+            status = 2;
+            break;
+        }
+        if (!same_record(&ra, &rb)) {
+            uint64_t cycle = ga > 0 ? ra.cycles : gb > 0 ? rb.cycles : ra.cycles;
+            printf("Traces diverge at cycle %" PRIu64 " (after %" PRIu64 " matching instructions):\n", cycle, count);
+            print_record("  A: ", &ra);
+            print_record("  B: ", &rb);
+            status = 1;
+            break;
+        }
+        if (ga == 0) {
+            printf("Traces are identical (%" PRIu64 " instructions)\n", count);
+            break;
+        }
+        count++;
+    }
+    replay_close(&a);
+    replay_close(&b);
+    return status;
+}
+
+// Print count records starting with the one that retires at cycle from + 1
+static int cmd_dump(const char *path, uint64_t from, uint64_t count) {
+    replay_state s;
+    if (replay_open(&s, path) != 0) return EXIT_FAILURE;
+    trace_record rec;
+    int result = 0;
+    uint64_t printed = 0;
+    while (printed < count && (result = trace_next(s.reader, &rec)) >= 0) {
+        if (result == 0 || rec.cycles > from) {
+            print_record("", &rec);
+            printed++;
+        }
+        if (result == 0) break;
+    }
+    replay_close(&s);
+    return result < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s replay TRACE [--at=N]      state after cycle N (default: the end)\n", prog);
+    fprintf(stderr, "       %s diff TRACE_A TRACE_B       first instruction where two runs differ\n", prog);
+    fprintf(stderr, "       %s dump TRACE [--from=N] [--count=M]\n", prog);
+    fprintf(stderr, "                                     records after cycle N (default 0), at most M\n");
+    fprintf(stderr, "TRACE files are written by riscv_cpu --trace-file=FILE.\n");
+    fprintf(stderr, "diff exits with 0 if the traces match, 1 if they differ and 2 on errors.\n");
+}
+
+int main(int argc, char *argv[]) {
+    static char stdout_buffer[1 << 16];
+    setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer));
+
+    if (argc < 3) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *paths[2] = { NULL, NULL };
+    int path_count = 0;
+    uint64_t at = UINT64_MAX, from = 0, count = UINT64_MAX;
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--at=", 5) == 0) {
+            at = strtoull(argv[i] + 5, NULL, 0);
+        } else if (strncmp(argv[i], "--from=", 7) == 0) {
+            from = strtoull(argv[i] + 7, NULL, 0);
+        } else if (strncmp(argv[i], "--count=", 8) == 0) {
+            count = strtoull(argv[i] + 8, NULL, 0);
+        } else if (argv[i][0] == '-' || path_count == 2) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        } else {
+            paths[path_count++] = argv[i];
+        }
+    }
+
+    if (strcmp(argv[1], "replay") == 0 && path_count == 1) return cmd_replay(paths[0], at);
+    if (strcmp(argv[1], "diff") == 0 && path_count == 2) return cmd_diff(paths[0], paths[1]);
+    if (strcmp(argv[1], "dump") == 0 && path_count == 1) return cmd_dump(paths[0], from, count);
+    usage(argv[0]);
+    return EXIT_FAILURE;
+}